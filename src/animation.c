@@ -0,0 +1,456 @@
+
+#include "animation.h"
+#include "helpers.h"
+#include "clock.h"
+
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, strerror
+#include <errno.h>
+#include <unistd.h> // read
+
+#define LIGHT_NS_PER_MS 1000000ull
+
+// Value of `next_ns` for animations that won't change anymore
+#define LIGHT_ANIMATION_IDLE UINT64_MAX
+
+// Frames of a ramp are at least this many times as far apart as a write to its target takes, so that writes never queue up
+#define LIGHT_ANIMATION_WRITE_SHARE 2
+
+// Name of the per-target setting the write latency is kept in, in microseconds
+static char const * const _light_animation_latency_setting = "latency";
+
+// The setting is only rewritten once the estimate moved by more than 1/LIGHT_ANIMATION_LATENCY_MARGIN of what it holds, so that
+// runs on a target whose latency is known don't write anything
+#define LIGHT_ANIMATION_LATENCY_MARGIN 4
+
+static uint64_t _light_animation_raw(light_animation_t *animation, double level)
+{
+    if(level <= 0.0)
+    {
+        return 0;
+    }
+
+    if(level >= 1.0)
+    {
+        return animation->max_value;
+    }
+
+    return (uint64_t)(level * (double)animation->max_value + 0.5);
+}
+
+// Computes the value of the animation at `now_ns`, and when it will next need to be evaluated
+static uint64_t _light_animation_evaluate(light_animator_t *animator, light_animation_t *animation, uint64_t now_ns, uint64_t *next_ns)
+{
+    uint64_t elapsed_ns = now_ns > animation->start_ns ? now_ns - animation->start_ns : 0;
+    uint64_t total_ns = animation->total_ms * LIGHT_NS_PER_MS;
+
+    if(!animation->repeat && elapsed_ns >= total_ns)
+    {
+        animation->finished = true;
+        *next_ns = LIGHT_ANIMATION_IDLE;
+        return _light_animation_raw(animation, animation->keyframes[animation->num_keyframes - 1].level);
+    }
+
+    // Position within the current cycle, and the time that cycle started
+    uint64_t cycle_ns = elapsed_ns % total_ns;
+    uint64_t cycle_start_ns = now_ns - cycle_ns;
+
+    uint64_t keyframe_start_ns = 0;
+    for(uint64_t i = 0; i < animation->num_keyframes; i++)
+    {
+        light_keyframe_t const *keyframe = &animation->keyframes[i];
+        uint64_t keyframe_end_ns = keyframe_start_ns + keyframe->duration_ms * LIGHT_NS_PER_MS;
+
+        if(cycle_ns >= keyframe_end_ns)
+        {
+            keyframe_start_ns = keyframe_end_ns;
+            continue;
+        }
+
+        // Holding keyframes only need another look once they end
+        *next_ns = cycle_start_ns + keyframe_end_ns;
+        if(!keyframe->ramp)
+        {
+            return _light_animation_raw(animation, keyframe->level);
+        }
+
+        // The last keyframe of a non-repeating animation has nothing to ramp towards
+        double to_level = keyframe->level;
+        if(i + 1 < animation->num_keyframes)
+        {
+            to_level = animation->keyframes[i + 1].level;
+        }
+        else if(animation->repeat)
+        {
+            to_level = animation->keyframes[0].level;
+        }
+
+        double progress = (double)(cycle_ns - keyframe_start_ns) / (double)(keyframe_end_ns - keyframe_start_ns);
+        double level = keyframe->level + (to_level - keyframe->level) * progress;
+
+        // Ramps are updated on a tick grid shared by all animations, so that simultaneous ramps cause a single wakeup.
+        // Slow targets skip ticks, taking fewer and larger steps that still end on time.
+        uint64_t tick_ns = animator->tick_ms * LIGHT_NS_PER_MS;
+        uint64_t min_interval_ns = animation->target->write_latency_ns * LIGHT_ANIMATION_WRITE_SHARE;
+        if(min_interval_ns > tick_ns)
+        {
+            tick_ns = (min_interval_ns + tick_ns - 1) / tick_ns * tick_ns;
+        }
+        uint64_t next_tick_ns = (now_ns / tick_ns + 1) * tick_ns;
+        if(next_tick_ns < *next_ns)
+        {
+            *next_ns = next_tick_ns;
+        }
+
+        return _light_animation_raw(animation, level);
+    }
+
+    // Not reachable, cycle_ns is always within the cycle
+    *next_ns = LIGHT_ANIMATION_IDLE;
+    return animation->last_value;
+}
+
+static void _light_animation_load_latency(light_device_target_t *target)
+{
+    if(target->write_latency_loaded)
+    {
+        return;
+    }
+
+    target->write_latency_loaded = true;
+
+    uint64_t latency_us = 0;
+    if(light_read_target_setting(target->device->enumerator->context, target, _light_animation_latency_setting, &latency_us))
+    {
+        target->write_latency_ns = latency_us * 1000;
+        target->write_latency_saved = true;
+        target->write_latency_saved_us = latency_us;
+    }
+}
+
+// Keeps what was learned about the target for later runs, if it differs enough from what they would find
+static void _light_animation_save_latency(light_device_target_t *target)
+{
+    uint64_t saved_us = target->write_latency_saved_us;
+    uint64_t latency_us = target->write_latency_ns / 1000;
+    uint64_t difference_us = latency_us > saved_us ? latency_us - saved_us : saved_us - latency_us;
+    if(target->write_latency_saved && difference_us * LIGHT_ANIMATION_LATENCY_MARGIN <= saved_us)
+    {
+        return;
+    }
+
+    // Whether or not it could be written, it isn't worth trying again before it moves
+    target->write_latency_saved = true;
+    target->write_latency_saved_us = latency_us;
+    light_write_target_setting(target->device->enumerator->context, target, _light_animation_latency_setting, latency_us);
+}
+
+static void _light_animation_free(light_animation_t *animation)
+{
+    if(animation->num_writes > 0)
+    {
+        _light_animation_save_latency(animation->target);
+    }
+
+    if(animation->free_userdata != NULL)
+    {
+        animation->free_userdata(animation->userdata);
+    }
+
+    free(animation->keyframes);
+    free(animation);
+}
+
+// Removes the animation at `index`, keeping the order of the others
+static void _light_animator_remove_at(light_animator_t *animator, uint64_t index)
+{
+    _light_animation_free(animator->animations[index]);
+
+    for(uint64_t i = index + 1; i < animator->num_animations; i++)
+    {
+        animator->animations[i - 1] = animator->animations[i];
+    }
+
+    animator->num_animations--;
+}
+
+// Arms the timer for the absolute time `when_ns`, or disarms it for LIGHT_ANIMATION_IDLE
+static bool _light_animator_arm(light_animator_t *animator, uint64_t when_ns)
+{
+    // A zero deadline would disarm the timer instead
+    if(when_ns == 0)
+    {
+        when_ns = 1;
+    }
+
+    if(!light_clock_timer_arm(animator->timer_fd, when_ns != LIGHT_ANIMATION_IDLE ? when_ns : 0, false))
+    {
+        return false;
+    }
+
+    animator->due_ns = when_ns != LIGHT_ANIMATION_IDLE ? when_ns : 0;
+    return true;
+}
+
+// Adds a newly created animation to the animator, replacing the one its target already had
+static light_animation_t *_light_animator_start(light_animator_t *animator, light_animation_t *animation)
+{
+    light_animator_remove(animator, animation->target);
+    _light_animation_load_latency(animation->target);
+
+    // Grow the animation array
+    light_animation_t **new_animations = realloc(animator->animations, (animator->num_animations + 1) * sizeof(light_animation_t*));
+    if(new_animations == NULL)
+    {
+        LIGHT_MEMERR();
+        _light_animation_free(animation);
+        return NULL;
+    }
+
+    animator->animations = new_animations;
+    animator->animations[animator->num_animations] = animation;
+    animator->num_animations++;
+
+    // Let the next tick write the first frame right away
+    if(!_light_animator_arm(animator, animation->start_ns))
+    {
+        return NULL;
+    }
+
+    return animation;
+}
+
+uint64_t light_animator_now_ns()
+{
+    return light_clock_now_ns();
+}
+
+light_animator_t *light_animator_create(uint64_t tick_ms)
+{
+    int timer_fd = light_clock_timer_create(false, false);
+    if(timer_fd < 0)
+    {
+        return NULL;
+    }
+
+    light_animator_t *animator = malloc(sizeof(light_animator_t));
+    animator->timer_fd = timer_fd;
+    animator->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    animator->animations = NULL;
+    animator->num_animations = 0;
+    animator->due_ns = 0;
+    memset(&animator->lateness, 0, sizeof(animator->lateness));
+    animator->overruns = 0;
+
+    return animator;
+}
+
+void light_animator_free(light_animator_t *animator)
+{
+    for(uint64_t i = 0; i < animator->num_animations; i++)
+    {
+        _light_animation_free(animator->animations[i]);
+    }
+
+    free(animator->animations);
+    light_clock_timer_close(animator->timer_fd);
+    free(animator);
+}
+
+light_animation_t *light_animator_add(light_animator_t *animator, light_device_target_t *target, light_keyframe_t const *keyframes, uint64_t num_keyframes, bool repeat)
+{
+    uint64_t total_ms = 0;
+    for(uint64_t i = 0; i < num_keyframes; i++)
+    {
+        total_ms += keyframes[i].duration_ms;
+    }
+
+    if(num_keyframes == 0 || (repeat && total_ms == 0))
+    {
+        LIGHT_ERR("animation of %s has no duration", target->name);
+        return NULL;
+    }
+
+    uint64_t max_value = 0;
+    if(!target->get_max_value(target, &max_value))
+    {
+        LIGHT_ERR("couldn't read max value of %s", target->name);
+        return NULL;
+    }
+
+    light_animation_t *animation = malloc(sizeof(light_animation_t));
+    animation->target = target;
+    animation->keyframes = malloc(num_keyframes * sizeof(light_keyframe_t));
+    memcpy(animation->keyframes, keyframes, num_keyframes * sizeof(light_keyframe_t));
+    animation->num_keyframes = num_keyframes;
+    animation->total_ms = total_ms;
+    animation->repeat = repeat;
+    animation->max_value = max_value;
+    animation->start_ns = light_animator_now_ns();
+    animation->last_value = UINT64_MAX;
+    animation->finished = false;
+    animation->num_writes = 0;
+    animation->priority = 0;
+    animation->frame = NULL;
+    animation->userdata = NULL;
+    animation->free_userdata = NULL;
+
+    return _light_animator_start(animator, animation);
+}
+
+light_animation_t *light_animator_add_frame(light_animator_t *animator, light_device_target_t *target, LFUNCANIMFRAME frame, void *userdata, LFUNCANIMFREE free_userdata)
+{
+    light_animation_t *animation = malloc(sizeof(light_animation_t));
+    animation->target = target;
+    animation->keyframes = NULL;
+    animation->num_keyframes = 0;
+    animation->total_ms = 0;
+    animation->repeat = true;
+    animation->max_value = 0;
+    animation->start_ns = light_animator_now_ns();
+    animation->last_value = UINT64_MAX;
+    animation->finished = false;
+    animation->num_writes = 0;
+    animation->priority = 0;
+    animation->frame = frame;
+    animation->userdata = userdata;
+    animation->free_userdata = free_userdata;
+
+    return _light_animator_start(animator, animation);
+}
+
+light_animation_t *light_animator_find(light_animator_t *animator, light_device_target_t *target)
+{
+    for(uint64_t i = 0; i < animator->num_animations; i++)
+    {
+        if(animator->animations[i]->target == target)
+        {
+            return animator->animations[i];
+        }
+    }
+
+    return NULL;
+}
+
+void light_animator_remove(light_animator_t *animator, light_device_target_t *target)
+{
+    for(uint64_t i = 0; i < animator->num_animations; i++)
+    {
+        if(animator->animations[i]->target == target)
+        {
+            _light_animator_remove_at(animator, i);
+            return;
+        }
+    }
+}
+
+bool light_animator_is_running(light_animator_t *animator)
+{
+    return animator->num_animations > 0;
+}
+
+bool light_animator_tick(light_animator_t *animator, uint64_t now_ns)
+{
+    bool success = true;
+    uint64_t next_ns = LIGHT_ANIMATION_IDLE;
+
+    for(uint64_t i = 0; i < animator->num_animations;)
+    {
+        light_animation_t *animation = animator->animations[i];
+
+        uint64_t animation_next_ns = LIGHT_ANIMATION_IDLE;
+
+        if(animation->frame != NULL)
+        {
+            if(!animation->frame(animation, now_ns, &animation_next_ns))
+            {
+                LIGHT_ERR("failed to write animation frame to %s, stopping its animation", animation->target->name);
+                animation->finished = true;
+                success = false;
+            }
+        }
+        else
+        {
+            uint64_t value = _light_animation_evaluate(animator, animation, now_ns, &animation_next_ns);
+
+            // Only write frames that actually change the target
+            if(value != animation->last_value)
+            {
+                // The middleware folds the cost of the write into the latency of the target
+                if(!animation->target->set_value(animation->target, value))
+                {
+                    LIGHT_ERR("failed to write animation frame to %s, stopping its animation", animation->target->name);
+                    animation->finished = true;
+                    success = false;
+                }
+                else
+                {
+                    animation->num_writes++;
+                }
+
+                animation->last_value = value;
+            }
+        }
+
+        if(animation->finished)
+        {
+            _light_animator_remove_at(animator, i);
+            continue;
+        }
+
+        if(animation_next_ns < next_ns)
+        {
+            next_ns = animation_next_ns;
+        }
+
+        i++;
+    }
+
+    if(!_light_animator_arm(animator, next_ns))
+    {
+        return false;
+    }
+
+    return success;
+}
+
+bool light_animator_dispatch(light_animator_t *animator)
+{
+    uint64_t expirations = 0;
+    if(read(animator->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+        LIGHT_ERR("failed to read animation timer: %s", strerror(errno));
+        return false;
+    }
+
+    uint64_t now_ns = light_animator_now_ns();
+    if(animator->due_ns != 0 && now_ns > animator->due_ns)
+    {
+        uint64_t late_ns = now_ns - animator->due_ns;
+        light_histogram_add(&animator->lateness, late_ns);
+        if(late_ns > animator->tick_ms * LIGHT_NS_PER_MS)
+        {
+            LIGHT_COUNT(animator->overruns);
+        }
+    }
+
+    return light_animator_tick(animator, now_ns);
+}
+
+bool light_animator_run(light_animator_t *animator)
+{
+    bool success = true;
+
+    while(light_animator_is_running(animator))
+    {
+        // The timer fd is blocking, so this sleeps until the next frame is due
+        light_clock_timer_wait(animator->timer_fd);
+        if(!light_animator_dispatch(animator))
+        {
+            success = false;
+        }
+    }
+
+    return success;
+}
+
@@ -0,0 +1,90 @@
+
+#pragma once
+
+#include "light.h"
+#include "metrics.h"
+
+// Keyframe animations of device targets
+// All running animations are driven by a single timer, which only wakes up when some target's value has to change
+// Ramps are paced by the measured write latency of their target, which is kept in the target's "latency" setting for later runs.
+// The setting is only rewritten when the estimate moved by more than a quarter, so runs on known targets don't write anything.
+
+/* One step of an animation */
+typedef struct _light_keyframe_t light_keyframe_t;
+struct _light_keyframe_t
+{
+    double      level;       // Brightness as a fraction (0.0 - 1.0) of the target's max value
+    uint64_t    duration_ms; // How long this keyframe lasts
+    bool        ramp;        // Fade linearly towards the level of the next keyframe, instead of holding this level
+};
+
+typedef struct _light_animation_t light_animation_t;
+
+/* Computes and writes a frame of an animation that isn't made of keyframes, and sets `next_ns` to when the next frame is due */
+typedef bool (*LFUNCANIMFRAME)(light_animation_t*, uint64_t now_ns, uint64_t *next_ns);
+typedef void (*LFUNCANIMFREE)(void *userdata);
+
+struct _light_animation_t
+{
+    light_device_target_t   *target;
+    light_keyframe_t        *keyframes;
+    uint64_t                num_keyframes;
+    uint64_t                total_ms;   // Sum of the keyframe durations
+    bool                    repeat;     // Loop forever, otherwise the animation ends on the level of its last keyframe
+    uint64_t                max_value;  // Max value of the target, read once when the animation is started
+    uint64_t                start_ns;
+    uint64_t                last_value; // Last value written to the target, used to skip writes that don't change anything
+    bool                    finished;
+    uint64_t                num_writes;    // Frames written, whose cost was measured
+    uint32_t                priority;      // Class of the request that started the animation, see scheduler.h
+    LFUNCANIMFRAME          frame;         // Set for custom animations, which do their own writes instead of following keyframes
+    void                    *userdata;     // Custom animation state
+    LFUNCANIMFREE           free_userdata; // Frees userdata when the animation is removed
+};
+
+typedef struct _light_animator_t light_animator_t;
+struct _light_animator_t
+{
+    int                 timer_fd;  // Monotonic timer of clock.h, blocking, only armed while there are running animations
+    uint64_t            tick_ms;   // Resolution of ramps, all ramping animations are updated on the same ticks
+    light_animation_t   **animations;
+    uint64_t            num_animations;
+    uint64_t            due_ns;    // When the timer was armed to expire, 0 while disarmed
+    light_histogram_t   lateness;  // How late the timer woke the animator up
+    uint64_t            overruns;  // Wakeups more than a tick late, which delayed frames of every running animation
+};
+
+/* Creates an animator with the given ramp resolution. Returns NULL on failure. */
+light_animator_t *light_animator_create(uint64_t tick_ms);
+
+/* Stops all animations and frees the animator */
+void light_animator_free(light_animator_t *animator);
+
+/* Starts animating `target`, replacing any animation it already had. The keyframes are copied. Returns NULL on failure. */
+light_animation_t *light_animator_add(light_animator_t *animator, light_device_target_t *target, light_keyframe_t const *keyframes, uint64_t num_keyframes, bool repeat);
+
+/* Starts a custom animation, attached to `target`. `frame` is called every time the animation is due. Returns NULL on failure. */
+light_animation_t *light_animator_add_frame(light_animator_t *animator, light_device_target_t *target, LFUNCANIMFRAME frame, void *userdata, LFUNCANIMFREE free_userdata);
+
+/* Returns the animation running on `target`, or NULL */
+light_animation_t *light_animator_find(light_animator_t *animator, light_device_target_t *target);
+
+/* Stops the animation of `target`, if any, leaving it at its current value */
+void light_animator_remove(light_animator_t *animator, light_device_target_t *target);
+
+/* Returns true while some animation hasn't finished */
+bool light_animator_is_running(light_animator_t *animator);
+
+/* Evaluates every animation at `now_ns` (CLOCK_MONOTONIC), writing the targets whose value changed in one pass, and re-arms the timer.
+ * Returns false if a write failed, the failing animation is stopped. */
+bool light_animator_tick(light_animator_t *animator, uint64_t now_ns);
+
+/* To be called when timer_fd is readable, for use in an event loop */
+bool light_animator_dispatch(light_animator_t *animator);
+
+/* Runs the animator until all animations have finished, which is never when some of them repeat */
+bool light_animator_run(light_animator_t *animator);
+
+/* Returns the current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t light_animator_now_ns();
+
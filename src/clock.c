@@ -0,0 +1,387 @@
+
+#include "clock.h"
+#include "helpers.h"
+
+#include <stdio.h> // snprintf, sscanf
+#include <stdlib.h> // realloc, free
+#include <string.h> // memset, strerror, strchr, strcmp
+#include <inttypes.h> // PRIu64, SCNu64
+#include <errno.h>
+#include <signal.h> // raise
+#include <time.h> // clock_gettime, nanosleep
+#include <unistd.h> // read, write, close
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+// Longest $LIGHT_VIRTUAL_CLOCK
+#define LIGHT_CLOCK_SPEC_MAX 128
+
+// A timer of the virtual clock
+typedef struct
+{
+    int         fd; // eventfd, written to when the timer expires
+    bool        realtime;
+    uint64_t    deadline_ns; // In the time of its clock, 0 while disarmed or once expired
+} _light_clock_timer_t;
+
+static bool _light_clock_virtual = false;
+
+// State of the virtual clock, the time is also read without the lock
+static pthread_mutex_t _light_clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t _light_clock_now_ns = 0;
+static uint64_t _light_clock_wall_offset_ns = 0; // Wall clock time minus monotonic time
+static uint64_t _light_clock_stop_ns = 0; // When to raise SIGTERM, 0 for never
+static _light_clock_timer_t *_light_clock_timers = NULL;
+static uint64_t _light_clock_num_timers = 0;
+
+static uint64_t _light_clock_read(clockid_t clock_id)
+{
+    struct timespec now;
+    clock_gettime(clock_id, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Returns the virtual timer of `fd`, or NULL. Must be called with the lock held.
+static _light_clock_timer_t *_light_clock_find(int fd)
+{
+    for(uint64_t i = 0; i < _light_clock_num_timers; i++)
+    {
+        if(_light_clock_timers[i].fd == fd)
+        {
+            return &_light_clock_timers[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the deadline of an armed `timer` on the monotonic clock
+static uint64_t _light_clock_deadline(_light_clock_timer_t const *timer)
+{
+    if(!timer->realtime)
+    {
+        return timer->deadline_ns;
+    }
+
+    return timer->deadline_ns > _light_clock_wall_offset_ns ? timer->deadline_ns - _light_clock_wall_offset_ns : 1;
+}
+
+// Returns the armed timer with the earliest deadline, or NULL. Must be called with the lock held.
+static _light_clock_timer_t *_light_clock_next()
+{
+    _light_clock_timer_t *next = NULL;
+    for(uint64_t i = 0; i < _light_clock_num_timers; i++)
+    {
+        _light_clock_timer_t *timer = &_light_clock_timers[i];
+        if(timer->deadline_ns != 0 && (next == NULL || _light_clock_deadline(timer) < _light_clock_deadline(next)))
+        {
+            next = timer;
+        }
+    }
+
+    return next;
+}
+
+static void _light_clock_expire(_light_clock_timer_t *timer)
+{
+    uint64_t expirations = 1;
+    timer->deadline_ns = 0;
+    if(write(timer->fd, &expirations, sizeof(expirations)) < 0)
+    {
+        LIGHT_ERR("failed to signal virtual timer: %s", strerror(errno));
+    }
+}
+
+// Moves the virtual clock to `when_ns`, expiring the timers on the way one after the other. Must be called with the lock held.
+static void _light_clock_move(uint64_t when_ns)
+{
+    _light_clock_timer_t *timer = _light_clock_next();
+    while(timer != NULL && _light_clock_deadline(timer) <= when_ns)
+    {
+        uint64_t deadline_ns = _light_clock_deadline(timer);
+        if(deadline_ns > _light_clock_now_ns)
+        {
+            __atomic_store_n(&_light_clock_now_ns, deadline_ns, __ATOMIC_RELAXED);
+        }
+
+        _light_clock_expire(timer);
+        timer = _light_clock_next();
+    }
+
+    if(when_ns > _light_clock_now_ns)
+    {
+        __atomic_store_n(&_light_clock_now_ns, when_ns, __ATOMIC_RELAXED);
+    }
+}
+
+bool light_clock_set_virtual(char const *spec)
+{
+    if(_light_clock_virtual)
+    {
+        return true;
+    }
+
+    char buffer[LIGHT_CLOCK_SPEC_MAX];
+    if(snprintf(buffer, sizeof(buffer), "%s", spec) >= (int)sizeof(buffer))
+    {
+        LIGHT_ERR("LIGHT_VIRTUAL_CLOCK is too long");
+        return false;
+    }
+
+    uint64_t wall_s = _light_clock_read(CLOCK_REALTIME) / 1000000000ull;
+    uint64_t run_s = 0;
+
+    char *save_ptr = NULL;
+    for(char *pair = strtok_r(buffer, ",", &save_ptr); pair != NULL; pair = strtok_r(NULL, ",", &save_ptr))
+    {
+        char *value = strchr(pair, '=');
+        if(value == NULL)
+        {
+            LIGHT_ERR("expected key=value in LIGHT_VIRTUAL_CLOCK, got \"%s\"", pair);
+            return false;
+        }
+        *value++ = '\0';
+
+        int length = 0;
+        bool valid = false;
+        if(strcmp(pair, "wall") == 0)
+        {
+            valid = sscanf(value, "%" SCNu64 "%n", &wall_s, &length) == 1 && value[length] == '\0';
+        }
+        else if(strcmp(pair, "run") == 0)
+        {
+            valid = sscanf(value, "%" SCNu64 "%n", &run_s, &length) == 1 && value[length] == '\0';
+        }
+        else
+        {
+            LIGHT_ERR("unknown key \"%s\" in LIGHT_VIRTUAL_CLOCK", pair);
+            return false;
+        }
+
+        if(!valid)
+        {
+            LIGHT_ERR("invalid value \"%s\" for %s in LIGHT_VIRTUAL_CLOCK", value, pair);
+            return false;
+        }
+    }
+
+    _light_clock_now_ns = LIGHT_CLOCK_VIRTUAL_START_NS;
+    _light_clock_wall_offset_ns = wall_s * 1000000000ull - LIGHT_CLOCK_VIRTUAL_START_NS;
+    _light_clock_stop_ns = run_s > 0 ? LIGHT_CLOCK_VIRTUAL_START_NS + run_s * 1000000000ull : 0;
+    _light_clock_virtual = true;
+
+    LIGHT_NOTE("running on a virtual clock, starting at %" PRIu64, wall_s);
+    return true;
+}
+
+bool light_clock_is_virtual()
+{
+    return _light_clock_virtual;
+}
+
+uint64_t light_clock_now_ns()
+{
+    if(_light_clock_virtual)
+    {
+        return __atomic_load_n(&_light_clock_now_ns, __ATOMIC_RELAXED);
+    }
+
+    return _light_clock_read(CLOCK_MONOTONIC);
+}
+
+uint64_t light_clock_wall_ns()
+{
+    if(_light_clock_virtual)
+    {
+        return __atomic_load_n(&_light_clock_now_ns, __ATOMIC_RELAXED) + _light_clock_wall_offset_ns;
+    }
+
+    return _light_clock_read(CLOCK_REALTIME);
+}
+
+void light_clock_sleep(uint64_t duration_ns)
+{
+    if(_light_clock_virtual)
+    {
+        light_clock_advance(duration_ns);
+        return;
+    }
+
+    struct timespec duration;
+    duration.tv_sec = duration_ns / 1000000000ull;
+    duration.tv_nsec = duration_ns % 1000000000ull;
+    while(nanosleep(&duration, &duration) != 0 && errno == EINTR)
+    {
+    }
+}
+
+int light_clock_timer_create(bool realtime, bool nonblocking)
+{
+    if(!_light_clock_virtual)
+    {
+        int timer_fd = timerfd_create(realtime ? CLOCK_REALTIME : CLOCK_MONOTONIC, TFD_CLOEXEC | (nonblocking ? TFD_NONBLOCK : 0));
+        if(timer_fd < 0)
+        {
+            LIGHT_ERR("failed to create timer: %s", strerror(errno));
+        }
+
+        return timer_fd;
+    }
+
+    // Always non-blocking, so that arming can drain it. Blocking readers call light_clock_timer_wait first.
+    int timer_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(timer_fd < 0)
+    {
+        LIGHT_ERR("failed to create virtual timer: %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&_light_clock_lock);
+
+    _light_clock_timer_t *new_timers = realloc(_light_clock_timers, (_light_clock_num_timers + 1) * sizeof(_light_clock_timer_t));
+    if(new_timers == NULL)
+    {
+        pthread_mutex_unlock(&_light_clock_lock);
+        LIGHT_MEMERR();
+        close(timer_fd);
+        return -1;
+    }
+
+    _light_clock_timers = new_timers;
+    _light_clock_timers[_light_clock_num_timers].fd = timer_fd;
+    _light_clock_timers[_light_clock_num_timers].realtime = realtime;
+    _light_clock_timers[_light_clock_num_timers].deadline_ns = 0;
+    _light_clock_num_timers++;
+
+    pthread_mutex_unlock(&_light_clock_lock);
+    return timer_fd;
+}
+
+bool light_clock_timer_arm(int timer_fd, uint64_t when_ns, bool cancel_on_set)
+{
+    if(!_light_clock_virtual)
+    {
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = when_ns / 1000000000ull;
+        spec.it_value.tv_nsec = when_ns % 1000000000ull;
+
+        if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | (cancel_on_set ? TFD_TIMER_CANCEL_ON_SET : 0), &spec, NULL) < 0)
+        {
+            LIGHT_ERR("failed to arm timer: %s", strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    pthread_mutex_lock(&_light_clock_lock);
+
+    _light_clock_timer_t *timer = _light_clock_find(timer_fd);
+    if(timer == NULL)
+    {
+        pthread_mutex_unlock(&_light_clock_lock);
+        LIGHT_ERR("%d is not a virtual timer", timer_fd);
+        return false;
+    }
+
+    // Like timerfd_settime, arming forgets the expirations that weren't read
+    uint64_t expirations = 0;
+    if(read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+        LIGHT_WARN("failed to reset virtual timer: %s", strerror(errno));
+    }
+
+    timer->deadline_ns = when_ns;
+    if(when_ns != 0 && _light_clock_deadline(timer) <= _light_clock_now_ns)
+    {
+        _light_clock_expire(timer);
+    }
+
+    pthread_mutex_unlock(&_light_clock_lock);
+    return true;
+}
+
+void light_clock_timer_wait(int timer_fd)
+{
+    if(!_light_clock_virtual)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&_light_clock_lock);
+
+    _light_clock_timer_t *timer = _light_clock_find(timer_fd);
+    if(timer != NULL && timer->deadline_ns != 0)
+    {
+        _light_clock_move(_light_clock_deadline(timer));
+    }
+
+    pthread_mutex_unlock(&_light_clock_lock);
+}
+
+void light_clock_timer_close(int timer_fd)
+{
+    if(_light_clock_virtual)
+    {
+        pthread_mutex_lock(&_light_clock_lock);
+
+        _light_clock_timer_t *timer = _light_clock_find(timer_fd);
+        if(timer != NULL)
+        {
+            *timer = _light_clock_timers[--_light_clock_num_timers];
+        }
+
+        pthread_mutex_unlock(&_light_clock_lock);
+    }
+
+    close(timer_fd);
+}
+
+void light_clock_advance(uint64_t duration_ns)
+{
+    if(!_light_clock_virtual)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&_light_clock_lock);
+    _light_clock_move(_light_clock_now_ns + duration_ns);
+    pthread_mutex_unlock(&_light_clock_lock);
+}
+
+bool light_clock_skip()
+{
+    if(!_light_clock_virtual)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&_light_clock_lock);
+
+    _light_clock_timer_t *timer = _light_clock_next();
+    if(timer == NULL && _light_clock_stop_ns == 0)
+    {
+        pthread_mutex_unlock(&_light_clock_lock);
+        return false;
+    }
+
+    uint64_t deadline_ns = timer != NULL ? _light_clock_deadline(timer) : UINT64_MAX;
+    if(_light_clock_stop_ns != 0 && deadline_ns > _light_clock_stop_ns)
+    {
+        // The end of the run comes first. Only once, the process may take a few more steps to stop.
+        _light_clock_move(_light_clock_stop_ns);
+        _light_clock_stop_ns = 0;
+        pthread_mutex_unlock(&_light_clock_lock);
+
+        LIGHT_NOTE("virtual clock ran out");
+        raise(SIGTERM);
+        return true;
+    }
+
+    _light_clock_move(deadline_ns);
+    pthread_mutex_unlock(&_light_clock_lock);
+    return true;
+}
+
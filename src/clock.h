@@ -0,0 +1,59 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The time as light sees it
+// Everything that decides from the time (fades, idle dimming, schedules, the write cache, the scheduler, traces) reads it here
+// and waits for it with timers made here, so that a whole daemon can run on a virtual clock instead of the system's.
+//
+// With $LIGHT_VIRTUAL_CLOCK set, the clock only moves when it is told to: the event loop jumps straight to the next deadline
+// whenever nothing else is ready, and simulated device latencies (sim, replay) and the delays of DDC/CI advance it instead of
+// sleeping. Timers are then eventfds that are signalled when the clock passes their deadline, so they read like timerfds.
+// Together with the sim enumerator and $LIGHT_TRACE, hours of schedule or thousands of fade frames run in milliseconds, and the
+// trace has the exact sequence of writes with their virtual times, identical from one run to the next.
+//
+// LIGHT_VIRTUAL_CLOCK is a comma separated list of key=value pairs, all optional:
+//   wall=SECONDS   the wall clock time to start at, in seconds since the epoch (default: the real time)
+//   run=SECONDS    raise SIGTERM once the clock would move this far past the start, so that a daemon stops by itself
+
+// Monotonic time at which a virtual clock starts. Not 0, since that disarms timers.
+#define LIGHT_CLOCK_VIRTUAL_START_NS 1000000000ull
+
+/* Switches the process to a virtual clock configured by `spec` (see above). Must be called before any timer is created, does
+ * nothing if the clock is virtual already. Returns false if `spec` is invalid. */
+bool light_clock_set_virtual(char const *spec);
+
+/* Returns whether the clock is virtual */
+bool light_clock_is_virtual();
+
+/* Returns the monotonic time (CLOCK_MONOTONIC), in nanoseconds */
+uint64_t light_clock_now_ns();
+
+/* Returns the wall clock time (CLOCK_REALTIME), in nanoseconds since the epoch */
+uint64_t light_clock_wall_ns();
+
+/* Sleeps for `duration_ns`, or advances a virtual clock by as much */
+void light_clock_sleep(uint64_t duration_ns);
+
+/* Creates a timer on the monotonic clock, or the wall clock if `realtime` is set. Reading it returns the number of expirations
+ * as a uint64_t, like a timerfd. Returns -1 on failure. */
+int light_clock_timer_create(bool realtime, bool nonblocking);
+
+/* Arms `timer_fd` to expire once at the absolute time `when_ns` of its clock, or disarms it if `when_ns` is 0. With
+ * `cancel_on_set`, reading a wall clock timer fails with ECANCELED if the system clock is set in the meantime. */
+bool light_clock_timer_arm(int timer_fd, uint64_t when_ns, bool cancel_on_set);
+
+/* Makes sure a blocking read of `timer_fd` returns: a virtual clock is advanced to its deadline. Nothing to do otherwise. */
+void light_clock_timer_wait(int timer_fd);
+
+/* Closes a timer made by light_clock_timer_create */
+void light_clock_timer_close(int timer_fd);
+
+/* Advances a virtual clock by `duration_ns`, expiring the timers it passes in order of their deadlines */
+void light_clock_advance(uint64_t duration_ns);
+
+/* Advances a virtual clock to the next deadline of an armed timer. Returns false if there is none, or the clock isn't virtual. */
+bool light_clock_skip();
+
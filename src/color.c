@@ -0,0 +1,243 @@
+
+#include "color.h"
+#include "animation.h"
+#include "helpers.h"
+
+#include <stdio.h> // sscanf, snprintf
+#include <stdlib.h> // malloc, free
+#include <string.h> // strncmp, strlen
+
+// Resolution of the rainbow animation
+#define LIGHT_COLOR_RAINBOW_TICK_MS 40
+
+// State of a running rainbow, owned by its animation
+typedef struct _light_color_rainbow_t light_color_rainbow_t;
+struct _light_color_rainbow_t
+{
+    light_device_target_t   **targets;
+    light_hsv_t             *hsv;
+    light_rgb_t             *rgb;
+    char                    (*last_color)[32]; // The color last written to each target, to skip writes that change nothing
+    uint64_t                num_targets;
+    uint64_t                period_ms;
+};
+
+static double _light_color_clamp(double value)
+{
+    return value < 0.0 ? 0.0 : (value > 1.0 ? 1.0 : value);
+}
+
+// One channel of the hsv to rgb conversion, `n` selects the channel (5 for red, 3 for green, 1 for blue)
+static inline double _light_color_hsv_channel(light_hsv_t const *hsv, double n)
+{
+    double k = n + hsv->h / 60.0;
+    k = k >= 6.0 ? k - 6.0 : k;
+
+    double ramp = 4.0 - k < k ? 4.0 - k : k;
+    ramp = ramp < 1.0 ? ramp : 1.0;
+    ramp = ramp > 0.0 ? ramp : 0.0;
+
+    return hsv->v - hsv->v * hsv->s * ramp;
+}
+
+void light_color_hsv_to_rgb(light_hsv_t const *in, light_rgb_t *out, uint64_t count)
+{
+    for(uint64_t i = 0; i < count; i++)
+    {
+        out[i].r = _light_color_hsv_channel(&in[i], 5.0);
+        out[i].g = _light_color_hsv_channel(&in[i], 3.0);
+        out[i].b = _light_color_hsv_channel(&in[i], 1.0);
+        out[i].w = 0.0;
+    }
+}
+
+void light_color_rgb_to_hsv(light_rgb_t const *in, light_hsv_t *out, uint64_t count)
+{
+    for(uint64_t i = 0; i < count; i++)
+    {
+        double r = in[i].r;
+        double g = in[i].g;
+        double b = in[i].b;
+
+        double max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+        double min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+        double chroma = max - min;
+
+        double hue = 0.0;
+        if(chroma > 0.0)
+        {
+            if(max == r)
+            {
+                hue = (g - b) / chroma;
+            }
+            else if(max == g)
+            {
+                hue = (b - r) / chroma + 2.0;
+            }
+            else
+            {
+                hue = (r - g) / chroma + 4.0;
+            }
+
+            hue *= 60.0;
+            hue = hue < 0.0 ? hue + 360.0 : hue;
+        }
+
+        out[i].h = hue;
+        out[i].s = max > 0.0 ? chroma / max : 0.0;
+        out[i].v = max;
+    }
+}
+
+bool light_color_parse(char const *str, light_rgb_t *out_color)
+{
+    unsigned int r = 0, g = 0, b = 0, w = 0;
+    int length = 0;
+
+    out_color->w = 0.0;
+
+    if(str[0] == '#')
+    {
+        size_t digits = strlen(str + 1);
+        if(digits == 6 && sscanf(str + 1, "%2x%2x%2x%n", &r, &g, &b, &length) == 3 && length == 6)
+        {
+            w = 0;
+        }
+        else if(digits == 8 && sscanf(str + 1, "%2x%2x%2x%2x%n", &r, &g, &b, &w, &length) == 4 && length == 8)
+        {
+            out_color->w = w / 255.0;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else if(strncmp(str, "hsv:", 4) == 0)
+    {
+        light_hsv_t hsv;
+        if(sscanf(str + 4, "%lf,%lf,%lf", &hsv.h, &hsv.s, &hsv.v) != 3 || hsv.h < 0.0 || hsv.h > 360.0)
+        {
+            return false;
+        }
+
+        hsv.h = hsv.h >= 360.0 ? 0.0 : hsv.h;
+        hsv.s = light_percent_clamp(hsv.s) / 100.0;
+        hsv.v = light_percent_clamp(hsv.v) / 100.0;
+        light_color_hsv_to_rgb(&hsv, out_color, 1);
+        return true;
+    }
+    else
+    {
+        int matched = sscanf(str, "%u,%u,%u,%u", &r, &g, &b, &w);
+        if(matched < 3 || r > 255 || g > 255 || b > 255 || w > 255)
+        {
+            return false;
+        }
+
+        out_color->w = w / 255.0;
+    }
+
+    out_color->r = r / 255.0;
+    out_color->g = g / 255.0;
+    out_color->b = b / 255.0;
+    return true;
+}
+
+void light_color_format(light_rgb_t const *color, char *out_str, size_t size)
+{
+    snprintf(out_str, size, "%u,%u,%u,%u",
+            (unsigned int)(_light_color_clamp(color->r) * 255.0 + 0.5),
+            (unsigned int)(_light_color_clamp(color->g) * 255.0 + 0.5),
+            (unsigned int)(_light_color_clamp(color->b) * 255.0 + 0.5),
+            (unsigned int)(_light_color_clamp(color->w) * 255.0 + 0.5));
+}
+
+static bool _light_color_rainbow_frame(light_animation_t *animation, uint64_t now_ns, uint64_t *next_ns)
+{
+    light_color_rainbow_t *rainbow = (light_color_rainbow_t*)animation->userdata;
+
+    uint64_t period_ns = rainbow->period_ms * 1000000ull;
+    double base_hue = (double)((now_ns - animation->start_ns) % period_ns) / (double)period_ns * 360.0;
+    double spread = 360.0 / (double)rainbow->num_targets;
+
+    for(uint64_t i = 0; i < rainbow->num_targets; i++)
+    {
+        double hue = base_hue + spread * (double)i;
+        rainbow->hsv[i].h = hue >= 360.0 ? hue - 360.0 : hue;
+    }
+
+    // Convert the whole strip at once, then write every led that changed within this frame
+    light_color_hsv_to_rgb(rainbow->hsv, rainbow->rgb, rainbow->num_targets);
+
+    bool success = true;
+    for(uint64_t i = 0; i < rainbow->num_targets; i++)
+    {
+        char command[48];
+        char color[32];
+        light_color_format(&rainbow->rgb[i], color, sizeof(color));
+
+        if(strcmp(color, rainbow->last_color[i]) == 0)
+        {
+            continue;
+        }
+
+        snprintf(command, sizeof(command), "color %s", color);
+        if(!rainbow->targets[i]->custom_command(rainbow->targets[i], command))
+        {
+            success = false;
+        }
+
+        snprintf(rainbow->last_color[i], sizeof(rainbow->last_color[i]), "%s", color);
+    }
+
+    uint64_t tick_ns = LIGHT_COLOR_RAINBOW_TICK_MS * 1000000ull;
+    *next_ns = (now_ns / tick_ns + 1) * tick_ns;
+    return success;
+}
+
+static void _light_color_rainbow_free(void *userdata)
+{
+    light_color_rainbow_t *rainbow = (light_color_rainbow_t*)userdata;
+
+    free(rainbow->targets);
+    free(rainbow->hsv);
+    free(rainbow->rgb);
+    free(rainbow->last_color);
+    free(rainbow);
+}
+
+bool light_color_run_rainbow(light_context_t *ctx, light_device_target_t **targets, uint64_t num_targets, uint64_t period_ms)
+{
+    if(num_targets == 0 || period_ms == 0)
+    {
+        return false;
+    }
+
+    if(ctx->animator == NULL)
+    {
+        ctx->animator = light_animator_create(LIGHT_COLOR_RAINBOW_TICK_MS);
+        if(ctx->animator == NULL)
+        {
+            return false;
+        }
+    }
+
+    light_color_rainbow_t *rainbow = malloc(sizeof(light_color_rainbow_t));
+    rainbow->targets = malloc(num_targets * sizeof(light_device_target_t*));
+    rainbow->hsv = malloc(num_targets * sizeof(light_hsv_t));
+    rainbow->rgb = malloc(num_targets * sizeof(light_rgb_t));
+    rainbow->last_color = calloc(num_targets, sizeof(rainbow->last_color[0]));
+    rainbow->num_targets = num_targets;
+    rainbow->period_ms = period_ms;
+
+    for(uint64_t i = 0; i < num_targets; i++)
+    {
+        rainbow->targets[i] = targets[i];
+        rainbow->hsv[i].s = 1.0;
+        rainbow->hsv[i].v = 1.0;
+    }
+
+    // The animation is attached to the first target, but drives all of them
+    return light_animator_add_frame(ctx->animator, targets[0], _light_color_rainbow_frame, rainbow, _light_color_rainbow_free) != NULL;
+}
+
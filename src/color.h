@@ -0,0 +1,44 @@
+
+#pragma once
+
+#include "light.h"
+
+// Colors of multicolor leds, and conversions between color spaces
+
+// Max number of color channels of a led (red, green, blue, white)
+#define LIGHT_COLOR_MAX_CHANNELS 4
+
+/* A color with components between 0.0 and 1.0. White is only used by leds that have a white channel. */
+typedef struct _light_rgb_t light_rgb_t;
+struct _light_rgb_t
+{
+    double r;
+    double g;
+    double b;
+    double w;
+};
+
+/* A color with hue in degrees (0.0 - 360.0), saturation and value between 0.0 and 1.0 */
+typedef struct _light_hsv_t light_hsv_t;
+struct _light_hsv_t
+{
+    double h;
+    double s;
+    double v;
+};
+
+/* Parses a color, "#rrggbb", "#rrggbbww", "r,g,b[,w]" with components 0-255, or "hsv:h,s,v" with hue in degrees and saturation and value in percent.
+ * Returns false if `str` isn't a valid color. */
+bool light_color_parse(char const *str, light_rgb_t *out_color);
+
+/* Formats a color in the "r,g,b,w" form that light_color_parse reads */
+void light_color_format(light_rgb_t const *color, char *out_str, size_t size);
+
+/* Converts `count` colors at once. The loops have no branches between elements, so converting the colors of a whole led strip is one pass. */
+void light_color_hsv_to_rgb(light_hsv_t const *in, light_rgb_t *out, uint64_t count);
+void light_color_rgb_to_hsv(light_rgb_t const *in, light_hsv_t *out, uint64_t count);
+
+/* Starts a hue rotation over `targets`, spreading the hues evenly over them so that a strip shows a moving rainbow.
+ * The colors of all targets are computed in one batch per frame, and written in the same animator tick. */
+bool light_color_run_rainbow(light_context_t *ctx, light_device_target_t **targets, uint64_t num_targets, uint64_t period_ms);
+
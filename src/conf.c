@@ -0,0 +1,568 @@
+
+#include "conf.h"
+#include "helpers.h"
+
+#include <stdio.h> // fopen, fgets, snprintf
+#include <stdlib.h> // malloc, realloc, free, strtod, qsort, mkstemp
+#include <string.h> // memcpy, memset, strcmp, strlen, strtok_r, strerror
+#include <limits.h> // NAME_MAX
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <fcntl.h> // open
+#include <unistd.h> // close, write, unlink
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Longest line of the configuration file
+#define LIGHT_CONF_LINE_MAX 1024
+
+// The table being compiled
+typedef struct
+{
+    light_conf_target_t *targets;
+    uint64_t            num_targets;
+    light_conf_alias_t  *aliases;
+    uint64_t            num_aliases;
+    char                *strings;
+    uint64_t            strings_size;
+    uint32_t            default_target;
+} _light_conf_builder_t;
+
+// FNV-1a
+static uint64_t _light_conf_hash(char const *str)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(; *str != '\0'; str++)
+    {
+        hash ^= (uint8_t)*str;
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static char const *_light_conf_string(light_conf_t const *conf, uint32_t offset)
+{
+    return offset < conf->header->strings_size ? conf->strings + offset : NULL;
+}
+
+// Points the fields of `conf` into the table at `data`, after checking that its layout adds up
+static bool _light_conf_attach(light_conf_t *conf, void const *data, size_t size)
+{
+    light_conf_header_t const *header = (light_conf_header_t const*)data;
+    if(size < sizeof(light_conf_header_t) || header->magic != LIGHT_CONF_MAGIC || header->version != LIGHT_CONF_VERSION)
+    {
+        return false;
+    }
+
+    size_t expected = sizeof(light_conf_header_t) + (size_t)header->num_targets * sizeof(light_conf_target_t) +
+                      (size_t)header->num_aliases * sizeof(light_conf_alias_t) + header->strings_size;
+    if(size != expected || header->strings_size == 0)
+    {
+        return false;
+    }
+
+    conf->header = header;
+    conf->targets = (light_conf_target_t const*)(header + 1);
+    conf->aliases = (light_conf_alias_t const*)(conf->targets + header->num_targets);
+    conf->strings = (char const*)(conf->aliases + header->num_aliases);
+    conf->size = size;
+
+    // Every string ends within the table
+    return conf->strings[header->strings_size - 1] == '\0';
+}
+
+static bool _light_conf_matches(light_conf_header_t const *header, struct stat const *source_stat)
+{
+    return header->source_size == (uint64_t)source_stat->st_size &&
+           header->source_mtime_sec == (int64_t)source_stat->st_mtim.tv_sec &&
+           header->source_mtime_nsec == (int64_t)source_stat->st_mtim.tv_nsec &&
+           header->source_ino == (uint64_t)source_stat->st_ino;
+}
+
+// Maps the cache at `path` if it was compiled from the text described by `source_stat`
+static light_conf_t *_light_conf_map(char const *path, struct stat const *source_stat)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat cache_stat;
+    if(fstat(fd, &cache_stat) < 0 || !S_ISREG(cache_stat.st_mode) || (size_t)cache_stat.st_size < sizeof(light_conf_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)cache_stat.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    light_conf_t *conf = malloc(sizeof(light_conf_t));
+    if(conf == NULL || !_light_conf_attach(conf, data, size) || !_light_conf_matches(conf->header, source_stat))
+    {
+        free(conf);
+        munmap(data, size);
+        return NULL;
+    }
+
+    conf->mapped = true;
+    return conf;
+}
+
+// Appends `str` to the string table, returns its offset
+static uint32_t _light_conf_add_string(_light_conf_builder_t *builder, char const *str)
+{
+    size_t length = strlen(str) + 1;
+    char *new_strings = realloc(builder->strings, builder->strings_size + length);
+    if(new_strings == NULL)
+    {
+        LIGHT_MEMERR();
+        return LIGHT_CONF_NONE;
+    }
+
+    builder->strings = new_strings;
+    memcpy(builder->strings + builder->strings_size, str, length);
+
+    uint32_t offset = (uint32_t)builder->strings_size;
+    builder->strings_size += length;
+    return offset;
+}
+
+// Parses a percentage, or a raw value followed by "r"
+static bool _light_conf_parse_value(char const *str, light_conf_value_t *out_value)
+{
+    char *end = NULL;
+    double value = strtod(str, &end);
+    if(end == str || value < 0.0)
+    {
+        return false;
+    }
+
+    out_value->value = value;
+    out_value->flags = LIGHT_CONF_SET;
+    if(*end == 'r')
+    {
+        out_value->flags |= LIGHT_CONF_RAW;
+        end++;
+    }
+    else if(value > 100.0)
+    {
+        return false;
+    }
+
+    return *end == '\0';
+}
+
+// Returns the entry of `path`, adding it if it is new
+static light_conf_target_t *_light_conf_builder_target(_light_conf_builder_t *builder, char const *path)
+{
+    for(uint64_t i = 0; i < builder->num_targets; i++)
+    {
+        if(strcmp(builder->strings + builder->targets[i].path, path) == 0)
+        {
+            return &builder->targets[i];
+        }
+    }
+
+    light_conf_target_t *new_targets = realloc(builder->targets, (builder->num_targets + 1) * sizeof(light_conf_target_t));
+    if(new_targets == NULL)
+    {
+        LIGHT_MEMERR();
+        return NULL;
+    }
+    builder->targets = new_targets;
+
+    light_conf_target_t *target = &builder->targets[builder->num_targets];
+    memset(target, 0, sizeof(light_conf_target_t));
+    target->hash = _light_conf_hash(path);
+    target->path = _light_conf_add_string(builder, path);
+    target->curve = 1.0;
+    if(target->path == LIGHT_CONF_NONE)
+    {
+        return NULL;
+    }
+
+    builder->num_targets++;
+    return target;
+}
+
+// Parses the settings of a "target" line
+static bool _light_conf_parse_target(_light_conf_builder_t *builder, char *path, char **save_ptr, char const *file, uint64_t line)
+{
+    if(path == NULL || strchr(path, '/') == NULL)
+    {
+        LIGHT_ERR("%s:%" PRIu64 ": expected a target path after \"target\"", file, line);
+        return false;
+    }
+
+    light_conf_target_t *target = _light_conf_builder_target(builder, path);
+    if(target == NULL)
+    {
+        return false;
+    }
+
+    for(char *setting = strtok_r(NULL, " \t\n", save_ptr); setting != NULL; setting = strtok_r(NULL, " \t\n", save_ptr))
+    {
+        char *value = strchr(setting, '=');
+        if(value == NULL)
+        {
+            LIGHT_ERR("%s:%" PRIu64 ": expected key=value, got \"%s\"", file, line, setting);
+            return false;
+        }
+        *value++ = '\0';
+
+        bool valid = false;
+        if(strcmp(setting, "min") == 0)
+        {
+            valid = _light_conf_parse_value(value, &target->min);
+        }
+        else if(strcmp(setting, "max") == 0)
+        {
+            valid = _light_conf_parse_value(value, &target->max);
+        }
+        else if(strcmp(setting, "step") == 0)
+        {
+            valid = _light_conf_parse_value(value, &target->step) && target->step.value > 0.0;
+        }
+        else if(strcmp(setting, "curve") == 0)
+        {
+            char *end = NULL;
+            target->curve = strtod(value, &end);
+            valid = end != value && *end == '\0' && target->curve >= 0.1 && target->curve <= 10.0;
+        }
+        else
+        {
+            LIGHT_ERR("%s:%" PRIu64 ": unknown setting \"%s\"", file, line, setting);
+            return false;
+        }
+
+        if(!valid)
+        {
+            LIGHT_ERR("%s:%" PRIu64 ": invalid value \"%s\" for %s", file, line, value, setting);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool _light_conf_parse_line(_light_conf_builder_t *builder, char *text, char const *file, uint64_t line)
+{
+    char *comment = strchr(text, '#');
+    if(comment != NULL)
+    {
+        *comment = '\0';
+    }
+
+    char *save_ptr = NULL;
+    char *keyword = strtok_r(text, " \t\n", &save_ptr);
+    if(keyword == NULL)
+    {
+        return true;
+    }
+
+    char *first = strtok_r(NULL, " \t\n", &save_ptr);
+    if(strcmp(keyword, "target") == 0)
+    {
+        return _light_conf_parse_target(builder, first, &save_ptr, file, line);
+    }
+
+    char *second = strtok_r(NULL, " \t\n", &save_ptr);
+    if(strcmp(keyword, "default") == 0 && first != NULL && second == NULL)
+    {
+        builder->default_target = _light_conf_add_string(builder, first);
+        return builder->default_target != LIGHT_CONF_NONE;
+    }
+
+    if(strcmp(keyword, "alias") == 0 && first != NULL && second != NULL && strtok_r(NULL, " \t\n", &save_ptr) == NULL)
+    {
+        if(strchr(first, '/') != NULL || strchr(second, '/') == NULL)
+        {
+            LIGHT_ERR("%s:%" PRIu64 ": expected \"alias <name> <enumerator/device/target>\"", file, line);
+            return false;
+        }
+
+        light_conf_alias_t *new_aliases = realloc(builder->aliases, (builder->num_aliases + 1) * sizeof(light_conf_alias_t));
+        if(new_aliases == NULL)
+        {
+            LIGHT_MEMERR();
+            return false;
+        }
+        builder->aliases = new_aliases;
+
+        light_conf_alias_t *alias = &builder->aliases[builder->num_aliases++];
+        alias->hash = _light_conf_hash(first);
+        alias->name = _light_conf_add_string(builder, first);
+        alias->path = _light_conf_add_string(builder, second);
+        return alias->name != LIGHT_CONF_NONE && alias->path != LIGHT_CONF_NONE;
+    }
+
+    LIGHT_ERR("%s:%" PRIu64 ": expected \"default\", \"alias\" or \"target\" with their arguments", file, line);
+    return false;
+}
+
+static int _light_conf_compare_targets(void const *a, void const *b)
+{
+    uint64_t hash_a = ((light_conf_target_t const*)a)->hash;
+    uint64_t hash_b = ((light_conf_target_t const*)b)->hash;
+    return hash_a < hash_b ? -1 : (hash_a > hash_b ? 1 : 0);
+}
+
+static int _light_conf_compare_aliases(void const *a, void const *b)
+{
+    uint64_t hash_a = ((light_conf_alias_t const*)a)->hash;
+    uint64_t hash_b = ((light_conf_alias_t const*)b)->hash;
+    return hash_a < hash_b ? -1 : (hash_a > hash_b ? 1 : 0);
+}
+
+// Parses the text at `path` into a table
+static light_conf_t *_light_conf_compile(char const *path, struct stat const *source_stat)
+{
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+    {
+        LIGHT_WARN("couldn't open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    _light_conf_builder_t builder;
+    memset(&builder, 0, sizeof(builder));
+    builder.default_target = LIGHT_CONF_NONE;
+
+    // The string table starts with an empty string, so that it is never empty
+    bool success = _light_conf_add_string(&builder, "") != LIGHT_CONF_NONE;
+
+    char line[LIGHT_CONF_LINE_MAX];
+    uint64_t line_number = 0;
+    while(success && fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        success = _light_conf_parse_line(&builder, line, path, line_number);
+    }
+
+    fclose(file);
+
+    light_conf_t *conf = NULL;
+    if(success)
+    {
+        qsort(builder.targets, builder.num_targets, sizeof(light_conf_target_t), _light_conf_compare_targets);
+        qsort(builder.aliases, builder.num_aliases, sizeof(light_conf_alias_t), _light_conf_compare_aliases);
+
+        size_t targets_size = builder.num_targets * sizeof(light_conf_target_t);
+        size_t aliases_size = builder.num_aliases * sizeof(light_conf_alias_t);
+        size_t size = sizeof(light_conf_header_t) + targets_size + aliases_size + builder.strings_size;
+
+        uint8_t *data = malloc(size);
+        conf = malloc(sizeof(light_conf_t));
+        if(data == NULL || conf == NULL)
+        {
+            LIGHT_MEMERR();
+            free(data);
+            free(conf);
+            conf = NULL;
+        }
+        else
+        {
+            light_conf_header_t header;
+            memset(&header, 0, sizeof(header));
+            header.magic = LIGHT_CONF_MAGIC;
+            header.version = LIGHT_CONF_VERSION;
+            header.source_size = (uint64_t)source_stat->st_size;
+            header.source_mtime_sec = (int64_t)source_stat->st_mtim.tv_sec;
+            header.source_mtime_nsec = (int64_t)source_stat->st_mtim.tv_nsec;
+            header.source_ino = (uint64_t)source_stat->st_ino;
+            header.num_targets = (uint32_t)builder.num_targets;
+            header.num_aliases = (uint32_t)builder.num_aliases;
+            header.default_target = builder.default_target;
+            header.strings_size = (uint32_t)builder.strings_size;
+
+            uint8_t *write_ptr = data;
+            memcpy(write_ptr, &header, sizeof(header));
+            write_ptr += sizeof(header);
+            memcpy(write_ptr, builder.targets, targets_size);
+            write_ptr += targets_size;
+            memcpy(write_ptr, builder.aliases, aliases_size);
+            write_ptr += aliases_size;
+            memcpy(write_ptr, builder.strings, builder.strings_size);
+
+            _light_conf_attach(conf, data, size);
+            conf->mapped = false;
+        }
+    }
+    else
+    {
+        LIGHT_WARN("ignoring %s", path);
+    }
+
+    free(builder.targets);
+    free(builder.aliases);
+    free(builder.strings);
+    return conf;
+}
+
+// Replaces the cache at `path` with `conf`, atomically so that concurrent invocations never map half of it
+static void _light_conf_write_cache(light_conf_t const *conf, char const *path)
+{
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+
+    int fd = mkstemp(temp_path);
+    if(fd < 0)
+    {
+        // Not being able to write next to the configuration is allowed, it is compiled on every run then
+        LIGHT_NOTE("couldn't cache the configuration in %s: %s", path, strerror(errno));
+        return;
+    }
+
+    bool success = fchmod(fd, 0644) == 0 && write(fd, conf->header, conf->size) == (ssize_t)conf->size;
+    close(fd);
+
+    if(!success || rename(temp_path, path) < 0)
+    {
+        LIGHT_WARN("couldn't write %s: %s", path, strerror(errno));
+        unlink(temp_path);
+    }
+}
+
+light_conf_t *light_conf_load(char const *conf_dir)
+{
+    char path[PATH_MAX];
+    char cache_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", conf_dir, LIGHT_CONF_FILE);
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", conf_dir, LIGHT_CONF_CACHE_FILE);
+
+    struct stat source_stat;
+    if(stat(path, &source_stat) < 0)
+    {
+        // Not having one is the norm
+        if(errno != ENOENT)
+        {
+            LIGHT_WARN("couldn't read %s: %s", path, strerror(errno));
+        }
+
+        return NULL;
+    }
+
+    light_conf_t *conf = _light_conf_map(cache_path, &source_stat);
+    if(conf != NULL)
+    {
+        return conf;
+    }
+
+    // Stamped with the state of the text before it was read, so that an edit made meanwhile is compiled by the next run
+    conf = _light_conf_compile(path, &source_stat);
+    if(conf != NULL)
+    {
+        _light_conf_write_cache(conf, cache_path);
+    }
+
+    return conf;
+}
+
+void light_conf_free(light_conf_t *conf)
+{
+    if(conf == NULL)
+    {
+        return;
+    }
+
+    if(conf->mapped)
+    {
+        munmap((void*)conf->header, conf->size);
+    }
+    else
+    {
+        free((void*)conf->header);
+    }
+
+    free(conf);
+}
+
+char const *light_conf_default_target(light_conf_t const *conf)
+{
+    if(conf == NULL)
+    {
+        return NULL;
+    }
+
+    return _light_conf_string(conf, conf->header->default_target);
+}
+
+char const *light_conf_alias(light_conf_t const *conf, char const *name)
+{
+    if(conf == NULL || conf->header->num_aliases == 0)
+    {
+        return NULL;
+    }
+
+    // Lower bound of the hash, then every alias with the same hash
+    uint64_t hash = _light_conf_hash(name);
+    uint64_t low = 0;
+    uint64_t high = conf->header->num_aliases;
+    while(low < high)
+    {
+        uint64_t middle = (low + high) / 2;
+        if(conf->aliases[middle].hash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    for(uint64_t i = low; i < conf->header->num_aliases && conf->aliases[i].hash == hash; i++)
+    {
+        char const *alias_name = _light_conf_string(conf, conf->aliases[i].name);
+        if(alias_name != NULL && strcmp(alias_name, name) == 0)
+        {
+            return _light_conf_string(conf, conf->aliases[i].path);
+        }
+    }
+
+    return NULL;
+}
+
+light_conf_target_t const *light_conf_find_target(light_conf_t const *conf, char const *path)
+{
+    if(conf == NULL || conf->header->num_targets == 0)
+    {
+        return NULL;
+    }
+
+    uint64_t hash = _light_conf_hash(path);
+    uint64_t low = 0;
+    uint64_t high = conf->header->num_targets;
+    while(low < high)
+    {
+        uint64_t middle = (low + high) / 2;
+        if(conf->targets[middle].hash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    for(uint64_t i = low; i < conf->header->num_targets && conf->targets[i].hash == hash; i++)
+    {
+        char const *target_path = _light_conf_string(conf, conf->targets[i].path);
+        if(target_path != NULL && strcmp(target_path, path) == 0)
+        {
+            return &conf->targets[i];
+        }
+    }
+
+    return NULL;
+}
+
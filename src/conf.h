@@ -0,0 +1,102 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h> // size_t
+
+// The configuration file
+// <conf_dir>/config gathers the settings that aren't given on the command line, one per line, # starting a comment:
+//   default <path>                  the target of commands without -s, instead of sysfs/backlight/auto
+//   alias <name> <path>             lets -s, schedules and library users say <name> for the target <path>
+//   target <path> <key>=<value>...  settings of a target: min and max caps, step of -A and -U without a value, and curve,
+//                                   the exponent of the percentage scale (2 makes 50% a quarter of the max value)
+// Values are percentages, or raw values when followed by "r", as in min=20r.
+//
+// The text is compiled once into a compact binary table that is written next to it as config.cache. Later runs check the cache
+// against the size, modification time and inode of the text, and map it as is: a normal invocation costs a stat, an open and
+// an mmap, whatever the number of targets. Targets are looked up by the hash of their path when they are created.
+
+#define LIGHT_CONF_FILE "config"
+#define LIGHT_CONF_CACHE_FILE "config.cache"
+#define LIGHT_CONF_MAGIC 0x464e434cu // "LCNF"
+#define LIGHT_CONF_VERSION 1
+
+// An offset in the string table that points nowhere
+#define LIGHT_CONF_NONE UINT32_MAX
+
+// Flags of a light_conf_value_t
+#define LIGHT_CONF_SET 1u // The setting was given
+#define LIGHT_CONF_RAW 2u // The value is raw, not a percentage
+
+typedef struct _light_conf_value_t light_conf_value_t;
+struct _light_conf_value_t
+{
+    double      value;
+    uint32_t    flags;
+    uint32_t    padding;
+};
+
+typedef struct _light_conf_target_t light_conf_target_t;
+struct _light_conf_target_t
+{
+    uint64_t            hash; // Of the path, the table is sorted by it
+    uint32_t            path; // "enumerator/device/target", offset in the string table
+    uint32_t            padding;
+    light_conf_value_t  min; // Minimum cap, instead of the one set with -N
+    light_conf_value_t  max; // Maximum cap, below the max value of the target
+    light_conf_value_t  step; // What -A and -U change the brightness by when they are given no value
+    double              curve; // Exponent of the percentage scale, 1 for linear
+};
+
+typedef struct _light_conf_alias_t light_conf_alias_t;
+struct _light_conf_alias_t
+{
+    uint64_t    hash; // Of the name, the table is sorted by it
+    uint32_t    name; // Offsets in the string table
+    uint32_t    path;
+};
+
+// Layout of the cache, in native byte order: this header, the targets, the aliases and the string table
+typedef struct _light_conf_header_t light_conf_header_t;
+struct _light_conf_header_t
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    source_size; // Of the text the table was compiled from, to tell when it changed
+    int64_t     source_mtime_sec;
+    int64_t     source_mtime_nsec;
+    uint64_t    source_ino;
+    uint32_t    num_targets;
+    uint32_t    num_aliases;
+    uint32_t    default_target; // Offset in the string table, LIGHT_CONF_NONE if not given
+    uint32_t    strings_size;
+};
+
+typedef struct _light_conf_t light_conf_t;
+struct _light_conf_t
+{
+    light_conf_header_t const   *header;
+    light_conf_target_t const   *targets;
+    light_conf_alias_t const    *aliases;
+    char const                  *strings;
+    size_t                      size;
+    bool                        mapped; // Whether the table is the mapped cache, or was compiled by this process
+};
+
+/* Loads the configuration file of `conf_dir` from its cache, compiling it and writing the cache if that is missing or stale.
+ * Returns NULL if there is no configuration file, or it is invalid. */
+light_conf_t *light_conf_load(char const *conf_dir);
+
+/* Frees a configuration loaded by light_conf_load. NULL is fine. */
+void light_conf_free(light_conf_t *conf);
+
+/* Returns the default target, or NULL if there is none */
+char const *light_conf_default_target(light_conf_t const *conf);
+
+/* Returns the path `name` is an alias of, or NULL if it isn't one */
+char const *light_conf_alias(light_conf_t const *conf, char const *name);
+
+/* Returns the settings of the target at `path`, or NULL if it has none */
+light_conf_target_t const *light_conf_find_target(light_conf_t const *conf, char const *path);
+
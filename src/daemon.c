@@ -0,0 +1,540 @@
+
+#include "daemon.h"
+#include "helpers.h"
+#include "animation.h"
+#include "middleware.h"
+#include "metrics.h"
+#include "logring.h"
+
+#include <stdio.h> // open_memstream, fwrite
+#include <stdlib.h> // malloc, calloc, free
+#include <string.h> // memset, memmove, strerror, strlen
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h> // read, close, unlink
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h> // lstat
+#include <sys/un.h> // sockaddr_un
+
+// Resolution of the fades run by the daemon
+#define LIGHT_DAEMON_TICK_MS 20
+
+static bool _light_daemon_signal(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_daemon_t *daemon = (light_daemon_t*)userdata;
+
+    struct signalfd_siginfo info;
+    if(read(fd, &info, sizeof(info)) < 0)
+    {
+        if(errno != EAGAIN)
+        {
+            LIGHT_ERR("failed to read signal: %s", strerror(errno));
+        }
+
+        return true;
+    }
+
+    if(info.ssi_signo == SIGUSR1)
+    {
+        light_loop_print_stats(daemon->loop);
+        light_scheduler_print_stats(daemon->scheduler);
+        light_middleware_print_stats(daemon->ctx);
+        light_log_ring_dump(stdout);
+        return true;
+    }
+
+    LIGHT_NOTE("stopping on signal %u", info.ssi_signo);
+    light_loop_stop(loop);
+    return true;
+}
+
+// Writes every metric of the daemon
+static void _light_daemon_write_metrics(light_daemon_t *daemon, FILE *out)
+{
+    light_metrics_write_targets(out, daemon->ctx);
+    light_scheduler_write_metrics(daemon->scheduler, out);
+    light_loop_write_metrics(daemon->loop, out);
+
+    light_animator_t *animator = daemon->ctx->animator;
+    light_metrics_family(out, "light_animations_running", "gauge", "Transitions and effects on the animator.");
+    light_metrics_value(out, "light_animations_running", NULL, animator->num_animations);
+    light_metrics_family(out, "light_animation_overruns_total", "counter", "Animator wakeups more than a tick late.");
+    light_metrics_value(out, "light_animation_overruns_total", NULL, animator->overruns);
+    light_metrics_family(out, "light_animation_lateness_seconds", "histogram", "How late the animator woke up for its frames.");
+    light_metrics_histogram(out, "light_animation_lateness_seconds", NULL, &animator->lateness);
+
+    if(daemon->publisher != NULL)
+    {
+        light_publisher_write_metrics(daemon->publisher, out);
+    }
+
+    if(daemon->hotkeys != NULL)
+    {
+        light_metrics_family(out, "light_hotkeys_presses_total", "counter", "Brightness key presses and auto-repeats.");
+        light_metrics_value(out, "light_hotkeys_presses_total", NULL, daemon->hotkeys->presses);
+        light_metrics_family(out, "light_hotkeys_coalesced_total", "counter", "Key presses folded into the write of an earlier press.");
+        light_metrics_value(out, "light_hotkeys_coalesced_total", NULL, daemon->hotkeys->coalesced);
+    }
+}
+
+static void _light_daemon_metrics_drop(light_metrics_client_t *client)
+{
+    light_daemon_t *daemon = client->daemon;
+    for(uint64_t i = 0; i < daemon->num_metrics_clients; i++)
+    {
+        if(daemon->metrics_clients[i] == client)
+        {
+            memmove(&daemon->metrics_clients[i], &daemon->metrics_clients[i + 1], (daemon->num_metrics_clients - i - 1) * sizeof(light_metrics_client_t*));
+            daemon->num_metrics_clients--;
+            break;
+        }
+    }
+
+    light_loop_remove(daemon->loop, client->fd);
+    close(client->fd);
+    free(client->text);
+    free(client);
+}
+
+// Sends the rest of the metrics of `client` until they are all sent or its socket is full. Returns true if some are left.
+static bool _light_daemon_metrics_send(light_metrics_client_t *client)
+{
+    while(client->sent < client->length)
+    {
+        ssize_t sent = send(client->fd, client->text + client->sent, client->length - client->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            if(errno == EAGAIN)
+            {
+                return true;
+            }
+
+            LIGHT_WARN("failed to send metrics: %s", strerror(errno));
+            return false;
+        }
+
+        client->sent += (size_t)sent;
+    }
+
+    return false;
+}
+
+static bool _light_daemon_metrics_writable(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_metrics_client_t *client = (light_metrics_client_t*)userdata;
+    if(!_light_daemon_metrics_send(client))
+    {
+        _light_daemon_metrics_drop(client);
+    }
+
+    return true;
+}
+
+static bool _light_daemon_metrics_client(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_daemon_t *daemon = (light_daemon_t*)userdata;
+
+    int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(client_fd < 0)
+    {
+        if(errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        {
+            LIGHT_ERR("failed to accept metrics client: %s", strerror(errno));
+        }
+
+        return true;
+    }
+
+    light_metrics_client_t *client = calloc(1, sizeof(light_metrics_client_t));
+    FILE *out = client != NULL ? open_memstream(&client->text, &client->length) : NULL;
+    if(out == NULL)
+    {
+        LIGHT_MEMERR();
+        free(client);
+        close(client_fd);
+        return true;
+    }
+
+    client->daemon = daemon;
+    client->fd = client_fd;
+    _light_daemon_write_metrics(daemon, out);
+    fclose(out);
+
+    // Most clients take it all at once, the others get the rest whenever they read, without holding up the loop
+    if(!_light_daemon_metrics_send(client))
+    {
+        free(client->text);
+        free(client);
+        close(client_fd);
+        return true;
+    }
+
+    if(daemon->num_metrics_clients == LIGHT_DAEMON_METRICS_CLIENTS)
+    {
+        LIGHT_WARN("too many metrics clients, dropping the oldest");
+        _light_daemon_metrics_drop(daemon->metrics_clients[0]);
+    }
+
+    if(!light_loop_add(loop, client_fd, EPOLLOUT, _light_daemon_metrics_writable, client, "metrics"))
+    {
+        free(client->text);
+        free(client);
+        close(client_fd);
+        return true;
+    }
+
+    daemon->metrics_clients[daemon->num_metrics_clients++] = client;
+    return true;
+}
+
+// Fills in the address of the socket at `path`
+static bool _light_daemon_socket_address(char const *path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address->sun_path))
+    {
+        LIGHT_ERR("socket path %s is too long", path);
+        return false;
+    }
+
+    memcpy(address->sun_path, path, strlen(path));
+    return true;
+}
+
+// Returns a non-blocking socket listening at `path`, -1 on failure
+static int _light_daemon_listen(char const *path)
+{
+    struct sockaddr_un address;
+    if(!_light_daemon_socket_address(path, &address))
+    {
+        return -1;
+    }
+
+    // A socket left behind by a daemon that didn't stop cleanly is replaced, anything else at the path is left alone
+    struct stat path_stat;
+    if(lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode))
+    {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if(fd < 0)
+    {
+        LIGHT_ERR("failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if(bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 8) < 0)
+    {
+        LIGHT_ERR("failed to listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool _light_daemon_metrics_listen(light_daemon_t *daemon, char const *path)
+{
+    daemon->metrics_fd = _light_daemon_listen(path);
+    if(daemon->metrics_fd < 0)
+    {
+        return false;
+    }
+
+    LIGHT_NOTE("serving metrics on %s", path);
+    return light_loop_add(daemon->loop, daemon->metrics_fd, EPOLLIN, _light_daemon_metrics_client, daemon, "metrics");
+}
+
+static bool _light_daemon_publish_listen(light_daemon_t *daemon, char const *path)
+{
+    daemon->publish_fd = _light_daemon_listen(path);
+    if(daemon->publish_fd < 0)
+    {
+        return false;
+    }
+
+    daemon->publisher = light_publisher_create(daemon->ctx, daemon->loop, daemon->publish_fd);
+    if(daemon->publisher == NULL)
+    {
+        return false;
+    }
+
+    LIGHT_NOTE("publishing changes on %s", path);
+    return true;
+}
+
+static bool _light_daemon_animate(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_animator_dispatch((light_animator_t*)userdata);
+    return true;
+}
+
+static void _light_daemon_free(light_daemon_t *daemon)
+{
+    // Features are stopped first, as they may still write to their targets
+    if(daemon->idle != NULL)
+    {
+        light_idle_free(daemon->idle);
+    }
+
+    if(daemon->hotkeys != NULL)
+    {
+        light_hotkeys_free(daemon->hotkeys);
+    }
+
+    if(daemon->power != NULL)
+    {
+        light_power_free(daemon->power);
+    }
+
+    if(daemon->schedule != NULL)
+    {
+        light_schedule_free(daemon->schedule);
+    }
+
+    // After the features, whose last writes are still published
+    if(daemon->publisher != NULL)
+    {
+        light_publisher_free(daemon->publisher);
+    }
+
+    if(daemon->publish_fd >= 0)
+    {
+        close(daemon->publish_fd);
+        unlink(daemon->ctx->daemon_params.publish_path);
+    }
+
+    if(daemon->input != NULL)
+    {
+        light_input_free(daemon->input);
+    }
+
+    if(daemon->scheduler != NULL)
+    {
+        light_scheduler_free(daemon->scheduler);
+    }
+
+    if(daemon->ctx->animator != NULL)
+    {
+        light_loop_remove(daemon->loop, daemon->ctx->animator->timer_fd);
+    }
+
+    if(daemon->signal_fd >= 0)
+    {
+        close(daemon->signal_fd);
+    }
+
+    while(daemon->num_metrics_clients > 0)
+    {
+        _light_daemon_metrics_drop(daemon->metrics_clients[0]);
+    }
+
+    if(daemon->metrics_fd >= 0)
+    {
+        close(daemon->metrics_fd);
+        unlink(daemon->ctx->daemon_params.metrics_path);
+    }
+
+    light_loop_free(daemon->loop);
+    free(daemon);
+}
+
+static bool _light_daemon_start(light_daemon_t *daemon)
+{
+    light_context_t *ctx = daemon->ctx;
+
+    if(!light_loop_set_timer_slack(ctx->daemon_params.timer_slack_ms * 1000000ull))
+    {
+        return false;
+    }
+
+    // Notices are recorded whatever -v says, formatting them is left to the dump
+    if(ctx->daemon_params.log_ring_entries > 0 && !light_log_ring_start(ctx->daemon_params.log_ring_entries, LIGHT_NOTE_LEVEL))
+    {
+        return false;
+    }
+
+    // Signals are handled as events, so that features can clean up (restore brightness etc.) on the way out
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    if(sigprocmask(SIG_BLOCK, &signals, NULL) < 0)
+    {
+        LIGHT_ERR("failed to block signals: %s", strerror(errno));
+        return false;
+    }
+
+    daemon->signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    if(daemon->signal_fd < 0)
+    {
+        LIGHT_ERR("failed to create signalfd: %s", strerror(errno));
+        return false;
+    }
+
+    if(!light_loop_add(daemon->loop, daemon->signal_fd, EPOLLIN, _light_daemon_signal, daemon, "daemon"))
+    {
+        return false;
+    }
+
+    // Fades and effects started by features run on the shared animator, driven by the loop instead of light_effect_wait
+    if(ctx->animator == NULL)
+    {
+        ctx->animator = light_animator_create(LIGHT_DAEMON_TICK_MS);
+        if(ctx->animator == NULL)
+        {
+            return false;
+        }
+    }
+
+    if(!light_loop_add(daemon->loop, ctx->animator->timer_fd, EPOLLIN, _light_daemon_animate, ctx->animator, "animation"))
+    {
+        return false;
+    }
+
+    daemon->scheduler = light_scheduler_create(ctx);
+
+    if(ctx->daemon_params.metrics_path != NULL && !_light_daemon_metrics_listen(daemon, ctx->daemon_params.metrics_path))
+    {
+        return false;
+    }
+
+    if(ctx->daemon_params.publish_path != NULL && !_light_daemon_publish_listen(daemon, ctx->daemon_params.publish_path))
+    {
+        return false;
+    }
+
+    bool need_input = ctx->daemon_params.idle_timeout_ms > 0 || ctx->daemon_params.hotkeys;
+    if(need_input)
+    {
+        daemon->input = light_input_create(daemon->loop, ctx->daemon_params.input_paths, ctx->daemon_params.num_input_paths);
+        if(daemon->input == NULL)
+        {
+            return false;
+        }
+    }
+
+    if(ctx->daemon_params.idle_timeout_ms > 0)
+    {
+        daemon->idle = light_idle_create(ctx, daemon->loop, daemon->input, daemon->scheduler, ctx->daemon_params.idle_timeout_ms, ctx->daemon_params.idle_value);
+        if(daemon->idle == NULL)
+        {
+            return false;
+        }
+    }
+
+    if(ctx->daemon_params.power_profiles)
+    {
+        daemon->power = light_power_create(ctx, daemon->loop);
+        if(daemon->power == NULL)
+        {
+            return false;
+        }
+    }
+
+    if(ctx->daemon_params.schedule_path != NULL)
+    {
+        daemon->schedule = light_schedule_create(ctx, daemon->loop, daemon->scheduler, ctx->daemon_params.schedule_path);
+        if(daemon->schedule == NULL)
+        {
+            return false;
+        }
+    }
+
+    // Registered after idle dimming, so that a key press that wakes the target up steps from the restored brightness
+    if(ctx->daemon_params.hotkeys)
+    {
+        daemon->hotkeys = light_hotkeys_create(ctx, daemon->input, daemon->scheduler, ctx->daemon_params.hotkey_step);
+        if(daemon->hotkeys == NULL)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool light_cmd_run_daemon(light_context_t *ctx)
+{
+    // Profiles, hotplugged devices and the metrics cover every target
+    if(!light_init_enumerators(ctx))
+    {
+        LIGHT_WARN("failed to initialize all enumerators");
+    }
+
+    light_daemon_t *daemon = malloc(sizeof(light_daemon_t));
+    memset(daemon, 0, sizeof(light_daemon_t));
+    daemon->ctx = ctx;
+    daemon->signal_fd = -1;
+    daemon->metrics_fd = -1;
+    daemon->publish_fd = -1;
+
+    daemon->loop = light_loop_create();
+    if(daemon->loop == NULL)
+    {
+        free(daemon);
+        return false;
+    }
+
+    bool success = _light_daemon_start(daemon) && light_loop_run(daemon->loop);
+
+    _light_daemon_free(daemon);
+    return success;
+}
+
+bool light_daemon_print_metrics(char const *path)
+{
+    struct sockaddr_un address;
+    if(!_light_daemon_socket_address(path, &address))
+    {
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        LIGHT_ERR("failed to create socket: %s", strerror(errno));
+        return false;
+    }
+
+    if(connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "couldn't connect to the daemon at %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    // The daemon closes the connection once everything was sent
+    char buffer[4096];
+    ssize_t length = 0;
+    while((length = read(fd, buffer, sizeof(buffer))) != 0)
+    {
+        if(length < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            LIGHT_ERR("failed to read metrics: %s", strerror(errno));
+            close(fd);
+            return false;
+        }
+
+        fwrite(buffer, 1, (size_t)length, stdout);
+    }
+
+    close(fd);
+    fflush(stdout);
+    return true;
+}
+
@@ -0,0 +1,56 @@
+
+#pragma once
+
+#include "light.h"
+#include "loop.h"
+#include "scheduler.h"
+#include "input.h"
+#include "idle.h"
+#include "hotkeys.h"
+#include "power.h"
+#include "schedule.h"
+#include "publish.h"
+
+// The long-running mode of light, started by any of the daemon options (--idle etc.)
+// Every enabled feature registers its file descriptors with one event loop, which runs until SIGINT or SIGTERM.
+// SIGUSR1 prints the wakeups and CPU time of every feature, the request stats of the scheduler and the log ring (--log-ring). With --metrics, the same numbers and more are served in the Prometheus text
+// format on a Unix socket, to every client that connects, and `light --stats` prints them. With --publish, the changes of every
+// target are sent to the clients that subscribe to them, see publish.h.
+
+// Metrics clients being sent their snapshot at once, the oldest is dropped to make room for a new one
+#define LIGHT_DAEMON_METRICS_CLIENTS 8
+
+typedef struct _light_daemon_t light_daemon_t;
+
+// A client of --metrics that didn't take its snapshot at once, the loop sends the rest as its socket drains
+typedef struct _light_metrics_client_t light_metrics_client_t;
+struct _light_metrics_client_t
+{
+    light_daemon_t  *daemon;
+    int             fd;
+    char            *text; // The metrics as they were when the client connected
+    size_t          length;
+    size_t          sent;
+};
+
+struct _light_daemon_t
+{
+    light_context_t *ctx;
+    light_loop_t    *loop;
+    int             signal_fd;
+    light_scheduler_t *scheduler;
+    light_input_t   *input; // Only opened when a feature needs input
+    light_idle_t    *idle;
+    light_hotkeys_t *hotkeys;
+    light_power_t   *power;
+    light_schedule_t *schedule;
+    int             metrics_fd; // Listening socket of --metrics, -1 if not serving
+    light_metrics_client_t *metrics_clients[LIGHT_DAEMON_METRICS_CLIENTS]; // Oldest first
+    uint64_t        num_metrics_clients;
+    int             publish_fd; // Listening socket of --publish, -1 if not publishing
+    light_publisher_t *publisher;
+};
+
+/* Prints the metrics served by a daemon on the socket `path` */
+bool light_daemon_print_metrics(char const *path);
+
@@ -0,0 +1,253 @@
+
+#include "effect.h"
+#include "helpers.h"
+
+#include <stdio.h> // sscanf, snprintf
+#include <string.h> // strcmp, strtok_r
+#include <stdlib.h> // strtod, strtoull
+#include <errno.h>
+
+// Resolution of the fades of userspace effects
+#define LIGHT_EFFECT_TICK_MS 20
+
+static void _light_effect_set_keyframe(light_keyframe_t *keyframe, double level, uint64_t duration_ms, bool ramp)
+{
+    keyframe->level = level;
+    keyframe->duration_ms = duration_ms;
+    keyframe->ramp = ramp;
+}
+
+// Parses a duration in milliseconds. Only digits, since strtoull would take "-5" for a huge number.
+static bool _light_effect_parse_ms(char const *token, uint64_t *out_ms)
+{
+    if(*token < '0' || *token > '9')
+    {
+        return false;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    *out_ms = strtoull(token, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+// Parses the entries of a table effect, "<percent>:<ms>" or "<percent>/<ms>"
+static bool _light_effect_parse_table(char const *str, light_effect_t *out_effect)
+{
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%s", str);
+
+    uint64_t total_ms = 0;
+    out_effect->num_keyframes = 0;
+
+    char *save = NULL;
+    for(char *token = strtok_r(buffer, " \t", &save); token != NULL; token = strtok_r(NULL, " \t", &save))
+    {
+        if(out_effect->num_keyframes == LIGHT_EFFECT_MAX_KEYFRAMES)
+        {
+            LIGHT_ERR("table effects can have at most %d entries", LIGHT_EFFECT_MAX_KEYFRAMES);
+            return false;
+        }
+
+        char *separator = NULL;
+        double percent = strtod(token, &separator);
+        if(separator == token || (*separator != ':' && *separator != '/'))
+        {
+            return false;
+        }
+
+        uint64_t duration_ms = 0;
+        if(!_light_effect_parse_ms(separator + 1, &duration_ms))
+        {
+            return false;
+        }
+
+        _light_effect_set_keyframe(&out_effect->keyframes[out_effect->num_keyframes], light_percent_clamp(percent) / 100.0, duration_ms, *separator == '/');
+        out_effect->num_keyframes++;
+        total_ms += duration_ms;
+    }
+
+    return out_effect->num_keyframes > 0 && total_ms > 0;
+}
+
+bool light_effect_parse(char const *str, light_effect_t *out_effect)
+{
+    char name[16];
+    int length = 0;
+
+    if(sscanf(str, " %15s%n", name, &length) != 1)
+    {
+        return false;
+    }
+
+    char const *args = str + length;
+
+    out_effect->on_ms = 0;
+    out_effect->off_ms = 0;
+    out_effect->period_ms = 0;
+    out_effect->level = 0.0;
+    out_effect->num_keyframes = 0;
+
+    if(strcmp(name, "table") == 0)
+    {
+        out_effect->type = LIGHT_EFFECT_TABLE;
+        return _light_effect_parse_table(args, out_effect);
+    }
+
+    // The other effects take at most two arguments, anything left over makes the effect invalid
+    char buffer[64];
+    if(snprintf(buffer, sizeof(buffer), "%s", args) >= (int)sizeof(buffer))
+    {
+        return false;
+    }
+
+    char *tokens[2];
+    uint64_t num_tokens = 0;
+    char *save = NULL;
+    for(char *token = strtok_r(buffer, " \t", &save); token != NULL; token = strtok_r(NULL, " \t", &save))
+    {
+        if(num_tokens == 2)
+        {
+            return false;
+        }
+        tokens[num_tokens++] = token;
+    }
+
+    if(strcmp(name, "none") == 0)
+    {
+        out_effect->type = LIGHT_EFFECT_NONE;
+        return num_tokens == 0;
+    }
+
+    if(strcmp(name, "blink") == 0 || strcmp(name, "oneshot") == 0)
+    {
+        out_effect->type = (name[0] == 'b') ? LIGHT_EFFECT_BLINK : LIGHT_EFFECT_ONESHOT;
+        out_effect->on_ms = 500;
+        if(num_tokens >= 1 && !_light_effect_parse_ms(tokens[0], &out_effect->on_ms))
+        {
+            return false;
+        }
+
+        out_effect->off_ms = out_effect->on_ms;
+        if(num_tokens == 2 && !_light_effect_parse_ms(tokens[1], &out_effect->off_ms))
+        {
+            return false;
+        }
+
+        return out_effect->on_ms > 0 || out_effect->off_ms > 0;
+    }
+
+    if(strcmp(name, "breathe") == 0)
+    {
+        out_effect->type = LIGHT_EFFECT_BREATHE;
+        out_effect->period_ms = 2000;
+        if(num_tokens > 1 || (num_tokens == 1 && !_light_effect_parse_ms(tokens[0], &out_effect->period_ms)))
+        {
+            return false;
+        }
+
+        return out_effect->period_ms >= 2 * LIGHT_EFFECT_TICK_MS;
+    }
+
+    if(strcmp(name, "ramp") == 0)
+    {
+        out_effect->type = LIGHT_EFFECT_RAMP;
+        if(num_tokens != 2)
+        {
+            return false;
+        }
+
+        char *end = NULL;
+        double percent = strtod(tokens[0], &end);
+        if(end == tokens[0] || *end != '\0' || !_light_effect_parse_ms(tokens[1], &out_effect->period_ms))
+        {
+            return false;
+        }
+
+        out_effect->level = light_percent_clamp(percent) / 100.0;
+        return true;
+    }
+
+    return false;
+}
+
+bool light_effect_run_userspace(light_device_target_t *target, light_effect_t const *effect)
+{
+    light_context_t *ctx = target->device->enumerator->context;
+
+    if(ctx->animator == NULL)
+    {
+        ctx->animator = light_animator_create(LIGHT_EFFECT_TICK_MS);
+        if(ctx->animator == NULL)
+        {
+            return false;
+        }
+    }
+
+    LIGHT_NOTE("running effect on %s from userspace", target->name);
+
+    light_keyframe_t keyframes[LIGHT_EFFECT_MAX_KEYFRAMES];
+    uint64_t num_keyframes = 0;
+    bool repeat = true;
+
+    switch(effect->type)
+    {
+        case LIGHT_EFFECT_NONE:
+            // Stop whatever we were running on the target
+            light_animator_remove(ctx->animator, target);
+            return true;
+
+        case LIGHT_EFFECT_BLINK:
+        case LIGHT_EFFECT_ONESHOT:
+            _light_effect_set_keyframe(&keyframes[0], 1.0, effect->on_ms, false);
+            _light_effect_set_keyframe(&keyframes[1], 0.0, effect->off_ms, false);
+            num_keyframes = 2;
+            repeat = (effect->type == LIGHT_EFFECT_BLINK);
+            break;
+
+        case LIGHT_EFFECT_BREATHE:
+            _light_effect_set_keyframe(&keyframes[0], 0.0, effect->period_ms / 2, true);
+            _light_effect_set_keyframe(&keyframes[1], 1.0, effect->period_ms - effect->period_ms / 2, true);
+            num_keyframes = 2;
+            break;
+
+        case LIGHT_EFFECT_RAMP:
+        {
+            // Fade from wherever the target is now
+            uint64_t value = 0;
+            uint64_t max_value = 0;
+            if(!target->get_value(target, &value) || !target->get_max_value(target, &max_value) || max_value == 0)
+            {
+                LIGHT_ERR("couldn't read the current value of %s", target->name);
+                return false;
+            }
+
+            _light_effect_set_keyframe(&keyframes[0], (double)value / (double)max_value, effect->period_ms, true);
+            _light_effect_set_keyframe(&keyframes[1], effect->level, 0, false);
+            num_keyframes = 2;
+            repeat = false;
+            break;
+        }
+
+        case LIGHT_EFFECT_TABLE:
+            for(uint64_t i = 0; i < effect->num_keyframes; i++)
+            {
+                keyframes[i] = effect->keyframes[i];
+            }
+            num_keyframes = effect->num_keyframes;
+            break;
+    }
+
+    return light_animator_add(ctx->animator, target, keyframes, num_keyframes, repeat) != NULL;
+}
+
+bool light_effect_wait(light_context_t *ctx)
+{
+    if(ctx->animator == NULL)
+    {
+        return true;
+    }
+
+    return light_animator_run(ctx->animator);
+}
+
@@ -0,0 +1,50 @@
+
+#pragma once
+
+#include "light.h"
+#include "animation.h"
+
+// Light effects (blinking, breathing etc.) that run on a device target, either offloaded to
+// the hardware by the enumerator, or driven from userspace by the context's animator
+
+// Max number of entries in a table effect
+#define LIGHT_EFFECT_MAX_KEYFRAMES 32
+
+typedef enum {
+    LIGHT_EFFECT_NONE = 0, // Stops any running effect
+    LIGHT_EFFECT_BLINK,    // Alternates between max and off, forever
+    LIGHT_EFFECT_ONESHOT,  // A single blink
+    LIGHT_EFFECT_BREATHE,  // Fades between off and max, forever
+    LIGHT_EFFECT_RAMP,     // Fades from the current brightness to a level, once
+    LIGHT_EFFECT_TABLE     // Custom keyframes, forever
+} light_effect_type_t;
+
+typedef struct _light_effect_t light_effect_t;
+struct _light_effect_t
+{
+    light_effect_type_t type;
+    uint64_t            on_ms;     // Blink/oneshot: time spent lit
+    uint64_t            off_ms;    // Blink/oneshot: time spent off
+    uint64_t            period_ms; // Breathe: duration of a full off-max-off cycle. Ramp: duration of the fade
+    double              level;     // Ramp: the level to fade to, as a fraction of max
+    light_keyframe_t    keyframes[LIGHT_EFFECT_MAX_KEYFRAMES]; // Table: the keyframes
+    uint64_t            num_keyframes;
+};
+
+/* Parses an effect description, one of:
+ *   none
+ *   blink [on_ms] [off_ms]
+ *   oneshot [on_ms] [off_ms]
+ *   breathe [period_ms]
+ *   ramp <percent> <ms>
+ *   table <percent>:<ms>|<percent>/<ms> ...  (':' holds the level, '/' fades towards the next entry)
+ * Returns false if `str` isn't a valid effect. */
+bool light_effect_parse(char const *str, light_effect_t *out_effect);
+
+/* Starts `effect` on `target` by writing its brightness from userspace, through the animator of the context. For fallback use when the
+ * target can't run the effect by itself. Returns immediately, light_effect_wait drives the effects. */
+bool light_effect_run_userspace(light_device_target_t *target, light_effect_t const *effect);
+
+/* Drives the userspace effects of the context until they are done, which for repeating effects is never (until the process is stopped) */
+bool light_effect_wait(light_context_t *ctx);
+
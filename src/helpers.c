@@ -1,4 +1,5 @@
 #include "helpers.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,53 +8,159 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h> // errno
+#include <inttypes.h> // PRIu64
 #include <libgen.h> // dirname 
+#include <fcntl.h> // open, O_DIRECTORY
+#include <sys/syscall.h> // SYS_getdents64
 
+/* Size of the buffer handed to getdents64, large enough to fetch a typical sysfs class directory in one call */
+#define LIGHT_DIR_SCAN_BUFSIZE 32768
+
+/* Layout of the records returned by getdents64 */
+struct _light_dirent64_t
+{
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+__thread light_loglevel_t light_loglevel;
+
+void light_log(light_log_site_t const *site, FILE *fp, char const *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if(light_loglevel >= site->level)
+    {
+        va_list print_args;
+        va_copy(print_args, args);
+
+        // In one piece, even when threads log at the same time
+        flockfile(fp);
+        fprintf(fp, "%s:%d:", site->file, site->line);
+        vfprintf(fp, format, print_args);
+        fputc('\n', fp);
+        funlockfile(fp);
+
+        va_end(print_args);
+    }
+
+    if(light_log_ring_level >= site->level)
+    {
+        light_log_ring_record(site, args);
+    }
+
+    va_end(args);
+}
 
 bool light_file_read_uint64(char const *filename, uint64_t *val)
 {
-    FILE *fp;
-    uint64_t data;
+    return light_file_read_uint64_at(AT_FDCWD, filename, val);
+}
 
-    fp = fopen(filename, "r");
-    if(!fp)
+bool light_file_write_uint64(char const *filename, uint64_t val)
+{
+    return light_file_write_uint64_at(AT_FDCWD, filename, val);
+}
+
+// Reads an unsigned integer from `filename`, quietly returning false if the file doesn't exist and `optional` is set
+static bool _light_file_read_uint64_at(int dirfd, char const *filename, uint64_t *val, bool optional)
+{
+    int fd = openat(dirfd, filename, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
     {
-        LIGHT_PERMERR("reading");
+        if(!optional || errno != ENOENT)
+        {
+            LIGHT_PERMERR("reading");
+        }
         return false;
     }
 
-    if(fscanf(fp, "%lu", &data) != 1)
+    char buffer[32];
+    ssize_t nread = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+
+    if(nread < 0)
+    {
+        LIGHT_ERR("Couldn't read from '%s': %s", filename, strerror(errno));
+        return false;
+    }
+
+    buffer[nread] = '\0';
+
+    char *begin = buffer;
+    while(*begin == ' ' || *begin == '\t' || *begin == '\n')
+    {
+        begin++;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    uint64_t data = strtoull(begin, &end, 10);
+    if(end == begin || *begin == '-' || errno != 0)
     {
         LIGHT_ERR("Couldn't parse an unsigned integer from '%s'", filename);
-        fclose(fp);
         return false;
     }
 
     *val = data;
-
-    fclose(fp);
     return true;
 }
 
-bool light_file_write_uint64(char const *filename, uint64_t val)
+bool light_file_read_uint64_at(int dirfd, char const *filename, uint64_t *val)
 {
-    FILE *fp;
+    return _light_file_read_uint64_at(dirfd, filename, val, false);
+}
 
-    fp = fopen(filename, "w");
-    if(!fp)
+bool light_file_read_uint64_optional(char const *filename, uint64_t *val)
+{
+    return _light_file_read_uint64_at(AT_FDCWD, filename, val, true);
+}
+
+bool light_file_write_uint64_at(int dirfd, char const *filename, uint64_t val)
+{
+    int fd = openat(dirfd, filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd < 0)
     {
         LIGHT_PERMERR("writing");
         return false;
     }
 
-    if(fprintf(fp, "%lu", val) < 0)
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), "%" PRIu64, val);
+
+    if(write(fd, buffer, length) != length)
     {
-        LIGHT_ERR("fprintf failed");
-        fclose(fp);
+        LIGHT_ERR("write to '%s' failed: %s", filename, strerror(errno));
+        close(fd);
         return false;
     }
 
-    fclose(fp);
+    close(fd);
+    return true;
+}
+
+bool light_file_write_string_at(int dirfd, char const *filename, char const *str)
+{
+    int fd = openat(dirfd, filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd < 0)
+    {
+        LIGHT_PERMERR("writing");
+        return false;
+    }
+
+    ssize_t length = strlen(str);
+    if(write(fd, str, length) != length)
+    {
+        LIGHT_ERR("write to '%s' failed: %s", filename, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    close(fd);
     return true;
 }
 
@@ -146,3 +253,86 @@ int light_mkpath(char *dir, mode_t mode)
     return mkdir(dir, mode);
 }
 
+/* Resolves the type of an entry that the filesystem reported as DT_UNKNOWN */
+static unsigned char _light_dir_entry_type(int dirfd, char const *name)
+{
+    struct stat sb;
+    if(fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+        return DT_UNKNOWN;
+    }
+
+    return IFTODT(sb.st_mode);
+}
+
+bool light_dir_scan(char const *path, uint32_t type_mask, LFUNCDIRENTRY callback, void *userdata)
+{
+    uint64_t trace_start_ns = light_trace_scan_begin();
+    
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirfd < 0)
+    {
+        light_trace_scan(path, trace_start_ns, false);
+        return false;
+    }
+
+    bool success = light_dir_scan_fd(dirfd, type_mask, callback, userdata);
+
+    close(dirfd);
+    light_trace_scan(path, trace_start_ns, success);
+    return success;
+}
+
+bool light_dir_scan_fd(int dirfd, uint32_t type_mask, LFUNCDIRENTRY callback, void *userdata)
+{
+    char buffer[LIGHT_DIR_SCAN_BUFSIZE] __attribute__((aligned(8)));
+    bool success = true;
+    bool done = false;
+
+    while(!done)
+    {
+        long nread = syscall(SYS_getdents64, dirfd, buffer, sizeof(buffer));
+        if(nread < 0)
+        {
+            LIGHT_ERR("getdents64 failed: %s", strerror(errno));
+            success = false;
+            break;
+        }
+
+        if(nread == 0)
+        {
+            break;
+        }
+
+        for(long offset = 0; offset < nread && !done;)
+        {
+            struct _light_dirent64_t *entry = (struct _light_dirent64_t*)(buffer + offset);
+            offset += entry->d_reclen;
+
+            // Skip dot entries
+            if(entry->d_name[0] == '.')
+            {
+                continue;
+            }
+
+            unsigned char type = entry->d_type;
+            if(type == DT_UNKNOWN)
+            {
+                type = _light_dir_entry_type(dirfd, entry->d_name);
+            }
+
+            if(!(type_mask & LIGHT_DT_MASK(type)))
+            {
+                continue;
+            }
+
+            if(!callback(dirfd, entry->d_name, type, userdata))
+            {
+                done = true;
+            }
+        }
+    }
+
+    return success;
+}
+
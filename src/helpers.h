@@ -1,13 +1,14 @@
 
 #pragma once
 
+#include "config.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stdarg.h> // va_list
 
-/* Clamps x(value) between y(min) and z(max) in a nested ternary operation */
-#define LIGHT_CLAMP(val, min, max) (val < min ? light_log_clamp_min(min) : (val > max ? light_log_clamp_max(max) : val))
 
 /* Verbosity levels: 
 * 0 - No output
@@ -21,11 +22,45 @@ typedef enum {
     LIGHT_NOTE_LEVEL
 } light_loglevel_t;
 
-light_loglevel_t light_loglevel;
+// Most verbose level that is built in, set with ./configure --with-log-level. The messages above it are left out of the
+// binary, along with their strings and the test of light_loglevel.
+#ifndef LIGHT_LOG_MAX_LEVEL
+#define LIGHT_LOG_MAX_LEVEL 3
+#endif
+
+// Per thread, so that contexts with different levels can be used from different threads
+extern __thread light_loglevel_t light_loglevel;
+
+// Where a message is logged from. Every LIGHT_LOG has a static one, whose address is what the log ring records.
+typedef struct _light_log_site_t light_log_site_t;
+struct _light_log_site_t
+{
+    char const          *file;
+    int                 line;
+    light_loglevel_t    level;
+    char const          *format;
+};
+
+// Most verbose level recorded in the log ring, 0 while there is none (see logring.h)
+extern light_loglevel_t light_log_ring_level;
+
+/* Records a message in the log ring, with the arguments of `site->format` */
+void light_log_ring_record(light_log_site_t const *site, va_list args);
+
+/* Prints a message to `fp` if the level of the thread lets it through, and records it in the log ring if that is started up
+ * to its level. The arguments are only taken once, for both. `format` is the one of `site`, passed again to check the
+ * arguments against it. */
+void light_log(light_log_site_t const *site, FILE *fp, char const *format, ...) __attribute__((format(printf, 3, 4)));
 
 #define LIGHT_LOG(lvl, fp, fmt, args...)\
-    if(light_loglevel >= lvl)\
-        fprintf(fp, "%s:%d:" fmt "\n", __FILE__, __LINE__, ##args)
+    do {\
+        if(lvl <= LIGHT_LOG_MAX_LEVEL)\
+        {\
+            static light_log_site_t const _light_log_site = {__FILE__, __LINE__, lvl, fmt};\
+            if(light_loglevel >= lvl || light_log_ring_level >= lvl)\
+                light_log(&_light_log_site, fp, fmt, ##args);\
+        }\
+    } while(0)
 
 #define LIGHT_NOTE(fmt, args...) LIGHT_LOG(LIGHT_NOTE_LEVEL,  stdout, " Notice: " fmt, ##args)
 #define LIGHT_WARN(fmt, args...) LIGHT_LOG(LIGHT_WARN_LEVEL,  stderr, " Warning: " fmt, ##args)
@@ -43,6 +78,16 @@ light_loglevel_t light_loglevel;
 bool light_file_write_uint64   (char const *filename, uint64_t val);
 bool light_file_read_uint64    (char const *filename, uint64_t *val);
 
+/* Same as above, but `filename` is resolved relative to the directory `dirfd` (or the working directory for AT_FDCWD) */
+bool light_file_write_uint64_at(int dirfd, char const *filename, uint64_t val);
+bool light_file_read_uint64_at (int dirfd, char const *filename, uint64_t *val);
+
+/* Same as light_file_read_uint64, but a missing file is no error: it only costs the failed open instead of checking first */
+bool light_file_read_uint64_optional(char const *filename, uint64_t *val);
+
+/* Writes the string `str` to `filename`, relative to `dirfd` */
+bool light_file_write_string_at(int dirfd, char const *filename, char const *str);
+
 bool light_file_exists (char const *filename);
 bool light_file_is_writable (char const *filename);
 bool light_file_is_readable (char const *filename);
@@ -50,7 +95,27 @@ bool light_file_is_readable (char const *filename);
 uint64_t light_log_clamp_min(uint64_t min);
 uint64_t light_log_clamp_max(uint64_t max);
 
+/* Clamps x(value) between y(min) and z(max) in a nested ternary operation, with a notice when notices are built in */
+#if LIGHT_LOG_MAX_LEVEL >= 3
+#define LIGHT_CLAMP(val, min, max) (val < min ? light_log_clamp_min(min) : (val > max ? light_log_clamp_max(max) : val))
+#else
+#define LIGHT_CLAMP(val, min, max) (val < min ? (min) : (val > max ? (max) : val))
+#endif
+
 double light_percent_clamp(double percent);
 
 int light_mkpath(char *dir, mode_t mode);
 
+/* Builds a type mask for light_dir_scan from a DT_* value (see dirent.h) */
+#define LIGHT_DT_MASK(type) (1u << (type))
+
+/* Called by light_dir_scan for each matching entry. `dirfd` is the scanned directory, return false to stop the scan. */
+typedef bool (*LFUNCDIRENTRY)(int dirfd, char const *name, unsigned char type, void *userdata);
+
+/* Lists the entries of `path` in large getdents64 batches, calling `callback` for each entry whose type is in `type_mask`.
+ * Dot entries are skipped. Returns false if the directory couldn't be opened or read. */
+bool light_dir_scan(char const *path, uint32_t type_mask, LFUNCDIRENTRY callback, void *userdata);
+
+/* Same as above, for a directory that is already open. `dirfd` is left open. */
+bool light_dir_scan_fd(int dirfd, uint32_t type_mask, LFUNCDIRENTRY callback, void *userdata);
+
@@ -0,0 +1,84 @@
+
+#include "hotkeys.h"
+#include "helpers.h"
+
+#include <stdlib.h> // malloc, free
+
+static void _light_hotkeys_input(struct input_event const *events, uint64_t num_events, uint64_t time_ns, void *userdata)
+{
+    light_hotkeys_t *hotkeys = (light_hotkeys_t*)userdata;
+
+    // The presses of a batch are summed up, so that they cost a single write
+    int64_t delta = 0;
+    uint64_t presses = 0;
+    for(uint64_t i = 0; i < num_events; i++)
+    {
+        struct input_event const *event = &events[i];
+        if(event->type != EV_KEY || (event->code != KEY_BRIGHTNESSUP && event->code != KEY_BRIGHTNESSDOWN))
+        {
+            continue;
+        }
+
+        // 1 is a press, 2 an auto-repeat and 0 a release
+        if(event->value == 0)
+        {
+            continue;
+        }
+
+        hotkeys->repeats = event->value == 2 ? hotkeys->repeats + 1 : 0;
+
+        uint64_t accel = 1 + hotkeys->repeats / LIGHT_HOTKEYS_ACCEL_REPEATS;
+        if(accel > LIGHT_HOTKEYS_MAX_ACCEL)
+        {
+            accel = LIGHT_HOTKEYS_MAX_ACCEL;
+        }
+
+        int64_t step = (int64_t)(hotkeys->step * accel);
+        delta += event->code == KEY_BRIGHTNESSUP ? step : -step;
+        presses++;
+    }
+
+    hotkeys->presses += presses;
+    if(presses > 1)
+    {
+        hotkeys->coalesced += presses - 1;
+    }
+
+    if(delta == 0)
+    {
+        return;
+    }
+
+    // Key presses preempt whatever fade is running on the target
+    light_device_target_t *target = hotkeys->ctx->run_params.device_target;
+    LFUNCCOMMAND command = delta > 0 ? light_cmd_add_brightness : light_cmd_sub_brightness;
+    if(!light_scheduler_run(hotkeys->scheduler, target, LIGHT_PRIORITY_INTERACTIVE, time_ns, command, (uint64_t)(delta > 0 ? delta : -delta)))
+    {
+        LIGHT_ERR("couldn't change brightness of %s", target->name);
+    }
+}
+
+light_hotkeys_t *light_hotkeys_create(light_context_t *ctx, light_input_t *input, light_scheduler_t *scheduler, uint64_t step)
+{
+    light_hotkeys_t *hotkeys = malloc(sizeof(light_hotkeys_t));
+    hotkeys->ctx = ctx;
+    hotkeys->scheduler = scheduler;
+    hotkeys->step = step;
+    hotkeys->repeats = 0;
+    hotkeys->presses = 0;
+    hotkeys->coalesced = 0;
+
+    if(!light_input_add_handler(input, _light_hotkeys_input, hotkeys))
+    {
+        free(hotkeys);
+        return NULL;
+    }
+
+    return hotkeys;
+}
+
+void light_hotkeys_free(light_hotkeys_t *hotkeys)
+{
+    free(hotkeys);
+}
+
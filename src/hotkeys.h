@@ -0,0 +1,34 @@
+
+#pragma once
+
+#include "light.h"
+#include "loop.h"
+#include "input.h"
+#include "scheduler.h"
+
+// Brightness hotkeys for the daemon
+// KEY_BRIGHTNESSUP/DOWN are handled in-process against the already resolved target, instead of a hotkey daemon spawning light for every press
+
+// Number of auto-repeats after which the step grows by another multiple
+#define LIGHT_HOTKEYS_ACCEL_REPEATS 5
+
+// Max multiple of the step while a key is held
+#define LIGHT_HOTKEYS_MAX_ACCEL 4
+
+typedef struct _light_hotkeys_t light_hotkeys_t;
+struct _light_hotkeys_t
+{
+    light_context_t *ctx;
+    light_scheduler_t *scheduler;
+    uint64_t        step; // Raw step of a single press
+    uint64_t        repeats; // Auto-repeats since the key was pressed
+    uint64_t        presses; // Presses and auto-repeats handled
+    uint64_t        coalesced; // Presses that were folded into the write of an earlier press of their batch
+};
+
+/* Starts handling brightness keys, changing the context's target by `step` (raw) per press. Returns NULL on failure. */
+light_hotkeys_t *light_hotkeys_create(light_context_t *ctx, light_input_t *input, light_scheduler_t *scheduler, uint64_t step);
+
+/* Stops handling brightness keys */
+void light_hotkeys_free(light_hotkeys_t *hotkeys);
+
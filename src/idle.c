@@ -0,0 +1,129 @@
+
+#include "idle.h"
+#include "helpers.h"
+
+#include <stdlib.h> // malloc, free
+#include <string.h> // strerror
+#include <errno.h>
+#include <unistd.h> // read, close
+
+static bool _light_idle_dim(light_idle_t *idle, uint64_t deadline_ns)
+{
+    light_context_t *ctx = idle->ctx;
+
+    // The brightness is saved like with -O, so that a crash while dimmed can still be undone with -I
+    if(!light_cmd_save_brightness(ctx))
+    {
+        LIGHT_ERR("couldn't save brightness before dimming");
+        return false;
+    }
+
+    // Setting goes through the minimum cap. Dimming is background work that a running fade of the user's wins over.
+    if(!light_scheduler_run(idle->scheduler, ctx->run_params.device_target, LIGHT_PRIORITY_BACKGROUND, deadline_ns, light_cmd_set_brightness, idle->dim_value))
+    {
+        LIGHT_ERR("couldn't dim %s", ctx->run_params.device_target->name);
+        return false;
+    }
+
+    LIGHT_NOTE("idle, dimmed %s", ctx->run_params.device_target->name);
+    idle->dimmed = true;
+    return true;
+}
+
+static bool _light_idle_restore(light_idle_t *idle, uint64_t input_ns)
+{
+    idle->dimmed = false;
+
+    light_device_target_t *target = idle->ctx->run_params.device_target;
+    if(!light_scheduler_run(idle->scheduler, target, LIGHT_PRIORITY_INTERACTIVE, input_ns, light_cmd_restore_brightness, 0))
+    {
+        LIGHT_ERR("couldn't restore brightness after idle");
+        return false;
+    }
+
+    LIGHT_NOTE("active, restored %s", idle->ctx->run_params.device_target->name);
+    return true;
+}
+
+static void _light_idle_input(struct input_event const *events, uint64_t num_events, uint64_t time_ns, void *userdata)
+{
+    light_idle_t *idle = (light_idle_t*)userdata;
+    idle->last_input_ns = time_ns;
+
+    // While active, the timer notices the new input when it expires. Only waking up from dimming needs work right away.
+    if(idle->dimmed)
+    {
+        _light_idle_restore(idle, time_ns);
+        light_loop_timer_arm(idle->timer_fd, idle->last_input_ns + idle->timeout_ns);
+    }
+}
+
+static bool _light_idle_timer(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_idle_t *idle = (light_idle_t*)userdata;
+
+    uint64_t expirations = 0;
+    if(read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+        LIGHT_ERR("failed to read idle timer: %s", strerror(errno));
+        return false;
+    }
+
+    uint64_t deadline_ns = idle->last_input_ns + idle->timeout_ns;
+    if(light_loop_now_ns() < deadline_ns)
+    {
+        // There was input since the timer was armed
+        return light_loop_timer_arm(fd, deadline_ns);
+    }
+
+    // Stays disarmed until the next input. A dim that fails, as when the brightness can't be saved, is tried again after
+    // another timeout: input only re-arms the timer once dimmed.
+    if(!_light_idle_dim(idle, deadline_ns))
+    {
+        return light_loop_timer_arm(fd, light_loop_now_ns() + idle->timeout_ns);
+    }
+
+    return true;
+}
+
+light_idle_t *light_idle_create(light_context_t *ctx, light_loop_t *loop, light_input_t *input, light_scheduler_t *scheduler, uint64_t timeout_ms, uint64_t dim_value)
+{
+    int timer_fd = light_loop_timer_create(false);
+    if(timer_fd < 0)
+    {
+        return NULL;
+    }
+
+    light_idle_t *idle = malloc(sizeof(light_idle_t));
+    idle->ctx = ctx;
+    idle->loop = loop;
+    idle->scheduler = scheduler;
+    idle->timer_fd = timer_fd;
+    idle->timeout_ns = timeout_ms * 1000000ull;
+    idle->dim_value = dim_value;
+    idle->last_input_ns = light_loop_now_ns();
+    idle->dimmed = false;
+
+    if(!light_input_add_handler(input, _light_idle_input, idle) ||
+       !light_loop_add(loop, timer_fd, EPOLLIN, _light_idle_timer, idle, "idle") ||
+       !light_loop_timer_arm(timer_fd, idle->last_input_ns + idle->timeout_ns))
+    {
+        light_idle_free(idle);
+        return NULL;
+    }
+
+    return idle;
+}
+
+void light_idle_free(light_idle_t *idle)
+{
+    if(idle->dimmed)
+    {
+        _light_idle_restore(idle, light_loop_now_ns());
+    }
+
+    light_loop_remove(idle->loop, idle->timer_fd);
+    light_loop_timer_close(idle->timer_fd);
+    free(idle);
+}
+
@@ -0,0 +1,31 @@
+
+#pragma once
+
+#include "light.h"
+#include "loop.h"
+#include "input.h"
+#include "scheduler.h"
+
+// Idle dimming for the daemon
+// Input only records the time of the last event, the single deadline timer is re-armed lazily when it expires
+// early, so a busy mouse costs no syscalls and an idle session no wakeups besides the one that dims
+
+typedef struct _light_idle_t light_idle_t;
+struct _light_idle_t
+{
+    light_context_t *ctx;
+    light_loop_t    *loop;
+    light_scheduler_t *scheduler;
+    int             timer_fd;
+    uint64_t        timeout_ns;
+    uint64_t        dim_value; // Raw value to dim to, raised to the minimum cap
+    uint64_t        last_input_ns;
+    bool            dimmed;
+};
+
+/* Starts dimming the context's target after `timeout_ms` without input. Returns NULL on failure. */
+light_idle_t *light_idle_create(light_context_t *ctx, light_loop_t *loop, light_input_t *input, light_scheduler_t *scheduler, uint64_t timeout_ms, uint64_t dim_value);
+
+/* Stops idle dimming, restoring the brightness if it was dimmed */
+void light_idle_free(light_idle_t *idle);
+
@@ -0,0 +1,531 @@
+
+#include "impl/ddc.h"
+#include "light.h"
+#include "helpers.h"
+#include "effect.h"
+#include "clock.h"
+
+#include <stdio.h> // snprintf
+#include <stdlib.h> // malloc, free, secure_getenv
+#include <string.h> // strncmp, strerror
+#include <errno.h>
+#include <fcntl.h> // open
+#include <unistd.h> // read, write, close
+#include <poll.h>
+#include <dirent.h> // DT_CHR
+#include <sys/ioctl.h>
+#include <sys/stat.h> // fstat
+#include <linux/i2c-dev.h> // I2C_SLAVE
+
+// DDC/CI constants, see the VESA DDC/CI and MCCS standards
+#define IMPL_DDC_ADDRESS        0x37 // i2c address of the display's DDC/CI interface
+#define IMPL_DDC_HOST_ADDRESS   0x51 // Source address of messages from us
+#define IMPL_DDC_CHECKSUM_WRITE 0x6E // Destination address, starts the checksum of our messages
+#define IMPL_DDC_CHECKSUM_READ  0x50 // Starts the checksum of replies
+#define IMPL_DDC_VCP_GET        0x01
+#define IMPL_DDC_VCP_REPLY      0x02
+#define IMPL_DDC_VCP_SET        0x03
+#define IMPL_DDC_VCP_BRIGHTNESS 0x10
+
+// Delays required by the standard, the monitor won't answer (or will answer garbage) if we don't wait
+#define IMPL_DDC_REPLY_DELAY_MS   40 // Between a get request and reading the reply
+#define IMPL_DDC_COMMAND_DELAY_MS 50 // Between the end of a transaction and the next one
+#define IMPL_DDC_READ_TIMEOUT_MS  200 // Stand-in devices may deliver the reply in pieces
+
+// How old the cached value may get before a get has the worker read the monitor again, which catches changes made with the
+// buttons of the monitor. Nothing is read while nobody asks.
+#define IMPL_DDC_REFRESH_INTERVAL_MS 10000
+
+// How long a bus that failed is left alone before a get or set tries it again. A monitor that is asleep or in DPMS-off doesn't
+// answer, and each attempt holds up the caller for the length of a transaction.
+#define IMPL_DDC_RETRY_INTERVAL_MS 5000
+
+#define IMPL_DDC_NS_PER_MS 1000000ull
+
+// The delays follow the clock of light, so that a virtual clock skips them like the latencies of sim and replay
+static void _impl_ddc_sleep_until(uint64_t deadline_ns)
+{
+    uint64_t now_ns = light_clock_now_ns();
+    if(deadline_ns > now_ns)
+    {
+        light_clock_sleep(deadline_ns - now_ns);
+    }
+}
+
+// Records that the bus failed, must be called with the lock held
+static void _impl_ddc_fail(impl_ddc_bus_t *bus)
+{
+    bus->failed = true;
+    bus->failure_ns = light_clock_now_ns();
+}
+
+// Whether the bus failed recently enough to be left alone, must be called with the lock held
+static bool _impl_ddc_backing_off(impl_ddc_bus_t const *bus)
+{
+    return bus->failed && light_clock_now_ns() < bus->failure_ns + IMPL_DDC_RETRY_INTERVAL_MS * IMPL_DDC_NS_PER_MS;
+}
+
+// Sends a DDC/CI message, framing it with the length and checksum
+static bool _impl_ddc_send(impl_ddc_bus_t *bus, uint8_t const *data, uint8_t length)
+{
+    uint8_t message[16];
+    message[0] = IMPL_DDC_HOST_ADDRESS;
+    message[1] = 0x80 | length;
+
+    uint8_t checksum = IMPL_DDC_CHECKSUM_WRITE ^ message[0] ^ message[1];
+    for(uint8_t i = 0; i < length; i++)
+    {
+        message[2 + i] = data[i];
+        checksum ^= data[i];
+    }
+    message[2 + length] = checksum;
+
+    ssize_t size = 3 + length;
+    if(write(bus->fd, message, size) != size)
+    {
+        LIGHT_WARN("ddc: write to %s failed: %s", bus->path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Reads exactly `length` bytes. i2c-dev returns them in one go, stand-in devices may not.
+static bool _impl_ddc_receive(impl_ddc_bus_t *bus, uint8_t *data, size_t length)
+{
+    size_t received = 0;
+    while(received < length)
+    {
+        if(!bus->is_i2c)
+        {
+            struct pollfd pfd = { bus->fd, POLLIN, 0 };
+            if(poll(&pfd, 1, IMPL_DDC_READ_TIMEOUT_MS) <= 0)
+            {
+                LIGHT_WARN("ddc: timed out waiting for a reply on %s", bus->path);
+                return false;
+            }
+        }
+
+        ssize_t nread = read(bus->fd, data + received, length - received);
+        if(nread <= 0)
+        {
+            LIGHT_WARN("ddc: read from %s failed: %s", bus->path, nread < 0 ? strerror(errno) : "end of file");
+            return false;
+        }
+
+        received += nread;
+    }
+
+    return true;
+}
+
+// Reads the current and max brightness of the monitor, only called by the worker
+static bool _impl_ddc_read_vcp(impl_ddc_bus_t *bus, uint64_t *out_value, uint64_t *out_max)
+{
+    _impl_ddc_sleep_until(bus->last_command_ns + IMPL_DDC_COMMAND_DELAY_MS * IMPL_DDC_NS_PER_MS);
+
+    uint8_t request[] = { IMPL_DDC_VCP_GET, IMPL_DDC_VCP_BRIGHTNESS };
+    if(!_impl_ddc_send(bus, request, sizeof(request)))
+    {
+        bus->last_command_ns = light_clock_now_ns();
+        return false;
+    }
+
+    light_clock_sleep(IMPL_DDC_REPLY_DELAY_MS * IMPL_DDC_NS_PER_MS);
+
+    // Source address, length, opcode, result, vcp code, type, max (2 bytes), current (2 bytes), checksum
+    uint8_t reply[11];
+    bool received = _impl_ddc_receive(bus, reply, sizeof(reply));
+    bus->last_command_ns = light_clock_now_ns();
+    if(!received)
+    {
+        return false;
+    }
+
+    uint8_t checksum = IMPL_DDC_CHECKSUM_READ;
+    for(size_t i = 0; i < sizeof(reply) - 1; i++)
+    {
+        checksum ^= reply[i];
+    }
+
+    if(checksum != reply[10] || reply[2] != IMPL_DDC_VCP_REPLY || reply[4] != IMPL_DDC_VCP_BRIGHTNESS)
+    {
+        LIGHT_WARN("ddc: invalid reply from %s", bus->path);
+        return false;
+    }
+
+    if(reply[3] != 0)
+    {
+        LIGHT_WARN("ddc: the monitor on %s doesn't support brightness control", bus->path);
+        return false;
+    }
+
+    *out_max = ((uint64_t)reply[6] << 8) | reply[7];
+    *out_value = ((uint64_t)reply[8] << 8) | reply[9];
+    return true;
+}
+
+// Writes the brightness of the monitor, only called by the worker
+static bool _impl_ddc_write_vcp(impl_ddc_bus_t *bus, uint64_t value)
+{
+    _impl_ddc_sleep_until(bus->last_command_ns + IMPL_DDC_COMMAND_DELAY_MS * IMPL_DDC_NS_PER_MS);
+
+    uint8_t request[] = { IMPL_DDC_VCP_SET, IMPL_DDC_VCP_BRIGHTNESS, (value >> 8) & 0xFF, value & 0xFF };
+    bool success = _impl_ddc_send(bus, request, sizeof(request));
+    bus->last_command_ns = light_clock_now_ns();
+
+    return success;
+}
+
+// Owns all I/O with the monitor. Applies the latest pending set, reads the monitor when a get finds the cache too old, and
+// otherwise sleeps on the condition variable, so that a bus nobody uses sees no transactions.
+static void *_impl_ddc_worker(void *userdata)
+{
+    impl_ddc_bus_t *bus = (impl_ddc_bus_t*)userdata;
+
+    pthread_mutex_lock(&bus->lock);
+    while(true)
+    {
+        // The log level is per thread, and may have been changed on the context since the last transaction
+        light_apply_loglevel(bus->ctx);
+
+        if(bus->set_pending)
+        {
+            uint64_t value = bus->pending_value;
+            bus->set_pending = false;
+
+            pthread_mutex_unlock(&bus->lock);
+            bool success = _impl_ddc_write_vcp(bus, value);
+            pthread_mutex_lock(&bus->lock);
+
+            if(success)
+            {
+                bus->failed = false;
+            }
+            else
+            {
+                // We don't know what the monitor ended up at
+                bus->cache_valid = false;
+                _impl_ddc_fail(bus);
+            }
+            continue;
+        }
+
+        if(bus->refresh_requested)
+        {
+            bus->refresh_requested = false;
+            bus->refreshing = true;
+
+            pthread_mutex_unlock(&bus->lock);
+            uint64_t value = 0;
+            uint64_t max_value = 0;
+            bool success = _impl_ddc_read_vcp(bus, &value, &max_value);
+            pthread_mutex_lock(&bus->lock);
+
+            // A set that came in meanwhile is newer than what we read
+            if(success && !bus->set_pending)
+            {
+                bus->value = value;
+            }
+
+            if(success)
+            {
+                bus->max_value = max_value;
+                bus->cache_valid = true;
+                bus->cache_time_ns = light_clock_now_ns();
+                bus->failed = false;
+            }
+            else
+            {
+                _impl_ddc_fail(bus);
+            }
+
+            bus->refreshing = false;
+            pthread_cond_broadcast(&bus->cond);
+            continue;
+        }
+
+        if(bus->stop)
+        {
+            break;
+        }
+
+        pthread_cond_wait(&bus->cond, &bus->lock);
+    }
+    pthread_mutex_unlock(&bus->lock);
+
+    return NULL;
+}
+
+// Opens the bus for the worker, which is only done on first use: listing devices doesn't touch them
+static bool _impl_ddc_open(impl_ddc_bus_t *bus)
+{
+    int fd = open(bus->path, O_RDWR | O_CLOEXEC | O_NOCTTY | O_NOFOLLOW);
+    if(fd < 0)
+    {
+        LIGHT_ERR("ddc: couldn't open %s: %s", bus->path, strerror(errno));
+        return false;
+    }
+
+    // Whatever the name, nothing but a character device gets written to
+    struct stat bus_stat;
+    if(fstat(fd, &bus_stat) < 0 || !S_ISCHR(bus_stat.st_mode))
+    {
+        LIGHT_ERR("ddc: %s is not a character device", bus->path);
+        close(fd);
+        return false;
+    }
+
+    bus->is_i2c = true;
+    if(ioctl(fd, I2C_SLAVE, IMPL_DDC_ADDRESS) < 0)
+    {
+        // Not an i2c adapter. When testing against an emulator, it is a stand-in that speaks the same protocol over plain
+        // reads and writes, such as a pty.
+        if(!bus->stand_in_allowed || (errno != ENOTTY && errno != EINVAL))
+        {
+            LIGHT_ERR("ddc: couldn't address the display on %s: %s", bus->path, strerror(errno));
+            close(fd);
+            return false;
+        }
+
+        bus->is_i2c = false;
+    }
+
+    bus->fd = fd;
+    return true;
+}
+
+// Starts the worker of the bus if it isn't running yet, must be called with the lock held
+static bool _impl_ddc_start_worker(impl_ddc_bus_t *bus)
+{
+    if(bus->worker_started)
+    {
+        return true;
+    }
+
+    // A bus that can't be opened is tried again once it is no longer backing off
+    if(bus->fd < 0 && !_impl_ddc_open(bus))
+    {
+        _impl_ddc_fail(bus);
+        return false;
+    }
+
+    int rc = pthread_create(&bus->worker, NULL, _impl_ddc_worker, bus);
+    if(rc != 0)
+    {
+        LIGHT_ERR("ddc: couldn't start worker for %s: %s", bus->path, strerror(rc));
+        return false;
+    }
+
+    bus->worker_started = true;
+    return true;
+}
+
+// Makes sure the cache holds values read from the monitor, waiting for the worker to read them if needed. With `fresh`, they
+// must have been read less than IMPL_DDC_REFRESH_INTERVAL_MS ago, which the max value doesn't need: it doesn't change, and
+// every set checks against it. An older value is still used if the read fails, or if the bus is backing off from a failure.
+// Must be called with the lock held.
+static bool _impl_ddc_wait_cache(impl_ddc_bus_t *bus, bool fresh)
+{
+    if(bus->cache_valid && (!fresh || light_clock_now_ns() < bus->cache_time_ns + IMPL_DDC_REFRESH_INTERVAL_MS * IMPL_DDC_NS_PER_MS))
+    {
+        return true;
+    }
+
+    if(_impl_ddc_backing_off(bus) || !_impl_ddc_start_worker(bus))
+    {
+        return bus->cache_valid;
+    }
+
+    // A read that is already under way may have started before a set, so it takes one that starts after this request
+    bus->refresh_requested = true;
+    pthread_cond_broadcast(&bus->cond);
+
+    while(bus->refresh_requested || bus->refreshing)
+    {
+        pthread_cond_wait(&bus->cond, &bus->lock);
+    }
+
+    return bus->cache_valid;
+}
+
+// What _impl_ddc_add_bus needs to know about the scan
+typedef struct
+{
+    light_device_enumerator_t   *enumerator;
+    char const                  *devices_dir;
+    bool                        stand_in_allowed;
+} _impl_ddc_scan_t;
+
+static bool _impl_ddc_add_bus(int dirfd, char const *name, unsigned char type, void *userdata)
+{
+    _impl_ddc_scan_t *scan = (_impl_ddc_scan_t*)userdata;
+
+    if(strncmp(name, "i2c-", 4) != 0)
+    {
+        return true;
+    }
+
+    // Buses we can't open are either not accessible to us, or not worth a warning. They are opened on first use.
+    if(faccessat(dirfd, name, R_OK | W_OK, AT_EACCESS) < 0)
+    {
+        return true;
+    }
+
+    impl_ddc_bus_t *bus = malloc(sizeof(impl_ddc_bus_t));
+    snprintf(bus->path, sizeof(bus->path), "%s/%s", scan->devices_dir, name);
+    bus->fd = -1;
+    bus->is_i2c = true;
+    bus->stand_in_allowed = scan->stand_in_allowed;
+    bus->ctx = scan->enumerator->context;
+
+    bus->worker_started = false;
+    bus->last_command_ns = 0;
+    pthread_mutex_init(&bus->lock, NULL);
+    pthread_cond_init(&bus->cond, NULL);
+
+    bus->cache_valid = false;
+    bus->failed = false;
+    bus->failure_ns = 0;
+    bus->value = 0;
+    bus->max_value = 0;
+    bus->cache_time_ns = 0;
+    bus->refresh_requested = false;
+    bus->refreshing = false;
+    bus->set_pending = false;
+    bus->pending_value = 0;
+    bus->stop = false;
+
+    // Probing a bus for a monitor takes tens of milliseconds, so it is left until the target is used
+    light_device_t *device = light_create_device(scan->enumerator, name, bus);
+    light_create_device_target(device, "brightness", impl_ddc_set, impl_ddc_get, impl_ddc_getmax, impl_ddc_command, NULL);
+
+    return true;
+}
+
+bool impl_ddc_init(light_device_enumerator_t *enumerator)
+{
+    _impl_ddc_scan_t scan;
+    scan.enumerator = enumerator;
+
+    // Testing against an emulator, which may be a stand-in rather than an i2c adapter. Not honored in SUID mode, where it would
+    // let anyone have root write DDC/CI frames to a device of their choosing.
+    scan.devices_dir = secure_getenv("LIGHT_DDC_DEVICES");
+    scan.stand_in_allowed = scan.devices_dir != NULL;
+    if(scan.devices_dir == NULL)
+    {
+        scan.devices_dir = "/dev";
+    }
+
+    // Missing i2c-dev support simply means there are no ddc devices
+    light_dir_scan(scan.devices_dir, LIGHT_DT_MASK(DT_CHR), _impl_ddc_add_bus, &scan);
+
+    return true;
+}
+
+bool impl_ddc_free(light_device_enumerator_t *enumerator)
+{
+    // Let the workers write any pending value before shutting down, the bus itself is freed by light
+    for(uint64_t d = 0; d < enumerator->num_devices; d++)
+    {
+        impl_ddc_bus_t *bus = (impl_ddc_bus_t*)enumerator->devices[d]->device_data;
+
+        pthread_mutex_lock(&bus->lock);
+        bool worker_started = bus->worker_started;
+        bus->stop = true;
+        pthread_cond_broadcast(&bus->cond);
+        pthread_mutex_unlock(&bus->lock);
+
+        if(worker_started)
+        {
+            pthread_join(bus->worker, NULL);
+        }
+
+        pthread_cond_destroy(&bus->cond);
+        pthread_mutex_destroy(&bus->lock);
+        if(bus->fd >= 0)
+        {
+            close(bus->fd);
+        }
+    }
+
+    return true;
+}
+
+bool impl_ddc_set(light_device_target_t *target, uint64_t in_value)
+{
+    impl_ddc_bus_t *bus = (impl_ddc_bus_t*)target->device->device_data;
+
+    pthread_mutex_lock(&bus->lock);
+
+    if(_impl_ddc_backing_off(bus) || !_impl_ddc_start_worker(bus))
+    {
+        pthread_mutex_unlock(&bus->lock);
+        LIGHT_ERR("ddc: no usable monitor on %s", bus->path);
+        return false;
+    }
+
+    // Replaces any value the worker hasn't written yet, so a burst of sets results in a single transaction
+    bus->pending_value = in_value;
+    bus->set_pending = true;
+    bus->value = in_value;
+
+    // After a failure, the cache is read again right after the write rather than on the next get
+    if(bus->failed)
+    {
+        bus->refresh_requested = true;
+    }
+    pthread_cond_broadcast(&bus->cond);
+
+    pthread_mutex_unlock(&bus->lock);
+    return true;
+}
+
+bool impl_ddc_get(light_device_target_t *target, uint64_t *out_value)
+{
+    impl_ddc_bus_t *bus = (impl_ddc_bus_t*)target->device->device_data;
+
+    pthread_mutex_lock(&bus->lock);
+    bool success = _impl_ddc_wait_cache(bus, true);
+    *out_value = bus->value;
+    pthread_mutex_unlock(&bus->lock);
+
+    if(!success)
+    {
+        LIGHT_ERR("ddc: failed to read brightness from %s", bus->path);
+    }
+
+    return success;
+}
+
+bool impl_ddc_getmax(light_device_target_t *target, uint64_t *out_value)
+{
+    impl_ddc_bus_t *bus = (impl_ddc_bus_t*)target->device->device_data;
+
+    pthread_mutex_lock(&bus->lock);
+    bool success = _impl_ddc_wait_cache(bus, false);
+    *out_value = bus->max_value;
+    pthread_mutex_unlock(&bus->lock);
+
+    if(!success)
+    {
+        LIGHT_ERR("ddc: failed to read max brightness from %s", bus->path);
+    }
+
+    return success;
+}
+
+bool impl_ddc_command(light_device_target_t *target, char const *command_string)
+{
+    // The custom commands of ddc targets are effects, which monitors can't run by themselves.
+    // The worker collapses the frames it can't keep up with, so they run at whatever rate the monitor allows.
+    light_effect_t effect;
+    if(!light_effect_parse(command_string, &effect))
+    {
+        LIGHT_ERR("ddc: invalid effect \"%s\"", command_string);
+        return false;
+    }
+    
+    return light_effect_run_userspace(target, &effect);
+}
+
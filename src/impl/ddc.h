@@ -0,0 +1,51 @@
+
+#pragma once
+
+#include "light.h"
+
+#include <pthread.h>
+
+// Implementation of the ddc enumerator
+// Enumerates external monitors that support DDC/CI, through the i2c-dev buses in /dev (or in $LIGHT_DDC_DEVICES, for testing against an emulator)
+// Buses are only opened once their target is used, and only character devices are written to
+// Every bus has a worker thread that owns all I/O with the monitor, since each transaction takes tens of milliseconds
+
+// Device data, one per i2c bus
+struct _impl_ddc_bus_t
+{
+    char            path[PATH_MAX];
+    int             fd; // -1 until the bus is first used
+    bool            is_i2c; // False for stand-in devices (such as a pty) that don't take i2c ioctls
+    bool            stand_in_allowed; // Only when testing against an emulator, with $LIGHT_DDC_DEVICES
+
+    pthread_t       worker;
+    bool            worker_started; // The worker is only started when the bus is first used
+    uint64_t        last_command_ns; // When the last transaction ended, only used by the worker
+    light_context_t *ctx; // Whose log level the worker logs at
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    // Everything below is protected by lock
+    bool            cache_valid; // Whether value and max_value have been read from the monitor
+    uint64_t        value;
+    uint64_t        max_value;
+    uint64_t        cache_time_ns; // When the cache was last read from the monitor
+    bool            failed; // The last open, read or write failed, as when the monitor is asleep or there is none
+    uint64_t        failure_ns; // When it did, see IMPL_DDC_RETRY_INTERVAL_MS
+    bool            refresh_requested; // By a get that found the cache too old
+    bool            refreshing; // The worker is reading the monitor
+    bool            set_pending; // Rapid sets collapse into the latest pending value
+    uint64_t        pending_value;
+    bool            stop;
+};
+
+typedef struct _impl_ddc_bus_t impl_ddc_bus_t;
+
+bool impl_ddc_init(light_device_enumerator_t *enumerator);
+bool impl_ddc_free(light_device_enumerator_t *enumerator);
+
+bool impl_ddc_set(light_device_target_t *target, uint64_t in_value);
+bool impl_ddc_get(light_device_target_t *target, uint64_t *out_value);
+bool impl_ddc_getmax(light_device_target_t *target, uint64_t *out_value);
+bool impl_ddc_command(light_device_target_t *target, char const *command_string);
+
@@ -5,82 +5,137 @@
 
 #include <stdio.h> //snprintf
 #include <stdlib.h> // malloc, free
-#include <dirent.h> // opendir, readdir
+#include <string.h> // strcmp, strerror
+#include <errno.h>
+#include <fcntl.h> // openat
+#include <unistd.h> // close
+#include <dirent.h> // DT_REG, DT_LNK
 
-static void _impl_razer_add_target(light_device_t *device, char const *name, char const *filename, uint64_t max_brightness)
+#define IMPL_RAZER_DRIVER_DIR "/sys/bus/hid/drivers/razerkbd"
+
+// Describes a target that a razer device may expose, and the sysfs attribute that backs it
+typedef struct _impl_razer_attribute_t impl_razer_attribute_t;
+struct _impl_razer_attribute_t
 {
-    impl_razer_data_t *target_data = malloc(sizeof(impl_razer_data_t));
-    snprintf(target_data->brightness, sizeof(target_data->brightness), "/sys/bus/hid/drivers/razerkbd/%s/%s", device->name, filename);
-    target_data->max_brightness = max_brightness;
+    char const  *name;
+    char const  *filename;
+    uint64_t    max_brightness;
+};
+
+// All the targets we know of. We aren't fully sure exactly what targets exist for a given device, so only the ones with a matching attribute are added
+static impl_razer_attribute_t const _impl_razer_attributes[] =
+{
+    // The backlight
+    { "backlight", "matrix_brightness", 255 },
     
-    // Only add targets that actually exist, as we aren't fully sure exactly what targets exist for a given device
-    if(light_file_exists(target_data->brightness))
-    {
-        light_create_device_target(device, name, impl_razer_set, impl_razer_get, impl_razer_getmax, impl_razer_command, target_data);
-    }
-    else 
+    // Different possible leds
+    { "game_led", "game_led_state", 1 },
+    { "macro_led", "macro_led_state", 1 },
+    { "logo_led", "logo_led_state", 1 },
+    { "profile_led_r", "profile_led_red", 1 },
+    { "profile_led_g", "profile_led_green", 1 },
+    { "profile_led_b", "profile_led_blue", 1 },
+};
+
+#define IMPL_RAZER_NUM_ATTRIBUTES (sizeof(_impl_razer_attributes) / sizeof(_impl_razer_attributes[0]))
+
+// Marks the attributes found in a device directory, one bit per entry in _impl_razer_attributes
+static bool _impl_razer_match_attribute(int dirfd, char const *name, unsigned char type, void *userdata)
+{
+    uint32_t *found = (uint32_t*)userdata;
+    
+    for(uint32_t i = 0; i < IMPL_RAZER_NUM_ATTRIBUTES; i++)
     {
-        LIGHT_WARN("razer: couldn't add target %s to device %s, the file %s doesn't exist", name, device->name, filename);
-        // target_data will not be freed automatically if we dont add a device target with it as userdata, so free it here
-        free(target_data);
+        if(strcmp(name, _impl_razer_attributes[i].filename) == 0)
+        {
+            *found |= (1u << i);
+            break;
+        }
     }
+    
+    return true;
 }
 
-static void _impl_razer_add_device(light_device_enumerator_t *enumerator, char const *device_id)
+static void _impl_razer_add_target(light_device_t *device, impl_razer_attribute_t const *attribute)
 {
-    // Create a new razer device
-    light_device_t *new_device = light_create_device(enumerator, device_id, NULL);
-
-    // Setup a target to backlight
-    _impl_razer_add_target(new_device, "backlight", "matrix_brightness", 255);
+    impl_razer_data_t *target_data = malloc(sizeof(impl_razer_data_t));
+    target_data->brightness = attribute->filename;
+    target_data->max_brightness = attribute->max_brightness;
     
-    // Setup targets to different possible leds
-    _impl_razer_add_target(new_device, "game_led", "game_led_state", 1);
-    _impl_razer_add_target(new_device, "macro_led", "macro_led_state", 1);
-    _impl_razer_add_target(new_device, "logo_led", "logo_led_state", 1);
-    _impl_razer_add_target(new_device, "profile_led_r", "profile_led_red", 1);
-    _impl_razer_add_target(new_device, "profile_led_g", "profile_led_green", 1);
-    _impl_razer_add_target(new_device, "profile_led_b", "profile_led_blue", 1);
+    light_create_device_target(device, attribute->name, impl_razer_set, impl_razer_get, impl_razer_getmax, impl_razer_command, target_data);
 }
 
-bool impl_razer_init(light_device_enumerator_t *enumerator)
+static bool _impl_razer_add_device(int dirfd, char const *device_id, unsigned char type, void *userdata)
 {
-    // Iterate through the led controllers and create a device_target for each controller 
-    DIR *razer_dir;
-    struct dirent *curr_entry;
+    light_device_enumerator_t *enumerator = (light_device_enumerator_t*)userdata;
+    
+    // Open the device node, it is kept open for the lifetime of the device
+    int device_fd = openat(dirfd, device_id, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(device_fd < 0)
+    {
+        LIGHT_WARN("razer: couldn't open device %s: %s", device_id, strerror(errno));
+        return true;
+    }
     
-    if((razer_dir = opendir("/sys/bus/hid/drivers/razerkbd/")) == NULL)
+    // List the device directory once and match it against the known attributes
+    uint32_t found = 0;
+    if(!light_dir_scan_fd(device_fd, LIGHT_DT_MASK(DT_REG), _impl_razer_match_attribute, &found))
     {
-        // Razer driver isnt properly installed, so we cant add devices in this enumerator 
+        LIGHT_WARN("razer: couldn't list the attributes of device %s", device_id);
+        close(device_fd);
         return true;
     }
     
-    while((curr_entry = readdir(razer_dir)) != NULL)
+    // Driver entries such as "module" aren't devices, and have none of the attributes
+    if(found == 0)
+    {
+        close(device_fd);
+        return true;
+    }
+    
+    // Create a new razer device
+    impl_razer_device_data_t *device_data = malloc(sizeof(impl_razer_device_data_t));
+    device_data->dirfd = device_fd;
+    light_device_t *new_device = light_create_device(enumerator, device_id, device_data);
+    
+    for(uint32_t i = 0; i < IMPL_RAZER_NUM_ATTRIBUTES; i++)
     {
-        // Skip dot entries
-        if(curr_entry->d_name[0] == '.')
+        if(found & (1u << i))
         {
-            continue;
+            _impl_razer_add_target(new_device, &_impl_razer_attributes[i]);
         }
- 
-        _impl_razer_add_device(enumerator, curr_entry->d_name);
     }
     
-    closedir(razer_dir);
+    return true;
+}
+
+bool impl_razer_init(light_device_enumerator_t *enumerator)
+{
+    // Iterate through the razer devices (symlinks to the hid devices bound to the driver) and create a device for each of them
+    // If the directory can't be opened, the razer driver isnt properly installed, so we cant add devices in this enumerator 
+    light_dir_scan(IMPL_RAZER_DRIVER_DIR, LIGHT_DT_MASK(DT_LNK) | LIGHT_DT_MASK(DT_DIR), _impl_razer_add_device, enumerator);
     
     return true;
 }
 
 bool impl_razer_free(light_device_enumerator_t *enumerator)
 {
+    // Close the device nodes, the device data itself is freed by light
+    for(uint64_t d = 0; d < enumerator->num_devices; d++)
+    {
+        impl_razer_device_data_t *device_data = (impl_razer_device_data_t*)enumerator->devices[d]->device_data;
+        close(device_data->dirfd);
+    }
+    
     return true;
 }
 
 bool impl_razer_set(light_device_target_t *target, uint64_t in_value)
 {
     impl_razer_data_t *data = (impl_razer_data_t*)target->device_target_data;
+    impl_razer_device_data_t *device_data = (impl_razer_device_data_t*)target->device->device_data;
 
-    if(!light_file_write_uint64(data->brightness, in_value))
+    if(!light_file_write_uint64_at(device_data->dirfd, data->brightness, in_value))
     {
         LIGHT_ERR("failed to write to razer device");
         return false;
@@ -92,8 +147,9 @@ bool impl_razer_set(light_device_target_t *target, uint64_t in_value)
 bool impl_razer_get(light_device_target_t *target, uint64_t *out_value)
 {
     impl_razer_data_t *data = (impl_razer_data_t*)target->device_target_data;
+    impl_razer_device_data_t *device_data = (impl_razer_device_data_t*)target->device->device_data;
 
-    if(!light_file_read_uint64(data->brightness, out_value))
+    if(!light_file_read_uint64_at(device_data->dirfd, data->brightness, out_value))
     {
         LIGHT_ERR("failed to read from razer device");
         return false;
@@ -6,10 +6,18 @@
 // Implementation of the razer enumerator
 // Enumerates devices for the openrazer driver https://github.com/openrazer/openrazer
 
+// Device data 
+struct _impl_razer_device_data_t
+{
+    int dirfd; // The device's sysfs node, attributes are opened relative to it
+};
+
+typedef struct _impl_razer_device_data_t impl_razer_device_data_t;
+
 // Device target data 
 struct _impl_razer_data_t
 {
-    char brightness[NAME_MAX];
+    char const *brightness; // Name of the attribute, points into the table of known attributes
     uint64_t max_brightness;
 };
 
@@ -0,0 +1,302 @@
+
+#include "impl/replay.h"
+#include "light.h"
+#include "helpers.h"
+#include "effect.h"
+#include "trace.h"
+#include "clock.h"
+
+#include <stdio.h> // fopen, fread, snprintf
+#include <stdlib.h> // malloc, realloc, free, getenv
+#include <string.h> // memcmp, strcmp, strerror
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+
+static void _impl_replay_wait(uint64_t latency_ns)
+{
+    if(latency_ns == 0)
+    {
+        return;
+    }
+
+    light_clock_sleep(latency_ns);
+}
+
+static bool _impl_replay_add_op(impl_replay_ops_t *ops, light_trace_record_t const *record)
+{
+    // Grown to the next power of two
+    if((ops->num_ops & (ops->num_ops - 1)) == 0)
+    {
+        uint64_t capacity = ops->num_ops == 0 ? 1 : ops->num_ops * 2;
+        impl_replay_op_t *new_ops = realloc(ops->ops, capacity * sizeof(impl_replay_op_t));
+        if(new_ops == NULL)
+        {
+            LIGHT_MEMERR();
+            return false;
+        }
+        ops->ops = new_ops;
+    }
+
+    ops->ops[ops->num_ops].latency_ns = record->latency_ns;
+    ops->ops[ops->num_ops].success = record->success;
+    ops->num_ops++;
+    return true;
+}
+
+// Takes as long as the next recorded operation, and returns whether it succeeded. Targets without recorded operations of
+// the kind answer at once.
+static bool _impl_replay_next(impl_replay_ops_t *ops)
+{
+    if(ops->num_ops == 0)
+    {
+        return true;
+    }
+
+    impl_replay_op_t const *op = &ops->ops[ops->next];
+    ops->next = (ops->next + 1) % ops->num_ops;
+
+    _impl_replay_wait(op->latency_ns);
+    return op->success;
+}
+
+static light_device_target_t *_impl_replay_add_target(light_device_enumerator_t *enumerator, char const *name)
+{
+    light_target_path_t path;
+    if(!light_split_target_path(name, &path))
+    {
+        LIGHT_ERR("replay: invalid target name \"%s\" in trace", name);
+        return NULL;
+    }
+
+    // The enumerator of the recorded target becomes part of the device name
+    char device_name[NAME_MAX];
+    snprintf(device_name, sizeof(device_name), "%s-%s", path.enumerator, path.device);
+
+    light_device_t *device = NULL;
+    for(uint64_t d = 0; d < enumerator->num_devices; d++)
+    {
+        if(strcmp(enumerator->devices[d]->name, device_name) == 0)
+        {
+            device = enumerator->devices[d];
+            break;
+        }
+    }
+
+    if(device == NULL)
+    {
+        device = light_create_device(enumerator, device_name, NULL);
+    }
+
+    impl_replay_target_t *replay_target = malloc(sizeof(impl_replay_target_t));
+    memset(replay_target, 0, sizeof(impl_replay_target_t));
+    return light_create_device_target(device, path.target, impl_replay_set, impl_replay_get, impl_replay_getmax, impl_replay_command, replay_target);
+}
+
+static bool _impl_replay_load(light_device_enumerator_t *enumerator, FILE *file, char const *path)
+{
+    light_trace_header_t header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, LIGHT_TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        LIGHT_ERR("replay: %s is not a trace", path);
+        return false;
+    }
+
+    if(header.version != LIGHT_TRACE_VERSION)
+    {
+        LIGHT_ERR("replay: %s is a trace of version %u, only version %u is supported", path, header.version, LIGHT_TRACE_VERSION);
+        return false;
+    }
+
+    light_device_target_t **targets = NULL;
+    uint64_t num_targets = 0;
+    uint64_t scan_ns = 0;
+    bool success = true;
+
+    light_trace_record_t record;
+    while(success && fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if(record.type == LIGHT_TRACE_TARGET || record.type == LIGHT_TRACE_SCAN)
+        {
+            char name[LIGHT_TRACE_NAME_MAX];
+            if(record.value >= sizeof(name) || fread(name, 1, record.value, file) != record.value)
+            {
+                LIGHT_ERR("replay: %s is truncated or corrupt", path);
+                success = false;
+                break;
+            }
+            name[record.value] = '\0';
+
+            if(record.type == LIGHT_TRACE_SCAN)
+            {
+                scan_ns += record.latency_ns;
+                continue;
+            }
+
+            if(record.target != num_targets)
+            {
+                LIGHT_ERR("replay: %s declares target %u out of order", path, record.target);
+                success = false;
+                break;
+            }
+
+            light_device_target_t *target = _impl_replay_add_target(enumerator, name);
+            light_device_target_t **new_targets = realloc(targets, (num_targets + 1) * sizeof(light_device_target_t*));
+            if(target == NULL || new_targets == NULL)
+            {
+                success = false;
+                break;
+            }
+
+            targets = new_targets;
+            targets[num_targets++] = target;
+            continue;
+        }
+
+        if(record.target >= num_targets)
+        {
+            LIGHT_ERR("replay: %s uses undeclared target %u", path, record.target);
+            success = false;
+            break;
+        }
+
+        impl_replay_target_t *replay_target = (impl_replay_target_t*)targets[record.target]->device_target_data;
+        switch(record.type)
+        {
+            case LIGHT_TRACE_SET:
+            case LIGHT_TRACE_GET:
+                // The first value seen is where the target starts
+                if(record.success && !replay_target->value_known)
+                {
+                    replay_target->value = record.value;
+                    replay_target->value_known = true;
+                }
+                success = _impl_replay_add_op(record.type == LIGHT_TRACE_SET ? &replay_target->sets : &replay_target->gets, &record);
+                break;
+            case LIGHT_TRACE_GET_MAX:
+                if(record.success && !replay_target->max_known)
+                {
+                    replay_target->max_value = record.value;
+                    replay_target->max_known = true;
+                }
+                success = _impl_replay_add_op(&replay_target->get_maxes, &record);
+                break;
+            default:
+                LIGHT_ERR("replay: %s has a record of unknown type %u", path, record.type);
+                success = false;
+                break;
+        }
+    }
+
+    for(uint64_t t = 0; t < num_targets; t++)
+    {
+        impl_replay_target_t *replay_target = (impl_replay_target_t*)targets[t]->device_target_data;
+        if(!replay_target->max_known)
+        {
+            LIGHT_NOTE("replay: the max value of %s wasn't recorded, using 255", targets[t]->name);
+            replay_target->max_value = 255;
+        }
+    }
+
+    free(targets);
+
+    if(success)
+    {
+        // Looking for devices takes as long as it did on the recorded machine
+        LIGHT_NOTE("replay: %" PRIu64 " targets, %" PRIu64 " us of directory scans", num_targets, scan_ns / 1000);
+        _impl_replay_wait(scan_ns);
+    }
+
+    return success;
+}
+
+bool impl_replay_init(light_device_enumerator_t *enumerator)
+{
+    // Not honored in SUID mode, where it would read any file
+    char const *path = secure_getenv("LIGHT_REPLAY");
+    if(path == NULL)
+    {
+        return true;
+    }
+
+    FILE *file = fopen(path, "rbe");
+    if(file == NULL)
+    {
+        LIGHT_ERR("replay: couldn't open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    bool success = _impl_replay_load(enumerator, file, path);
+    fclose(file);
+    return success;
+}
+
+bool impl_replay_free(light_device_enumerator_t *enumerator)
+{
+    // The target data itself is freed by light
+    for(uint64_t d = 0; d < enumerator->num_devices; d++)
+    {
+        light_device_t *device = enumerator->devices[d];
+        for(uint64_t t = 0; t < device->num_targets; t++)
+        {
+            impl_replay_target_t *replay_target = (impl_replay_target_t*)device->targets[t]->device_target_data;
+            free(replay_target->sets.ops);
+            free(replay_target->gets.ops);
+            free(replay_target->get_maxes.ops);
+        }
+    }
+
+    return true;
+}
+
+bool impl_replay_set(light_device_target_t *target, uint64_t in_value)
+{
+    impl_replay_target_t *replay_target = (impl_replay_target_t*)target->device_target_data;
+    if(!_impl_replay_next(&replay_target->sets))
+    {
+        LIGHT_ERR("replay: write to %s failed in the trace", target->name);
+        return false;
+    }
+
+    replay_target->value = in_value;
+    return true;
+}
+
+bool impl_replay_get(light_device_target_t *target, uint64_t *out_value)
+{
+    impl_replay_target_t *replay_target = (impl_replay_target_t*)target->device_target_data;
+    if(!_impl_replay_next(&replay_target->gets))
+    {
+        LIGHT_ERR("replay: read from %s failed in the trace", target->name);
+        return false;
+    }
+
+    *out_value = replay_target->value;
+    return true;
+}
+
+bool impl_replay_getmax(light_device_target_t *target, uint64_t *out_value)
+{
+    impl_replay_target_t *replay_target = (impl_replay_target_t*)target->device_target_data;
+    if(!_impl_replay_next(&replay_target->get_maxes))
+    {
+        LIGHT_ERR("replay: read of max value from %s failed in the trace", target->name);
+        return false;
+    }
+
+    *out_value = replay_target->max_value;
+    return true;
+}
+
+bool impl_replay_command(light_device_target_t *target, char const *command_string)
+{
+    // Effects of the recorded hardware aren't part of the trace, they run through the userspace animator
+    light_effect_t effect;
+    if(!light_effect_parse(command_string, &effect))
+    {
+        LIGHT_ERR("replay: %s doesn't support \"%s\"", target->name, command_string);
+        return false;
+    }
+
+    return light_effect_run_userspace(target, &effect);
+}
+
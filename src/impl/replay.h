@@ -0,0 +1,47 @@
+
+#pragma once
+
+#include "light.h"
+
+// Implementation of the replay enumerator
+// Recreates the targets of a trace recorded with $LIGHT_TRACE (see trace.h), given in $LIGHT_REPLAY.
+// Each target starts at the value that was first read from it, and its reads and writes take as long as the recorded ones,
+// and fail where they failed, in the recorded order (starting over when they run out).
+
+typedef struct _impl_replay_op_t impl_replay_op_t;
+struct _impl_replay_op_t
+{
+    uint32_t    latency_ns;
+    bool        success;
+};
+
+// The recorded operations of one kind on a target
+typedef struct _impl_replay_ops_t impl_replay_ops_t;
+struct _impl_replay_ops_t
+{
+    impl_replay_op_t    *ops;
+    uint64_t            num_ops;
+    uint64_t            next; // The op the next call replays
+};
+
+// Target data, one per replayed target
+typedef struct _impl_replay_target_t impl_replay_target_t;
+struct _impl_replay_target_t
+{
+    uint64_t            value;
+    bool                value_known; // Whether value was read or written in the trace yet, while loading
+    uint64_t            max_value;
+    bool                max_known;
+    impl_replay_ops_t   sets;
+    impl_replay_ops_t   gets;
+    impl_replay_ops_t   get_maxes;
+};
+
+bool impl_replay_init(light_device_enumerator_t *enumerator);
+bool impl_replay_free(light_device_enumerator_t *enumerator);
+
+bool impl_replay_set(light_device_target_t *target, uint64_t in_value);
+bool impl_replay_get(light_device_target_t *target, uint64_t *out_value);
+bool impl_replay_getmax(light_device_target_t *target, uint64_t *out_value);
+bool impl_replay_command(light_device_target_t *target, char const *command_string);
+
@@ -0,0 +1,316 @@
+
+#include "impl/sim.h"
+#include "light.h"
+#include "helpers.h"
+#include "effect.h"
+#include "clock.h"
+
+#include <stdio.h> // snprintf, sscanf
+#include <stdlib.h> // malloc, secure_getenv
+#include <string.h> // strncmp, strcmp, strchr
+#include <inttypes.h> // PRIu64, SCNu64
+
+// Max length of $LIGHT_SIM
+#define IMPL_SIM_SPEC_MAX 1024
+
+// Max number of simulated devices, and targets per device
+#define IMPL_SIM_MAX_DEVICES 256
+#define IMPL_SIM_MAX_TARGETS 256
+
+typedef struct
+{
+    uint64_t            num_devices;
+    uint64_t            num_targets;
+    uint64_t            max_low; // Every target gets a max value in this range
+    uint64_t            max_high;
+    impl_sim_latency_t  get_latency;
+    impl_sim_latency_t  set_latency;
+    double              fail_rate;
+    uint64_t            seed;
+} _impl_sim_config_t;
+
+// splitmix64, turns seeds that are close to each other into unrelated states
+static uint64_t _impl_sim_mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// xorshift64*, the state must not be 0
+static uint64_t _impl_sim_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+// Returns a random number in [0, 1)
+static double _impl_sim_random_unit(uint64_t *state)
+{
+    return (double)(_impl_sim_random(state) >> 11) / 9007199254740992.0;
+}
+
+// Parses "N" or "N-M"
+static bool _impl_sim_parse_range(char const *str, uint64_t *out_low, uint64_t *out_high)
+{
+    int length = 0;
+    if(sscanf(str, "%" SCNu64 "-%" SCNu64 "%n", out_low, out_high, &length) == 2 && str[length] == '\0')
+    {
+        return *out_low <= *out_high;
+    }
+
+    length = 0;
+    if(sscanf(str, "%" SCNu64 "%n", out_low, &length) == 1 && str[length] == '\0')
+    {
+        *out_high = *out_low;
+        return true;
+    }
+
+    return false;
+}
+
+// Parses "fixed:US", "uniform:MIN-MAX" or "longtail:MIN-MAX"
+static bool _impl_sim_parse_latency(char const *str, impl_sim_latency_t *out_latency)
+{
+    char const *range = strchr(str, ':');
+    if(range == NULL || !_impl_sim_parse_range(range + 1, &out_latency->min_us, &out_latency->max_us))
+    {
+        return false;
+    }
+
+    if(strncmp(str, "fixed:", 6) == 0)
+    {
+        out_latency->type = IMPL_SIM_FIXED;
+        return out_latency->min_us == out_latency->max_us;
+    }
+
+    if(strncmp(str, "uniform:", 8) == 0)
+    {
+        out_latency->type = IMPL_SIM_UNIFORM;
+        return true;
+    }
+
+    if(strncmp(str, "longtail:", 9) == 0)
+    {
+        out_latency->type = IMPL_SIM_LONGTAIL;
+        return true;
+    }
+
+    return false;
+}
+
+// Parses the comma separated key=value pairs of $LIGHT_SIM
+static bool _impl_sim_parse_config(char const *spec, _impl_sim_config_t *config)
+{
+    char buffer[IMPL_SIM_SPEC_MAX];
+    if(snprintf(buffer, sizeof(buffer), "%s", spec) >= (int)sizeof(buffer))
+    {
+        LIGHT_ERR("sim: LIGHT_SIM is too long");
+        return false;
+    }
+
+    char *save_ptr = NULL;
+    for(char *pair = strtok_r(buffer, ",", &save_ptr); pair != NULL; pair = strtok_r(NULL, ",", &save_ptr))
+    {
+        char *value = strchr(pair, '=');
+        if(value == NULL)
+        {
+            LIGHT_ERR("sim: expected key=value in LIGHT_SIM, got \"%s\"", pair);
+            return false;
+        }
+        *value++ = '\0';
+
+        bool valid = false;
+        uint64_t high = 0;
+        int length = 0;
+        if(strcmp(pair, "devices") == 0)
+        {
+            valid = _impl_sim_parse_range(value, &config->num_devices, &high) && high == config->num_devices && config->num_devices <= IMPL_SIM_MAX_DEVICES;
+        }
+        else if(strcmp(pair, "targets") == 0)
+        {
+            valid = _impl_sim_parse_range(value, &config->num_targets, &high) && high == config->num_targets && config->num_targets <= IMPL_SIM_MAX_TARGETS;
+        }
+        else if(strcmp(pair, "max") == 0)
+        {
+            valid = _impl_sim_parse_range(value, &config->max_low, &config->max_high) && config->max_low > 0;
+        }
+        else if(strcmp(pair, "latency") == 0)
+        {
+            valid = _impl_sim_parse_latency(value, &config->get_latency);
+            config->set_latency = config->get_latency;
+        }
+        else if(strcmp(pair, "get") == 0)
+        {
+            valid = _impl_sim_parse_latency(value, &config->get_latency);
+        }
+        else if(strcmp(pair, "set") == 0)
+        {
+            valid = _impl_sim_parse_latency(value, &config->set_latency);
+        }
+        else if(strcmp(pair, "fail") == 0)
+        {
+            valid = sscanf(value, "%lf%n", &config->fail_rate, &length) == 1 && value[length] == '\0' && config->fail_rate >= 0.0 && config->fail_rate <= 1.0;
+        }
+        else if(strcmp(pair, "seed") == 0)
+        {
+            valid = _impl_sim_parse_range(value, &config->seed, &high) && high == config->seed;
+        }
+        else
+        {
+            LIGHT_ERR("sim: unknown key \"%s\" in LIGHT_SIM", pair);
+            return false;
+        }
+
+        if(!valid)
+        {
+            LIGHT_ERR("sim: invalid value \"%s\" for %s in LIGHT_SIM", value, pair);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Sleeps for as long as the operation is configured to take
+static void _impl_sim_wait(impl_sim_target_t *sim_target, impl_sim_latency_t const *latency)
+{
+    uint64_t latency_us = latency->min_us;
+    if(latency->type == IMPL_SIM_UNIFORM)
+    {
+        latency_us += (uint64_t)(_impl_sim_random_unit(&sim_target->rng) * (double)(latency->max_us - latency->min_us + 1));
+    }
+    else if(latency->type == IMPL_SIM_LONGTAIL)
+    {
+        // Pareto distribution with an exponent of 1, cut off at max_us
+        double scaled_us = (double)latency->min_us / (1.0 - _impl_sim_random_unit(&sim_target->rng));
+        latency_us = scaled_us < (double)latency->max_us ? (uint64_t)scaled_us : latency->max_us;
+    }
+
+    if(latency_us == 0)
+    {
+        return;
+    }
+
+    light_clock_sleep(latency_us * 1000ull);
+}
+
+static bool _impl_sim_fails(impl_sim_target_t *sim_target)
+{
+    return sim_target->fail_rate > 0.0 && _impl_sim_random_unit(&sim_target->rng) < sim_target->fail_rate;
+}
+
+bool impl_sim_init(light_device_enumerator_t *enumerator)
+{
+    char const *spec = secure_getenv("LIGHT_SIM");
+    if(spec == NULL)
+    {
+        return true;
+    }
+
+    _impl_sim_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.num_devices = 1;
+    config.num_targets = 1;
+    config.max_low = 255;
+    config.max_high = 255;
+
+    if(!_impl_sim_parse_config(spec, &config))
+    {
+        return false;
+    }
+
+    uint64_t layout_rng = _impl_sim_mix(config.seed) | 1;
+    for(uint64_t d = 0; d < config.num_devices; d++)
+    {
+        char device_name[NAME_MAX];
+        snprintf(device_name, sizeof(device_name), "device%" PRIu64, d);
+        light_device_t *device = light_create_device(enumerator, device_name, NULL);
+
+        for(uint64_t t = 0; t < config.num_targets; t++)
+        {
+            impl_sim_target_t *sim_target = malloc(sizeof(impl_sim_target_t));
+            sim_target->max_value = config.max_low + _impl_sim_random(&layout_rng) % (config.max_high - config.max_low + 1);
+            sim_target->value = sim_target->max_value / 2;
+            sim_target->get_latency = config.get_latency;
+            sim_target->set_latency = config.set_latency;
+            sim_target->fail_rate = config.fail_rate;
+
+            // Every target has its own sequence, so that what happens to one doesn't change the timing of the others
+            sim_target->rng = _impl_sim_mix(config.seed + d * IMPL_SIM_MAX_TARGETS + t + 1) | 1;
+
+            char target_name[NAME_MAX];
+            snprintf(target_name, sizeof(target_name), "target%" PRIu64, t);
+            light_create_device_target(device, target_name, impl_sim_set, impl_sim_get, impl_sim_getmax, impl_sim_command, sim_target);
+        }
+    }
+
+    return true;
+}
+
+bool impl_sim_free(light_device_enumerator_t *enumerator)
+{
+    return true;
+}
+
+bool impl_sim_set(light_device_target_t *target, uint64_t in_value)
+{
+    impl_sim_target_t *sim_target = (impl_sim_target_t*)target->device_target_data;
+
+    _impl_sim_wait(sim_target, &sim_target->set_latency);
+    if(_impl_sim_fails(sim_target))
+    {
+        LIGHT_ERR("sim: failing write to %s/%s", target->device->name, target->name);
+        return false;
+    }
+
+    sim_target->value = in_value;
+    return true;
+}
+
+bool impl_sim_get(light_device_target_t *target, uint64_t *out_value)
+{
+    impl_sim_target_t *sim_target = (impl_sim_target_t*)target->device_target_data;
+
+    _impl_sim_wait(sim_target, &sim_target->get_latency);
+    if(_impl_sim_fails(sim_target))
+    {
+        LIGHT_ERR("sim: failing read from %s/%s", target->device->name, target->name);
+        return false;
+    }
+
+    *out_value = sim_target->value;
+    return true;
+}
+
+bool impl_sim_getmax(light_device_target_t *target, uint64_t *out_value)
+{
+    impl_sim_target_t *sim_target = (impl_sim_target_t*)target->device_target_data;
+
+    _impl_sim_wait(sim_target, &sim_target->get_latency);
+    if(_impl_sim_fails(sim_target))
+    {
+        LIGHT_ERR("sim: failing read of max value from %s/%s", target->device->name, target->name);
+        return false;
+    }
+
+    *out_value = sim_target->max_value;
+    return true;
+}
+
+bool impl_sim_command(light_device_target_t *target, char const *command_string)
+{
+    // Simulated lights have no effects of their own, they run through the userspace animator
+    light_effect_t effect;
+    if(!light_effect_parse(command_string, &effect))
+    {
+        LIGHT_ERR("sim: %s doesn't support \"%s\"", target->name, command_string);
+        return false;
+    }
+
+    return light_effect_run_userspace(target, &effect);
+}
+
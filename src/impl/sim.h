@@ -0,0 +1,45 @@
+
+#pragma once
+
+#include "light.h"
+
+// Implementation of the sim enumerator
+// Enumerates simulated devices, described by $LIGHT_SIM, for benchmarks and tests that need realistic timing without hardware.
+// Targets keep their value, take time to read and write as configured, and can be made to fail now and then.
+// Random numbers come from a fixed seed, so that a run can be repeated exactly.
+
+typedef enum
+{
+    IMPL_SIM_FIXED = 0, // Always min_us
+    IMPL_SIM_UNIFORM, // Anything between min_us and max_us
+    IMPL_SIM_LONGTAIL // Mostly close to min_us: half of the operations take at most twice as long, one in ten ten times as long, up to max_us
+} impl_sim_distribution_t;
+
+typedef struct _impl_sim_latency_t impl_sim_latency_t;
+struct _impl_sim_latency_t
+{
+    impl_sim_distribution_t type;
+    uint64_t                min_us;
+    uint64_t                max_us;
+};
+
+// Target data, one per simulated target
+typedef struct _impl_sim_target_t impl_sim_target_t;
+struct _impl_sim_target_t
+{
+    uint64_t            value;
+    uint64_t            max_value;
+    impl_sim_latency_t  get_latency; // Of get_value and get_max_value
+    impl_sim_latency_t  set_latency;
+    double              fail_rate; // Share of operations that fail, 0 to 1
+    uint64_t            rng; // State of the random number generator of the target
+};
+
+bool impl_sim_init(light_device_enumerator_t *enumerator);
+bool impl_sim_free(light_device_enumerator_t *enumerator);
+
+bool impl_sim_set(light_device_target_t *target, uint64_t in_value);
+bool impl_sim_get(light_device_target_t *target, uint64_t *out_value);
+bool impl_sim_getmax(light_device_target_t *target, uint64_t *out_value);
+bool impl_sim_command(light_device_target_t *target, char const *command_string);
+
@@ -2,107 +2,400 @@
 #include "impl/sysfs.h"
 #include "light.h"
 #include "helpers.h"
+#include "effect.h"
+#include "color.h"
+#include "middleware.h"
 
 #include <stdio.h> //snprintf
 #include <stdlib.h> // malloc, free
-#include <dirent.h> // opendir, readdir
+#include <string.h> // strerror, strtok_r, strncmp
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <fcntl.h> // openat
+#include <unistd.h> // close, dup
+#include <dirent.h> // DT_LNK, DT_DIR
 
-static bool _impl_sysfs_init_leds(light_device_enumerator_t *enumerator)
-{
-    // Create a new backlight device
-    light_device_t *leds_device = light_create_device(enumerator, "leds", NULL);
+// Scan filter for class directories, whose entries are symlinks to the actual device nodes
+#define IMPL_SYSFS_CLASS_ENTRY_TYPES (LIGHT_DT_MASK(DT_LNK) | LIGHT_DT_MASK(DT_DIR))
 
-    // Iterate through the led controllers and create a device_target for each controller 
-    DIR *leds_dir;
-    struct dirent *curr_entry;
+// Attributes of a controller node
+static char const * const _impl_sysfs_brightness = "brightness";
+static char const * const _impl_sysfs_max_brightness = "max_brightness";
+
+static char const * const _impl_sysfs_trigger = "trigger";
+
+// Reads the triggers supported by a led. The attribute lists all triggers separated by spaces, with the active one in brackets
+static uint32_t _impl_sysfs_probe_triggers(impl_sysfs_data_t *data)
+{
+    if(data->triggers_probed)
+    {
+        return data->triggers;
+    }
+    
+    data->triggers_probed = true;
+    data->triggers = 0;
     
-    if((leds_dir = opendir("/sys/class/leds")) == NULL)
+    // Backlights have no trigger attribute, which simply means there is no hardware support for effects
+    int fd = openat(data->dirfd, _impl_sysfs_trigger, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return 0;
+    }
+    
+    char buffer[4096];
+    ssize_t nread = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    
+    if(nread <= 0)
+    {
+        return 0;
+    }
+    
+    buffer[nread] = '\0';
+    
+    char *save = NULL;
+    for(char *token = strtok_r(buffer, " \n[]", &save); token != NULL; token = strtok_r(NULL, " \n[]", &save))
+    {
+        if(strcmp(token, "timer") == 0)
+        {
+            data->triggers |= IMPL_SYSFS_TRIGGER_TIMER;
+        }
+        else if(strcmp(token, "oneshot") == 0)
+        {
+            data->triggers |= IMPL_SYSFS_TRIGGER_ONESHOT;
+        }
+        else if(strcmp(token, "pattern") == 0)
+        {
+            data->triggers |= IMPL_SYSFS_TRIGGER_PATTERN;
+        }
+    }
+    
+    return data->triggers;
+}
+
+// Formats a table effect as the pattern attribute of the pattern trigger. Returns false if it doesn't fit, such tables run in userspace.
+static bool _impl_sysfs_table_pattern(light_device_target_t *target, light_effect_t const *effect, char *pattern, size_t size)
+{
+    uint64_t max_value = 0;
+    if(!impl_sysfs_getmax(target, &max_value))
     {
-        LIGHT_ERR("failed to open leds controller directory for reading");
         return false;
     }
     
-    while((curr_entry = readdir(leds_dir)) != NULL)
+    // Fading entries map directly to pattern entries, held levels need a second entry with the same level and no duration
+    size_t length = 0;
+    pattern[0] = '\0';
+    for(uint64_t i = 0; i < effect->num_keyframes; i++)
     {
-        // Skip dot entries
-        if(curr_entry->d_name[0] == '.')
+        light_keyframe_t const *keyframe = &effect->keyframes[i];
+        uint64_t value = (uint64_t)(keyframe->level * (double)max_value + 0.5);
+        
+        int written = 0;
+        if(keyframe->ramp)
         {
-            continue;
+            written = snprintf(pattern + length, size - length, "%" PRIu64 " %" PRIu64 " ", value, keyframe->duration_ms);
+        }
+        else
+        {
+            written = snprintf(pattern + length, size - length, "%" PRIu64 " %" PRIu64 " %" PRIu64 " 0 ", value, keyframe->duration_ms, value);
         }
         
-        // Setup the target data 
-        impl_sysfs_data_t *dev_data = malloc(sizeof(impl_sysfs_data_t));
-        snprintf(dev_data->brightness, sizeof(dev_data->brightness), "/sys/class/leds/%s/brightness", curr_entry->d_name);
-        snprintf(dev_data->max_brightness, sizeof(dev_data->max_brightness), "/sys/class/leds/%s/max_brightness", curr_entry->d_name);
+        if(written < 0 || (size_t)written >= size - length)
+        {
+            LIGHT_NOTE("sysfs: the effect is too long for the pattern trigger of %s", target->name);
+            return false;
+        }
         
-        // Create a new device target for the controller 
-        light_create_device_target(leds_device, curr_entry->d_name, impl_sysfs_set, impl_sysfs_get, impl_sysfs_getmax, impl_sysfs_command, dev_data);
+        length += (size_t)written;
     }
     
-    closedir(leds_dir);
-    
     return true;
 }
 
-static bool _impl_sysfs_init_backlight(light_device_enumerator_t *enumerator)
+// Programs the effect into the kernel led trigger, after which it runs without any help from us. `pattern` is the one of a table
+// effect, formatted by _impl_sysfs_table_pattern.
+static bool _impl_sysfs_offload_effect(light_device_target_t *target, light_effect_t const *effect, char const *pattern)
 {
-    // Create a new backlight device
-    light_device_t *backlight_device = light_create_device(enumerator, "backlight", NULL);
+    impl_sysfs_data_t *data = (impl_sysfs_data_t*)target->device_target_data;
+    
+    switch(effect->type)
+    {
+        case LIGHT_EFFECT_NONE:
+            return light_file_write_string_at(data->dirfd, _impl_sysfs_trigger, "none");
+        
+        case LIGHT_EFFECT_BLINK:
+            // Activating the trigger creates the delay attributes
+            return light_file_write_string_at(data->dirfd, _impl_sysfs_trigger, "timer") &&
+                   light_file_write_uint64_at(data->dirfd, "delay_on", effect->on_ms) &&
+                   light_file_write_uint64_at(data->dirfd, "delay_off", effect->off_ms);
+        
+        case LIGHT_EFFECT_ONESHOT:
+            return light_file_write_string_at(data->dirfd, _impl_sysfs_trigger, "oneshot") &&
+                   light_file_write_uint64_at(data->dirfd, "delay_on", effect->on_ms) &&
+                   light_file_write_uint64_at(data->dirfd, "delay_off", effect->off_ms) &&
+                   light_file_write_uint64_at(data->dirfd, "shot", 1);
+        
+        case LIGHT_EFFECT_BREATHE:
+        {
+            uint64_t max_value = 0;
+            if(!impl_sysfs_getmax(target, &max_value))
+            {
+                return false;
+            }
+            
+            // The pattern engine fades linearly between consecutive brightness/duration pairs, and repeats forever by default
+            char pattern[64];
+            snprintf(pattern, sizeof(pattern), "0 %" PRIu64 " %" PRIu64 " %" PRIu64, effect->period_ms / 2, max_value, effect->period_ms / 2);
+            
+            return light_file_write_string_at(data->dirfd, _impl_sysfs_trigger, "pattern") &&
+                   light_file_write_string_at(data->dirfd, "pattern", pattern);
+        }
+        
+        case LIGHT_EFFECT_TABLE:
+            return light_file_write_string_at(data->dirfd, _impl_sysfs_trigger, "pattern") &&
+                   light_file_write_string_at(data->dirfd, "pattern", pattern);
+        
+        case LIGHT_EFFECT_RAMP:
+            // One-shot fades are left to userspace
+            return false;
+    }
+    
+    return false;
+}
 
-    // Iterate through the backlight controllers and create a device_target for each controller 
-    DIR *backlight_dir;
-    struct dirent *curr_entry;
+// Returns true if the triggers of the led can run the effect by themselves
+static bool _impl_sysfs_can_offload_effect(uint32_t triggers, light_effect_t const *effect)
+{
+    switch(effect->type)
+    {
+        case LIGHT_EFFECT_NONE:
+            // Any led with a trigger attribute can have its trigger removed
+            return triggers != 0;
+        case LIGHT_EFFECT_BLINK:
+            return (triggers & IMPL_SYSFS_TRIGGER_TIMER) != 0;
+        case LIGHT_EFFECT_ONESHOT:
+            return (triggers & IMPL_SYSFS_TRIGGER_ONESHOT) != 0;
+        case LIGHT_EFFECT_BREATHE:
+        case LIGHT_EFFECT_TABLE:
+            return (triggers & IMPL_SYSFS_TRIGGER_PATTERN) != 0;
+        case LIGHT_EFFECT_RAMP:
+            return false;
+    }
     
-    // Keep track of the best controller, and create an autodevice from that
-    char best_controller[NAME_MAX];
-    uint64_t best_value = 0;
+    return false;
+}
+
+// Reads the order of the color channels of a multicolor led, multi_index lists their names separated by spaces
+static uint8_t _impl_sysfs_probe_channels(impl_sysfs_data_t *data)
+{
+    if(data->channels_probed)
+    {
+        return data->num_channels;
+    }
+    
+    data->channels_probed = true;
+    data->num_channels = 0;
     
-    if((backlight_dir = opendir("/sys/class/backlight")) == NULL)
+    // Single color leds and backlights have no multi_index attribute
+    int fd = openat(data->dirfd, "multi_index", O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
     {
-        LIGHT_ERR("failed to open backlight controller directory for reading");
-        return false;
+        return 0;
+    }
+    
+    char buffer[256];
+    ssize_t nread = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    
+    if(nread <= 0)
+    {
+        return 0;
     }
     
-    while((curr_entry = readdir(backlight_dir)) != NULL)
+    buffer[nread] = '\0';
+    
+    static char const * const channel_names[] = { "red", "green", "blue", "white" };
+    
+    char *save = NULL;
+    for(char *token = strtok_r(buffer, " \n", &save); token != NULL && data->num_channels < IMPL_SYSFS_MAX_COLOR_CHANNELS; token = strtok_r(NULL, " \n", &save))
     {
-        // Skip dot entries
-        if(curr_entry->d_name[0] == '.')
+        uint8_t channel = IMPL_SYSFS_CHANNEL_UNKNOWN;
+        for(uint8_t i = 0; i < 4; i++)
         {
-            continue;
+            if(strcmp(token, channel_names[i]) == 0)
+            {
+                channel = i;
+                break;
+            }
         }
         
-        // Setup the target data 
-        impl_sysfs_data_t *dev_data = malloc(sizeof(impl_sysfs_data_t));
-        snprintf(dev_data->brightness, sizeof(dev_data->brightness), "/sys/class/backlight/%s/brightness", curr_entry->d_name);
-        snprintf(dev_data->max_brightness, sizeof(dev_data->max_brightness), "/sys/class/backlight/%s/max_brightness", curr_entry->d_name);
-        
-        // Create a new device target for the controller 
-        light_create_device_target(backlight_device, curr_entry->d_name, impl_sysfs_set, impl_sysfs_get, impl_sysfs_getmax, impl_sysfs_command, dev_data);
-        
-        // Read the max brightness to get the best one
-        uint64_t curr_value = 0;
-        if(light_file_read_uint64(dev_data->max_brightness, &curr_value))
+        data->channels[data->num_channels++] = channel;
+    }
+    
+    return data->num_channels;
+}
+
+// Sets all the color channels of a multicolor led with a single write to multi_intensity
+static bool _impl_sysfs_set_color(light_device_target_t *target, char const *color_string)
+{
+    impl_sysfs_data_t *data = (impl_sysfs_data_t*)target->device_target_data;
+    
+    light_rgb_t color;
+    if(!light_color_parse(color_string, &color))
+    {
+        LIGHT_ERR("sysfs: invalid color \"%s\"", color_string);
+        return false;
+    }
+    
+    if(_impl_sysfs_probe_channels(data) == 0)
+    {
+        LIGHT_ERR("sysfs: %s is not a multicolor led", target->name);
+        return false;
+    }
+    
+    // Intensities are in the range of the led's brightness, which in turn scales all of them
+    uint64_t max_value = 0;
+    if(!impl_sysfs_getmax(target, &max_value))
+    {
+        return false;
+    }
+    
+    double components[4] = { color.r, color.g, color.b, color.w };
+    char intensities[IMPL_SYSFS_MAX_COLOR_CHANNELS * 21];
+    size_t length = 0;
+    
+    for(uint8_t i = 0; i < data->num_channels; i++)
+    {
+        double component = data->channels[i] == IMPL_SYSFS_CHANNEL_UNKNOWN ? 0.0 : components[data->channels[i]];
+        uint64_t intensity = (uint64_t)(component * (double)max_value + 0.5);
+        length += snprintf(intensities + length, sizeof(intensities) - length, i == 0 ? "%" PRIu64 : " %" PRIu64, intensity);
+    }
+    
+    return light_file_write_string_at(data->dirfd, "multi_intensity", intensities);
+}
+
+// Opens the controller node `name` in the class directory `dirfd`, and sets up target data for it
+static impl_sysfs_data_t *_impl_sysfs_create_data(int dirfd, char const *name)
+{
+    int node_fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(node_fd < 0)
+    {
+        LIGHT_WARN("sysfs: couldn't open controller %s: %s", name, strerror(errno));
+        return NULL;
+    }
+    
+    impl_sysfs_data_t *dev_data = malloc(sizeof(impl_sysfs_data_t));
+    dev_data->dirfd = node_fd;
+    dev_data->triggers_probed = false;
+    dev_data->triggers = 0;
+    dev_data->channels_probed = false;
+    dev_data->num_channels = 0;
+    
+    return dev_data;
+}
+
+static bool _impl_sysfs_add_led(int dirfd, char const *name, unsigned char type, void *userdata)
+{
+    light_device_t *leds_device = (light_device_t*)userdata;
+
+    // Setup the target data 
+    impl_sysfs_data_t *dev_data = _impl_sysfs_create_data(dirfd, name);
+    if(dev_data == NULL)
+    {
+        return true;
+    }
+    
+    // Create a new device target for the controller 
+    light_create_device_target(leds_device, name, impl_sysfs_set, impl_sysfs_get, impl_sysfs_getmax, impl_sysfs_command, dev_data);
+    
+    return true;
+}
+
+static bool _impl_sysfs_init_leds(light_device_enumerator_t *enumerator)
+{
+    // Create a new backlight device
+    light_device_t *leds_device = light_create_device(enumerator, "leds", NULL);
+
+    // Iterate through the led controllers and create a device_target for each controller 
+    if(!light_dir_scan("/sys/class/leds", IMPL_SYSFS_CLASS_ENTRY_TYPES, _impl_sysfs_add_led, leds_device))
+    {
+        LIGHT_ERR("failed to open leds controller directory for reading");
+        return false;
+    }
+    
+    return true;
+}
+
+// Keeps track of the best backlight controller while scanning
+typedef struct _impl_sysfs_backlight_scan_t impl_sysfs_backlight_scan_t;
+struct _impl_sysfs_backlight_scan_t
+{
+    light_device_t      *device;
+    impl_sysfs_data_t   *best_controller;
+    uint64_t            best_value;
+};
+
+static bool _impl_sysfs_add_backlight(int dirfd, char const *name, unsigned char type, void *userdata)
+{
+    impl_sysfs_backlight_scan_t *scan = (impl_sysfs_backlight_scan_t*)userdata;
+
+    // Setup the target data 
+    impl_sysfs_data_t *dev_data = _impl_sysfs_create_data(dirfd, name);
+    if(dev_data == NULL)
+    {
+        return true;
+    }
+    
+    // Create a new device target for the controller 
+    light_device_target_t *target = light_create_device_target(scan->device, name, impl_sysfs_set, impl_sysfs_get, impl_sysfs_getmax, impl_sysfs_command, dev_data);
+    
+    // Read the max brightness to get the best one
+    uint64_t curr_value = 0;
+    if(light_file_read_uint64_at(dev_data->dirfd, _impl_sysfs_max_brightness, &curr_value))
+    {
+        light_middleware_seed_max(target, curr_value);
+        if(curr_value > scan->best_value)
         {
-            if(curr_value > best_value)
-            {
-                best_value = curr_value;
-                snprintf(best_controller, sizeof(best_controller), "%s", curr_entry->d_name);
-            }
+            scan->best_value = curr_value;
+            scan->best_controller = dev_data;
         }
     }
     
-    closedir(backlight_dir);
+    return true;
+}
+
+static bool _impl_sysfs_init_backlight(light_device_enumerator_t *enumerator)
+{
+    // Create a new backlight device
+    light_device_t *backlight_device = light_create_device(enumerator, "backlight", NULL);
+
+    // Iterate through the backlight controllers and create a device_target for each controller 
+    // Keep track of the best controller, and create an autodevice from that
+    impl_sysfs_backlight_scan_t scan;
+    scan.device = backlight_device;
+    scan.best_controller = NULL;
+    scan.best_value = 0;
+    
+    if(!light_dir_scan("/sys/class/backlight", IMPL_SYSFS_CLASS_ENTRY_TYPES, _impl_sysfs_add_backlight, &scan))
+    {
+        LIGHT_ERR("failed to open backlight controller directory for reading");
+        return false;
+    }
     
     // If we found at least one usable controller, create an auto target mapped to that controller
-    if(best_value > 0)
+    if(scan.best_value > 0)
     {
-        // Setup the target data 
+        // Setup the target data, with its own handle to the controller node
         impl_sysfs_data_t *dev_data = malloc(sizeof(impl_sysfs_data_t));
-        snprintf(dev_data->brightness, sizeof(dev_data->brightness), "/sys/class/backlight/%s/brightness", best_controller);
-        snprintf(dev_data->max_brightness, sizeof(dev_data->max_brightness), "/sys/class/backlight/%s/max_brightness", best_controller);
+        dev_data->dirfd = dup(scan.best_controller->dirfd);
+        dev_data->triggers_probed = false;
+        dev_data->triggers = 0;
+        dev_data->channels_probed = false;
+        dev_data->num_channels = 0;
         
         // Create a new device target for the controller 
-        light_create_device_target(backlight_device, "auto", impl_sysfs_set, impl_sysfs_get, impl_sysfs_getmax, impl_sysfs_command, dev_data);
+        light_device_target_t *auto_target = light_create_device_target(backlight_device, "auto", impl_sysfs_set, impl_sysfs_get, impl_sysfs_getmax, impl_sysfs_command, dev_data);
+        light_middleware_seed_max(auto_target, scan.best_value);
     }
     
     return true;
@@ -121,6 +414,17 @@ bool impl_sysfs_init(light_device_enumerator_t *enumerator)
 
 bool impl_sysfs_free(light_device_enumerator_t *enumerator)
 {
+    // Close the controller nodes, the target data itself is freed by light
+    for(uint64_t d = 0; d < enumerator->num_devices; d++)
+    {
+        light_device_t *device = enumerator->devices[d];
+        for(uint64_t t = 0; t < device->num_targets; t++)
+        {
+            impl_sysfs_data_t *data = (impl_sysfs_data_t*)device->targets[t]->device_target_data;
+            close(data->dirfd);
+        }
+    }
+    
     return true;
 }
 
@@ -128,7 +432,7 @@ bool impl_sysfs_set(light_device_target_t *target, uint64_t in_value)
 {
     impl_sysfs_data_t *data = (impl_sysfs_data_t*)target->device_target_data;
 
-    if(!light_file_write_uint64(data->brightness, in_value))
+    if(!light_file_write_uint64_at(data->dirfd, _impl_sysfs_brightness, in_value))
     {
         LIGHT_ERR("failed to write to sysfs device");
         return false;
@@ -141,7 +445,7 @@ bool impl_sysfs_get(light_device_target_t *target, uint64_t *out_value)
 {
     impl_sysfs_data_t *data = (impl_sysfs_data_t*)target->device_target_data;
 
-    if(!light_file_read_uint64(data->brightness, out_value))
+    if(!light_file_read_uint64_at(data->dirfd, _impl_sysfs_brightness, out_value))
     {
         LIGHT_ERR("failed to read from sysfs device");
         return false;
@@ -154,7 +458,7 @@ bool impl_sysfs_getmax(light_device_target_t *target, uint64_t *out_value)
 {
     impl_sysfs_data_t *data = (impl_sysfs_data_t*)target->device_target_data;
 
-    if(!light_file_read_uint64(data->max_brightness, out_value))
+    if(!light_file_read_uint64_at(data->dirfd, _impl_sysfs_max_brightness, out_value))
     {
         LIGHT_ERR("failed to read from sysfs device");
         return false;
@@ -165,9 +469,48 @@ bool impl_sysfs_getmax(light_device_target_t *target, uint64_t *out_value)
 
 bool impl_sysfs_command(light_device_target_t *target, char const *command_string)
 {
-    // No current need for custom commands in sysfs enumerator
-    // To implement support, simply parse the command string to your liking, and return false on invalid input or results!
-    return true;
+    // The custom commands of sysfs targets are colors of multicolor leds, and effects
+    if(strncmp(command_string, "color ", 6) == 0)
+    {
+        return _impl_sysfs_set_color(target, command_string + 6);
+    }
+    
+    light_effect_t effect;
+    if(!light_effect_parse(command_string, &effect))
+    {
+        LIGHT_ERR("sysfs: invalid effect \"%s\"", command_string);
+        return false;
+    }
+    
+    impl_sysfs_data_t *data = (impl_sysfs_data_t*)target->device_target_data;
+    uint32_t triggers = _impl_sysfs_probe_triggers(data);
+    
+    char pattern[IMPL_SYSFS_PATTERN_SIZE];
+    bool offload = _impl_sysfs_can_offload_effect(triggers, &effect);
+    if(offload && effect.type == LIGHT_EFFECT_TABLE)
+    {
+        offload = _impl_sysfs_table_pattern(target, &effect, pattern, sizeof(pattern));
+    }
+    
+    if(offload)
+    {
+        LIGHT_NOTE("sysfs: running effect on %s with a kernel trigger", target->name);
+        if(!_impl_sysfs_offload_effect(target, &effect, pattern))
+        {
+            LIGHT_ERR("sysfs: failed to program the trigger of %s", target->name);
+            return false;
+        }
+        
+        return true;
+    }
+    
+    // A trigger left running would fight with our writes
+    if(triggers != 0 && !light_file_write_string_at(data->dirfd, _impl_sysfs_trigger, "none"))
+    {
+        LIGHT_WARN("sysfs: couldn't remove the current trigger of %s", target->name);
+    }
+    
+    return light_effect_run_userspace(target, &effect);
 }
 
 
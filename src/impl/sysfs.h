@@ -6,11 +6,29 @@
 // Implementation of the sysfs enumerator
 // Enumerates devices for backlights and leds
 
+// LED triggers that can run effects in the kernel, as listed in a controller's trigger attribute
+#define IMPL_SYSFS_TRIGGER_TIMER   (1u << 0)
+#define IMPL_SYSFS_TRIGGER_ONESHOT (1u << 1)
+#define IMPL_SYSFS_TRIGGER_PATTERN (1u << 2)
+
+// Longest pattern written to the pattern trigger, longer tables of keyframes run in userspace
+#define IMPL_SYSFS_PATTERN_SIZE 1024
+
+// Max number of color channels of a multicolor led
+#define IMPL_SYSFS_MAX_COLOR_CHANNELS 8
+
+// Value of impl_sysfs_data_t::channels for colors that can't be set through light
+#define IMPL_SYSFS_CHANNEL_UNKNOWN 0xFF
+
 // Device target data 
 struct _impl_sysfs_data_t
 {
-    char brightness[NAME_MAX];
-    char max_brightness[NAME_MAX];
+    int dirfd; // The controller's sysfs node, attributes are opened relative to it
+    bool triggers_probed; // Whether triggers has been read yet, it is only needed by effects
+    uint32_t triggers; // Supported IMPL_SYSFS_TRIGGER_* flags, always 0 for backlights
+    bool channels_probed; // Whether the multicolor channels have been read yet, they are only needed by colors
+    uint8_t num_channels; // Number of entries in multi_index, 0 if this isn't a multicolor led
+    uint8_t channels[IMPL_SYSFS_MAX_COLOR_CHANNELS]; // Color of each multi_intensity entry, 0-3 for red, green, blue and white
 };
 
 typedef struct _impl_sysfs_data_t impl_sysfs_data_t;
@@ -2,8 +2,10 @@
 #include "impl/util.h"
 #include "light.h"
 #include "helpers.h"
+#include "effect.h"
 
 #include <stdio.h> //snprintf
+#include <string.h> // strncmp
 #include <stdlib.h> // malloc, free
 #include <dirent.h> // opendir, readdir
 #include <inttypes.h> // PRIu64
@@ -43,7 +45,22 @@ bool impl_util_dryrun_getmax(light_device_target_t *target, uint64_t *out_value)
 bool impl_util_dryrun_command(light_device_target_t *target, char const *command_string)
 {
     LIGHT_NOTE("impl_util_dryrun_command: running custom command on utility target %s: \"%s\"", target->name, command_string);
-    return true;
+    
+    // Colors only need to be logged, the above does that
+    if(strncmp(command_string, "color ", 6) == 0)
+    {
+        return true;
+    }
+    
+    // Other custom commands are effects, which the dryrun target runs through the userspace animator like any target without hardware support
+    light_effect_t effect;
+    if(!light_effect_parse(command_string, &effect))
+    {
+        LIGHT_ERR("impl_util_dryrun_command: invalid effect \"%s\"", command_string);
+        return false;
+    }
+    
+    return light_effect_run_userspace(target, &effect);
 }
 
 
@@ -0,0 +1,194 @@
+
+#include "input.h"
+#include "helpers.h"
+#include "scheduler.h"
+#include "clock.h"
+
+#include <stdlib.h> // malloc, free, realloc
+#include <string.h> // memcpy, strncmp, strerror
+#include <stdio.h> // snprintf
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <fcntl.h> // open, openat
+#include <unistd.h> // read, close
+#include <time.h> // CLOCK_MONOTONIC
+#include <dirent.h> // DT_CHR
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+// Max number of events read from a device at once
+#define LIGHT_INPUT_BATCH 64
+
+static bool _light_input_dispatch(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_input_device_t *device = (light_input_device_t*)userdata;
+    light_input_t *input = device->input;
+
+    struct input_event batch[LIGHT_INPUT_BATCH];
+    char *bytes = (char*)batch;
+
+    memcpy(bytes, device->buffer, device->pending);
+    ssize_t num_read = read(fd, bytes + device->pending, sizeof(batch) - device->pending);
+    if(num_read < 0)
+    {
+        if(errno == EAGAIN || errno == EINTR)
+        {
+            return true;
+        }
+
+        // ENODEV when the device was unplugged
+        LIGHT_WARN("failed to read input device: %s", strerror(errno));
+        return false;
+    }
+
+    if(num_read == 0)
+    {
+        return false;
+    }
+
+    uint64_t total = device->pending + (uint64_t)num_read;
+    uint64_t num_events = total / sizeof(struct input_event);
+    device->pending = total % sizeof(struct input_event);
+    memcpy(device->buffer, bytes + num_events * sizeof(struct input_event), device->pending);
+
+    if(num_events == 0)
+    {
+        return true;
+    }
+
+    // Events of evdev devices carry their own timestamp, which saves looking at the clock, unless it is virtual
+    uint64_t time_ns = 0;
+    if(device->monotonic && !light_clock_is_virtual())
+    {
+        struct input_event const *last = &batch[num_events - 1];
+        time_ns = (uint64_t)last->input_event_sec * 1000000000ull + (uint64_t)last->input_event_usec * 1000ull;
+    }
+    else
+    {
+        time_ns = light_loop_now_ns();
+    }
+
+    for(uint64_t i = 0; i < input->num_handlers; i++)
+    {
+        input->handlers[i].callback(batch, num_events, time_ns, input->handlers[i].userdata);
+    }
+
+    return true;
+}
+
+static bool _light_input_open(light_input_t *input, int dirfd, char const *path)
+{
+    // A FIFO is opened for writing as well, so that it doesn't hang up when the feeding process exits
+    struct stat path_stat;
+    int flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+    if(fstatat(dirfd, path, &path_stat, 0) == 0 && S_ISFIFO(path_stat.st_mode))
+    {
+        flags = O_RDWR | O_NONBLOCK | O_CLOEXEC;
+    }
+
+    int fd = openat(dirfd, path, flags);
+    if(fd < 0)
+    {
+        LIGHT_WARN("couldn't open input device %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    light_input_device_t **new_devices = realloc(input->devices, (input->num_devices + 1) * sizeof(light_input_device_t*));
+    if(new_devices == NULL)
+    {
+        LIGHT_MEMERR();
+        close(fd);
+        return false;
+    }
+    input->devices = new_devices;
+
+    light_input_device_t *device = malloc(sizeof(light_input_device_t));
+    device->fd = fd;
+    device->pending = 0;
+    device->input = input;
+
+    int clock_id = CLOCK_MONOTONIC;
+    device->monotonic = ioctl(fd, EVIOCSCLOCKID, &clock_id) == 0;
+
+    if(!light_loop_add(input->loop, fd, EPOLLIN, _light_input_dispatch, device, "input"))
+    {
+        close(fd);
+        free(device);
+        return false;
+    }
+
+    light_loop_set_priority(input->loop, fd, LIGHT_PRIORITY_INTERACTIVE);
+
+    input->devices[input->num_devices++] = device;
+    return true;
+}
+
+static bool _light_input_add_event_device(int dirfd, char const *name, unsigned char type, void *userdata)
+{
+    if(strncmp(name, "event", 5) == 0)
+    {
+        _light_input_open((light_input_t*)userdata, dirfd, name);
+    }
+
+    return true;
+}
+
+light_input_t *light_input_create(light_loop_t *loop, char const * const *paths, uint64_t num_paths)
+{
+    light_input_t *input = malloc(sizeof(light_input_t));
+    input->loop = loop;
+    input->devices = NULL;
+    input->num_devices = 0;
+    input->num_handlers = 0;
+
+    if(num_paths > 0)
+    {
+        for(uint64_t i = 0; i < num_paths; i++)
+        {
+            _light_input_open(input, AT_FDCWD, paths[i]);
+        }
+    }
+    else if(!light_dir_scan("/dev/input", LIGHT_DT_MASK(DT_CHR), _light_input_add_event_device, input))
+    {
+        LIGHT_WARN("couldn't list input devices");
+    }
+
+    if(input->num_devices == 0)
+    {
+        LIGHT_ERR("no input devices could be opened");
+        light_input_free(input);
+        return NULL;
+    }
+
+    LIGHT_NOTE("watching %" PRIu64 " input devices", input->num_devices);
+    return input;
+}
+
+void light_input_free(light_input_t *input)
+{
+    for(uint64_t i = 0; i < input->num_devices; i++)
+    {
+        light_loop_remove(input->loop, input->devices[i]->fd);
+        close(input->devices[i]->fd);
+        free(input->devices[i]);
+    }
+
+    free(input->devices);
+    free(input);
+}
+
+bool light_input_add_handler(light_input_t *input, LFUNCINPUTEVENTS callback, void *userdata)
+{
+    if(input->num_handlers == LIGHT_INPUT_MAX_HANDLERS)
+    {
+        LIGHT_ERR("too many input handlers");
+        return false;
+    }
+
+    input->handlers[input->num_handlers].callback = callback;
+    input->handlers[input->num_handlers].userdata = userdata;
+    input->num_handlers++;
+
+    return true;
+}
+
@@ -0,0 +1,51 @@
+
+#pragma once
+
+#include "light.h"
+#include "loop.h"
+
+#include <linux/input.h>
+
+// Input devices for long-running modes
+// Reads the evdev devices in /dev/input (or the given paths, which may also be FIFOs fed with struct input_event for testing),
+// and hands every batch of events to the registered handlers
+
+#define LIGHT_INPUT_MAX_HANDLERS 4
+
+/* Called for every batch of events read from a device. `time_ns` is the CLOCK_MONOTONIC time of the last event in the batch. */
+typedef void (*LFUNCINPUTEVENTS)(struct input_event const *events, uint64_t num_events, uint64_t time_ns, void *userdata);
+
+typedef struct _light_input_device_t light_input_device_t;
+struct _light_input_device_t
+{
+    int         fd;
+    bool        monotonic; // The device stamps its events with CLOCK_MONOTONIC, otherwise they are stamped when read
+    uint64_t    pending; // Bytes of a partially read event, only happens with FIFOs
+    char        buffer[sizeof(struct input_event)];
+    struct _light_input_t *input;
+};
+
+typedef struct _light_input_t light_input_t;
+struct _light_input_t
+{
+    light_loop_t            *loop;
+    light_input_device_t    **devices;
+    uint64_t                num_devices;
+
+    struct
+    {
+        LFUNCINPUTEVENTS    callback;
+        void                *userdata;
+    } handlers[LIGHT_INPUT_MAX_HANDLERS];
+    uint64_t                num_handlers;
+};
+
+/* Opens the given input devices, or every /dev/input/event* if `num_paths` is 0, and watches them in `loop`. Returns NULL on failure. */
+light_input_t *light_input_create(light_loop_t *loop, char const * const *paths, uint64_t num_paths);
+
+/* Closes all devices and frees the input */
+void light_input_free(light_input_t *input);
+
+/* Registers a handler that is called for every batch of events */
+bool light_input_add_handler(light_input_t *input, LFUNCINPUTEVENTS callback, void *userdata);
+
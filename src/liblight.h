@@ -0,0 +1,53 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The public interface of liblight, for programs that drive backlights and leds without spawning the light binary.
+// Create a context once, resolve the targets once with light_find_device_target, then get and set them through the calls below,
+// which act on the target directly without enumerating anything again.
+//
+// The log level is kept per context and applied to the calling thread by every call, so one context can be used by several
+// threads at once, as long as every target is driven by a single thread at a time. Threads the context runs by itself (the
+// workers of ddc buses) read the level from the context before every transaction, so light_set_loglevel reaches them as well.
+
+struct _light_context_t;
+typedef struct _light_context_t light_context_t;
+
+struct _light_device_target_t;
+typedef struct _light_device_target_t light_device_target_t;
+
+/* Creates a context, with every device enumerated. Returns NULL on failure. */
+light_context_t* light_context_create(void);
+
+/* Frees the given context */
+void light_free(light_context_t*);
+
+/* Sets how much the calls on `ctx` log to stdout and stderr, 0 (nothing, the default) to 3 (notices) as with -v */
+void light_set_loglevel(light_context_t *ctx, int loglevel);
+
+/* Returns the found device target, or null. Name should be enumerator/device/target */
+light_device_target_t* light_find_device_target(light_context_t *ctx, char const * name);
+
+/* Reads the raw value of `target` */
+bool light_target_get(light_context_t *ctx, light_device_target_t *target, uint64_t *out_value);
+
+/* Reads the raw max value of `target` */
+bool light_target_get_max(light_context_t *ctx, light_device_target_t *target, uint64_t *out_value);
+
+/* Writes the raw value of `target`, clamped between its minimum cap and max value */
+bool light_target_set(light_context_t *ctx, light_device_target_t *target, uint64_t value);
+
+/* Adds to the raw value of `target`, up to its max value */
+bool light_target_add(light_context_t *ctx, light_device_target_t *target, uint64_t value);
+
+/* Subtracts from the raw value of `target`, down to its minimum cap */
+bool light_target_sub(light_context_t *ctx, light_device_target_t *target, uint64_t value);
+
+/* Reads the value of `target` as a percentage of its max value */
+bool light_target_get_percent(light_context_t *ctx, light_device_target_t *target, double *out_percent);
+
+/* Writes the value of `target` as a percentage of its max value, clamped as with light_target_set */
+bool light_target_set_percent(light_context_t *ctx, light_device_target_t *target, double percent);
+
@@ -6,6 +6,18 @@
 #include "impl/sysfs.h"
 #include "impl/util.h"
 #include "impl/razer.h"
+#include "impl/ddc.h"
+#include "impl/sim.h"
+#include "impl/replay.h"
+
+#include "effect.h"
+#include "color.h"
+#include "middleware.h"
+#include "trace.h"
+#include "probes.h"
+#include "stats.h"
+#include "loop.h"
+#include "clock.h"
 
 #include <stdlib.h> // malloc, free
 #include <string.h> // strstr
@@ -13,7 +25,11 @@
 #include <unistd.h>	// geteuid
 #include <sys/types.h> // geteuid
 #include <errno.h>
-#include <inttypes.h> // PRIu64
+#include <ctype.h> // isspace, isdigit
+#include <inttypes.h> // PRIu64, SCNu64
+#include <getopt.h> // getopt_long
+#include <math.h> // pow
+#include <sys/auxv.h> // getauxval
 
 /* Static helper functions for this file only, prefix with _ */
 
@@ -70,41 +86,66 @@ static void _light_add_device_target(light_device_t *device, light_device_target
     device->num_targets = new_num_targets;
 }
 
-static void _light_get_target_path(light_context_t* ctx, char* output_path, size_t output_size)
+static void _light_get_target_path(light_context_t* ctx, light_device_target_t *target, char* output_path, size_t output_size)
 {
     snprintf(output_path, output_size,
                 "%s/targets/%s/%s/%s",
                 ctx->sys_params.conf_dir,
-                ctx->run_params.device_target->device->enumerator->name,
-                ctx->run_params.device_target->device->name,
-                ctx->run_params.device_target->name
+                target->device->enumerator->name,
+                target->device->name,
+                target->name
             );
 }
 
-static void _light_get_target_file(light_context_t* ctx, char* output_path, size_t output_size, char const * file)
+static void _light_get_target_file(light_context_t* ctx, light_device_target_t *target, char* output_path, size_t output_size, char const * file)
 {
     snprintf(output_path, output_size,
                 "%s/targets/%s/%s/%s/%s",
                 ctx->sys_params.conf_dir,
-                ctx->run_params.device_target->device->enumerator->name,
-                ctx->run_params.device_target->device->name,
-                ctx->run_params.device_target->name,
+                target->device->enumerator->name,
+                target->device->name,
+                target->name,
                 file
             );
 }
 
-static uint64_t _light_get_min_cap(light_context_t *ctx)
+// Writes a setting of the profile given with --profile, to the file "<profile>-<setting>" of the target
+static bool _light_write_profile_file(light_context_t *ctx, char const *setting, uint64_t value)
 {
     char target_path[NAME_MAX];
-    _light_get_target_file(ctx, target_path, sizeof(target_path), "minimum");
-
-    uint64_t minimum_value = 0;
-    if(!light_file_read_uint64(target_path, &minimum_value))
+    _light_get_target_path(ctx, ctx->run_params.device_target, target_path, sizeof(target_path));
+    
+    int32_t rc = light_mkpath(target_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    if(rc && errno != EEXIST)
     {
-        return 0;
+        LIGHT_ERR("couldn't create target directory for profile");
+        return false;
     }
     
-    return minimum_value;
+    char file_name[NAME_MAX];
+    snprintf(file_name, sizeof(file_name), "%s-%s", ctx->run_params.profile, setting);
+    
+    char target_filepath[NAME_MAX];
+    _light_get_target_file(ctx, ctx->run_params.device_target, target_filepath, sizeof(target_filepath), file_name);
+    
+    if(!light_file_write_uint64(target_filepath, value))
+    {
+        LIGHT_ERR("couldn't write value to profile file");
+        return false;
+    }
+    
+    return true;
+}
+
+static bool _light_init_enumerator(light_device_enumerator_t *enumerator)
+{
+    enumerator->initialized = true;
+    
+    LIGHT_PROBE1(enumerate__start, enumerator->name);
+    bool enumerated = enumerator->init(enumerator);
+    LIGHT_PROBE3(enumerate__done, enumerator->name, enumerator->num_devices, enumerated);
+    
+    return enumerated;
 }
 
 static light_device_enumerator_t* _light_find_enumerator(light_context_t *ctx, char const *comp)
@@ -113,7 +154,14 @@ static light_device_enumerator_t* _light_find_enumerator(light_context_t *ctx, c
     {
         if(strncmp(comp, ctx->enumerators[e]->name, NAME_MAX) == 0)
         {
-            return ctx->enumerators[e];
+            // Enumerated on first use when the command line left it alone
+            light_device_enumerator_t *enumerator = ctx->enumerators[e];
+            if(!enumerator->initialized && !_light_init_enumerator(enumerator))
+            {
+                LIGHT_WARN("failed to initialize enumerator \"%s\"", enumerator->name);
+            }
+            
+            return enumerator;
         }
     }
     
@@ -146,7 +194,13 @@ static light_device_target_t* _light_find_target(light_device_t * dev, char cons
     return NULL;
 }
 
-static bool _light_raw_to_percent(light_device_target_t *target, uint64_t inraw, double *outpercent)
+// Exponent of the percentage scale of `target`, see conf.h
+static double _light_get_curve(light_device_target_t *target)
+{
+    return target->conf != NULL ? target->conf->curve : 1.0;
+}
+
+bool light_raw_to_percent(light_device_target_t *target, uint64_t inraw, double *outpercent)
 {
         double inraw_d = (double)inraw;
         uint64_t max_value = 0;
@@ -156,29 +210,18 @@ static bool _light_raw_to_percent(light_device_target_t *target, uint64_t inraw,
             return false;
         }
         double max_value_d = (double)max_value;
-        double percent = light_percent_clamp((inraw_d / max_value_d) * 100.0);
+        double fraction = max_value_d > 0.0 ? inraw_d / max_value_d : 0.0;
+        double curve = _light_get_curve(target);
+        if(curve != 1.0)
+        {
+            fraction = pow(fraction, 1.0 / curve);
+        }
+        double percent = light_percent_clamp(fraction * 100.0);
         *outpercent = percent;
         
         return true;
 }
 
-static bool _light_percent_to_raw(light_device_target_t *target, double inpercent, uint64_t *outraw)
-{
-    uint64_t max_value = 0;
-    if(!target->get_max_value(target, &max_value))
-    {
-        LIGHT_ERR("couldn't read from target");
-        return false;
-    }
-
-    double max_value_d = (double)max_value;
-    double target_value_d = max_value_d * (light_percent_clamp(inpercent) / 100.0);
-    uint64_t target_value = LIGHT_CLAMP((uint64_t)target_value_d, 0, max_value);
-    *outraw = target_value;
-    
-    return true;
-}
-
 static void _light_print_usage()
 {
     printf("Usage:\n"
@@ -189,8 +232,8 @@ static void _light_print_usage()
         "  -V          Show program version and exit\n"
         "  -L          List available devices\n"
         
-        "  -A          Increase brightness by value\n"
-        "  -U          Decrease brightness by value\n" 
+        "  -A          Increase brightness by value, or the step set in the configuration file\n"
+        "  -U          Decrease brightness by value, or the step set in the configuration file\n" 
         "  -T          Multiply brightness by value (can be a non-whole number, ignores raw mode)\n"
         "  -S          Set brightness to value\n"
         "  -G          Get brightness\n"
@@ -198,12 +241,32 @@ static void _light_print_usage()
         "  -P          Get minimum brightness\n"
         "  -O          Save the current brightness\n"
         "  -I          Restore the previously saved brightness\n"
+        "  -E          Run an effect: none, blink [on_ms] [off_ms], oneshot [on_ms] [off_ms],\n"
+        "              breathe [period_ms], ramp <percent> <ms> or table <percent>:<ms>|<percent>/<ms> ...\n"
+        "  -C          Set the color of a multicolor LED: #rrggbb[ww], r,g,b[,w], hsv:h,s,v or rainbow [period_ms]\n"
+        "  --stats     Summarize the timings of earlier runs recorded in the stats file, and the metrics\n"
+        "              of the daemon serving on the socket given with --metrics\n"
+        "\n"
+        "Daemon (keeps running until interrupted, any of these starts it):\n"
+        "  --idle SECONDS      Dim after SECONDS without input, restore on the next input\n"
+        "  --idle-level VALUE  Brightness to dim to (default 0, raised to the minimum brightness)\n"
+        "  --hotkeys STEP      Change brightness by STEP on brightness key presses, faster while held\n"
+        "  --power-profiles    Apply the ac or battery profile of every target when the power source changes\n"
+        "  --schedule FILE     Follow the time-of-day rules in FILE, see the manual\n"
+        "  --input PATH        Watch this input device instead of all /dev/input/event* (repeatable)\n"
+        "  --metrics PATH      Serve counters and latency histograms on the Unix socket PATH\n"
+        "  --timer-slack MS    Let timers other than fades fire up to MS late, so that wakeups coalesce\n"
+        "  --log-ring COUNT    Keep the last COUNT messages of any level in memory, printed on SIGUSR1\n"
+        "  --publish PATH      Send the changes of every target to the clients of the Unix socket PATH\n"
 
 
         "\n"
         "Options:\n"
         "  -r          Interpret input and output values in raw mode (ignored for -T)\n"
-        "  -s          Specify device target path to use, use -L to list available\n"
+        "  --profile   With -S and -N, store the value in the ac or battery profile instead of applying it\n"
+        "  -s          Specify device target path to use, use -L to list available,\n"
+        "              or an alias set in the configuration file.\n"
+        "              With -E and -C, \"enumerator/device/*\" selects all targets of a device\n"
         "  -v          Specify the verbosity level (default 0)\n"
         "                 0: Values only\n"
         "                 1: Values, Errors.\n"
@@ -219,6 +282,12 @@ static void _light_print_usage()
 
 static bool _light_set_context_command(light_context_t *ctx, LFUNCCOMMAND new_cmd)
 {
+    // Daemon options all set the same command
+    if(ctx->run_params.command == new_cmd)
+    {
+        return true;
+    }
+    
     if(ctx->run_params.command != NULL)
     {
         LIGHT_WARN("a command was already set. ignoring.");
@@ -229,6 +298,69 @@ static bool _light_set_context_command(light_context_t *ctx, LFUNCCOMMAND new_cm
     return true;
 }
 
+// Parses the value of an option as a raw or percent value for the current target, like the <value> of commands
+static bool _light_parse_option_value(light_context_t *ctx, char const *option, char const *str, uint64_t *out_value)
+{
+    if(ctx->run_params.raw_mode)
+    {
+        if(sscanf(str, "%" SCNu64, out_value) != 1)
+        {
+            fprintf(stderr, "%s argument is not an integer.\n\n", option);
+            return false;
+        }
+        
+        return true;
+    }
+    
+    double percent_value = 0.0;
+    if(sscanf(str, "%lf", &percent_value) != 1)
+    {
+        fprintf(stderr, "%s argument is not a decimal.\n\n", option);
+        return false;
+    }
+    
+    if(!light_percent_to_raw(ctx->run_params.device_target, light_percent_clamp(percent_value), out_value))
+    {
+        LIGHT_ERR("failed to convert from percent to raw for device target");
+        return false;
+    }
+    
+    return true;
+}
+
+// Long options that have no short equivalent
+enum
+{
+    LIGHT_OPT_IDLE = 256,
+    LIGHT_OPT_IDLE_LEVEL,
+    LIGHT_OPT_INPUT,
+    LIGHT_OPT_HOTKEYS,
+    LIGHT_OPT_PROFILE,
+    LIGHT_OPT_POWER_PROFILES,
+    LIGHT_OPT_SCHEDULE,
+    LIGHT_OPT_METRICS,
+    LIGHT_OPT_STATS,
+    LIGHT_OPT_TIMER_SLACK,
+    LIGHT_OPT_LOG_RING,
+    LIGHT_OPT_PUBLISH
+};
+
+static struct option const _light_long_options[] = {
+    {"idle",       required_argument, NULL, LIGHT_OPT_IDLE},
+    {"idle-level", required_argument, NULL, LIGHT_OPT_IDLE_LEVEL},
+    {"input",      required_argument, NULL, LIGHT_OPT_INPUT},
+    {"hotkeys",    required_argument, NULL, LIGHT_OPT_HOTKEYS},
+    {"profile",    required_argument, NULL, LIGHT_OPT_PROFILE},
+    {"power-profiles", no_argument,   NULL, LIGHT_OPT_POWER_PROFILES},
+    {"schedule",   required_argument, NULL, LIGHT_OPT_SCHEDULE},
+    {"metrics",    required_argument, NULL, LIGHT_OPT_METRICS},
+    {"stats",      no_argument,       NULL, LIGHT_OPT_STATS},
+    {"timer-slack", required_argument, NULL, LIGHT_OPT_TIMER_SLACK},
+    {"log-ring",   required_argument, NULL, LIGHT_OPT_LOG_RING},
+    {"publish",    required_argument, NULL, LIGHT_OPT_PUBLISH},
+    {NULL, 0, NULL, 0}
+};
+
 static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
 {
     int32_t curr_arg = -1;
@@ -237,11 +369,15 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
     char ctrl_name[NAME_MAX];
     bool need_value = false;
     bool need_float_value = false;
+    bool need_string_value = false;
     bool need_target = true; // default cmd is get brightness
     bool specified_target = false;
-    snprintf(ctrl_name, sizeof(ctrl_name), "%s", "sysfs/backlight/auto");
+    char const *idle_level = NULL;
+    char const *hotkey_step = NULL;
+    char const *default_target = light_conf_default_target(ctx->sys_params.conf);
+    snprintf(ctrl_name, sizeof(ctrl_name), "%s", default_target != NULL ? default_target : "sysfs/backlight/auto");
     
-    while((curr_arg = getopt(argc, argv, "HhVGSLMNPAUTOIv:s:r")) != -1)
+    while((curr_arg = getopt_long(argc, argv, "HhVGSLMNPAUTOIECv:s:r", _light_long_options, NULL)) != -1)
     {
         switch(curr_arg)
         {
@@ -262,7 +398,12 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
                     return false;
                 }
                 
-                light_loglevel = (light_loglevel_t)log_level;
+                if(log_level > LIGHT_LOG_MAX_LEVEL)
+                {
+                    fprintf(stderr, "This build of light leaves out the messages above level %d.\n", LIGHT_LOG_MAX_LEVEL);
+                }
+                
+                light_set_loglevel(ctx, log_level);
                 break;
             case 's':
                 snprintf(ctrl_name, sizeof(ctrl_name), "%s", optarg);
@@ -328,14 +469,159 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
                 _light_set_context_command(ctx, light_cmd_restore_brightness);
                 need_target = true;
                 break;
+            case 'E':
+                _light_set_context_command(ctx, light_cmd_run_effect);
+                need_target = true;
+                need_string_value = true;
+                break;
+            case 'C':
+                _light_set_context_command(ctx, light_cmd_set_color);
+                need_target = true;
+                need_string_value = true;
+                break;
+            
+            // Daemon features
+            case LIGHT_OPT_IDLE:
+            {
+                double idle_seconds = 0.0;
+                if(sscanf(optarg, "%lf", &idle_seconds) != 1 || idle_seconds <= 0.0)
+                {
+                    fprintf(stderr, "--idle argument must be a positive number of seconds.\n\n");
+                    _light_print_usage();
+                    return false;
+                }
+                
+                ctx->daemon_params.idle_timeout_ms = (uint64_t)(idle_seconds * 1000.0);
+                _light_set_context_command(ctx, light_cmd_run_daemon);
+                need_target = true;
+                break;
+            }
+            case LIGHT_OPT_IDLE_LEVEL:
+                idle_level = optarg;
+                break;
+            case LIGHT_OPT_INPUT:
+                if(ctx->daemon_params.num_input_paths == LIGHT_MAX_INPUT_PATHS)
+                {
+                    fprintf(stderr, "at most %d --input devices can be given.\n\n", LIGHT_MAX_INPUT_PATHS);
+                    return false;
+                }
+                
+                ctx->daemon_params.input_paths[ctx->daemon_params.num_input_paths++] = optarg;
+                break;
+            case LIGHT_OPT_PROFILE:
+                if(strcmp(optarg, "ac") != 0 && strcmp(optarg, "battery") != 0)
+                {
+                    fprintf(stderr, "--profile argument must be ac or battery.\n\n");
+                    _light_print_usage();
+                    return false;
+                }
+                
+                ctx->run_params.profile = optarg;
+                break;
+            case LIGHT_OPT_POWER_PROFILES:
+                ctx->daemon_params.power_profiles = true;
+                _light_set_context_command(ctx, light_cmd_run_daemon);
+                need_target = true;
+                break;
+            case LIGHT_OPT_SCHEDULE:
+                ctx->daemon_params.schedule_path = optarg;
+                _light_set_context_command(ctx, light_cmd_run_daemon);
+                need_target = true;
+                break;
+            case LIGHT_OPT_HOTKEYS:
+                hotkey_step = optarg;
+                ctx->daemon_params.hotkeys = true;
+                _light_set_context_command(ctx, light_cmd_run_daemon);
+                need_target = true;
+                break;
+            case LIGHT_OPT_METRICS:
+                // Names the socket of a daemon for --stats too, the daemon is only started once no other command was given
+                if(getuid() != geteuid())
+                {
+                    fprintf(stderr, "--metrics is not available in SUID mode.\n\n");
+                    return false;
+                }
+                
+                ctx->daemon_params.metrics_path = optarg;
+                break;
+            case LIGHT_OPT_TIMER_SLACK:
+                if(sscanf(optarg, "%" SCNu64, &ctx->daemon_params.timer_slack_ms) != 1)
+                {
+                    fprintf(stderr, "--timer-slack argument must be a number of milliseconds.\n\n");
+                    _light_print_usage();
+                    return false;
+                }
+                break;
+            case LIGHT_OPT_LOG_RING:
+                if(sscanf(optarg, "%" SCNu64, &ctx->daemon_params.log_ring_entries) != 1 || ctx->daemon_params.log_ring_entries == 0)
+                {
+                    fprintf(stderr, "--log-ring argument must be a number of messages.\n\n");
+                    _light_print_usage();
+                    return false;
+                }
+                break;
+            case LIGHT_OPT_PUBLISH:
+                if(getuid() != geteuid())
+                {
+                    fprintf(stderr, "--publish is not available in SUID mode.\n\n");
+                    return false;
+                }
+                
+                ctx->daemon_params.publish_path = optarg;
+                _light_set_context_command(ctx, light_cmd_run_daemon);
+                need_target = true;
+                break;
+            case LIGHT_OPT_STATS:
+                _light_set_context_command(ctx, light_cmd_print_stats);
+                need_target = false;
+                break;
         }
     }
 
+    if(ctx->run_params.command == NULL && ctx->daemon_params.metrics_path != NULL)
+    {
+        _light_set_context_command(ctx, light_cmd_run_daemon);
+        need_target = true;
+    }
+    
     if(ctx->run_params.command == NULL)
     {
         _light_set_context_command(ctx, light_cmd_get_brightness);
     }
     
+    // The configuration file was loaded before -v was parsed: if it was ignored, load it again so that the reason is reported
+    if(ctx->sys_params.conf == NULL && light_loglevel >= LIGHT_ERROR_LEVEL)
+    {
+        light_conf_free(light_conf_load(ctx->sys_params.conf_dir));
+    }
+    
+    // Effects and colors can apply to all the targets of a device at once, given as "enumerator/device/*"
+    size_t ctrl_name_length = strlen(ctrl_name);
+    bool allow_all_targets = ctx->run_params.command == light_cmd_run_effect || ctx->run_params.command == light_cmd_set_color;
+    if(allow_all_targets && ctrl_name_length > 2 && strcmp(ctrl_name + ctrl_name_length - 2, "/*") == 0)
+    {
+        light_device_t *device = NULL;
+        light_target_path_t wildcard_path;
+        if(light_split_target_path(ctrl_name, &wildcard_path))
+        {
+            light_device_enumerator_t *enumerator = _light_find_enumerator(ctx, wildcard_path.enumerator);
+            if(enumerator != NULL)
+            {
+                device = _light_find_device(enumerator, wildcard_path.device);
+            }
+        }
+        
+        if(device == NULL || device->num_targets == 0)
+        {
+            fprintf(stderr, "We couldn't find any device targets at the path \"%s\". Use -L to find one.\n\n", ctrl_name);
+            return false;
+        }
+        
+        ctx->run_params.device_target = device->targets[0];
+        ctx->run_params.all_targets = true;
+        need_target = false;
+    }
+    
     if(need_target)
     {
         light_device_target_t *curr_target = light_find_device_target(ctx, ctrl_name);
@@ -356,9 +642,23 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
         ctx->run_params.device_target = curr_target;
     }
 
-    if(need_value || need_float_value)
+    // -A and -U without a value step by the step set in the configuration file
+    char step_value[64];
+    char const *value_arg = argv[optind];
+    int32_t num_value_args = 1;
+    bool is_step = ctx->run_params.command == light_cmd_add_brightness || ctx->run_params.command == light_cmd_sub_brightness;
+    light_conf_target_t const *target_conf = ctx->run_params.device_target != NULL ? ctx->run_params.device_target->conf : NULL;
+    if(is_step && argc == optind && target_conf != NULL && (target_conf->step.flags & LIGHT_CONF_SET))
+    {
+        ctx->run_params.raw_mode = (target_conf->step.flags & LIGHT_CONF_RAW) != 0;
+        snprintf(step_value, sizeof(step_value), ctx->run_params.raw_mode ? "%.0f" : "%f", target_conf->step.value);
+        value_arg = step_value;
+        num_value_args = 0;
+    }
+
+    if(need_value || need_float_value || need_string_value)
     {
-        if( (argc - optind) != 1)
+        if( (argc - optind) != num_value_args)
         {
             fprintf(stderr, "please specify a <value> for this command.\n\n");
             _light_print_usage();
@@ -370,7 +670,7 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
     {
         if(ctx->run_params.raw_mode)
         {
-            if(sscanf(argv[optind], "%lu", &ctx->run_params.value) != 1)
+            if(sscanf(value_arg, "%" SCNu64, &ctx->run_params.value) != 1)
             {
                 fprintf(stderr, "<value> is not an integer.\n\n");
                 _light_print_usage();
@@ -380,7 +680,7 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
         else
         {
             double percent_value = 0.0;
-            if(sscanf(argv[optind], "%lf", &percent_value) != 1)
+            if(sscanf(value_arg, "%lf", &percent_value) != 1)
             {
                 fprintf(stderr, "<value> is not a decimal.\n\n");
                 _light_print_usage();
@@ -389,8 +689,11 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
             
             percent_value = light_percent_clamp(percent_value);
             
+            // -A and -U add percentages as such on a curved scale, see light_cmd_add_brightness
+            ctx->run_params.float_value = (float)percent_value;
+            
             uint64_t raw_value = 0;
-            if(!_light_percent_to_raw(ctx->run_params.device_target, percent_value, &raw_value))
+            if(!light_percent_to_raw(ctx->run_params.device_target, percent_value, &raw_value))
             {
                 LIGHT_ERR("failed to convert from percent to raw for device target");
                 return false;
@@ -402,7 +705,7 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
 
     if(need_float_value)
     {
-        if(sscanf(argv[optind], "%f", &ctx->run_params.float_value) != 1)
+        if(sscanf(value_arg, "%f", &ctx->run_params.float_value) != 1)
         {
             fprintf(stderr, "<value> is not a float.\n\n");
             _light_print_usage();
@@ -410,6 +713,23 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
         }
     }
 
+    if(need_string_value)
+    {
+        ctx->run_params.string_value = value_arg;
+    }
+    
+    // Values of daemon options are converted like command values, once the target is known
+    bool is_daemon = ctx->run_params.command == light_cmd_run_daemon;
+    if(is_daemon && idle_level != NULL && !_light_parse_option_value(ctx, "--idle-level", idle_level, &ctx->daemon_params.idle_value))
+    {
+        return false;
+    }
+    
+    if(is_daemon && hotkey_step != NULL && !_light_parse_option_value(ctx, "--hotkeys", hotkey_step, &ctx->daemon_params.hotkey_step))
+    {
+        return false;
+    }
+
     return true;
     
 }
@@ -419,7 +739,9 @@ static bool _light_parse_arguments(light_context_t *ctx, int argc, char** argv)
 
 /* API function definitions */
 
-light_context_t* light_initialize(int argc, char **argv)
+// Creates a context, for root if `is_root`. Only enumerates devices up front with `enumerate`, otherwise each enumerator
+// scans for its devices the first time a target path names it.
+static light_context_t* _light_context_create(bool is_root, bool enumerate)
 {
     light_context_t *new_ctx = malloc(sizeof(light_context_t));
 
@@ -429,27 +751,32 @@ light_context_t* light_initialize(int argc, char **argv)
     new_ctx->run_params.command = NULL;
     new_ctx->run_params.device_target = NULL;
     new_ctx->run_params.value = 0;
+    new_ctx->run_params.string_value = NULL;
     new_ctx->run_params.raw_mode = false;
-
-    uid_t uid = getuid();
-    uid_t euid = geteuid();
-    gid_t egid = getegid();
-    // If the real user ID is different from the effective user ID (SUID mode)
-    // and if we have the effective user ID of root (0)
-    // and if the effective group ID is different from root (0),
-    // then make sure to set the effective group ID to root (0).
-    if((uid != euid) && (euid == 0) && (egid != 0))
-    {
-        if(setegid(euid) < 0)
-        {
-            LIGHT_ERR("could not change egid from %u to %u (uid: %u, euid: %u)", egid, euid, uid, euid);
-            return false;
-        }
-    }
+    new_ctx->run_params.all_targets = false;
+    new_ctx->run_params.profile = NULL;
+    new_ctx->animator = NULL;
+    new_ctx->loglevel = light_loglevel;
+    new_ctx->sys_params.start_ns = 0;
+    new_ctx->sys_params.enumerated_ns = 0;
+    new_ctx->sys_params.parsed_ns = 0;
+    new_ctx->daemon_params.idle_timeout_ms = 0;
+    new_ctx->daemon_params.idle_value = 0;
+    new_ctx->daemon_params.hotkeys = false;
+    new_ctx->daemon_params.hotkey_step = 0;
+    new_ctx->daemon_params.power_profiles = false;
+    new_ctx->daemon_params.schedule_path = NULL;
+    new_ctx->daemon_params.num_input_paths = 0;
+    new_ctx->daemon_params.metrics_path = NULL;
+    new_ctx->daemon_params.publish_path = NULL;
+    new_ctx->daemon_params.timer_slack_ms = 0;
+    new_ctx->daemon_params.log_ring_entries = 0;
+    new_ctx->sys_params.conf = NULL;
 
     // Setup the configuration folder
     // If we are root, use the system-wide configuration folder, otherwise try to find a user-specific folder, or fall back to ~/.config
-    if(euid == 0)
+    // It is only created by the commands that write to it (light_mkpath of a target folder), reading commands don't touch it
+    if(is_root)
     {
         snprintf(new_ctx->sys_params.conf_dir, sizeof(new_ctx->sys_params.conf_dir), "%s", "/etc/light");
     }
@@ -467,28 +794,90 @@ light_context_t* light_initialize(int argc, char **argv)
         }
     }
     
-    // Make sure the configuration folder exists, otherwise attempt to create it
-    int32_t rc = light_mkpath(new_ctx->sys_params.conf_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    if(rc && errno != EEXIST)
+    // Targets pick their settings up as the enumerators create them
+    new_ctx->sys_params.conf = light_conf_load(new_ctx->sys_params.conf_dir);
+    
+    // Before anything looks at the time. Not honored in SUID mode either, where it would hold timers back.
+    char const *clock_spec = secure_getenv("LIGHT_VIRTUAL_CLOCK");
+    if(clock_spec != NULL && !light_clock_set_virtual(clock_spec))
     {
-        LIGHT_WARN("couldn't create configuration directory");
-        return false;
+        light_conf_free(new_ctx->sys_params.conf);
+        free(new_ctx);
+        return NULL;
     }
     
+    // Recording has to start before the enumerators scan for devices. Not honored in SUID mode, where it would write anywhere.
+    char const *trace_path = secure_getenv("LIGHT_TRACE");
+    new_ctx->sys_params.tracing = trace_path != NULL && light_trace_start(trace_path);
+    
     // Create the built-in enumerators
     light_create_enumerator(new_ctx, "sysfs", &impl_sysfs_init, &impl_sysfs_free);
     light_create_enumerator(new_ctx, "util", &impl_util_init, &impl_util_free);
     light_create_enumerator(new_ctx, "razer", &impl_razer_init, &impl_razer_free);
+    light_create_enumerator(new_ctx, "ddc", &impl_ddc_init, &impl_ddc_free);
+    light_create_enumerator(new_ctx, "sim", &impl_sim_init, &impl_sim_free);
+    light_create_enumerator(new_ctx, "replay", &impl_replay_init, &impl_replay_free);
 
     // This is where we would create enumerators from plugins as well
     // 1. Run the plugins get_name() function to get its name
     // 2. Point to the plugins init() and free() functions when creating the enumerator
 
     // initialize all enumerators, this will create all the devices and their targets
-    if(!light_init_enumerators(new_ctx))
+    if(enumerate && !light_init_enumerators(new_ctx))
     {
         LIGHT_WARN("failed to initialize all enumerators");
     }
+    
+    return new_ctx;
+}
+
+light_context_t* light_context_create(void)
+{
+    return _light_context_create(geteuid() == 0, true);
+}
+
+void light_set_loglevel(light_context_t *ctx, int loglevel)
+{
+    // Read by the background threads of the context as well, see light_apply_loglevel
+    __atomic_store_n(&ctx->loglevel, loglevel, __ATOMIC_RELAXED);
+    light_loglevel = (light_loglevel_t)loglevel;
+}
+
+void light_apply_loglevel(light_context_t *ctx)
+{
+    light_loglevel = (light_loglevel_t)__atomic_load_n(&ctx->loglevel, __ATOMIC_RELAXED);
+}
+
+light_context_t* light_initialize(int argc, char **argv)
+{
+    uint64_t start_ns = light_loop_now_ns();
+    
+    // As the process was started, which is all that matters here, without a syscall for each
+    uid_t uid = (uid_t)getauxval(AT_UID);
+    uid_t euid = (uid_t)getauxval(AT_EUID);
+    gid_t egid = (gid_t)getauxval(AT_EGID);
+    // If the real user ID is different from the effective user ID (SUID mode)
+    // and if we have the effective user ID of root (0)
+    // and if the effective group ID is different from root (0),
+    // then make sure to set the effective group ID to root (0).
+    if((uid != euid) && (euid == 0) && (egid != 0))
+    {
+        if(setegid(euid) < 0)
+        {
+            LIGHT_ERR("could not change egid from %u to %u (uid: %u, euid: %u)", egid, euid, uid, euid);
+            return NULL;
+        }
+    }
+
+    // A command acts on one target, whose enumerator is the only one it has to scan
+    light_context_t *new_ctx = _light_context_create(euid == 0, false);
+    if(new_ctx == NULL)
+    {
+        return NULL;
+    }
+    
+    new_ctx->sys_params.start_ns = start_ns;
+    new_ctx->sys_params.enumerated_ns = light_loop_now_ns();
 
     // Parse arguments
     if(!_light_parse_arguments(new_ctx, argc, argv))
@@ -497,6 +886,8 @@ light_context_t* light_initialize(int argc, char **argv)
         return NULL;
     }
     
+    new_ctx->sys_params.parsed_ns = light_loop_now_ns();
+    
     return new_ctx;
 }
 
@@ -508,16 +899,33 @@ bool light_execute(light_context_t *ctx)
         return false;
     }
     
-    return ctx->run_params.command(ctx);
+    LIGHT_PROBE2(command__start, (uintptr_t)ctx->run_params.command, ctx->run_params.device_target != NULL ? ctx->run_params.device_target->name : NULL);
+    bool success = ctx->run_params.command(ctx);
+    LIGHT_PROBE2(command__done, (uintptr_t)ctx->run_params.command, success);
+    
+    light_stats_record(ctx, light_loop_now_ns());
+    
+    return success;
 }
 
 void light_free(light_context_t *ctx)
 {
+    if(ctx->animator != NULL)
+    {
+        light_animator_free(ctx->animator);
+    }
+    
     if(!light_free_enumerators(ctx))
     {
         LIGHT_WARN("failed to free all enumerators");
     }
     
+    if(ctx->sys_params.tracing)
+    {
+        light_trace_stop();
+    }
+    
+    light_conf_free(ctx->sys_params.conf);
     free(ctx);
 }
 
@@ -541,6 +949,8 @@ light_device_enumerator_t * light_create_enumerator(light_context_t *ctx, char c
     returner->num_devices = 0;
     returner->init = init_func;
     returner->free = free_func;
+    returner->context = ctx;
+    returner->initialized = false;
     snprintf(returner->name, sizeof(returner->name), "%s", name);
     
     // Free the old enumerator array, if needed
@@ -563,7 +973,7 @@ bool light_init_enumerators(light_context_t *ctx)
     for(uint64_t i = 0; i < ctx->num_enumerators; i++)
     {
         light_device_enumerator_t * curr_enumerator = ctx->enumerators[i];
-        if(!curr_enumerator->init(curr_enumerator))
+        if(!curr_enumerator->initialized && !_light_init_enumerator(curr_enumerator))
         {
             success = false;
         }
@@ -636,8 +1046,14 @@ bool light_split_target_path(char const *in_path, light_target_path_t *out_path)
     return true;
 }
 
-light_device_target_t* light_find_device_target(light_context_t *ctx, char const * name)
+static light_device_target_t* _light_resolve_target(light_context_t *ctx, char const * name)
 {
+    char const *alias_path = light_conf_alias(ctx->sys_params.conf, name);
+    if(alias_path != NULL)
+    {
+        name = alias_path;
+    }
+    
     light_target_path_t new_path;
     if(!light_split_target_path(name, &new_path))
     {
@@ -679,24 +1095,126 @@ light_device_target_t* light_find_device_target(light_context_t *ctx, char const
     return target;
 }
 
-bool light_cmd_print_help(light_context_t *ctx)
+light_device_target_t* light_find_device_target(light_context_t *ctx, char const * name)
 {
-    _light_print_usage();
+    light_apply_loglevel(ctx);
+    
+    LIGHT_PROBE1(resolve__start, name);
+    light_device_target_t *target = _light_resolve_target(ctx, name);
+    LIGHT_PROBE2(resolve__done, name, target);
+    
+    return target;
+}
+
+bool light_target_get(light_context_t *ctx, light_device_target_t *target, uint64_t *out_value)
+{
+    light_apply_loglevel(ctx);
+    
+    if(!target->get_value(target, out_value))
+    {
+        LIGHT_ERR("failed to read from target");
+        return false;
+    }
+    
     return true;
 }
 
-bool light_cmd_print_version(light_context_t *ctx)
+bool light_target_get_max(light_context_t *ctx, light_device_target_t *target, uint64_t *out_value)
 {
-    printf("v%s\n", VERSION);
+    light_apply_loglevel(ctx);
+    
+    if(!target->get_max_value(target, out_value))
+    {
+        LIGHT_ERR("failed to read from target");
+        return false;
+    }
+    
     return true;
 }
 
-bool light_cmd_list_devices(light_context_t *ctx)
+bool light_target_set(light_context_t *ctx, light_device_target_t *target, uint64_t value)
 {
-    printf("Listing device targets:\n");
-    for(uint64_t enumerator = 0; enumerator < ctx->num_enumerators; enumerator++)
+    light_apply_loglevel(ctx);
+    
+    // Clamped to the minimum cap and max value by the middleware
+    if(!target->set_value(target, value))
     {
-        light_device_enumerator_t *curr_enumerator = ctx->enumerators[enumerator];
+        LIGHT_ERR("failed to write to target");
+        return false;
+    }
+    
+    return true;
+}
+
+bool light_target_add(light_context_t *ctx, light_device_target_t *target, uint64_t value)
+{
+    uint64_t curr_value = 0;
+    if(!light_target_get(ctx, target, &curr_value))
+    {
+        return false;
+    }
+    
+    return light_target_set(ctx, target, curr_value + value);
+}
+
+bool light_target_sub(light_context_t *ctx, light_device_target_t *target, uint64_t value)
+{
+    uint64_t curr_value = 0;
+    if(!light_target_get(ctx, target, &curr_value))
+    {
+        return false;
+    }
+    
+    return light_target_set(ctx, target, curr_value > value ? curr_value - value : 0);
+}
+
+bool light_target_get_percent(light_context_t *ctx, light_device_target_t *target, double *out_percent)
+{
+    uint64_t value = 0;
+    if(!light_target_get(ctx, target, &value))
+    {
+        return false;
+    }
+    
+    return light_raw_to_percent(target, value, out_percent);
+}
+
+bool light_target_set_percent(light_context_t *ctx, light_device_target_t *target, double percent)
+{
+    light_apply_loglevel(ctx);
+    
+    uint64_t value = 0;
+    if(!light_percent_to_raw(target, percent, &value))
+    {
+        return false;
+    }
+    
+    return light_target_set(ctx, target, value);
+}
+
+bool light_cmd_print_help(light_context_t *ctx)
+{
+    _light_print_usage();
+    return true;
+}
+
+bool light_cmd_print_version(light_context_t *ctx)
+{
+    printf("v%s\n", VERSION);
+    return true;
+}
+
+bool light_cmd_list_devices(light_context_t *ctx)
+{
+    if(!light_init_enumerators(ctx))
+    {
+        LIGHT_WARN("failed to initialize all enumerators");
+    }
+    
+    printf("Listing device targets:\n");
+    for(uint64_t enumerator = 0; enumerator < ctx->num_enumerators; enumerator++)
+    {
+        light_device_enumerator_t *curr_enumerator = ctx->enumerators[enumerator];
         for(uint64_t device = 0; device < curr_enumerator->num_devices; device++)
         {
             light_device_t *curr_device = curr_enumerator->devices[device];
@@ -721,21 +1239,13 @@ bool light_cmd_set_brightness(light_context_t *ctx)
         return false;
     }
     
-    
-    uint64_t mincap = _light_get_min_cap(ctx);
-    uint64_t value = ctx->run_params.value;
-    if(mincap > value)
+    // With --profile, the value is stored for when the profile is applied
+    if(ctx->run_params.profile != NULL)
     {
-        value = mincap;
+        return _light_write_profile_file(ctx, "brightness", ctx->run_params.value);
     }
     
-    if(!target->set_value(target, value))
-    {
-        LIGHT_ERR("failed to write to target");
-        return false;
-    }
-    
-    return true;
+    return light_target_set(ctx, target, ctx->run_params.value);
 }
 
 bool light_cmd_get_brightness(light_context_t *ctx)
@@ -761,7 +1271,7 @@ bool light_cmd_get_brightness(light_context_t *ctx)
     else 
     {
         double percent = 0.0;
-        if(!_light_raw_to_percent(target, value, &percent))
+        if(!light_raw_to_percent(target, value, &percent))
         {
             LIGHT_ERR("failed to convert from raw to percent from device target");
             return false;
@@ -800,21 +1310,18 @@ bool light_cmd_get_max_brightness(light_context_t *ctx)
 
 bool light_cmd_set_min_brightness(light_context_t *ctx)
 {
-    char target_path[NAME_MAX];
-    _light_get_target_path(ctx, target_path, sizeof(target_path));
-    
-    // Make sure the target folder exists, otherwise attempt to create it
-    int32_t rc = light_mkpath(target_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    if(rc && errno != EEXIST)
+    if(ctx->run_params.profile != NULL)
     {
-        LIGHT_ERR("couldn't create target directory for minimum brightness");
-        return false;
+        return _light_write_profile_file(ctx, "minimum", ctx->run_params.value);
     }
     
-    char target_filepath[NAME_MAX];
-    _light_get_target_file(ctx, target_filepath, sizeof(target_filepath), "minimum");
+    light_conf_target_t const *target_conf = ctx->run_params.device_target->conf;
+    if(target_conf != NULL && (target_conf->min.flags & LIGHT_CONF_SET))
+    {
+        LIGHT_WARN("the minimum brightness of this target is set in %s/%s, which takes precedence", ctx->sys_params.conf_dir, LIGHT_CONF_FILE);
+    }
     
-    if(!light_file_write_uint64(target_filepath, ctx->run_params.value))
+    if(!light_write_target_setting(ctx, ctx->run_params.device_target, "minimum", ctx->run_params.value))
     {
         LIGHT_ERR("couldn't write value to minimum file");
         return false;
@@ -826,10 +1333,15 @@ bool light_cmd_set_min_brightness(light_context_t *ctx)
 bool light_cmd_get_min_brightness(light_context_t *ctx)
 {
     char target_path[NAME_MAX];
-    _light_get_target_file(ctx, target_path, sizeof(target_path), "minimum");
+    _light_get_target_file(ctx, ctx->run_params.device_target, target_path, sizeof(target_path), "minimum");
 
     uint64_t minimum_value = 0;
-    if(!light_file_read_uint64(target_path, &minimum_value))
+    light_conf_target_t const *target_conf = ctx->run_params.device_target->conf;
+    if(target_conf != NULL && (target_conf->min.flags & LIGHT_CONF_SET))
+    {
+        minimum_value = light_get_min_cap(ctx, ctx->run_params.device_target);
+    }
+    else if(!light_file_read_uint64(target_path, &minimum_value))
     {
         if(ctx->run_params.raw_mode)
         {
@@ -850,7 +1362,7 @@ bool light_cmd_get_min_brightness(light_context_t *ctx)
     else 
     {
         double minimum_d = 0.0;
-        if(!_light_raw_to_percent(ctx->run_params.device_target, minimum_value, &minimum_d))
+        if(!light_raw_to_percent(ctx->run_params.device_target, minimum_value, &minimum_d))
         {
             LIGHT_ERR("failed to convert value from raw to percent for device target");
             return false;
@@ -871,41 +1383,14 @@ bool light_cmd_add_brightness(light_context_t *ctx)
         return false;
     }
     
-    uint64_t value = 0;
-    if(!target->get_value(target, &value))
-    {
-        LIGHT_ERR("failed to read from target");
-        return false;
-    }
-    
-    uint64_t max_value = 0;
-    if(!target->get_max_value(target, &max_value))
-    {
-        LIGHT_ERR("failed to read from target");
-        return false;
-    }
-    
-    value += ctx->run_params.value;
-    
-    uint64_t mincap = _light_get_min_cap(ctx);
-    if(mincap > value)
+    // On a curved scale the same raw step is a different percentage at every level, so add the percentage itself
+    if(!ctx->run_params.raw_mode && _light_get_curve(target) != 1.0)
     {
-        value = mincap;
-    }
-    
-    
-    if(value > max_value)
-    {
-        value = max_value;
-    }
-    
-    if(!target->set_value(target, value))
-    {
-        LIGHT_ERR("failed to write to target");
-        return false;
+        double percent = 0.0;
+        return light_target_get_percent(ctx, target, &percent) && light_target_set_percent(ctx, target, percent + ctx->run_params.float_value);
     }
     
-    return true;
+    return light_target_add(ctx, target, ctx->run_params.value);
 }
 
 bool light_cmd_sub_brightness(light_context_t *ctx)
@@ -917,35 +1402,13 @@ bool light_cmd_sub_brightness(light_context_t *ctx)
         return false;
     }
     
-    uint64_t value = 0;
-    if(!target->get_value(target, &value))
+    if(!ctx->run_params.raw_mode && _light_get_curve(target) != 1.0)
     {
-        LIGHT_ERR("failed to read from target");
-        return false;
-    }
-    
-    if(value > ctx->run_params.value)
-    {
-        value -= ctx->run_params.value;
-    }
-    else 
-    {
-        value = 0;
-    }
-    
-    uint64_t mincap = _light_get_min_cap(ctx);
-    if(mincap > value)
-    {
-        value = mincap;
-    }
-
-    if(!target->set_value(target, value))
-    {
-        LIGHT_ERR("failed to write to target");
-        return false;
+        double percent = 0.0;
+        return light_target_get_percent(ctx, target, &percent) && light_target_set_percent(ctx, target, percent - ctx->run_params.float_value);
     }
     
-    return true;
+    return light_target_sub(ctx, target, ctx->run_params.value);
 }
 
 bool light_cmd_mul_brightness(light_context_t *ctx)
@@ -964,13 +1427,6 @@ bool light_cmd_mul_brightness(light_context_t *ctx)
         return false;
     }
 
-    uint64_t max_value = 0;
-    if(!target->get_max_value(target, &max_value))
-    {
-        LIGHT_ERR("failed to read from target");
-        return false;
-    }
-
     uint64_t old_value = value;
     value *= ctx->run_params.float_value;
  
@@ -983,17 +1439,7 @@ bool light_cmd_mul_brightness(light_context_t *ctx)
             value--;
     }
 
-    uint64_t mincap = _light_get_min_cap(ctx);
-    if(mincap > value)
-    {
-        value = mincap;
-    }
-
-    if(value > max_value)
-    {
-        value = max_value;
-    }
-
+    // Clamped to the minimum cap and max value by the middleware
     if(!target->set_value(target, value))
     {
         LIGHT_ERR("failed to write to target");
@@ -1006,7 +1452,7 @@ bool light_cmd_mul_brightness(light_context_t *ctx)
 bool light_cmd_save_brightness(light_context_t *ctx)
 {
     char target_path[NAME_MAX];
-    _light_get_target_path(ctx, target_path, sizeof(target_path));
+    _light_get_target_path(ctx, ctx->run_params.device_target, target_path, sizeof(target_path));
     
     // Make sure the target folder exists, otherwise attempt to create it
     int32_t rc = light_mkpath(target_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
@@ -1017,7 +1463,7 @@ bool light_cmd_save_brightness(light_context_t *ctx)
     }
     
     char target_filepath[NAME_MAX];
-    _light_get_target_file(ctx, target_filepath, sizeof(target_filepath), "save");
+    _light_get_target_file(ctx, ctx->run_params.device_target, target_filepath, sizeof(target_filepath), "save");
 
     uint64_t curr_value = 0;
     if(!ctx->run_params.device_target->get_value(ctx->run_params.device_target, &curr_value))
@@ -1038,7 +1484,7 @@ bool light_cmd_save_brightness(light_context_t *ctx)
 bool light_cmd_restore_brightness(light_context_t *ctx)
 {
     char target_path[NAME_MAX];
-    _light_get_target_file(ctx, target_path, sizeof(target_path), "save");
+    _light_get_target_file(ctx, ctx->run_params.device_target, target_path, sizeof(target_path), "save");
 
     uint64_t saved_value = 0;
     if(!light_file_read_uint64(target_path, &saved_value))
@@ -1047,21 +1493,275 @@ bool light_cmd_restore_brightness(light_context_t *ctx)
         return false;
     }
     
-    uint64_t mincap = _light_get_min_cap(ctx);
-    if(mincap > saved_value)
+    if(!ctx->run_params.device_target->set_value(ctx->run_params.device_target, saved_value))
     {
-        saved_value = mincap;
+        LIGHT_ERR("couldn't write saved value to device target");
+        return false;
     }
     
-    if(!ctx->run_params.device_target->set_value(ctx->run_params.device_target, saved_value))
+    return true;
+}
+
+bool light_cmd_run_effect(light_context_t *ctx)
+{
+    light_device_target_t *target = ctx->run_params.device_target;
+    if(target == NULL)
     {
-        LIGHT_ERR("couldn't write saved value to device target");
+        LIGHT_ERR("didn't have a valid target, programmer mistake");
         return false;
     }
     
+    light_device_t *device = target->device;
+    uint64_t num_targets = ctx->run_params.all_targets ? device->num_targets : 1;
+    
+    // Effects are custom commands, so that the enumerator can offload them to the hardware when possible.
+    // Targets that can't run them by themselves hand them to the animator, which drives all of them at once below.
+    for(uint64_t t = 0; t < num_targets; t++)
+    {
+        light_device_target_t *curr_target = ctx->run_params.all_targets ? device->targets[t] : target;
+        if(!curr_target->custom_command(curr_target, ctx->run_params.string_value))
+        {
+            LIGHT_ERR("failed to run effect on target %s", curr_target->name);
+            return false;
+        }
+    }
+    
+    return light_effect_wait(ctx);
+}
+
+// Parses "rainbow", optionally followed by its period in milliseconds. Returns false for anything else, including "rainbowish".
+static bool _light_parse_rainbow(char const *string, uint64_t *period_ms)
+{
+    if(strncmp(string, "rainbow", 7) != 0)
+    {
+        return false;
+    }
+    
+    char const *period_string = string + 7;
+    if(*period_string == '\0')
+    {
+        return true;
+    }
+    
+    if(!isspace((unsigned char)*period_string))
+    {
+        return false;
+    }
+    
+    while(isspace((unsigned char)*period_string))
+    {
+        period_string++;
+    }
+    
+    // strtoull would take a sign, and wrap negative numbers around
+    if(!isdigit((unsigned char)*period_string))
+    {
+        return false;
+    }
+    
+    char *end = NULL;
+    errno = 0;
+    unsigned long long period = strtoull(period_string, &end, 10);
+    if(errno != 0 || *end != '\0' || period == 0)
+    {
+        return false;
+    }
+    
+    *period_ms = period;
     return true;
 }
 
+bool light_cmd_set_color(light_context_t *ctx)
+{
+    light_device_target_t *target = ctx->run_params.device_target;
+    if(target == NULL)
+    {
+        LIGHT_ERR("didn't have a valid target, programmer mistake");
+        return false;
+    }
+    
+    light_device_t *device = target->device;
+    light_device_target_t **targets = ctx->run_params.all_targets ? device->targets : &ctx->run_params.device_target;
+    uint64_t num_targets = ctx->run_params.all_targets ? device->num_targets : 1;
+    char const *color_string = ctx->run_params.string_value;
+    
+    // A rainbow spreads the hues over all the targets, and keeps rotating them
+    uint64_t period_ms = 5000;
+    if(_light_parse_rainbow(color_string, &period_ms))
+    {
+        if(!light_color_run_rainbow(ctx, targets, num_targets, period_ms))
+        {
+            LIGHT_ERR("failed to start rainbow");
+            return false;
+        }
+        
+        return light_effect_wait(ctx);
+    }
+    
+    // Validate the color once, and normalize it so that every target parses the same form
+    light_rgb_t color;
+    if(!light_color_parse(color_string, &color))
+    {
+        fprintf(stderr, "\"%s\" is not a valid color.\n\n", color_string);
+        return false;
+    }
+    
+    char command[48];
+    char normalized[32];
+    light_color_format(&color, normalized, sizeof(normalized));
+    snprintf(command, sizeof(command), "color %s", normalized);
+    
+    // Colors are custom commands, as only some targets have them
+    for(uint64_t t = 0; t < num_targets; t++)
+    {
+        if(!targets[t]->custom_command(targets[t], command))
+        {
+            LIGHT_ERR("failed to set color of target %s", targets[t]->name);
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+uint64_t light_get_min_cap(light_context_t *ctx, light_device_target_t *target)
+{
+    uint64_t minimum_value = 0;
+    
+    // The configuration file spares opening the minimum file of the target
+    if(target->conf != NULL && (target->conf->min.flags & LIGHT_CONF_SET))
+    {
+        return light_conf_value_to_raw(target, &target->conf->min, &minimum_value) ? minimum_value : 0;
+    }
+    
+    if(!light_read_target_setting(ctx, target, "minimum", &minimum_value))
+    {
+        return 0;
+    }
+    
+    return minimum_value;
+}
+
+uint64_t light_get_max_cap(light_context_t *ctx, light_device_target_t *target)
+{
+    uint64_t maximum_value = 0;
+    if(target->conf == NULL || !(target->conf->max.flags & LIGHT_CONF_SET) || !light_conf_value_to_raw(target, &target->conf->max, &maximum_value))
+    {
+        return UINT64_MAX;
+    }
+    
+    return maximum_value;
+}
+
+bool light_conf_value_to_raw(light_device_target_t *target, light_conf_value_t const *value, uint64_t *outraw)
+{
+    if(!(value->flags & LIGHT_CONF_RAW))
+    {
+        return light_percent_to_raw(target, value->value, outraw);
+    }
+    
+    *outraw = (uint64_t)value->value;
+    return true;
+}
+
+bool light_percent_to_raw(light_device_target_t *target, double inpercent, uint64_t *outraw)
+{
+    uint64_t max_value = 0;
+    if(!target->get_max_value(target, &max_value))
+    {
+        LIGHT_ERR("couldn't read from target");
+        return false;
+    }
+
+    double max_value_d = (double)max_value;
+    double fraction = light_percent_clamp(inpercent) / 100.0;
+    double curve = _light_get_curve(target);
+    double target_value_d = max_value_d * fraction;
+    if(curve != 1.0)
+    {
+        // Rounded rather than truncated, so that -A and -U in percent space don't drift down
+        target_value_d = max_value_d * pow(fraction, curve) + 0.5;
+    }
+    uint64_t target_value = LIGHT_CLAMP((uint64_t)target_value_d, 0, max_value);
+    *outraw = target_value;
+    
+    return true;
+}
+
+bool light_read_target_setting(light_context_t *ctx, light_device_target_t *target, char const *setting, uint64_t *out_value)
+{
+    char file_path[NAME_MAX];
+    _light_get_target_file(ctx, target, file_path, sizeof(file_path), setting);
+    
+    return light_file_read_uint64_optional(file_path, out_value);
+}
+
+bool light_write_target_setting(light_context_t *ctx, light_device_target_t *target, char const *setting, uint64_t value)
+{
+    char target_path[NAME_MAX];
+    char file_path[NAME_MAX];
+    _light_get_target_path(ctx, target, target_path, sizeof(target_path));
+    _light_get_target_file(ctx, target, file_path, sizeof(file_path), setting);
+    
+    int32_t rc = light_mkpath(target_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    if(rc && errno != EEXIST)
+    {
+        LIGHT_ERR("couldn't create target directory for %s", setting);
+        return false;
+    }
+    
+    if(!light_file_write_uint64(file_path, value))
+    {
+        return false;
+    }
+    
+    // The minimum is cached by the middleware
+    if(strcmp(setting, "minimum") == 0)
+    {
+        light_middleware_forget(target);
+    }
+    
+    return true;
+}
+
+bool light_apply_profile(light_context_t *ctx, char const *profile)
+{
+    bool success = true;
+    
+    char brightness_name[NAME_MAX];
+    char minimum_name[NAME_MAX];
+    snprintf(brightness_name, sizeof(brightness_name), "%s-brightness", profile);
+    snprintf(minimum_name, sizeof(minimum_name), "%s-minimum", profile);
+    
+    for(uint64_t e = 0; e < ctx->num_enumerators; e++)
+    {
+        light_device_enumerator_t *enumerator = ctx->enumerators[e];
+        for(uint64_t d = 0; d < enumerator->num_devices; d++)
+        {
+            light_device_t *device = enumerator->devices[d];
+            for(uint64_t t = 0; t < device->num_targets; t++)
+            {
+                light_device_target_t *target = device->targets[t];
+                uint64_t minimum = 0;
+                uint64_t brightness = 0;
+                
+                // The minimum goes first, as it caps the brightness below
+                if(light_read_target_setting(ctx, target, minimum_name, &minimum))
+                {
+                    success &= light_write_target_setting(ctx, target, "minimum", minimum);
+                }
+                
+                if(light_read_target_setting(ctx, target, brightness_name, &brightness))
+                {
+                    success &= light_target_set(ctx, target, brightness);
+                }
+            }
+        }
+    }
+    
+    return success;
+}
+
 light_device_t *light_create_device(light_device_enumerator_t *enumerator, char const *name, void *device_data)
 {
     light_device_t *new_device = malloc(sizeof(light_device_t));
@@ -1101,14 +1801,29 @@ light_device_target_t *light_create_device_target(light_device_t *device, char c
 {
     light_device_target_t *new_target = malloc(sizeof(light_device_target_t));
     new_target->device = device;
-    new_target->set_value = setfunc;
-    new_target->get_value = getfunc;
-    new_target->get_max_value = getmaxfunc;
+    new_target->set_value = light_middleware_set;
+    new_target->get_value = light_middleware_get;
+    new_target->get_max_value = light_middleware_get_max;
+    new_target->impl.set_value = setfunc;
+    new_target->impl.get_value = getfunc;
+    new_target->impl.get_max_value = getmaxfunc;
+    new_target->layers = NULL;
     new_target->custom_command = cmdfunc;
     new_target->device_target_data = target_data;
+    new_target->write_latency_ns = 0;
+    new_target->write_latency_loaded = false;
+    new_target->write_latency_saved = false;
+    new_target->write_latency_saved_us = 0;
+    memset(&new_target->metrics, 0, sizeof(new_target->metrics));
     
     snprintf(new_target->name, sizeof(new_target->name), "%s", name);
     
+    char target_path[sizeof(device->enumerator->name) + sizeof(device->name) + sizeof(new_target->name)];
+    snprintf(target_path, sizeof(target_path), "%s/%s/%s", device->enumerator->name, device->name, name);
+    new_target->conf = light_conf_find_target(device->enumerator->context->sys_params.conf, target_path);
+    
+    light_middleware_init(new_target);
+    
     _light_add_device_target(device, new_target);
     
     return new_target;
@@ -1116,6 +1831,8 @@ light_device_target_t *light_create_device_target(light_device_t *device, char c
 
 void light_delete_device_target(light_device_target_t *device_target)
 {
+    light_middleware_free(device_target);
+    
     if(device_target->device_target_data != NULL)
     {
         free(device_target->device_target_data);
@@ -7,12 +7,15 @@
 #include <stddef.h> // NULL
 
 #include "config.h"
+#include "liblight.h"
+#include "metrics.h"
+#include "conf.h"
 
 #define LIGHT_YEAR   "2012 - 2018"
 #define LIGHT_AUTHOR "Fredrik Haikarainen"
 
-struct _light_device_target_t;
-typedef struct _light_device_target_t light_device_target_t;
+// Max number of --input devices
+#define LIGHT_MAX_INPUT_PATHS 16
 
 struct _light_device_t;
 typedef struct _light_device_t light_device_t;
@@ -20,6 +23,9 @@ typedef struct _light_device_t light_device_t;
 struct _light_device_enumerator_t;
 typedef struct _light_device_enumerator_t light_device_enumerator_t;
 
+struct _light_animator_t;
+typedef struct _light_animator_t light_animator_t;
+
 /* Function pointers that implementations have to set for device targets */
 typedef bool (*LFUNCVALSET)(light_device_target_t*, uint64_t);
 typedef bool (*LFUNCVALGET)(light_device_target_t*, uint64_t*);
@@ -30,12 +36,25 @@ typedef bool (*LFUNCCUSTOMCMD)(light_device_target_t*, char const *);
 struct _light_device_target_t
 {
     char           name[256];
-    LFUNCVALSET    set_value;
+    LFUNCVALSET    set_value; // These go through the middleware, see middleware.h
     LFUNCVALGET    get_value;
     LFUNCMAXVALGET get_max_value;
     LFUNCCUSTOMCMD custom_command;
+    struct
+    {
+        LFUNCVALSET    set_value;
+        LFUNCVALGET    get_value;
+        LFUNCMAXVALGET get_max_value;
+    } impl; // The functions the implementation set, below the middleware
+    struct _light_layer_t *layers; // Top of the middleware stack
     void           *device_target_data;
     light_device_t *device;
+    light_conf_target_t const *conf; // Settings of the configuration file, NULL if it has none
+    uint64_t       write_latency_ns; // Measured cost of set_value, used to pace animations. 0 until known.
+    bool           write_latency_loaded; // Whether the latency measured by earlier runs was read
+    bool           write_latency_saved; // Whether the "latency" setting holds a value, write_latency_saved_us
+    uint64_t       write_latency_saved_us;
+    light_target_metrics_t metrics; // Counted by the middleware
 };
 
 /* Describes a device (a backlight, a keyboard, a led-strip) */
@@ -61,10 +80,10 @@ struct _light_device_enumerator_t
 
     light_device_t  **devices;
     uint64_t        num_devices;
+    light_context_t *context; // The context this enumerator belongs to
+    bool            initialized; // Whether init was called. The command line only initializes the enumerators it uses.
 };
 
-typedef struct _light_context_t light_context_t;
-
 // A command that can be run (set, get, add, subtract, print help, print version, list devices etc.)
 typedef bool (*LFUNCCOMMAND)(light_context_t *);
 
@@ -76,17 +95,44 @@ struct _light_context_t
         // Only one of value and raw_value is populated; which one depends on the command
         uint64_t                value; // The input value, in raw mode
         float                   float_value; // The input value as a float
+        char const              *string_value; // The input value as a string
         bool                    raw_mode; // Whether or not we use raw or percentage mode
         light_device_target_t   *device_target; // The device target to act on
+        char const              *profile; // The power profile (ac or battery) that -S and -N store values in, NULL to act on the target
+        bool                    all_targets; // Whether to act on all the targets of the device, given as "enumerator/device/*" (effects and colors only)
     } run_params;
 
+    struct
+    {
+        uint64_t                idle_timeout_ms; // Dim after this long without input, 0 if idle dimming is off
+        uint64_t                idle_value; // The raw value to dim to
+        bool                    hotkeys; // Whether to handle brightness keys
+        uint64_t                hotkey_step; // The raw step of a brightness key press
+        bool                    power_profiles; // Whether to apply profiles when the power source changes
+        char const              *schedule_path; // Schedule file to follow, NULL for none
+        char const              *input_paths[LIGHT_MAX_INPUT_PATHS]; // Input devices to watch instead of /dev/input/event*
+        uint64_t                num_input_paths;
+        char const              *metrics_path; // Unix socket the daemon serves metrics on, and --stats reads them from. NULL for none.
+        uint64_t                timer_slack_ms; // How late timers other than fades may expire to coalesce wakeups, 0 for the kernel's default
+        uint64_t                log_ring_entries; // Size of the in-memory log of the daemon, 0 for none
+        char const              *publish_path; // Unix socket the daemon publishes target changes on, NULL for none
+    } daemon_params;
+
     struct
     {
         char                    conf_dir[NAME_MAX]; // The path to the application cache directory 
+        light_conf_t            *conf; // The configuration file, NULL if there is none
+        bool                    tracing; // Whether this context started a trace of device I/O ($LIGHT_TRACE)
+        uint64_t                start_ns; // When light_initialize was called, 0 for contexts it didn't make. See stats.h.
+        uint64_t                enumerated_ns; // When light_initialize had created the context
+        uint64_t                parsed_ns; // When light_initialize had parsed the command line
     } sys_params;
     
     light_device_enumerator_t   **enumerators;
     uint64_t                    num_enumerators;
+
+    light_animator_t            *animator; // Drives effects from userspace, created on first use
+    int                         loglevel; // Applied to the calling thread by the liblight.h functions, see light_apply_loglevel
 };
 
 // The different available commands
@@ -103,6 +149,34 @@ bool light_cmd_sub_brightness(light_context_t *ctx); // U
 bool light_cmd_mul_brightness(light_context_t *ctx); // T
 bool light_cmd_save_brightness(light_context_t *ctx); // O
 bool light_cmd_restore_brightness(light_context_t *ctx); // I
+bool light_cmd_run_effect(light_context_t *ctx); // E
+bool light_cmd_set_color(light_context_t *ctx); // C
+bool light_cmd_run_daemon(light_context_t *ctx); // --idle, --hotkeys, --power-profiles, --schedule, --metrics, --publish
+bool light_cmd_print_stats(light_context_t *ctx); // --stats
+
+/* Returns the minimum cap (raw) of `target`, 0 if it has none */
+uint64_t light_get_min_cap(light_context_t *ctx, light_device_target_t *target);
+
+/* Returns the maximum cap (raw) of `target` from the configuration file, UINT64_MAX if it has none */
+uint64_t light_get_max_cap(light_context_t *ctx, light_device_target_t *target);
+
+/* Converts a value of the configuration file to a raw value of `target` */
+bool light_conf_value_to_raw(light_device_target_t *target, light_conf_value_t const *value, uint64_t *outraw);
+
+/* Converts a percentage of the max value of `target` to a raw value */
+bool light_percent_to_raw(light_device_target_t *target, double inpercent, uint64_t *outraw);
+
+/* Converts a raw value of `target` to a percentage of its max value */
+bool light_raw_to_percent(light_device_target_t *target, uint64_t inraw, double *outpercent);
+
+/* Reads a per-target setting file (such as "minimum") of `target` */
+bool light_read_target_setting(light_context_t *ctx, light_device_target_t *target, char const *setting, uint64_t *out_value);
+
+/* Writes a per-target setting file of `target`, creating its directory if needed */
+bool light_write_target_setting(light_context_t *ctx, light_device_target_t *target, char const *setting, uint64_t value);
+
+/* Applies the brightness and minimum cap that every target stored for `profile` (ac or battery), in one pass over all targets */
+bool light_apply_profile(light_context_t *ctx, char const *profile);
 
 /* Initializes the application, given the command-line. Returns a context. */
 light_context_t* light_initialize(int argc, char **argv);
@@ -110,13 +184,13 @@ light_context_t* light_initialize(int argc, char **argv);
 /* Executes the given context. Returns true on success, false on failure. */
 bool light_execute(light_context_t*);
 
-/* Frees the given context */
-void light_free(light_context_t*);
+/* Sets the log level of the calling thread to the one of `ctx`. Safe to call while another thread changes it. */
+void light_apply_loglevel(light_context_t *ctx);
 
 /* Create a device enumerator in the given context */
 light_device_enumerator_t * light_create_enumerator(light_context_t *ctx, char const * name, LFUNCENUMINIT, LFUNCENUMFREE);
 
-/* Initializes all the device enumerators (and its devices, targets) */
+/* Initializes all the device enumerators (and its devices, targets) that aren't yet */
 bool light_init_enumerators(light_context_t *ctx);
 
 /* Frees all the device enumerators (and its devices, targets) */
@@ -144,6 +218,3 @@ struct _light_target_path_t
 
 bool light_split_target_path(char const * in_path, light_target_path_t *out_path);
 
-/* Returns the found device target, or null. Name should be enumerator/device/target */
-light_device_target_t* light_find_device_target(light_context_t *ctx, char const * name);
-
@@ -0,0 +1,337 @@
+
+#include "logring.h"
+#include "loop.h"
+
+#include <stdlib.h> // calloc
+#include <string.h> // memcpy, strnlen, strspn, strchr
+#include <stdarg.h>
+#include <inttypes.h> // PRIu64
+
+// What a conversion of a format takes from the arguments
+typedef enum
+{
+    _LIGHT_LOG_ARG_NONE = 0, // %%
+    _LIGHT_LOG_ARG_INT,
+    _LIGHT_LOG_ARG_LONG,
+    _LIGHT_LOG_ARG_LONG_LONG,
+    _LIGHT_LOG_ARG_SIZE,
+    _LIGHT_LOG_ARG_DOUBLE,
+    _LIGHT_LOG_ARG_STRING,
+    _LIGHT_LOG_ARG_POINTER,
+    _LIGHT_LOG_ARG_UNKNOWN // Anything else (%n, %Lf, *), ends the recording of arguments
+} _light_log_arg_t;
+
+typedef struct
+{
+    uint64_t                    seq; // The number of the message plus one once it is complete, 0 while it is being written
+    uint64_t                    time_ns;
+    light_log_site_t const      *site;
+    uint64_t                    args[LIGHT_LOG_RING_ARGS]; // Integers widened, doubles as their bits, strings as offsets in text
+    uint8_t                     num_args;
+    char                        text[LIGHT_LOG_RING_TEXT];
+} _light_log_entry_t;
+
+light_loglevel_t light_log_ring_level = (light_loglevel_t)0;
+
+static _light_log_entry_t *_light_log_ring = NULL;
+static uint64_t _light_log_ring_mask = 0;
+static uint64_t _light_log_ring_head = 0; // Messages recorded so far, the next one goes to entry head & mask
+
+// Parses the conversion at `format`, which points to a '%'. Returns what follows it, and what it takes in `out_type`.
+static char const *_light_log_conversion(char const *format, _light_log_arg_t *out_type)
+{
+    char const *c = format + 1;
+    c += strspn(c, "-+ #0'");
+    c += strspn(c, "0123456789");
+    if(*c == '.')
+    {
+        c++;
+        c += strspn(c, "0123456789");
+    }
+
+    uint64_t longs = 0;
+    bool size = false;
+    bool unknown = false;
+    while(*c != '\0' && strchr("hlLqjzt", *c) != NULL)
+    {
+        if(*c == 'l')
+        {
+            longs++;
+        }
+        else if(*c == 'z' || *c == 'j' || *c == 't')
+        {
+            size = true;
+        }
+        else if(*c != 'h')
+        {
+            unknown = true;
+        }
+
+        c++;
+    }
+
+    switch(*c)
+    {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            *out_type = size ? _LIGHT_LOG_ARG_SIZE : (longs >= 2 ? _LIGHT_LOG_ARG_LONG_LONG : (longs == 1 ? _LIGHT_LOG_ARG_LONG : _LIGHT_LOG_ARG_INT));
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            *out_type = _LIGHT_LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            *out_type = _LIGHT_LOG_ARG_STRING;
+            break;
+        case 'p':
+            *out_type = _LIGHT_LOG_ARG_POINTER;
+            break;
+        case '%':
+            *out_type = _LIGHT_LOG_ARG_NONE;
+            break;
+        default:
+            *out_type = _LIGHT_LOG_ARG_UNKNOWN;
+            break;
+    }
+
+    if(unknown)
+    {
+        *out_type = _LIGHT_LOG_ARG_UNKNOWN;
+    }
+
+    return *c != '\0' ? c + 1 : c;
+}
+
+bool light_log_ring_start(uint64_t num_entries, light_loglevel_t level)
+{
+    // A daemon started again in the same process keeps the ring of the first one
+    if(__atomic_load_n(&_light_log_ring, __ATOMIC_ACQUIRE) != NULL)
+    {
+        if(level > light_log_ring_level)
+        {
+            __atomic_store_n(&light_log_ring_level, level, __ATOMIC_RELEASE);
+        }
+
+        return true;
+    }
+
+    uint64_t size = 1;
+    while(size < num_entries)
+    {
+        size <<= 1;
+    }
+
+    _light_log_entry_t *ring = calloc(size, sizeof(_light_log_entry_t));
+    if(ring == NULL)
+    {
+        LIGHT_MEMERR();
+        return false;
+    }
+
+    _light_log_ring_mask = size - 1;
+    __atomic_store_n(&_light_log_ring, ring, __ATOMIC_RELEASE);
+    __atomic_store_n(&light_log_ring_level, level, __ATOMIC_RELEASE);
+    return true;
+}
+
+void light_log_ring_record(light_log_site_t const *site, va_list args)
+{
+    _light_log_entry_t *ring = __atomic_load_n(&_light_log_ring, __ATOMIC_ACQUIRE);
+    if(ring == NULL)
+    {
+        return;
+    }
+
+    uint64_t number = __atomic_fetch_add(&_light_log_ring_head, 1, __ATOMIC_RELAXED);
+    _light_log_entry_t *entry = &ring[number & _light_log_ring_mask];
+
+    // Readers skip the entry until it is complete
+    __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    entry->time_ns = light_loop_now_ns();
+    entry->site = site;
+    entry->text[LIGHT_LOG_RING_TEXT - 1] = '\0';
+
+    uint64_t num_args = 0;
+    size_t text_length = 0;
+    char const *c = site->format;
+    while(*c != '\0' && num_args < LIGHT_LOG_RING_ARGS)
+    {
+        if(*c != '%')
+        {
+            c++;
+            continue;
+        }
+
+        _light_log_arg_t type;
+        c = _light_log_conversion(c, &type);
+
+        switch(type)
+        {
+            case _LIGHT_LOG_ARG_NONE:
+                break;
+            case _LIGHT_LOG_ARG_INT:
+                entry->args[num_args++] = va_arg(args, unsigned int);
+                break;
+            case _LIGHT_LOG_ARG_LONG:
+                entry->args[num_args++] = va_arg(args, unsigned long);
+                break;
+            case _LIGHT_LOG_ARG_LONG_LONG:
+                entry->args[num_args++] = va_arg(args, unsigned long long);
+                break;
+            case _LIGHT_LOG_ARG_SIZE:
+                entry->args[num_args++] = va_arg(args, size_t);
+                break;
+            case _LIGHT_LOG_ARG_DOUBLE:
+            {
+                double value = va_arg(args, double);
+                memcpy(&entry->args[num_args++], &value, sizeof(value));
+                break;
+            }
+            case _LIGHT_LOG_ARG_POINTER:
+                entry->args[num_args++] = (uintptr_t)va_arg(args, void*);
+                break;
+            case _LIGHT_LOG_ARG_STRING:
+            {
+                // Strings may not outlive the call, keep what fits. Once the text is full, the last byte stands for an empty string.
+                char const *str = va_arg(args, char const*);
+                if(str == NULL)
+                {
+                    str = "(null)";
+                }
+
+                size_t length = strnlen(str, LIGHT_LOG_RING_TEXT - 1 - text_length);
+                memcpy(entry->text + text_length, str, length);
+                entry->text[text_length + length] = '\0';
+                entry->args[num_args++] = text_length;
+
+                text_length += length + 1;
+                if(text_length > LIGHT_LOG_RING_TEXT - 1)
+                {
+                    text_length = LIGHT_LOG_RING_TEXT - 1;
+                }
+                break;
+            }
+            case _LIGHT_LOG_ARG_UNKNOWN:
+                c = "";
+                break;
+        }
+    }
+
+    entry->num_args = (uint8_t)num_args;
+    __atomic_store_n(&entry->seq, number + 1, __ATOMIC_RELEASE);
+}
+
+// Formats the message of `entry` into `out`
+static void _light_log_format(_light_log_entry_t const *entry, char *out, size_t size)
+{
+    size_t length = 0;
+    uint64_t arg = 0;
+    char const *c = entry->site->format;
+    while(*c != '\0' && length + 1 < size)
+    {
+        if(*c != '%')
+        {
+            out[length++] = *c++;
+            continue;
+        }
+
+        _light_log_arg_t type;
+        char const *end = _light_log_conversion(c, &type);
+
+        char spec[32];
+        snprintf(spec, sizeof(spec), "%.*s", (int)(end - c), c);
+        c = end;
+
+        if(type == _LIGHT_LOG_ARG_NONE)
+        {
+            out[length++] = '%';
+            continue;
+        }
+
+        int written = 0;
+        if(type == _LIGHT_LOG_ARG_UNKNOWN || arg >= entry->num_args)
+        {
+            written = snprintf(out + length, size - length, "?");
+        }
+        else
+        {
+            uint64_t value = entry->args[arg++];
+            switch(type)
+            {
+                case _LIGHT_LOG_ARG_INT:
+                    written = snprintf(out + length, size - length, spec, (unsigned int)value);
+                    break;
+                case _LIGHT_LOG_ARG_LONG:
+                    written = snprintf(out + length, size - length, spec, (unsigned long)value);
+                    break;
+                case _LIGHT_LOG_ARG_LONG_LONG:
+                    written = snprintf(out + length, size - length, spec, (unsigned long long)value);
+                    break;
+                case _LIGHT_LOG_ARG_SIZE:
+                    written = snprintf(out + length, size - length, spec, (size_t)value);
+                    break;
+                case _LIGHT_LOG_ARG_DOUBLE:
+                {
+                    double number;
+                    memcpy(&number, &value, sizeof(number));
+                    written = snprintf(out + length, size - length, spec, number);
+                    break;
+                }
+                case _LIGHT_LOG_ARG_POINTER:
+                    written = snprintf(out + length, size - length, spec, (void*)(uintptr_t)value);
+                    break;
+                case _LIGHT_LOG_ARG_STRING:
+                    written = snprintf(out + length, size - length, spec, entry->text + (value < LIGHT_LOG_RING_TEXT ? value : LIGHT_LOG_RING_TEXT - 1));
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if(written > 0)
+        {
+            length += (size_t)written < size - length ? (size_t)written : size - length - 1;
+        }
+    }
+
+    out[length] = '\0';
+}
+
+void light_log_ring_dump(FILE *out)
+{
+    _light_log_entry_t *ring = __atomic_load_n(&_light_log_ring, __ATOMIC_ACQUIRE);
+    if(ring == NULL)
+    {
+        return;
+    }
+
+    uint64_t head = __atomic_load_n(&_light_log_ring_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > _light_log_ring_mask + 1 ? head - (_light_log_ring_mask + 1) : 0;
+    uint64_t now_ns = light_loop_now_ns();
+
+    fprintf(out, "log: %" PRIu64 " messages, the last %" PRIu64 ":\n", head, head - first);
+    for(uint64_t number = first; number < head; number++)
+    {
+        // Copied and checked again, since a writer that wrapped around may be reusing the entry
+        _light_log_entry_t const *slot = &ring[number & _light_log_ring_mask];
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != number + 1)
+        {
+            continue;
+        }
+
+        _light_log_entry_t entry;
+        memcpy(&entry, slot, sizeof(entry));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != number + 1)
+        {
+            continue;
+        }
+
+        char message[512];
+        _light_log_format(&entry, message, sizeof(message));
+        fprintf(out, "  %.3f s ago %s:%d:%s\n", (double)(now_ns - entry.time_ns) / 1e9, entry.site->file, entry.site->line, message);
+    }
+
+    fflush(out);
+}
+
@@ -0,0 +1,29 @@
+
+#pragma once
+
+#include "helpers.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Binary in-memory log of long-running modes
+// While the ring is started, every LIGHT_LOG up to its level also records the address of its site and its raw arguments in a
+// fixed array of entries, without formatting anything. Writers claim an entry with an atomic increment and never wait for
+// each other or for a reader, the oldest entries are overwritten. The messages are only formatted when the ring is dumped,
+// so notices can be kept at the cost of a few stores while -v stays quiet. Strings are copied, up to a few dozen bytes.
+
+// Arguments kept per message, conversions after these are printed as "?"
+#define LIGHT_LOG_RING_ARGS 6
+
+// Bytes kept for the string arguments of a message, together
+#define LIGHT_LOG_RING_TEXT 64
+
+/* Starts recording the messages up to `level` in a ring of `num_entries` entries, rounded up to a power of two. The ring is
+ * shared by all threads and lives until the process exits, starting it again only raises its level. Returns false if it
+ * couldn't be allocated. */
+bool light_log_ring_start(uint64_t num_entries, light_loglevel_t level);
+
+/* Writes the messages in the ring to `out`, oldest first, with how long ago they were logged */
+void light_log_ring_dump(FILE *out);
+
@@ -0,0 +1,431 @@
+
+#include "loop.h"
+#include "helpers.h"
+#include "metrics.h"
+#include "clock.h"
+
+#include <stdlib.h> // malloc, free, realloc
+#include <string.h> // memset, strerror, strcmp
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <time.h> // clock_gettime
+#include <unistd.h> // close
+#include <sys/epoll.h>
+#include <sys/prctl.h> // PR_SET_TIMERSLACK
+#include <sys/resource.h> // getrusage
+
+// Max number of events handled per epoll_wait
+#define LIGHT_LOOP_MAX_EVENTS 32
+
+// Deadlines of light_loop_timer_arm are rounded up to a multiple of this, 0 to leave them alone
+static uint64_t _light_loop_timer_slack_ns = 0;
+
+static uint64_t _light_loop_cpu_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Returns the account of the feature `name`, creating it on first use
+static light_loop_account_t *_light_loop_account(light_loop_t *loop, char const *name)
+{
+    for(uint64_t i = 0; i < loop->num_accounts; i++)
+    {
+        if(strcmp(loop->accounts[i]->name, name) == 0)
+        {
+            return loop->accounts[i];
+        }
+    }
+
+    light_loop_account_t **new_accounts = realloc(loop->accounts, (loop->num_accounts + 1) * sizeof(light_loop_account_t*));
+    if(new_accounts == NULL)
+    {
+        LIGHT_MEMERR();
+        return NULL;
+    }
+    loop->accounts = new_accounts;
+
+    light_loop_account_t *account = malloc(sizeof(light_loop_account_t));
+    memset(account, 0, sizeof(light_loop_account_t));
+    account->name = name;
+    loop->accounts[loop->num_accounts++] = account;
+    return account;
+}
+
+static uint64_t _light_loop_round_deadline(uint64_t when_ns)
+{
+    if(_light_loop_timer_slack_ns == 0)
+    {
+        return when_ns;
+    }
+
+    return (when_ns + _light_loop_timer_slack_ns - 1) / _light_loop_timer_slack_ns * _light_loop_timer_slack_ns;
+}
+
+// Reads the number of read and write syscalls of the process from /proc/self/io, which are most of what light makes. The
+// kernel only counts them per process, for every feature and thread together: telling them apart per feature would take a read
+// of the counters around every dispatch, more syscalls than most handlers make.
+static bool _light_loop_syscalls(uint64_t *out_reads, uint64_t *out_writes)
+{
+    FILE *file = fopen("/proc/self/io", "re");
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    char line[128];
+    bool have_reads = false;
+    bool have_writes = false;
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        have_reads = have_reads || sscanf(line, "syscr: %" SCNu64, out_reads) == 1;
+        have_writes = have_writes || sscanf(line, "syscw: %" SCNu64, out_writes) == 1;
+    }
+
+    fclose(file);
+    return have_reads && have_writes;
+}
+
+static light_loop_source_t *_light_loop_find(light_loop_t *loop, int fd)
+{
+    for(uint64_t i = 0; i < loop->num_sources; i++)
+    {
+        if(loop->sources[i]->fd == fd && !loop->sources[i]->removed)
+        {
+            return loop->sources[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Frees the sources that were removed during a dispatch
+static void _light_loop_collect(light_loop_t *loop)
+{
+    uint64_t kept = 0;
+    for(uint64_t i = 0; i < loop->num_sources; i++)
+    {
+        if(loop->sources[i]->removed)
+        {
+            free(loop->sources[i]);
+            continue;
+        }
+
+        loop->sources[kept++] = loop->sources[i];
+    }
+
+    loop->num_sources = kept;
+}
+
+light_loop_t *light_loop_create()
+{
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0)
+    {
+        LIGHT_ERR("failed to create event loop: %s", strerror(errno));
+        return NULL;
+    }
+
+    light_loop_t *loop = malloc(sizeof(light_loop_t));
+    loop->epoll_fd = epoll_fd;
+    loop->sources = NULL;
+    loop->num_sources = 0;
+    loop->running = false;
+    loop->dispatching = false;
+    loop->accounts = NULL;
+    loop->num_accounts = 0;
+    loop->wakeups = 0;
+    loop->start_ns = light_loop_now_ns();
+
+    return loop;
+}
+
+void light_loop_free(light_loop_t *loop)
+{
+    for(uint64_t i = 0; i < loop->num_sources; i++)
+    {
+        free(loop->sources[i]);
+    }
+
+    for(uint64_t i = 0; i < loop->num_accounts; i++)
+    {
+        free(loop->accounts[i]);
+    }
+
+    free(loop->sources);
+    free(loop->accounts);
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+bool light_loop_add(light_loop_t *loop, int fd, uint32_t events, LFUNCLOOPEVENT callback, void *userdata, char const *name)
+{
+    light_loop_source_t **new_sources = realloc(loop->sources, (loop->num_sources + 1) * sizeof(light_loop_source_t*));
+    if(new_sources == NULL)
+    {
+        LIGHT_MEMERR();
+        return false;
+    }
+    loop->sources = new_sources;
+
+    light_loop_source_t *source = malloc(sizeof(light_loop_source_t));
+    source->fd = fd;
+    source->callback = callback;
+    source->userdata = userdata;
+    source->name = name;
+    source->removed = false;
+    source->priority = 0;
+    source->account = _light_loop_account(loop, name);
+    if(source->account == NULL)
+    {
+        free(source);
+        return false;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = source;
+
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        LIGHT_ERR("%s: failed to watch file descriptor: %s", name, strerror(errno));
+        free(source);
+        return false;
+    }
+
+    loop->sources[loop->num_sources++] = source;
+    return true;
+}
+
+bool light_loop_modify(light_loop_t *loop, int fd, uint32_t events)
+{
+    light_loop_source_t *source = _light_loop_find(loop, fd);
+    if(source == NULL)
+    {
+        return false;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = source;
+
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0)
+    {
+        LIGHT_ERR("%s: failed to change watched events: %s", source->name, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool light_loop_set_priority(light_loop_t *loop, int fd, uint32_t priority)
+{
+    light_loop_source_t *source = _light_loop_find(loop, fd);
+    if(source == NULL)
+    {
+        return false;
+    }
+
+    source->priority = priority;
+    return true;
+}
+
+void light_loop_remove(light_loop_t *loop, int fd)
+{
+    light_loop_source_t *source = _light_loop_find(loop, fd);
+    if(source == NULL)
+    {
+        return;
+    }
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    source->removed = true;
+
+    // Events for the source may still be pending in the current dispatch, so it is freed afterwards
+    if(!loop->dispatching)
+    {
+        _light_loop_collect(loop);
+    }
+}
+
+bool light_loop_run(light_loop_t *loop)
+{
+    struct epoll_event events[LIGHT_LOOP_MAX_EVENTS];
+
+    loop->running = true;
+    while(loop->running && loop->num_sources > 0)
+    {
+        // A virtual clock jumps to the next deadline instead of sleeping until it, and waits for real events once none is left
+        int num_events = epoll_wait(loop->epoll_fd, events, LIGHT_LOOP_MAX_EVENTS, light_clock_is_virtual() ? 0 : -1);
+        if(num_events == 0 && !light_clock_skip())
+        {
+            num_events = epoll_wait(loop->epoll_fd, events, LIGHT_LOOP_MAX_EVENTS, -1);
+        }
+        loop->wakeups++;
+        if(num_events < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            LIGHT_ERR("failed to wait for events: %s", strerror(errno));
+            return false;
+        }
+
+        // Insertion sort by priority, stable so that sources of the same priority keep the kernel's order
+        for(int i = 1; i < num_events; i++)
+        {
+            struct epoll_event event = events[i];
+            uint32_t priority = ((light_loop_source_t*)event.data.ptr)->priority;
+
+            int j = i;
+            while(j > 0 && ((light_loop_source_t*)events[j - 1].data.ptr)->priority < priority)
+            {
+                events[j] = events[j - 1];
+                j--;
+            }
+
+            events[j] = event;
+        }
+
+        loop->dispatching = true;
+        for(int i = 0; i < num_events; i++)
+        {
+            light_loop_source_t *source = (light_loop_source_t*)events[i].data.ptr;
+            if(source->removed)
+            {
+                continue;
+            }
+
+            uint64_t cpu_start_ns = _light_loop_cpu_ns();
+            bool keep = source->callback(loop, source->fd, events[i].events, source->userdata);
+            source->account->dispatches++;
+            source->account->cpu_ns += _light_loop_cpu_ns() - cpu_start_ns;
+
+            if(!keep)
+            {
+                LIGHT_NOTE("%s: stopped watching file descriptor %d", source->name, source->fd);
+                light_loop_remove(loop, source->fd);
+            }
+        }
+        loop->dispatching = false;
+
+        _light_loop_collect(loop);
+    }
+
+    loop->running = false;
+    return true;
+}
+
+void light_loop_stop(light_loop_t *loop)
+{
+    loop->running = false;
+}
+
+int light_loop_timer_create(bool realtime)
+{
+    return light_clock_timer_create(realtime, true);
+}
+
+bool light_loop_timer_arm(int timer_fd, uint64_t when_ns)
+{
+    return light_clock_timer_arm(timer_fd, _light_loop_round_deadline(when_ns), false);
+}
+
+bool light_loop_timer_arm_wall(int timer_fd, uint64_t when_ns)
+{
+    return light_clock_timer_arm(timer_fd, _light_loop_round_deadline(when_ns), true);
+}
+
+void light_loop_timer_close(int timer_fd)
+{
+    light_clock_timer_close(timer_fd);
+}
+
+uint64_t light_loop_now_ns()
+{
+    return light_clock_now_ns();
+}
+
+bool light_loop_set_timer_slack(uint64_t slack_ns)
+{
+    if(slack_ns == 0)
+    {
+        return true;
+    }
+
+    if(prctl(PR_SET_TIMERSLACK, (unsigned long)slack_ns, 0, 0, 0) < 0)
+    {
+        LIGHT_ERR("failed to set timer slack: %s", strerror(errno));
+        return false;
+    }
+
+    _light_loop_timer_slack_ns = slack_ns;
+    return true;
+}
+
+void light_loop_print_stats(light_loop_t *loop)
+{
+    double seconds = (double)(light_loop_now_ns() - loop->start_ns) / 1e9;
+    if(seconds <= 0.0)
+    {
+        seconds = 1e-9;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_ms = (double)usage.ru_utime.tv_sec * 1e3 + (double)usage.ru_utime.tv_usec / 1e3 + (double)usage.ru_stime.tv_sec * 1e3 + (double)usage.ru_stime.tv_usec / 1e3;
+
+    printf("loop: %" PRIu64 " wakeups in %.1f s, %.3f/s, %.1f ms CPU\n", loop->wakeups, seconds, (double)loop->wakeups / seconds, cpu_ms);
+
+    for(uint64_t i = 0; i < loop->num_accounts; i++)
+    {
+        light_loop_account_t *account = loop->accounts[i];
+        printf("%s: %" PRIu64 " wakeups, %.3f/s, %.1f ms CPU\n", account->name, account->dispatches, (double)account->dispatches / seconds, (double)account->cpu_ns / 1e6);
+    }
+
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    if(_light_loop_syscalls(&reads, &writes))
+    {
+        printf("process: %.3f read and %.3f write syscalls/s, of all features and threads together\n", (double)reads / seconds, (double)writes / seconds);
+    }
+
+    fflush(stdout);
+}
+
+void light_loop_write_metrics(light_loop_t *loop, FILE *out)
+{
+    char labels[128];
+
+    light_metrics_family(out, "light_loop_wakeups_total", "counter", "Returns from the wait of the event loop.");
+    light_metrics_value(out, "light_loop_wakeups_total", NULL, loop->wakeups);
+
+    light_metrics_family(out, "light_feature_wakeups_total", "counter", "Times a source of a feature was ready.");
+    for(uint64_t i = 0; i < loop->num_accounts; i++)
+    {
+        snprintf(labels, sizeof(labels), "feature=\"%s\"", loop->accounts[i]->name);
+        light_metrics_value(out, "light_feature_wakeups_total", labels, loop->accounts[i]->dispatches);
+    }
+
+    light_metrics_family(out, "light_feature_cpu_seconds_total", "counter", "Thread CPU time spent handling the sources of a feature.");
+    for(uint64_t i = 0; i < loop->num_accounts; i++)
+    {
+        snprintf(labels, sizeof(labels), "feature=\"%s\"", loop->accounts[i]->name);
+        fprintf(out, "light_feature_cpu_seconds_total{%s} %.9f\n", labels, (double)loop->accounts[i]->cpu_ns / 1e9);
+    }
+
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    if(_light_loop_syscalls(&reads, &writes))
+    {
+        light_metrics_family(out, "light_process_rw_syscalls_total", "counter", "Read and write syscalls of the whole process, not per feature.");
+        light_metrics_value(out, "light_process_rw_syscalls_total", "kind=\"read\"", reads);
+        light_metrics_value(out, "light_process_rw_syscalls_total", "kind=\"write\"", writes);
+    }
+}
+
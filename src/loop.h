@@ -0,0 +1,105 @@
+
+#pragma once
+
+#include "light.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h> // FILE
+#include <sys/epoll.h> // EPOLLIN etc.
+
+// The event loop of long-running modes. Everything light waits for (input devices, timers, sockets) is a file descriptor
+// registered here, so an idle process sleeps in a single epoll_wait.
+
+typedef struct _light_loop_t light_loop_t;
+
+// What the sources of one feature cost, kept by name so that sources that come and go (input devices) add up
+typedef struct _light_loop_account_t light_loop_account_t;
+struct _light_loop_account_t
+{
+    char const      *name;
+    uint64_t        dispatches; // Times a source of the feature was ready, each one a wakeup or part of one
+    uint64_t        cpu_ns; // Thread CPU time spent in its callbacks
+};
+
+/* Called when the descriptor of a source is ready. Returning false removes the source (for example an unplugged device). */
+typedef bool (*LFUNCLOOPEVENT)(light_loop_t *loop, int fd, uint32_t events, void *userdata);
+
+typedef struct _light_loop_source_t light_loop_source_t;
+struct _light_loop_source_t
+{
+    int             fd;
+    LFUNCLOOPEVENT  callback;
+    void            *userdata;
+    char const      *name; // The feature this source belongs to, for logging
+    uint32_t        priority; // Ready sources of a higher priority are dispatched first
+    bool            removed; // Set when removed during dispatch, freed once the dispatch is done
+    light_loop_account_t *account;
+};
+
+struct _light_loop_t
+{
+    int                 epoll_fd;
+    light_loop_source_t **sources;
+    uint64_t            num_sources;
+    bool                running;
+    bool                dispatching;
+    light_loop_account_t **accounts;
+    uint64_t            num_accounts;
+    uint64_t            wakeups; // Returns from epoll_wait
+    uint64_t            start_ns; // When the loop was created
+};
+
+/* Creates an event loop. Returns NULL on failure. */
+light_loop_t *light_loop_create();
+
+/* Frees the loop and its sources. Descriptors are not closed, they belong to whoever added them. */
+void light_loop_free(light_loop_t *loop);
+
+/* Calls `callback` whenever `fd` has any of `events` (EPOLLIN etc.) */
+bool light_loop_add(light_loop_t *loop, int fd, uint32_t events, LFUNCLOOPEVENT callback, void *userdata, char const *name);
+
+/* Changes the events that are waited for on `fd` */
+bool light_loop_modify(light_loop_t *loop, int fd, uint32_t events);
+
+/* Sets the dispatch priority of `fd`, 0 by default. When several sources are ready at once, higher priorities go first,
+ * so that reacting to input never waits behind timers. */
+bool light_loop_set_priority(light_loop_t *loop, int fd, uint32_t priority);
+
+/* Stops watching `fd`. Safe to call from callbacks. */
+void light_loop_remove(light_loop_t *loop, int fd);
+
+/* Dispatches events until light_loop_stop is called, or no sources are left. Returns false on failure. */
+bool light_loop_run(light_loop_t *loop);
+
+/* Makes light_loop_run return after the current dispatch */
+void light_loop_stop(light_loop_t *loop);
+
+/* Creates a non-blocking timer on CLOCK_MONOTONIC, or CLOCK_REALTIME if `realtime` is set, see clock.h. Returns -1 on failure. */
+int light_loop_timer_create(bool realtime);
+
+/* Arms `timer_fd` to expire once at the absolute time `when_ns`, or disarms it if `when_ns` is 0 */
+bool light_loop_timer_arm(int timer_fd, uint64_t when_ns);
+
+/* Arms a CLOCK_REALTIME `timer_fd` to expire at the wall clock time `when_ns`. Reading the timer fails with ECANCELED if the
+ * clock is set in the meantime, so that deadlines computed from the old time can be recomputed. */
+bool light_loop_timer_arm_wall(int timer_fd, uint64_t when_ns);
+
+/* Closes a timer made by light_loop_timer_create, once it is removed from the loop */
+void light_loop_timer_close(int timer_fd);
+
+/* Lets the timers armed with light_loop_timer_arm and light_loop_timer_arm_wall expire up to `slack_ns` late, so that the
+ * wakeups of different features coalesce, and sets the timer slack of the process (PR_SET_TIMERSLACK) to the same. Applies to the
+ * whole process, 0 keeps the kernel's default. Fades aren't affected. */
+bool light_loop_set_timer_slack(uint64_t slack_ns);
+
+/* Prints the wakeups and CPU time of the process and of every feature, per second, and the read and write syscalls of the
+ * process, which the kernel doesn't count per feature */
+void light_loop_print_stats(light_loop_t *loop);
+
+/* Writes the same as metrics, see metrics.h */
+void light_loop_write_metrics(light_loop_t *loop, FILE *out);
+
+/* Returns the current time of CLOCK_MONOTONIC, or of the virtual clock, in nanoseconds */
+uint64_t light_loop_now_ns();
+
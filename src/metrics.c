@@ -0,0 +1,236 @@
+
+#include "metrics.h"
+#include "light.h"
+#include "middleware.h"
+
+#include <stdlib.h> // malloc, free
+#include <inttypes.h> // PRIu64
+
+static char const * const _light_op_names[LIGHT_OP_COUNT] = {"set", "get", "get_max"};
+
+void light_histogram_add(light_histogram_t *histogram, uint64_t duration_ns)
+{
+    uint64_t duration_us = duration_ns / 1000;
+    uint64_t bucket = duration_us == 0 ? 0 : 64 - (uint64_t)__builtin_clzll(duration_us);
+    if(bucket >= LIGHT_HISTOGRAM_BUCKETS)
+    {
+        bucket = LIGHT_HISTOGRAM_BUCKETS - 1;
+    }
+
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum_ns, duration_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+
+    uint64_t max_ns = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while(duration_ns > max_ns && !__atomic_compare_exchange_n(&histogram->max_ns, &max_ns, duration_ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+uint64_t light_histogram_percentile(light_histogram_t const *histogram, double fraction)
+{
+    uint64_t wanted = (uint64_t)(fraction * (double)histogram->count + 0.999);
+
+    uint64_t seen = 0;
+    for(uint64_t i = 0; i < LIGHT_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if(seen >= wanted && seen > 0)
+        {
+            // The upper bound of the bucket
+            return (1ull << i) * 1000ull;
+        }
+    }
+
+    return 0;
+}
+
+char const *light_op_name(light_op_t op)
+{
+    return _light_op_names[op];
+}
+
+void light_metrics_family(FILE *out, char const *name, char const *type, char const *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void light_metrics_value(FILE *out, char const *name, char const *labels, uint64_t value)
+{
+    if(labels != NULL)
+    {
+        fprintf(out, "%s{%s} %" PRIu64 "\n", name, labels, value);
+    }
+    else
+    {
+        fprintf(out, "%s %" PRIu64 "\n", name, value);
+    }
+}
+
+void light_metrics_histogram(FILE *out, char const *name, char const *labels, light_histogram_t const *histogram)
+{
+    char const *separator = labels != NULL ? "," : "";
+    if(labels == NULL)
+    {
+        labels = "";
+    }
+
+    // Buckets are cumulative, and bounded by their upper end in seconds
+    uint64_t count = 0;
+    for(uint64_t i = 0; i < LIGHT_HISTOGRAM_BUCKETS - 1; i++)
+    {
+        count += histogram->buckets[i];
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels, separator, (double)(1ull << i) / 1e6, count);
+    }
+
+    count += histogram->buckets[LIGHT_HISTOGRAM_BUCKETS - 1];
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, separator, count);
+
+    char sum_name[128];
+    char count_name[128];
+    snprintf(sum_name, sizeof(sum_name), "%s_sum", name);
+    snprintf(count_name, sizeof(count_name), "%s_count", name);
+    if(*labels != '\0')
+    {
+        fprintf(out, "%s{%s} %.9f\n", sum_name, labels, (double)histogram->sum_ns / 1e9);
+    }
+    else
+    {
+        fprintf(out, "%s %.9f\n", sum_name, (double)histogram->sum_ns / 1e9);
+    }
+    light_metrics_value(out, count_name, *labels != '\0' ? labels : NULL, count);
+}
+
+// Formats the target label of `target`, escaping what the text format requires
+static void _light_metrics_target_label(light_device_target_t *target, char *out, size_t size)
+{
+    char path[NAME_MAX * 3 + 3];
+    snprintf(path, sizeof(path), "%s/%s/%s", target->device->enumerator->name, target->device->name, target->name);
+
+    size_t length = 0;
+    length += (size_t)snprintf(out, size, "target=\"");
+    for(char const *c = path; *c != '\0' && length + 3 < size; c++)
+    {
+        if(*c == '"' || *c == '\\')
+        {
+            out[length++] = '\\';
+        }
+        out[length++] = *c;
+    }
+
+    out[length++] = '"';
+    out[length] = '\0';
+}
+
+// Returns the targets of `ctx` that any operation reached, in `out_targets` to be freed by the caller
+static uint64_t _light_metrics_used_targets(light_context_t *ctx, light_device_target_t ***out_targets)
+{
+    uint64_t num_targets = 0;
+    for(uint64_t e = 0; e < ctx->num_enumerators; e++)
+    {
+        light_device_enumerator_t *enumerator = ctx->enumerators[e];
+        for(uint64_t d = 0; d < enumerator->num_devices; d++)
+        {
+            num_targets += enumerator->devices[d]->num_targets;
+        }
+    }
+
+    light_device_target_t **targets = malloc((num_targets + 1) * sizeof(light_device_target_t*));
+    uint64_t num_used = 0;
+    for(uint64_t e = 0; e < ctx->num_enumerators; e++)
+    {
+        light_device_enumerator_t *enumerator = ctx->enumerators[e];
+        for(uint64_t d = 0; d < enumerator->num_devices; d++)
+        {
+            light_device_t *device = enumerator->devices[d];
+            for(uint64_t t = 0; t < device->num_targets; t++)
+            {
+                light_device_target_t *target = device->targets[t];
+                for(uint64_t op = 0; op < LIGHT_OP_COUNT; op++)
+                {
+                    if(target->metrics.latency[op].count > 0)
+                    {
+                        targets[num_used++] = target;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    *out_targets = targets;
+    return num_used;
+}
+
+void light_metrics_write_targets(FILE *out, light_context_t *ctx)
+{
+    light_device_target_t **targets = NULL;
+    uint64_t num_targets = _light_metrics_used_targets(ctx, &targets);
+
+    char target_label[NAME_MAX * 6];
+    char labels[sizeof(target_label) + NAME_MAX];
+
+    light_metrics_family(out, "light_target_operations_total", "counter", "Calls that reached the device, by target and operation.");
+    for(uint64_t t = 0; t < num_targets; t++)
+    {
+        _light_metrics_target_label(targets[t], target_label, sizeof(target_label));
+        for(uint64_t op = 0; op < LIGHT_OP_COUNT; op++)
+        {
+            snprintf(labels, sizeof(labels), "%s,op=\"%s\"", target_label, _light_op_names[op]);
+            light_metrics_value(out, "light_target_operations_total", labels, targets[t]->metrics.latency[op].count);
+        }
+    }
+
+    light_metrics_family(out, "light_target_failures_total", "counter", "Calls that the device failed, by target and operation.");
+    for(uint64_t t = 0; t < num_targets; t++)
+    {
+        _light_metrics_target_label(targets[t], target_label, sizeof(target_label));
+        for(uint64_t op = 0; op < LIGHT_OP_COUNT; op++)
+        {
+            snprintf(labels, sizeof(labels), "%s,op=\"%s\"", target_label, _light_op_names[op]);
+            light_metrics_value(out, "light_target_failures_total", labels, targets[t]->metrics.failures[op]);
+        }
+    }
+
+    light_metrics_family(out, "light_target_latency_seconds", "histogram", "Time the device took to answer, by target and operation.");
+    for(uint64_t t = 0; t < num_targets; t++)
+    {
+        _light_metrics_target_label(targets[t], target_label, sizeof(target_label));
+        for(uint64_t op = 0; op < LIGHT_OP_COUNT; op++)
+        {
+            snprintf(labels, sizeof(labels), "%s,op=\"%s\"", target_label, _light_op_names[op]);
+            light_metrics_histogram(out, "light_target_latency_seconds", labels, &targets[t]->metrics.latency[op]);
+        }
+    }
+
+    // What the middleware saved: writes skipped by the write cache are the elided ones, see middleware.h
+    light_metrics_family(out, "light_layer_calls_total", "counter", "Calls that reached a middleware layer.");
+    for(uint64_t t = 0; t < num_targets; t++)
+    {
+        _light_metrics_target_label(targets[t], target_label, sizeof(target_label));
+        for(light_layer_t *layer = targets[t]->layers; layer != NULL; layer = layer->next)
+        {
+            snprintf(labels, sizeof(labels), "%s,layer=\"%s\"", target_label, layer->name);
+            light_metrics_value(out, "light_layer_calls_total", labels, layer->calls);
+        }
+    }
+
+    light_metrics_family(out, "light_layer_hits_total", "counter", "Calls a middleware layer acted on instead of passing them on unchanged.");
+    for(uint64_t t = 0; t < num_targets; t++)
+    {
+        _light_metrics_target_label(targets[t], target_label, sizeof(target_label));
+        for(light_layer_t *layer = targets[t]->layers; layer != NULL; layer = layer->next)
+        {
+            if(layer->hits_name == NULL)
+            {
+                continue;
+            }
+
+            snprintf(labels, sizeof(labels), "%s,layer=\"%s\",kind=\"%s\"", target_label, layer->name, layer->hits_name);
+            light_metrics_value(out, "light_layer_hits_total", labels, layer->hits);
+        }
+    }
+
+    free(targets);
+}
+
@@ -0,0 +1,66 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "liblight.h"
+
+// Counters and latency histograms of long-running processes
+// Everything is counted with relaxed atomic increments where it happens, so that keeping the numbers costs next to nothing on
+// the hot path, and a reader on another thread (the metrics socket, a library user) sees consistent enough values without locks.
+// light_metrics_* write them in the Prometheus text format.
+
+// Number of power-of-two buckets of a histogram, the first counts durations below 1 µs
+#define LIGHT_HISTOGRAM_BUCKETS 32
+
+typedef struct _light_histogram_t light_histogram_t;
+struct _light_histogram_t
+{
+    uint64_t    count;
+    uint64_t    sum_ns;
+    uint64_t    max_ns;
+    uint64_t    buckets[LIGHT_HISTOGRAM_BUCKETS]; // Bucket i counts durations in [2^(i-1), 2^i) µs
+};
+
+// Operations on a target that are counted by the middleware
+typedef enum
+{
+    LIGHT_OP_SET = 0,
+    LIGHT_OP_GET,
+    LIGHT_OP_GET_MAX,
+    LIGHT_OP_COUNT
+} light_op_t;
+
+typedef struct _light_target_metrics_t light_target_metrics_t;
+struct _light_target_metrics_t
+{
+    light_histogram_t   latency[LIGHT_OP_COUNT]; // Calls that reached the implementation, failed ones included
+    uint64_t            failures[LIGHT_OP_COUNT];
+};
+
+/* Increments a counter that may be read by other threads */
+#define LIGHT_COUNT(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+/* Records a duration in `histogram` */
+void light_histogram_add(light_histogram_t *histogram, uint64_t duration_ns);
+
+/* Returns the duration under which `fraction` (0.99 for p99) of the recorded ones were, in nanoseconds */
+uint64_t light_histogram_percentile(light_histogram_t const *histogram, double fraction);
+
+/* Returns the name of an operation, as used in labels */
+char const *light_op_name(light_op_t op);
+
+/* Writes the HELP and TYPE lines of a metric, followed by its samples written with the functions below */
+void light_metrics_family(FILE *out, char const *name, char const *type, char const *help);
+
+/* Writes a sample of a counter or gauge. `labels` is a preformatted label list without braces, or NULL. */
+void light_metrics_value(FILE *out, char const *name, char const *labels, uint64_t value);
+
+/* Writes the _bucket, _sum and _count samples of a histogram in seconds */
+void light_metrics_histogram(FILE *out, char const *name, char const *labels, light_histogram_t const *histogram);
+
+/* Writes the operation counts, failures and latencies, and the layer counters of every target of `ctx` that was used */
+void light_metrics_write_targets(FILE *out, light_context_t *ctx);
+
@@ -0,0 +1,393 @@
+
+#include "middleware.h"
+#include "helpers.h"
+#include "loop.h"
+#include "trace.h"
+#include "probes.h"
+
+#include <stdlib.h> // malloc, free
+#include <string.h> // memset
+#include <stdio.h> // printf
+#include <inttypes.h> // PRIu64
+
+// How long a value read from or written to a target is trusted. Something else (firmware hotkeys, another program) may change
+// the target meanwhile, so cached values only save work within bursts of calls, such as the frames of an animation.
+#define LIGHT_MIDDLEWARE_FRESH_NS (1000ull * 1000000ull)
+
+// Clamps written values to the minimum cap, and the maximum cap and max value of the target
+typedef struct
+{
+    light_layer_t   layer;
+    bool            minimum_known;
+    uint64_t        minimum;
+    uint64_t        maximum; // Cap of the configuration file, read along with the minimum
+    uint64_t        minimum_time_ns;
+} _light_clamp_layer_t;
+
+// Skips writes of the value the target is known to have
+typedef struct
+{
+    light_layer_t   layer;
+    bool            value_known;
+    uint64_t        value;
+    uint64_t        value_time_ns;
+} _light_write_cache_layer_t;
+
+// Reads the max value once, it doesn't change
+typedef struct
+{
+    light_layer_t   layer;
+    bool            max_known;
+    uint64_t        max_value;
+} _light_max_cache_layer_t;
+
+static void *_light_layer_create(size_t size, char const *name, char const *hits_name)
+{
+    light_layer_t *layer = malloc(size);
+    memset(layer, 0, size);
+    layer->name = name;
+    layer->hits_name = hits_name;
+    return layer;
+}
+
+static bool _light_clamp_set(light_layer_t *layer, light_device_target_t *target, uint64_t value)
+{
+    _light_clamp_layer_t *clamp = (_light_clamp_layer_t*)layer;
+
+    uint64_t now_ns = light_loop_now_ns();
+    if(!clamp->minimum_known || now_ns - clamp->minimum_time_ns > LIGHT_MIDDLEWARE_FRESH_NS)
+    {
+        clamp->minimum = light_get_min_cap(target->device->enumerator->context, target);
+        clamp->maximum = light_get_max_cap(target->device->enumerator->context, target);
+        clamp->minimum_known = true;
+        clamp->minimum_time_ns = now_ns;
+    }
+
+    uint64_t max_value = 0;
+    if(!light_layer_get_max(layer->next, target, &max_value))
+    {
+        return false;
+    }
+
+    // The max value and maximum cap win over a minimum cap above them
+    if(max_value > clamp->maximum)
+    {
+        max_value = clamp->maximum;
+    }
+
+    uint64_t clamped = value < clamp->minimum ? clamp->minimum : value;
+    if(clamped > max_value)
+    {
+        clamped = max_value;
+    }
+
+    if(clamped != value)
+    {
+        LIGHT_COUNT(layer->hits);
+        LIGHT_TARGET_PROBE4(clamp, target, value, clamped, clamp->minimum, max_value);
+    }
+
+    return light_layer_set(layer->next, target, clamped);
+}
+
+static void _light_clamp_forget(light_layer_t *layer)
+{
+    ((_light_clamp_layer_t*)layer)->minimum_known = false;
+}
+
+static bool _light_write_cache_set(light_layer_t *layer, light_device_target_t *target, uint64_t value)
+{
+    _light_write_cache_layer_t *cache = (_light_write_cache_layer_t*)layer;
+
+    uint64_t now_ns = light_loop_now_ns();
+    if(cache->value_known && cache->value == value && now_ns - cache->value_time_ns <= LIGHT_MIDDLEWARE_FRESH_NS)
+    {
+        LIGHT_COUNT(layer->hits);
+        return true;
+    }
+
+    if(!light_layer_set(layer->next, target, value))
+    {
+        // We don't know what the target ended up at
+        cache->value_known = false;
+        return false;
+    }
+
+    cache->value_known = true;
+    cache->value = value;
+    cache->value_time_ns = now_ns;
+    return true;
+}
+
+static bool _light_write_cache_get(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value)
+{
+    _light_write_cache_layer_t *cache = (_light_write_cache_layer_t*)layer;
+
+    // Reads always go to the target, they are what notices changes made by others
+    if(!light_layer_get(layer->next, target, out_value))
+    {
+        cache->value_known = false;
+        return false;
+    }
+
+    cache->value_known = true;
+    cache->value = *out_value;
+    cache->value_time_ns = light_loop_now_ns();
+    return true;
+}
+
+static void _light_write_cache_forget(light_layer_t *layer)
+{
+    ((_light_write_cache_layer_t*)layer)->value_known = false;
+}
+
+static bool _light_max_cache_get_max(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value)
+{
+    _light_max_cache_layer_t *cache = (_light_max_cache_layer_t*)layer;
+
+    if(cache->max_known)
+    {
+        LIGHT_COUNT(layer->hits);
+        *out_value = cache->max_value;
+        return true;
+    }
+
+    if(!light_layer_get_max(layer->next, target, out_value))
+    {
+        return false;
+    }
+
+    cache->max_known = true;
+    cache->max_value = *out_value;
+    return true;
+}
+
+static void _light_max_cache_forget(light_layer_t *layer)
+{
+    ((_light_max_cache_layer_t*)layer)->max_known = false;
+}
+
+// Counts and times every call that goes to the device, and folds the cost of writes into the latency estimate of the target,
+// which animations are paced by
+static bool _light_timing_set(light_layer_t *layer, light_device_target_t *target, uint64_t value)
+{
+    uint64_t start_ns = light_loop_now_ns();
+    bool success = light_layer_set(layer->next, target, value);
+    uint64_t latency_ns = light_loop_now_ns() - start_ns;
+
+    light_histogram_add(&target->metrics.latency[LIGHT_OP_SET], latency_ns);
+    if(!success)
+    {
+        LIGHT_COUNT(target->metrics.failures[LIGHT_OP_SET]);
+        return false;
+    }
+
+    target->write_latency_ns = target->write_latency_ns == 0 ? latency_ns : (target->write_latency_ns * 7 + latency_ns) / 8;
+    return true;
+}
+
+static bool _light_timing_get(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value)
+{
+    uint64_t start_ns = light_loop_now_ns();
+    bool success = light_layer_get(layer->next, target, out_value);
+
+    light_histogram_add(&target->metrics.latency[LIGHT_OP_GET], light_loop_now_ns() - start_ns);
+    if(!success)
+    {
+        LIGHT_COUNT(target->metrics.failures[LIGHT_OP_GET]);
+    }
+
+    return success;
+}
+
+static bool _light_timing_get_max(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value)
+{
+    uint64_t start_ns = light_loop_now_ns();
+    bool success = light_layer_get_max(layer->next, target, out_value);
+
+    light_histogram_add(&target->metrics.latency[LIGHT_OP_GET_MAX], light_loop_now_ns() - start_ns);
+    if(!success)
+    {
+        LIGHT_COUNT(target->metrics.failures[LIGHT_OP_GET_MAX]);
+    }
+
+    return success;
+}
+
+bool light_middleware_init(light_device_target_t *target)
+{
+    // Pushed bottom first
+    light_trace_attach(target);
+
+    light_layer_t *timing = _light_layer_create(sizeof(light_layer_t), "timing", NULL);
+    timing->set_value = _light_timing_set;
+    timing->get_value = _light_timing_get;
+    timing->get_max_value = _light_timing_get_max;
+    light_middleware_push(target, timing);
+
+    light_layer_t *max_cache = _light_layer_create(sizeof(_light_max_cache_layer_t), "max cache", "cached");
+    max_cache->get_max_value = _light_max_cache_get_max;
+    max_cache->forget = _light_max_cache_forget;
+    light_middleware_push(target, max_cache);
+
+    light_layer_t *write_cache = _light_layer_create(sizeof(_light_write_cache_layer_t), "write cache", "skipped");
+    write_cache->set_value = _light_write_cache_set;
+    write_cache->get_value = _light_write_cache_get;
+    write_cache->forget = _light_write_cache_forget;
+    light_middleware_push(target, write_cache);
+
+    light_layer_t *clamp = _light_layer_create(sizeof(_light_clamp_layer_t), "clamp", "clamped");
+    clamp->set_value = _light_clamp_set;
+    clamp->forget = _light_clamp_forget;
+    light_middleware_push(target, clamp);
+
+    return true;
+}
+
+void light_middleware_free(light_device_target_t *target)
+{
+    light_layer_t *layer = target->layers;
+    while(layer != NULL)
+    {
+        light_layer_t *next = layer->next;
+        free(layer);
+        layer = next;
+    }
+
+    target->layers = NULL;
+}
+
+void light_middleware_push(light_device_target_t *target, light_layer_t *layer)
+{
+    layer->next = target->layers;
+    target->layers = layer;
+}
+
+void light_middleware_seed_max(light_device_target_t *target, uint64_t max_value)
+{
+    for(light_layer_t *layer = target->layers; layer != NULL; layer = layer->next)
+    {
+        if(layer->get_max_value == _light_max_cache_get_max)
+        {
+            _light_max_cache_layer_t *cache = (_light_max_cache_layer_t*)layer;
+            cache->max_known = true;
+            cache->max_value = max_value;
+        }
+    }
+}
+
+void light_middleware_forget(light_device_target_t *target)
+{
+    for(light_layer_t *layer = target->layers; layer != NULL; layer = layer->next)
+    {
+        if(layer->forget != NULL)
+        {
+            layer->forget(layer);
+        }
+    }
+}
+
+bool light_layer_set(light_layer_t *layer, light_device_target_t *target, uint64_t value)
+{
+    while(layer != NULL && layer->set_value == NULL)
+    {
+        layer = layer->next;
+    }
+
+    if(layer == NULL)
+    {
+        return target->impl.set_value(target, value);
+    }
+
+    LIGHT_COUNT(layer->calls);
+    return layer->set_value(layer, target, value);
+}
+
+bool light_layer_get(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value)
+{
+    while(layer != NULL && layer->get_value == NULL)
+    {
+        layer = layer->next;
+    }
+
+    if(layer == NULL)
+    {
+        return target->impl.get_value(target, out_value);
+    }
+
+    LIGHT_COUNT(layer->calls);
+    return layer->get_value(layer, target, out_value);
+}
+
+bool light_layer_get_max(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value)
+{
+    while(layer != NULL && layer->get_max_value == NULL)
+    {
+        layer = layer->next;
+    }
+
+    if(layer == NULL)
+    {
+        return target->impl.get_max_value(target, out_value);
+    }
+
+    LIGHT_COUNT(layer->calls);
+    return layer->get_max_value(layer, target, out_value);
+}
+
+bool light_middleware_set(light_device_target_t *target, uint64_t value)
+{
+    LIGHT_TARGET_PROBE1(set__entry, target, value);
+    bool success = light_layer_set(target->layers, target, value);
+    LIGHT_TARGET_PROBE2(set__return, target, value, success);
+    return success;
+}
+
+bool light_middleware_get(light_device_target_t *target, uint64_t *out_value)
+{
+    LIGHT_TARGET_PROBE0(get__entry, target);
+    bool success = light_layer_get(target->layers, target, out_value);
+    LIGHT_TARGET_PROBE2(get__return, target, success ? *out_value : 0, success);
+    return success;
+}
+
+bool light_middleware_get_max(light_device_target_t *target, uint64_t *out_value)
+{
+    LIGHT_TARGET_PROBE0(getmax__entry, target);
+    bool success = light_layer_get_max(target->layers, target, out_value);
+    LIGHT_TARGET_PROBE2(getmax__return, target, success ? *out_value : 0, success);
+    return success;
+}
+
+void light_middleware_print_stats(light_context_t *ctx)
+{
+    for(uint64_t e = 0; e < ctx->num_enumerators; e++)
+    {
+        light_device_enumerator_t *enumerator = ctx->enumerators[e];
+        for(uint64_t d = 0; d < enumerator->num_devices; d++)
+        {
+            light_device_t *device = enumerator->devices[d];
+            for(uint64_t t = 0; t < device->num_targets; t++)
+            {
+                light_device_target_t *target = device->targets[t];
+                for(light_layer_t *layer = target->layers; layer != NULL; layer = layer->next)
+                {
+                    if(layer->calls == 0)
+                    {
+                        continue;
+                    }
+
+                    printf("%s/%s/%s: %s: %" PRIu64 " calls", enumerator->name, device->name, target->name, layer->name, layer->calls);
+                    if(layer->hits_name != NULL)
+                    {
+                        printf(", %" PRIu64 " %s", layer->hits, layer->hits_name);
+                    }
+                    printf("\n");
+                }
+            }
+        }
+    }
+
+    fflush(stdout);
+}
+
@@ -0,0 +1,60 @@
+
+#pragma once
+
+#include "light.h"
+
+// Middleware of device targets
+// The set_value, get_value and get_max_value of every target go through a stack of layers before they reach the implementation,
+// so that clamping, caching and timing are done the same way for all enumerators instead of by every command
+
+typedef struct _light_layer_t light_layer_t;
+
+/* Functions of a layer. They get the layer itself, and pass calls on to the layers below with light_layer_set etc. on `layer->next`. */
+typedef bool (*LFUNCLAYERSET)(light_layer_t*, light_device_target_t*, uint64_t);
+typedef bool (*LFUNCLAYERGET)(light_layer_t*, light_device_target_t*, uint64_t*);
+typedef void (*LFUNCLAYERFORGET)(light_layer_t*);
+
+struct _light_layer_t
+{
+    char const          *name;
+    LFUNCLAYERSET       set_value; // NULL for layers that don't handle writes, the call goes straight to the layer below
+    LFUNCLAYERGET       get_value;
+    LFUNCLAYERGET       get_max_value;
+    LFUNCLAYERFORGET    forget; // Drops whatever the layer has cached, NULL if it caches nothing
+    light_layer_t       *next; // The layer below, NULL if the implementation is below
+
+    uint64_t            calls; // Calls that reached the layer
+    uint64_t            hits; // Calls the layer acted on, as named by hits_name
+    char const          *hits_name; // "skipped", "cached" etc., NULL if the layer only passes calls on
+};
+
+/* Pushes the default layers on `target`: clamping to the minimum cap and max value, skipping writes of the value the target
+ * already has, caching the max value, counting and timing the calls that reach the device (see metrics.h), and recording
+ * them if a trace is written. Called when the target is created. */
+bool light_middleware_init(light_device_target_t *target);
+
+/* Frees all layers of `target` */
+void light_middleware_free(light_device_target_t *target);
+
+/* Pushes `layer` on top of the layers of `target`. The target owns it from now on, and frees it with free(). */
+void light_middleware_push(light_device_target_t *target, light_layer_t *layer);
+
+/* Hands the max value cache of `target` a max value its enumerator read anyway, so that the first call doesn't read it again */
+void light_middleware_seed_max(light_device_target_t *target, uint64_t max_value);
+
+/* Makes the layers of `target` forget what they cached, for when a setting or the device changed behind their back */
+void light_middleware_forget(light_device_target_t *target);
+
+/* Passes a call to `layer`, or to the first layer below it that handles the call, or to the implementation */
+bool light_layer_set(light_layer_t *layer, light_device_target_t *target, uint64_t value);
+bool light_layer_get(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value);
+bool light_layer_get_max(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value);
+
+/* The entry points that the target's set_value, get_value and get_max_value point to */
+bool light_middleware_set(light_device_target_t *target, uint64_t value);
+bool light_middleware_get(light_device_target_t *target, uint64_t *out_value);
+bool light_middleware_get_max(light_device_target_t *target, uint64_t *out_value);
+
+/* Prints the counters of every layer that was used, for all targets of `ctx` */
+void light_middleware_print_stats(light_context_t *ctx);
+
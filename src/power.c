@@ -0,0 +1,227 @@
+
+#include "power.h"
+#include "helpers.h"
+
+#include <stdlib.h> // malloc, free, secure_getenv
+#include <string.h> // memset, strcmp, strncmp, strerror
+#include <stdio.h> // snprintf
+#include <errno.h>
+#include <fcntl.h> // openat
+#include <unistd.h> // read, close
+#include <dirent.h> // DT_DIR, DT_LNK
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+// Size of the receive buffer for uevents, which are at most a few kilobytes
+#define LIGHT_POWER_UEVENT_SIZE 8192
+
+static char const * const _light_power_supplies_path = "/sys/class/power_supply";
+
+// Where the power supplies are read from. $LIGHT_POWER_SUPPLIES points at a fake tree for testing, it isn't honored in SUID
+// mode, where it would let anyone pick which profile root applies.
+static char const *_light_power_supplies_dir()
+{
+    char const *path = secure_getenv("LIGHT_POWER_SUPPLIES");
+    return path != NULL ? path : _light_power_supplies_path;
+}
+
+// Batteries are the only supplies that don't power the machine from outside
+static bool _light_power_is_external(char const *type)
+{
+    return strcmp(type, "Battery") != 0;
+}
+
+static void _light_power_update(light_power_t *power, char const *name, bool online)
+{
+    for(uint64_t i = 0; i < power->num_supplies; i++)
+    {
+        if(strcmp(power->supplies[i].name, name) == 0)
+        {
+            power->supplies[i].online = online;
+            return;
+        }
+    }
+
+    if(power->num_supplies == LIGHT_POWER_MAX_SUPPLIES)
+    {
+        LIGHT_WARN("too many power supplies, ignoring %s", name);
+        return;
+    }
+
+    snprintf(power->supplies[power->num_supplies].name, NAME_MAX, "%s", name);
+    power->supplies[power->num_supplies].online = online;
+    power->num_supplies++;
+}
+
+static bool _light_power_is_on_ac(light_power_t *power)
+{
+    for(uint64_t i = 0; i < power->num_supplies; i++)
+    {
+        if(power->supplies[i].online)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Applies the profile of the current power source, if it changed
+static void _light_power_apply(light_power_t *power, bool force)
+{
+    bool on_ac = _light_power_is_on_ac(power);
+    if(on_ac == power->on_ac && !force)
+    {
+        return;
+    }
+
+    power->on_ac = on_ac;
+    char const *profile = on_ac ? "ac" : "battery";
+    LIGHT_NOTE("power source changed, applying the %s profile", profile);
+
+    if(!light_apply_profile(power->ctx, profile))
+    {
+        LIGHT_ERR("failed to apply the %s profile to all targets", profile);
+    }
+}
+
+static bool _light_power_add_supply(int dirfd, char const *name, unsigned char type, void *userdata)
+{
+    light_power_t *power = (light_power_t*)userdata;
+
+    char type_path[NAME_MAX];
+    snprintf(type_path, sizeof(type_path), "%s/type", name);
+
+    char supply_type[32] = "";
+    int type_fd = openat(dirfd, type_path, O_RDONLY | O_CLOEXEC);
+    if(type_fd >= 0)
+    {
+        ssize_t length = read(type_fd, supply_type, sizeof(supply_type) - 1);
+        close(type_fd);
+
+        supply_type[length > 0 ? length : 0] = '\0';
+        supply_type[strcspn(supply_type, "\n")] = '\0';
+    }
+
+    if(!_light_power_is_external(supply_type))
+    {
+        return true;
+    }
+
+    char online_path[NAME_MAX];
+    snprintf(online_path, sizeof(online_path), "%s/online", name);
+
+    uint64_t online = 0;
+    if(light_file_read_uint64_at(dirfd, online_path, &online))
+    {
+        _light_power_update(power, name, online != 0);
+    }
+
+    return true;
+}
+
+static bool _light_power_uevent(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_power_t *power = (light_power_t*)userdata;
+
+    char buffer[LIGHT_POWER_UEVENT_SIZE];
+    ssize_t length = recv(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+    if(length < 0)
+    {
+        if(errno == EAGAIN || errno == EINTR || errno == ENOBUFS)
+        {
+            // ENOBUFS means that events were lost, whatever is next still has the current state
+            return true;
+        }
+
+        LIGHT_ERR("failed to receive uevent: %s", strerror(errno));
+        return false;
+    }
+    buffer[length] = '\0';
+
+    // "action@devpath", followed by KEY=value strings
+    char const *subsystem = NULL;
+    char const *name = NULL;
+    char const *type = "";
+    char const *online = NULL;
+    for(char const *field = buffer + strlen(buffer) + 1; field < buffer + length; field += strlen(field) + 1)
+    {
+        if(strncmp(field, "SUBSYSTEM=", 10) == 0)
+        {
+            subsystem = field + 10;
+        }
+        else if(strncmp(field, "POWER_SUPPLY_NAME=", 18) == 0)
+        {
+            name = field + 18;
+        }
+        else if(strncmp(field, "POWER_SUPPLY_TYPE=", 18) == 0)
+        {
+            type = field + 18;
+        }
+        else if(strncmp(field, "POWER_SUPPLY_ONLINE=", 20) == 0)
+        {
+            online = field + 20;
+        }
+    }
+
+    if(subsystem == NULL || strcmp(subsystem, "power_supply") != 0 || name == NULL || online == NULL || !_light_power_is_external(type))
+    {
+        return true;
+    }
+
+    _light_power_update(power, name, strcmp(online, "0") != 0);
+    _light_power_apply(power, false);
+    return true;
+}
+
+light_power_t *light_power_create(light_context_t *ctx, light_loop_t *loop)
+{
+    int uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if(uevent_fd < 0)
+    {
+        LIGHT_ERR("failed to open uevent socket: %s", strerror(errno));
+        return NULL;
+    }
+
+    // Group 1 has the events of the kernel
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;
+    if(bind(uevent_fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        LIGHT_ERR("failed to listen to uevents: %s", strerror(errno));
+        close(uevent_fd);
+        return NULL;
+    }
+
+    light_power_t *power = malloc(sizeof(light_power_t));
+    power->ctx = ctx;
+    power->loop = loop;
+    power->uevent_fd = uevent_fd;
+    power->num_supplies = 0;
+    power->on_ac = false;
+
+    // The socket is already listening, so no change can slip in between reading the initial state and watching it
+    if(!light_dir_scan(_light_power_supplies_dir(), LIGHT_DT_MASK(DT_DIR) | LIGHT_DT_MASK(DT_LNK), _light_power_add_supply, power))
+    {
+        LIGHT_WARN("couldn't list power supplies");
+    }
+
+    if(!light_loop_add(loop, uevent_fd, EPOLLIN, _light_power_uevent, power, "power"))
+    {
+        light_power_free(power);
+        return NULL;
+    }
+
+    _light_power_apply(power, true);
+    return power;
+}
+
+void light_power_free(light_power_t *power)
+{
+    light_loop_remove(power->loop, power->uevent_fd);
+    close(power->uevent_fd);
+    free(power);
+}
+
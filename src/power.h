@@ -0,0 +1,36 @@
+
+#pragma once
+
+#include "light.h"
+#include "loop.h"
+
+// Power source profiles for the daemon
+// Listens to power_supply uevents from the kernel, and applies the ac or battery profile of every target when the machine
+// switches between them. The power supplies are only read from sysfs once, at startup.
+
+#define LIGHT_POWER_MAX_SUPPLIES 8
+
+typedef struct _light_power_t light_power_t;
+struct _light_power_t
+{
+    light_context_t *ctx;
+    light_loop_t    *loop;
+    int             uevent_fd; // NETLINK_KOBJECT_UEVENT socket
+
+    // External supplies (mains, usb), the machine is on ac while any of them is online
+    struct
+    {
+        char        name[NAME_MAX];
+        bool        online;
+    } supplies[LIGHT_POWER_MAX_SUPPLIES];
+    uint64_t        num_supplies;
+
+    bool            on_ac;
+};
+
+/* Applies the profile of the current power source, then keeps following it. Returns NULL on failure. */
+light_power_t *light_power_create(light_context_t *ctx, light_loop_t *loop);
+
+/* Stops following the power source */
+void light_power_free(light_power_t *power);
+
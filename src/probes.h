@@ -0,0 +1,58 @@
+
+#pragma once
+
+#include "config.h"
+
+#include <stdint.h>
+
+// USDT probes, for bpftrace, perf and SystemTap
+// Built in when sys/sdt.h is available (systemtap-sdt-dev or similar) unless configured with --disable-probes. A probe that
+// nothing is attached to is a single nop, its arguments are only pointers and integers already at hand.
+//
+// Probes of the provider "light", with their arguments:
+//   enumerate__start     enumerator name
+//   enumerate__done      enumerator name, number of devices, success
+//   resolve__start       target path as given
+//   resolve__done        target path as given, the target or 0 if there is none
+//   set__entry           enumerator, device and target name, raw value
+//   set__return          enumerator, device and target name, raw value, success
+//   get__entry           enumerator, device and target name
+//   get__return          enumerator, device and target name, raw value read, success
+//   getmax__entry        enumerator, device and target name
+//   getmax__return       enumerator, device and target name, raw max value, success
+//   clamp                enumerator, device and target name, requested value, written value, minimum cap, max value
+//   command__start       address of the command function (light_cmd_*), target name or 0
+//   command__done        address of the command function, success
+//
+// For example, the time every write takes, by target:
+//   bpftrace -e 'usdt:/usr/bin/light:light:set__entry { @start[tid] = nsecs; }
+//                usdt:/usr/bin/light:light:set__return /@start[tid]/ { @us[str(arg2)] = hist((nsecs - @start[tid]) / 1000); delete(@start[tid]); }'
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define LIGHT_PROBE1(probe, a)                    DTRACE_PROBE1(light, probe, a)
+#define LIGHT_PROBE2(probe, a, b)                 DTRACE_PROBE2(light, probe, a, b)
+#define LIGHT_PROBE3(probe, a, b, c)              DTRACE_PROBE3(light, probe, a, b, c)
+#define LIGHT_PROBE4(probe, a, b, c, d)           DTRACE_PROBE4(light, probe, a, b, c, d)
+#define LIGHT_PROBE5(probe, a, b, c, d, e)        DTRACE_PROBE5(light, probe, a, b, c, d, e)
+#define LIGHT_PROBE7(probe, a, b, c, d, e, f, g)  DTRACE_PROBE7(light, probe, a, b, c, d, e, f, g)
+
+#else
+
+#define LIGHT_PROBE1(probe, a)                    ((void)0)
+#define LIGHT_PROBE2(probe, a, b)                 ((void)0)
+#define LIGHT_PROBE3(probe, a, b, c)              ((void)0)
+#define LIGHT_PROBE4(probe, a, b, c, d)           ((void)0)
+#define LIGHT_PROBE5(probe, a, b, c, d, e)        ((void)0)
+#define LIGHT_PROBE7(probe, a, b, c, d, e, f, g)  ((void)0)
+
+#endif
+
+/* Probes of a target, whose arguments start with the enumerator, device and target name of `target` */
+#define LIGHT_TARGET_PROBE0(probe, target)              LIGHT_PROBE3(probe, (target)->device->enumerator->name, (target)->device->name, (target)->name)
+#define LIGHT_TARGET_PROBE1(probe, target, a)           LIGHT_PROBE4(probe, (target)->device->enumerator->name, (target)->device->name, (target)->name, a)
+#define LIGHT_TARGET_PROBE2(probe, target, a, b)        LIGHT_PROBE5(probe, (target)->device->enumerator->name, (target)->device->name, (target)->name, a, b)
+#define LIGHT_TARGET_PROBE4(probe, target, a, b, c, d)  LIGHT_PROBE7(probe, (target)->device->enumerator->name, (target)->device->name, (target)->name, a, b, c, d)
+
@@ -0,0 +1,602 @@
+
+#include "publish.h"
+#include "helpers.h"
+
+#include <stdio.h> // snprintf
+#include <stdlib.h> // malloc, calloc, free
+#include <string.h> // memset, memchr, memmove, strcmp, strncmp, strerror, strtok_r
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <fnmatch.h>
+#include <unistd.h> // close
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+// Size of the receive buffer for uevents, which are at most a few kilobytes
+#define LIGHT_PUBLISH_UEVENT_SIZE 8192
+
+// Sits on top of the middleware of a target, and publishes what the daemon writes to it
+typedef struct _light_publish_layer_t
+{
+    light_layer_t       layer;
+    light_publisher_t   *publisher; // NULL once the publisher is freed, the target still owns the layer
+    uint64_t            index; // Of the target in the publisher
+} _light_publish_layer_t;
+
+static void _light_publish_drop(light_publish_client_t *client)
+{
+    light_publisher_t *publisher = client->publisher;
+    for(uint64_t i = 0; i < publisher->num_clients; i++)
+    {
+        if(publisher->clients[i] == client)
+        {
+            publisher->clients[i] = publisher->clients[--publisher->num_clients];
+            break;
+        }
+    }
+
+    light_loop_remove(publisher->loop, client->fd);
+    close(client->fd);
+    free(client->matches);
+    free(client->pending);
+    free(client);
+}
+
+// Waits for what `client` can do next: send its subscription, and take the rest of an event if `waiting`
+static void _light_publish_watch(light_publish_client_t *client, bool waiting)
+{
+    uint32_t events = (client->read_closed ? 0 : EPOLLIN) | (waiting ? EPOLLOUT : 0);
+    if(light_loop_modify(client->publisher->loop, client->fd, events))
+    {
+        client->waiting = waiting;
+    }
+}
+
+// Formats the latest value of `target` as an event line of `client`
+static bool _light_publish_format(light_publish_client_t *client, light_publish_target_t *target)
+{
+    uint64_t max_value = 0;
+    double percent = 0.0;
+    if(!target->target->get_max_value(target->target, &max_value) || !light_raw_to_percent(target->target, target->value, &percent))
+    {
+        return false;
+    }
+
+    int length = 0;
+    if(client->format == LIGHT_PUBLISH_JSON)
+    {
+        length = snprintf(client->line, sizeof(client->line), "{\"target\":\"%s\",\"percent\":%.2f,\"value\":%" PRIu64 ",\"max\":%" PRIu64 "}\n",
+                          target->path, percent, target->value, max_value);
+    }
+    else
+    {
+        length = snprintf(client->line, sizeof(client->line), "%s %.2f %" PRIu64 " %" PRIu64 "\n", target->path, percent, target->value, max_value);
+    }
+
+    if(length < 0 || (size_t)length >= sizeof(client->line))
+    {
+        return false;
+    }
+
+    client->line_length = (uint64_t)length;
+    client->line_sent = 0;
+    return true;
+}
+
+// Sends the pending events of `client` until they are all sent or its socket is full. Returns false if the client is gone.
+static bool _light_publish_flush(light_publish_client_t *client)
+{
+    light_publisher_t *publisher = client->publisher;
+    while(true)
+    {
+        if(client->line_sent < client->line_length)
+        {
+            ssize_t sent = send(client->fd, client->line + client->line_sent, client->line_length - client->line_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(sent < 0)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+
+                if(errno != EAGAIN)
+                {
+                    return false;
+                }
+
+                // The rest goes out once the client reads, meanwhile new changes only update what is pending
+                if(!client->waiting)
+                {
+                    _light_publish_watch(client, true);
+                }
+
+                return true;
+            }
+
+            client->line_sent += (uint64_t)sent;
+            continue;
+        }
+
+        // The next pending target, round robin
+        uint64_t index = 0;
+        bool found = false;
+        for(uint64_t i = 0; i < publisher->num_targets && !found; i++)
+        {
+            index = (client->next_target + i) % publisher->num_targets;
+            found = client->pending[index];
+        }
+
+        if(!found)
+        {
+            if(client->waiting)
+            {
+                _light_publish_watch(client, false);
+            }
+
+            return true;
+        }
+
+        client->pending[index] = false;
+        client->next_target = index + 1;
+        if(_light_publish_format(client, &publisher->targets[index]))
+        {
+            publisher->events++;
+        }
+    }
+}
+
+// Records the value of a target, and hands it to the clients that follow it if it changed
+static void _light_publish_update(light_publisher_t *publisher, uint64_t index, uint64_t value)
+{
+    light_publish_target_t *target = &publisher->targets[index];
+    if(target->known && target->value == value)
+    {
+        return;
+    }
+
+    target->known = true;
+    target->value = value;
+    publisher->changes++;
+
+    // Clients may be dropped while iterating, which moves the last one in their place
+    for(uint64_t i = 0; i < publisher->num_clients;)
+    {
+        light_publish_client_t *client = publisher->clients[i];
+        if(!client->subscribed || !client->matches[index])
+        {
+            i++;
+            continue;
+        }
+
+        if(client->pending[index])
+        {
+            publisher->coalesced++;
+        }
+        client->pending[index] = true;
+
+        if(client->waiting)
+        {
+            i++;
+        }
+        else if(_light_publish_flush(client))
+        {
+            i++;
+        }
+        else
+        {
+            _light_publish_drop(client);
+        }
+    }
+}
+
+// Reads the value of a target from the device, and publishes it if it changed
+static void _light_publish_refresh(light_publisher_t *publisher, uint64_t index)
+{
+    light_device_target_t *target = publisher->targets[index].target;
+
+    uint64_t value = 0;
+    light_middleware_forget(target);
+    if(target->get_value(target, &value))
+    {
+        _light_publish_update(publisher, index, value);
+    }
+}
+
+static bool _light_publish_layer_set(light_layer_t *layer, light_device_target_t *target, uint64_t value)
+{
+    _light_publish_layer_t *publish = (_light_publish_layer_t*)layer;
+    if(!light_layer_set(layer->next, target, value))
+    {
+        return false;
+    }
+
+    // The value as clamped, from the write cache below
+    uint64_t written = 0;
+    if(publish->publisher != NULL && light_layer_get(layer->next, target, &written))
+    {
+        _light_publish_update(publish->publisher, publish->index, written);
+    }
+
+    return true;
+}
+
+// Handles the subscription line of `client`. Returns false if it isn't valid.
+static bool _light_publish_subscribe(light_publish_client_t *client, char *request)
+{
+    light_publisher_t *publisher = client->publisher;
+
+    char *save_ptr = NULL;
+    char const *format = strtok_r(request, " \t\r\n", &save_ptr);
+    if(format == NULL || strcmp(format, "text") == 0)
+    {
+        client->format = LIGHT_PUBLISH_TEXT;
+    }
+    else if(strcmp(format, "json") == 0)
+    {
+        client->format = LIGHT_PUBLISH_JSON;
+    }
+    else
+    {
+        LIGHT_WARN("publish: unknown format \"%s\"", format);
+        return false;
+    }
+
+    bool any_pattern = false;
+    for(char const *pattern = strtok_r(NULL, " \t\r\n", &save_ptr); pattern != NULL; pattern = strtok_r(NULL, " \t\r\n", &save_ptr))
+    {
+        any_pattern = true;
+
+        char const *alias_path = light_conf_alias(publisher->ctx->sys_params.conf, pattern);
+        if(alias_path != NULL)
+        {
+            pattern = alias_path;
+        }
+
+        for(uint64_t t = 0; t < publisher->num_targets; t++)
+        {
+            client->matches[t] |= fnmatch(pattern, publisher->targets[t].path, 0) == 0;
+        }
+    }
+
+    // The current values first, read once for targets no one asked about yet
+    for(uint64_t t = 0; t < publisher->num_targets; t++)
+    {
+        client->matches[t] |= !any_pattern;
+        if(client->matches[t] && !publisher->targets[t].known)
+        {
+            _light_publish_refresh(publisher, t);
+        }
+
+        client->pending[t] = client->matches[t] && publisher->targets[t].known;
+    }
+
+    client->subscribed = true;
+    return _light_publish_flush(client);
+}
+
+static bool _light_publish_client_event(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_publish_client_t *client = (light_publish_client_t*)userdata;
+
+    // Hung up for good, after shutting down its side
+    if((events & (EPOLLHUP | EPOLLERR)) && client->read_closed)
+    {
+        _light_publish_drop(client);
+        return true;
+    }
+
+    if(events & EPOLLOUT)
+    {
+        if(!_light_publish_flush(client))
+        {
+            _light_publish_drop(client);
+            return true;
+        }
+    }
+
+    if(!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    {
+        return true;
+    }
+
+    // Anything sent after the subscription line is ignored
+    char discard[LIGHT_PUBLISH_REQUEST_MAX];
+    char *buffer = client->subscribed ? discard : client->request + client->request_length;
+    size_t size = client->subscribed ? sizeof(discard) : sizeof(client->request) - client->request_length - 1;
+
+    ssize_t length = recv(fd, buffer, size, MSG_DONTWAIT);
+    if(length < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return true;
+    }
+
+    // A subscribed client that is done sending may still be reading, such as `echo json | socat - UNIX-CONNECT:...`
+    if(length == 0 && client->subscribed)
+    {
+        client->read_closed = true;
+        _light_publish_watch(client, client->waiting);
+        return true;
+    }
+
+    if(length <= 0)
+    {
+        _light_publish_drop(client);
+        return true;
+    }
+
+    if(client->subscribed)
+    {
+        return true;
+    }
+
+    client->request_length += (uint64_t)length;
+    client->request[client->request_length] = '\0';
+
+    char *end = memchr(client->request, '\n', client->request_length);
+    if(end == NULL)
+    {
+        if(client->request_length == sizeof(client->request) - 1)
+        {
+            LIGHT_WARN("publish: subscription too long");
+            _light_publish_drop(client);
+        }
+
+        return true;
+    }
+
+    *end = '\0';
+    if(!_light_publish_subscribe(client, client->request))
+    {
+        _light_publish_drop(client);
+    }
+
+    return true;
+}
+
+static bool _light_publish_accept(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_publisher_t *publisher = (light_publisher_t*)userdata;
+
+    int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(client_fd < 0)
+    {
+        if(errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        {
+            LIGHT_ERR("failed to accept publish client: %s", strerror(errno));
+        }
+
+        return true;
+    }
+
+    if(publisher->num_clients == LIGHT_PUBLISH_MAX_CLIENTS)
+    {
+        LIGHT_WARN("publish: too many clients, closing a new connection");
+        close(client_fd);
+        return true;
+    }
+
+    light_publish_client_t *client = calloc(1, sizeof(light_publish_client_t));
+    bool *matches = calloc(publisher->num_targets + 1, sizeof(bool));
+    bool *pending = calloc(publisher->num_targets + 1, sizeof(bool));
+    if(client == NULL || matches == NULL || pending == NULL)
+    {
+        LIGHT_MEMERR();
+        free(client);
+        free(matches);
+        free(pending);
+        close(client_fd);
+        return true;
+    }
+
+    client->publisher = publisher;
+    client->fd = client_fd;
+    client->matches = matches;
+    client->pending = pending;
+
+    if(!light_loop_add(loop, client_fd, EPOLLIN, _light_publish_client_event, client, "publish"))
+    {
+        free(client->matches);
+        free(client->pending);
+        free(client);
+        close(client_fd);
+        return true;
+    }
+
+    publisher->clients[publisher->num_clients++] = client;
+    return true;
+}
+
+static bool _light_publish_uevent(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_publisher_t *publisher = (light_publisher_t*)userdata;
+
+    char buffer[LIGHT_PUBLISH_UEVENT_SIZE];
+    ssize_t length = recv(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+    if(length < 0)
+    {
+        if(errno == EAGAIN || errno == EINTR || errno == ENOBUFS)
+        {
+            return true;
+        }
+
+        LIGHT_ERR("failed to receive uevent: %s", strerror(errno));
+        return false;
+    }
+    buffer[length] = '\0';
+
+    // "action@devpath", followed by KEY=value strings
+    char const *action = NULL;
+    char const *subsystem = NULL;
+    for(char const *field = buffer + strlen(buffer) + 1; field < buffer + length; field += strlen(field) + 1)
+    {
+        if(strncmp(field, "ACTION=", 7) == 0)
+        {
+            action = field + 7;
+        }
+        else if(strncmp(field, "SUBSYSTEM=", 10) == 0)
+        {
+            subsystem = field + 10;
+        }
+    }
+
+    if(action == NULL || strcmp(action, "change") != 0 || subsystem == NULL || strcmp(subsystem, "backlight") != 0)
+    {
+        return true;
+    }
+
+    // The kernel sends one for every write to a backlight. Which target it was matters little: the auto target follows one of
+    // them, and rereading the few backlights that have a known value is cheaper than working that out.
+    for(uint64_t t = 0; t < publisher->num_targets; t++)
+    {
+        light_device_target_t *target = publisher->targets[t].target;
+        if(publisher->targets[t].known && strcmp(target->device->enumerator->name, "sysfs") == 0 && strcmp(target->device->name, "backlight") == 0)
+        {
+            _light_publish_refresh(publisher, t);
+        }
+    }
+
+    return true;
+}
+
+// Listens to the uevents of the kernel, returns -1 if that isn't possible
+static int _light_publish_uevent_open()
+{
+    int uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if(uevent_fd < 0)
+    {
+        return -1;
+    }
+
+    // Group 1 has the events of the kernel
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;
+    if(bind(uevent_fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        close(uevent_fd);
+        return -1;
+    }
+
+    return uevent_fd;
+}
+
+light_publisher_t *light_publisher_create(light_context_t *ctx, light_loop_t *loop, int listen_fd)
+{
+    light_publisher_t *publisher = calloc(1, sizeof(light_publisher_t));
+    if(publisher == NULL)
+    {
+        LIGHT_MEMERR();
+        return NULL;
+    }
+
+    publisher->ctx = ctx;
+    publisher->loop = loop;
+    publisher->listen_fd = listen_fd;
+    publisher->uevent_fd = -1;
+
+    uint64_t num_targets = 0;
+    for(uint64_t e = 0; e < ctx->num_enumerators; e++)
+    {
+        for(uint64_t d = 0; d < ctx->enumerators[e]->num_devices; d++)
+        {
+            num_targets += ctx->enumerators[e]->devices[d]->num_targets;
+        }
+    }
+
+    publisher->targets = calloc(num_targets + 1, sizeof(light_publish_target_t));
+    if(publisher->targets == NULL)
+    {
+        LIGHT_MEMERR();
+        free(publisher);
+        return NULL;
+    }
+
+    for(uint64_t e = 0; e < ctx->num_enumerators; e++)
+    {
+        light_device_enumerator_t *enumerator = ctx->enumerators[e];
+        for(uint64_t d = 0; d < enumerator->num_devices; d++)
+        {
+            light_device_t *device = enumerator->devices[d];
+            for(uint64_t t = 0; t < device->num_targets; t++)
+            {
+                _light_publish_layer_t *layer = calloc(1, sizeof(_light_publish_layer_t));
+                if(layer == NULL)
+                {
+                    LIGHT_MEMERR();
+                    continue;
+                }
+
+                light_publish_target_t *target = &publisher->targets[publisher->num_targets];
+                target->target = device->targets[t];
+                snprintf(target->path, sizeof(target->path), "%s/%s/%s", enumerator->name, device->name, device->targets[t]->name);
+
+                layer->layer.name = "publish";
+                layer->layer.set_value = _light_publish_layer_set;
+                layer->publisher = publisher;
+                layer->index = publisher->num_targets;
+                light_middleware_push(target->target, &layer->layer);
+                target->layer = layer;
+
+                publisher->num_targets++;
+            }
+        }
+    }
+
+    // Without uevents, writes of other processes go unnoticed, but those of the daemon are still published
+    publisher->uevent_fd = _light_publish_uevent_open();
+    if(publisher->uevent_fd < 0)
+    {
+        LIGHT_WARN("publish: couldn't listen to uevents, changes made outside the daemon won't be published: %s", strerror(errno));
+    }
+    else if(!light_loop_add(loop, publisher->uevent_fd, EPOLLIN, _light_publish_uevent, publisher, "publish"))
+    {
+        light_publisher_free(publisher);
+        return NULL;
+    }
+
+    if(!light_loop_add(loop, listen_fd, EPOLLIN, _light_publish_accept, publisher, "publish"))
+    {
+        light_publisher_free(publisher);
+        return NULL;
+    }
+
+    return publisher;
+}
+
+void light_publisher_free(light_publisher_t *publisher)
+{
+    while(publisher->num_clients > 0)
+    {
+        _light_publish_drop(publisher->clients[0]);
+    }
+
+    // The layers stay on their targets until those are freed, doing nothing
+    for(uint64_t t = 0; t < publisher->num_targets; t++)
+    {
+        publisher->targets[t].layer->publisher = NULL;
+    }
+
+    light_loop_remove(publisher->loop, publisher->listen_fd);
+    if(publisher->uevent_fd >= 0)
+    {
+        light_loop_remove(publisher->loop, publisher->uevent_fd);
+        close(publisher->uevent_fd);
+    }
+
+    free(publisher->targets);
+    free(publisher);
+}
+
+void light_publisher_write_metrics(light_publisher_t *publisher, FILE *out)
+{
+    light_metrics_family(out, "light_publish_clients", "gauge", "Clients connected to the --publish socket.");
+    light_metrics_value(out, "light_publish_clients", NULL, publisher->num_clients);
+    light_metrics_family(out, "light_publish_changes_total", "counter", "Changes of a target value noticed by the publisher.");
+    light_metrics_value(out, "light_publish_changes_total", NULL, publisher->changes);
+    light_metrics_family(out, "light_publish_events_total", "counter", "Event lines sent to clients.");
+    light_metrics_value(out, "light_publish_events_total", NULL, publisher->events);
+    light_metrics_family(out, "light_publish_coalesced_total", "counter", "Changes a slow client only got the later value of.");
+    light_metrics_value(out, "light_publish_coalesced_total", NULL, publisher->coalesced);
+}
+
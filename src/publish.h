@@ -0,0 +1,95 @@
+
+#pragma once
+
+#include "light.h"
+#include "loop.h"
+#include "middleware.h"
+
+// Change notifications for the daemon (--publish)
+// The daemon watches every target once and fans their changes out to any number of clients on a Unix socket, so that status
+// bars, OSDs and agents don't each keep a watcher of their own. A change is noticed
+//   - when the daemon writes a target itself (hotkeys, idle dimming, schedules, fades), by a layer on top of its middleware,
+//   - when anyone writes a backlight, by the change uevent the kernel sends for it.
+// Other targets (LEDs, DDC monitors) are only published when they are changed by the daemon.
+//
+// A client subscribes by sending one line, a format followed by the target paths to follow, all of them if none is given.
+// Paths may be aliases of the configuration file, or shell patterns:
+//   json sysfs/backlight/* kbd
+// It then gets the current value of every matching target, and a line for every change:
+//   text    <path> <percent> <value> <max value>
+//   json    {"target":"<path>","percent":<percent>,"value":<value>,"max":<max value>}
+// Clients that don't keep up don't queue anything: a client has a pending flag per target, and gets the latest value of each
+// target it fell behind on once it reads again.
+
+// Clients served at once, further connections are closed right away
+#define LIGHT_PUBLISH_MAX_CLIENTS 64
+
+// Longest subscription line
+#define LIGHT_PUBLISH_REQUEST_MAX 512
+
+// Longest event line
+#define LIGHT_PUBLISH_LINE_MAX 512
+
+typedef enum
+{
+    LIGHT_PUBLISH_TEXT = 0,
+    LIGHT_PUBLISH_JSON
+} light_publish_format_t;
+
+typedef struct _light_publisher_t light_publisher_t;
+
+// A target as published
+typedef struct _light_publish_target_t light_publish_target_t;
+struct _light_publish_target_t
+{
+    light_device_target_t   *target;
+    char                    path[NAME_MAX]; // "enumerator/device/target"
+    struct _light_publish_layer_t *layer; // Tells the publisher about the writes of the daemon
+    bool                    known; // Whether the value was read or written since the daemon started
+    uint64_t                value;
+};
+
+typedef struct _light_publish_client_t light_publish_client_t;
+struct _light_publish_client_t
+{
+    light_publisher_t       *publisher;
+    int                     fd;
+    bool                    subscribed; // Whether the subscription line was received
+    char                    request[LIGHT_PUBLISH_REQUEST_MAX];
+    uint64_t                request_length;
+    light_publish_format_t  format;
+    bool                    *matches; // Per target, whether the client follows it
+    bool                    *pending; // Per target, whether the client has yet to get its latest value
+    uint64_t                next_target; // Where the search for a pending target starts, so that busy targets don't starve others
+    char                    line[LIGHT_PUBLISH_LINE_MAX]; // The event being sent
+    uint64_t                line_length;
+    uint64_t                line_sent;
+    bool                    waiting; // Whether the socket is full, and the loop waits for it to be writable
+    bool                    read_closed; // Whether the client shut its side down, it may still be reading
+};
+
+struct _light_publisher_t
+{
+    light_context_t         *ctx;
+    light_loop_t            *loop;
+    int                     listen_fd;
+    int                     uevent_fd; // NETLINK_KOBJECT_UEVENT socket, -1 if unavailable
+    light_publish_target_t  *targets;
+    uint64_t                num_targets;
+    light_publish_client_t  *clients[LIGHT_PUBLISH_MAX_CLIENTS];
+    uint64_t                num_clients;
+    uint64_t                changes; // Changes of a value
+    uint64_t                events; // Lines sent to clients
+    uint64_t                coalesced; // Changes a client missed as it still had an earlier one to get
+};
+
+/* Starts publishing the changes of every target of `ctx` to the clients that connect to `listen_fd`, a listening Unix socket.
+ * Returns NULL on failure. */
+light_publisher_t *light_publisher_create(light_context_t *ctx, light_loop_t *loop, int listen_fd);
+
+/* Disconnects all clients and stops publishing. Doesn't close `listen_fd`. */
+void light_publisher_free(light_publisher_t *publisher);
+
+/* Writes the counters of the publisher, see metrics.h */
+void light_publisher_write_metrics(light_publisher_t *publisher, FILE *out);
+
@@ -0,0 +1,381 @@
+
+#include "schedule.h"
+#include "helpers.h"
+#include "clock.h"
+
+#include <stdlib.h> // malloc, free, strtod, strtoull
+#include <string.h> // strcmp, strtok_r, strerror
+#include <stdio.h> // fopen, fgets, sscanf
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <unistd.h> // read, close
+
+// Transitions noticed later than this (after a suspend, say) are applied without fading, together with any others that were missed
+#define LIGHT_SCHEDULE_LATE_S 60
+
+// time() can lag behind the timer, which expires on the exact wall clock time, and doesn't follow a virtual clock
+static time_t _light_schedule_now()
+{
+    return (time_t)(light_clock_wall_ns() / 1000000000ull);
+}
+
+// Parses a whole token as a number. Only digits, since strtoull would take "-5" for a huge number.
+static bool _light_schedule_parse_uint(char const *str, uint64_t *out_value)
+{
+    if(*str < '0' || *str > '9')
+    {
+        return false;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    *out_value = strtoull(str, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+static bool _light_schedule_parse_rule(light_schedule_t *schedule, char *line, light_schedule_rule_t *rule)
+{
+    char *save = NULL;
+    char *time_str = strtok_r(line, " \t\n", &save);
+    char *target_str = strtok_r(NULL, " \t\n", &save);
+    char *command_str = strtok_r(NULL, " \t\n", &save);
+    char *value_str = strtok_r(NULL, " \t\n", &save);
+    char *fade_str = strtok_r(NULL, " \t\n", &save);
+    char *fade_ms_str = strtok_r(NULL, " \t\n", &save);
+    char *extra_str = strtok_r(NULL, " \t\n", &save);
+
+    if(value_str == NULL || extra_str != NULL)
+    {
+        LIGHT_ERR("expected \"HH:MM[:SS] <target> <command> <value> [fade <ms>]\"");
+        return false;
+    }
+
+    unsigned int hours = 0, minutes = 0, seconds = 0;
+    if(sscanf(time_str, "%u:%u:%u", &hours, &minutes, &seconds) < 2 || hours > 23 || minutes > 59 || seconds > 59)
+    {
+        LIGHT_ERR("\"%s\" is not a valid time of day", time_str);
+        return false;
+    }
+    rule->time_s = hours * 3600 + minutes * 60 + seconds;
+
+    rule->target = light_find_device_target(schedule->ctx, target_str);
+    if(rule->target == NULL)
+    {
+        LIGHT_ERR("couldn't find device target \"%s\"", target_str);
+        return false;
+    }
+
+    bool raw_mode = false;
+    if(strcmp(command_str, "-S") == 0 || strcmp(command_str, "-Sr") == 0)
+    {
+        rule->command = light_cmd_set_brightness;
+        raw_mode = command_str[2] == 'r';
+    }
+    else if(strcmp(command_str, "-N") == 0 || strcmp(command_str, "-Nr") == 0)
+    {
+        rule->command = light_cmd_set_min_brightness;
+        raw_mode = command_str[2] == 'r';
+    }
+    else
+    {
+        LIGHT_ERR("\"%s\" is not a schedulable command, only -S and -N are", command_str);
+        return false;
+    }
+
+    bool valid_value = false;
+    if(raw_mode)
+    {
+        valid_value = _light_schedule_parse_uint(value_str, &rule->value);
+    }
+    else
+    {
+        char *value_end = NULL;
+        double percent = strtod(value_str, &value_end);
+        if(!light_percent_to_raw(rule->target, percent, &rule->value))
+        {
+            return false;
+        }
+        valid_value = value_end != value_str && *value_end == '\0';
+    }
+
+    if(!valid_value)
+    {
+        LIGHT_ERR("\"%s\" is not a valid value", value_str);
+        return false;
+    }
+
+    rule->fade_ms = 0;
+    if(fade_str != NULL)
+    {
+        if(strcmp(fade_str, "fade") != 0 || fade_ms_str == NULL || !_light_schedule_parse_uint(fade_ms_str, &rule->fade_ms))
+        {
+            LIGHT_ERR("expected \"fade <ms>\" after the value");
+            return false;
+        }
+
+        if(rule->command != light_cmd_set_brightness)
+        {
+            LIGHT_ERR("only -S can fade");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool _light_schedule_load(light_schedule_t *schedule, char const *path)
+{
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+    {
+        LIGHT_ERR("couldn't open schedule %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    char line[1024];
+    uint64_t line_number = 0;
+    bool success = true;
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+
+        char *start = line + strspn(line, " \t");
+        if(*start == '#' || *start == '\n' || *start == '\0')
+        {
+            continue;
+        }
+
+        if(schedule->num_rules == LIGHT_SCHEDULE_MAX_RULES)
+        {
+            LIGHT_ERR("%s: schedules can have at most %d rules", path, LIGHT_SCHEDULE_MAX_RULES);
+            success = false;
+            break;
+        }
+
+        light_schedule_rule_t rule;
+        if(!_light_schedule_parse_rule(schedule, start, &rule))
+        {
+            LIGHT_ERR("%s:%" PRIu64 ": invalid rule", path, line_number);
+            success = false;
+            break;
+        }
+
+        // Insertion keeps rules of the same time in file order
+        uint64_t index = schedule->num_rules;
+        while(index > 0 && schedule->rules[index - 1].time_s > rule.time_s)
+        {
+            schedule->rules[index] = schedule->rules[index - 1];
+            index--;
+        }
+
+        schedule->rules[index] = rule;
+        schedule->num_rules++;
+    }
+
+    fclose(file);
+    return success;
+}
+
+static void _light_schedule_apply(light_schedule_t *schedule, light_schedule_rule_t *rule, uint64_t submit_ns, bool allow_fade)
+{
+    // Schedules are background work, so they don't override a transition the user started
+    bool success = true;
+    if(allow_fade && rule->fade_ms > 0)
+    {
+        success = light_scheduler_fade(schedule->scheduler, rule->target, LIGHT_PRIORITY_BACKGROUND, submit_ns, rule->value, rule->fade_ms);
+    }
+    else
+    {
+        success = light_scheduler_run(schedule->scheduler, rule->target, LIGHT_PRIORITY_BACKGROUND, submit_ns, rule->command, rule->value);
+    }
+
+    if(!success)
+    {
+        LIGHT_ERR("failed to run scheduled command on %s", rule->target->name);
+    }
+}
+
+// Applies the rule that is in effect at `now` for every target and command, which is the last one due today, or yesterday's last one
+static void _light_schedule_catch_up(light_schedule_t *schedule, time_t now)
+{
+    struct tm now_tm;
+    localtime_r(&now, &now_tm);
+    uint32_t now_s = (uint32_t)(now_tm.tm_hour * 3600 + now_tm.tm_min * 60 + now_tm.tm_sec);
+
+    for(uint64_t i = 0; i < schedule->num_rules; i++)
+    {
+        light_schedule_rule_t *rule = &schedule->rules[i];
+
+        uint64_t current = schedule->num_rules;
+        uint64_t latest = i;
+        for(uint64_t j = 0; j < schedule->num_rules; j++)
+        {
+            light_schedule_rule_t *other = &schedule->rules[j];
+            if(other->target != rule->target || other->command != rule->command)
+            {
+                continue;
+            }
+
+            // Rules are sorted, so the last match wins
+            latest = j;
+            if(other->time_s <= now_s)
+            {
+                current = j;
+            }
+        }
+
+        if((current == schedule->num_rules ? latest : current) == i)
+        {
+            _light_schedule_apply(schedule, rule, light_loop_now_ns(), false);
+        }
+    }
+}
+
+static bool _light_schedule_arm(light_schedule_t *schedule, time_t now)
+{
+    schedule->next = light_schedule_next(schedule, now, &schedule->next_due);
+    LIGHT_NOTE("next scheduled transition in %ld seconds", (long)(schedule->next_due - now));
+
+    return light_loop_timer_arm_wall(schedule->timer_fd, (uint64_t)schedule->next_due * 1000000000ull);
+}
+
+static bool _light_schedule_timer(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_schedule_t *schedule = (light_schedule_t*)userdata;
+
+    uint64_t expirations = 0;
+    ssize_t num_read = read(fd, &expirations, sizeof(expirations));
+    time_t now = _light_schedule_now();
+
+    if(num_read < 0 && errno == ECANCELED)
+    {
+        LIGHT_NOTE("the clock was set, reapplying the schedule");
+        _light_schedule_catch_up(schedule, now);
+    }
+    else if(num_read < 0)
+    {
+        if(errno != EAGAIN)
+        {
+            LIGHT_ERR("failed to read schedule timer: %s", strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+    else if(now - schedule->next_due > LIGHT_SCHEDULE_LATE_S)
+    {
+        _light_schedule_catch_up(schedule, now);
+    }
+    else
+    {
+        // The transition was due when the wall clock passed next_due, which is this long ago on the monotonic clock
+        uint64_t wall_ns = light_clock_wall_ns();
+        uint64_t due_ns = (uint64_t)schedule->next_due * 1000000000ull;
+        uint64_t late_ns = wall_ns > due_ns ? wall_ns - due_ns : 0;
+        uint64_t submit_ns = light_loop_now_ns() - late_ns;
+
+        // All the rules of this transition
+        uint32_t time_s = schedule->rules[schedule->next].time_s;
+        for(uint64_t i = schedule->next; i < schedule->num_rules && schedule->rules[i].time_s == time_s; i++)
+        {
+            _light_schedule_apply(schedule, &schedule->rules[i], submit_ns, true);
+        }
+
+        // The next transition is the one after this, even if the clock hasn't quite reached it
+        if(now < schedule->next_due)
+        {
+            now = schedule->next_due;
+        }
+    }
+
+    return _light_schedule_arm(schedule, now);
+}
+
+uint64_t light_schedule_next(light_schedule_t *schedule, time_t now, time_t *out_due)
+{
+    if(schedule->num_rules == 0)
+    {
+        return schedule->num_rules;
+    }
+
+    struct tm due_tm;
+    localtime_r(&now, &due_tm);
+    uint32_t now_s = (uint32_t)(due_tm.tm_hour * 3600 + due_tm.tm_min * 60 + due_tm.tm_sec);
+
+    uint64_t next = 0;
+    while(next < schedule->num_rules && schedule->rules[next].time_s <= now_s)
+    {
+        next++;
+    }
+
+    // Past the last rule of the day, the first one is next, tomorrow
+    if(next == schedule->num_rules)
+    {
+        next = 0;
+        due_tm.tm_mday++;
+    }
+
+    // mktime normalizes the day and takes care of daylight saving time changes in between
+    uint32_t time_s = schedule->rules[next].time_s;
+    due_tm.tm_hour = (int)(time_s / 3600);
+    due_tm.tm_min = (int)(time_s / 60 % 60);
+    due_tm.tm_sec = (int)(time_s % 60);
+    due_tm.tm_isdst = -1;
+    *out_due = mktime(&due_tm);
+
+    return next;
+}
+
+light_schedule_t *light_schedule_create(light_context_t *ctx, light_loop_t *loop, light_scheduler_t *scheduler, char const *path)
+{
+    light_schedule_t *schedule = malloc(sizeof(light_schedule_t));
+    schedule->ctx = ctx;
+    schedule->loop = loop;
+    schedule->scheduler = scheduler;
+    schedule->timer_fd = -1;
+    schedule->num_rules = 0;
+    schedule->next = 0;
+    schedule->next_due = 0;
+
+    if(!_light_schedule_load(schedule, path))
+    {
+        light_schedule_free(schedule);
+        return NULL;
+    }
+
+    if(schedule->num_rules == 0)
+    {
+        LIGHT_WARN("schedule %s has no rules", path);
+        return schedule;
+    }
+
+    schedule->timer_fd = light_loop_timer_create(true);
+    if(schedule->timer_fd < 0 || !light_loop_add(loop, schedule->timer_fd, EPOLLIN, _light_schedule_timer, schedule, "schedule"))
+    {
+        light_schedule_free(schedule);
+        return NULL;
+    }
+
+    time_t now = _light_schedule_now();
+    _light_schedule_catch_up(schedule, now);
+
+    if(!_light_schedule_arm(schedule, now))
+    {
+        light_schedule_free(schedule);
+        return NULL;
+    }
+
+    return schedule;
+}
+
+void light_schedule_free(light_schedule_t *schedule)
+{
+    if(schedule->timer_fd >= 0)
+    {
+        light_loop_remove(schedule->loop, schedule->timer_fd);
+        light_loop_timer_close(schedule->timer_fd);
+    }
+
+    free(schedule);
+}
+
@@ -0,0 +1,50 @@
+
+#pragma once
+
+#include "light.h"
+#include "loop.h"
+#include "scheduler.h"
+
+#include <time.h> // time_t
+
+// Time-of-day schedules for the daemon
+// The rules of a schedule file are sorted into a daily timeline, and a single CLOCK_REALTIME timer sleeps until the next transition.
+// When the clock is set (or after a suspend crossed transitions), the state every rule should be in is applied again.
+//
+// Each line of a schedule file is "HH:MM[:SS] <target> <command> <value> [fade <ms>]", where command is -S or -N (-Sr or -Nr for raw values).
+// Empty lines and lines starting with '#' are skipped.
+
+#define LIGHT_SCHEDULE_MAX_RULES 64
+
+typedef struct _light_schedule_rule_t light_schedule_rule_t;
+struct _light_schedule_rule_t
+{
+    uint32_t                time_s; // Seconds since local midnight
+    light_device_target_t   *target;
+    LFUNCCOMMAND            command; // light_cmd_set_brightness or light_cmd_set_min_brightness
+    uint64_t                value; // Raw value
+    uint64_t                fade_ms; // Fade to the value instead of setting it (-S only)
+};
+
+typedef struct _light_schedule_t light_schedule_t;
+struct _light_schedule_t
+{
+    light_context_t         *ctx;
+    light_loop_t            *loop;
+    light_scheduler_t       *scheduler;
+    int                     timer_fd;
+    light_schedule_rule_t   rules[LIGHT_SCHEDULE_MAX_RULES]; // Sorted by time
+    uint64_t                num_rules;
+    uint64_t                next; // The next rule due
+    time_t                  next_due; // When the next rule is due
+};
+
+/* Loads the schedule at `path`, applies the state it is in at the current time and follows it. Returns NULL on failure. */
+light_schedule_t *light_schedule_create(light_context_t *ctx, light_loop_t *loop, light_scheduler_t *scheduler, char const *path);
+
+/* Stops following the schedule */
+void light_schedule_free(light_schedule_t *schedule);
+
+/* Returns the index of the first rule due after `now`, and sets `out_due` to when it is due. Returns num_rules if there are no rules. */
+uint64_t light_schedule_next(light_schedule_t *schedule, time_t now, time_t *out_due);
+
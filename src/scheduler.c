@@ -0,0 +1,168 @@
+
+#include "scheduler.h"
+#include "helpers.h"
+#include "effect.h"
+#include "loop.h"
+
+#include <stdlib.h> // malloc, free
+#include <string.h> // memset
+#include <stdio.h> // printf
+#include <inttypes.h> // PRIu64
+
+static char const * const _light_priority_names[LIGHT_PRIORITY_COUNT] = {"background", "scene", "interactive"};
+
+// Lets the request through if nothing of a higher class is fading its target, stopping whatever it overrules
+static bool _light_scheduler_admit(light_scheduler_t *scheduler, light_device_target_t *target, light_priority_t priority)
+{
+    light_animator_t *animator = scheduler->ctx->animator;
+    light_animation_t *running = light_animator_find(animator, target);
+    if(running == NULL)
+    {
+        return true;
+    }
+
+    if(running->priority > (uint32_t)priority)
+    {
+        LIGHT_NOTE("%s request on %s refused, a %s transition is running", _light_priority_names[priority], target->name, _light_priority_names[running->priority]);
+        scheduler->stats[priority].refused++;
+        return false;
+    }
+
+    scheduler->stats[running->priority].preempted++;
+    light_animator_remove(animator, target);
+    return true;
+}
+
+static void _light_scheduler_record(light_scheduler_t *scheduler, light_priority_t priority, uint64_t submit_ns)
+{
+    uint64_t now_ns = light_loop_now_ns();
+    uint64_t delay_ns = now_ns > submit_ns ? now_ns - submit_ns : 0;
+
+    light_histogram_add(&scheduler->stats[priority].delay, delay_ns);
+}
+
+light_scheduler_t *light_scheduler_create(light_context_t *ctx)
+{
+    light_scheduler_t *scheduler = malloc(sizeof(light_scheduler_t));
+    memset(scheduler, 0, sizeof(light_scheduler_t));
+    scheduler->ctx = ctx;
+
+    return scheduler;
+}
+
+void light_scheduler_free(light_scheduler_t *scheduler)
+{
+    free(scheduler);
+}
+
+bool light_scheduler_run(light_scheduler_t *scheduler, light_device_target_t *target, light_priority_t priority, uint64_t submit_ns, LFUNCCOMMAND command, uint64_t value)
+{
+    if(!_light_scheduler_admit(scheduler, target, priority))
+    {
+        return true;
+    }
+
+    // Commands act on the context's target, which is borrowed for the request
+    light_context_t *ctx = scheduler->ctx;
+    light_device_target_t *curr_target = ctx->run_params.device_target;
+    uint64_t curr_value = ctx->run_params.value;
+    ctx->run_params.device_target = target;
+    ctx->run_params.value = value;
+
+    bool success = command(ctx);
+
+    ctx->run_params.device_target = curr_target;
+    ctx->run_params.value = curr_value;
+
+    _light_scheduler_record(scheduler, priority, submit_ns);
+    return success;
+}
+
+bool light_scheduler_fade(light_scheduler_t *scheduler, light_device_target_t *target, light_priority_t priority, uint64_t submit_ns, uint64_t value, uint64_t fade_ms)
+{
+    if(!_light_scheduler_admit(scheduler, target, priority))
+    {
+        return true;
+    }
+
+    uint64_t max_value = 0;
+    if(!target->get_max_value(target, &max_value) || max_value == 0)
+    {
+        LIGHT_ERR("couldn't read max value of %s", target->name);
+        return false;
+    }
+
+    light_effect_t effect;
+    memset(&effect, 0, sizeof(effect));
+    effect.type = LIGHT_EFFECT_RAMP;
+    effect.period_ms = fade_ms;
+    effect.level = (double)value / (double)max_value;
+
+    if(!light_effect_run_userspace(target, &effect))
+    {
+        LIGHT_ERR("failed to start fade on %s", target->name);
+        return false;
+    }
+
+    // The first frame is written by the next tick, the delay until then is small and the same for every class
+    light_animation_t *animation = light_animator_find(scheduler->ctx->animator, target);
+    if(animation != NULL)
+    {
+        animation->priority = (uint32_t)priority;
+    }
+
+    _light_scheduler_record(scheduler, priority, submit_ns);
+    return true;
+}
+
+uint64_t light_scheduler_percentile(light_scheduler_t *scheduler, light_priority_t priority, double fraction)
+{
+    return light_histogram_percentile(&scheduler->stats[priority].delay, fraction);
+}
+
+void light_scheduler_print_stats(light_scheduler_t *scheduler)
+{
+    for(uint64_t p = LIGHT_PRIORITY_COUNT; p-- > 0;)
+    {
+        light_scheduler_stats_t *stats = &scheduler->stats[p];
+        double mean_us = stats->delay.count > 0 ? (double)stats->delay.sum_ns / (double)stats->delay.count / 1000.0 : 0.0;
+
+        printf("%s: %" PRIu64 " requests, %" PRIu64 " refused, %" PRIu64 " preempted, delay mean %.1f us, p99 < %" PRIu64 " us, max %.1f us\n",
+               _light_priority_names[p], stats->delay.count, stats->refused, stats->preempted,
+               mean_us, light_scheduler_percentile(scheduler, (light_priority_t)p, 0.99) / 1000, (double)stats->delay.max_ns / 1000.0);
+    }
+
+    fflush(stdout);
+}
+
+void light_scheduler_write_metrics(light_scheduler_t *scheduler, FILE *out)
+{
+    char labels[64];
+
+    light_metrics_family(out, "light_requests_refused_total", "counter", "Requests refused because a higher priority transition was running.");
+    for(uint64_t p = 0; p < LIGHT_PRIORITY_COUNT; p++)
+    {
+        snprintf(labels, sizeof(labels), "priority=\"%s\"", _light_priority_names[p]);
+        light_metrics_value(out, "light_requests_refused_total", labels, scheduler->stats[p].refused);
+    }
+
+    light_metrics_family(out, "light_requests_preempted_total", "counter", "Transitions cut short by a request of the same or a higher priority.");
+    for(uint64_t p = 0; p < LIGHT_PRIORITY_COUNT; p++)
+    {
+        snprintf(labels, sizeof(labels), "priority=\"%s\"", _light_priority_names[p]);
+        light_metrics_value(out, "light_requests_preempted_total", labels, scheduler->stats[p].preempted);
+    }
+
+    light_metrics_family(out, "light_request_delay_seconds", "histogram", "Time from the cause of a request to its write.");
+    for(uint64_t p = 0; p < LIGHT_PRIORITY_COUNT; p++)
+    {
+        snprintf(labels, sizeof(labels), "priority=\"%s\"", _light_priority_names[p]);
+        light_metrics_histogram(out, "light_request_delay_seconds", labels, &scheduler->stats[p].delay);
+    }
+}
+
+char const *light_priority_name(light_priority_t priority)
+{
+    return _light_priority_names[priority];
+}
+
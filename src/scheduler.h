@@ -0,0 +1,58 @@
+
+#pragma once
+
+#include "light.h"
+#include "animation.h"
+#include "metrics.h"
+
+// Prioritized brightness requests for the daemon
+// Every write a feature makes goes through here with a priority class. A request preempts transitions of the same or a lower class
+// running on its target, and is refused while a higher class is fading it, so a key press always wins over a scheduled fade.
+// The delay between a request's cause (an input event, a timer deadline) and its write is recorded per class.
+
+typedef enum {
+    LIGHT_PRIORITY_BACKGROUND = 0, // Schedules, idle dimming
+    LIGHT_PRIORITY_SCENE,          // Profiles and other switches made on behalf of the user
+    LIGHT_PRIORITY_INTERACTIVE,    // Direct reactions to input
+    LIGHT_PRIORITY_COUNT
+} light_priority_t;
+
+typedef struct _light_scheduler_stats_t light_scheduler_stats_t;
+struct _light_scheduler_stats_t
+{
+    light_histogram_t   delay; // Queueing delays of the requests that were run
+    uint64_t            refused; // Requests that lost to a higher class
+    uint64_t            preempted; // Transitions of this class that were cut short
+};
+
+typedef struct _light_scheduler_t light_scheduler_t;
+struct _light_scheduler_t
+{
+    light_context_t         *ctx;
+    light_scheduler_stats_t stats[LIGHT_PRIORITY_COUNT];
+};
+
+/* Creates a scheduler for the targets of `ctx`, whose animator has to exist already */
+light_scheduler_t *light_scheduler_create(light_context_t *ctx);
+
+void light_scheduler_free(light_scheduler_t *scheduler);
+
+/* Runs `command` (light_cmd_set_brightness etc.) on `target` with `value`. `submit_ns` is the CLOCK_MONOTONIC time the request
+ * was caused at. Returns false if the command failed, a refused request is not a failure. */
+bool light_scheduler_run(light_scheduler_t *scheduler, light_device_target_t *target, light_priority_t priority, uint64_t submit_ns, LFUNCCOMMAND command, uint64_t value);
+
+/* Fades `target` to the raw `value` over `fade_ms`, respecting the minimum cap */
+bool light_scheduler_fade(light_scheduler_t *scheduler, light_device_target_t *target, light_priority_t priority, uint64_t submit_ns, uint64_t value, uint64_t fade_ms);
+
+/* Returns the queueing delay under which `fraction` (0.99 for p99) of the requests of a class were run, in nanoseconds */
+uint64_t light_scheduler_percentile(light_scheduler_t *scheduler, light_priority_t priority, double fraction);
+
+/* Prints the stats of all classes */
+void light_scheduler_print_stats(light_scheduler_t *scheduler);
+
+/* Writes the stats of all classes as metrics, see metrics.h */
+void light_scheduler_write_metrics(light_scheduler_t *scheduler, FILE *out);
+
+/* Returns the name of a priority class */
+char const *light_priority_name(light_priority_t priority);
+
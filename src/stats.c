@@ -0,0 +1,222 @@
+
+#include "stats.h"
+#include "helpers.h"
+#include "daemon.h"
+#include "clock.h"
+
+#include <stdio.h> // snprintf, printf
+#include <string.h> // strerror
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <fcntl.h> // open
+#include <unistd.h> // close, ftruncate
+#include <time.h> // time, localtime_r, strftime
+#include <sys/mman.h>
+#include <sys/stat.h> // fstat
+
+typedef struct
+{
+    LFUNCCOMMAND    command;
+    char const      *name;
+} _light_stats_command_t;
+
+// The slot of a command in the file is its position here, new commands go at the end
+static _light_stats_command_t const _light_stats_commands[] = {
+    {light_cmd_print_help,          "-H"},
+    {light_cmd_print_version,       "-V"},
+    {light_cmd_list_devices,        "-L"},
+    {light_cmd_set_brightness,      "-S"},
+    {light_cmd_get_brightness,      "-G"},
+    {light_cmd_get_max_brightness,  "-M"},
+    {light_cmd_set_min_brightness,  "-N"},
+    {light_cmd_get_min_brightness,  "-P"},
+    {light_cmd_add_brightness,      "-A"},
+    {light_cmd_sub_brightness,      "-U"},
+    {light_cmd_mul_brightness,      "-T"},
+    {light_cmd_save_brightness,     "-O"},
+    {light_cmd_restore_brightness,  "-I"},
+    {light_cmd_run_effect,          "-E"},
+    {light_cmd_set_color,           "-C"},
+    {light_cmd_run_daemon,          "daemon"},
+    {light_cmd_print_stats,         "--stats"},
+};
+
+#define LIGHT_STATS_NUM_COMMANDS (sizeof(_light_stats_commands) / sizeof(_light_stats_commands[0]))
+
+_Static_assert(LIGHT_STATS_NUM_COMMANDS <= LIGHT_STATS_COMMANDS, "the stats file has no slot for some commands");
+
+static char const * const _light_stats_phase_names[LIGHT_STATS_PHASES] = {"enumerate", "parse", "command", "total"};
+
+// Maps the stats file of `ctx`, initializing it if it is empty. Returns NULL if there is none or it can't be used.
+static light_stats_file_t *_light_stats_map(light_context_t *ctx)
+{
+    char path[NAME_MAX + sizeof(LIGHT_STATS_FILE) + 1];
+    snprintf(path, sizeof(path), "%s/%s", ctx->sys_params.conf_dir, LIGHT_STATS_FILE);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+    if(fd < 0)
+    {
+        // Not having one is the norm
+        if(errno != ENOENT)
+        {
+            LIGHT_WARN("couldn't open %s: %s", path, strerror(errno));
+        }
+
+        return NULL;
+    }
+
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+    {
+        LIGHT_WARN("%s is not a regular file", path);
+        close(fd);
+        return NULL;
+    }
+
+    // An empty file is how stats are enabled, and reset. Growing it fills it with zeroes, which are valid empty histograms.
+    if(file_stat.st_size == 0 && ftruncate(fd, sizeof(light_stats_file_t)) < 0)
+    {
+        LIGHT_WARN("couldn't initialize %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    else if(file_stat.st_size != 0 && (size_t)file_stat.st_size != sizeof(light_stats_file_t))
+    {
+        LIGHT_WARN("%s was written by another version of light, truncate it to start over", path);
+        close(fd);
+        return NULL;
+    }
+
+    light_stats_file_t *file = mmap(NULL, sizeof(light_stats_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(file == MAP_FAILED)
+    {
+        LIGHT_WARN("couldn't map %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    // Invocations that find the file empty at the same time all grow it, only one of them fills in the header
+    uint32_t empty = 0;
+    if(__atomic_compare_exchange_n(&file->magic, &empty, LIGHT_STATS_MAGIC, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        file->since = (uint64_t)time(NULL);
+        __atomic_store_n(&file->version, LIGHT_STATS_VERSION, __ATOMIC_RELEASE);
+    }
+    else if(empty != LIGHT_STATS_MAGIC)
+    {
+        LIGHT_WARN("%s is not a stats file", path);
+        munmap(file, sizeof(light_stats_file_t));
+        return NULL;
+    }
+
+    uint32_t version = __atomic_load_n(&file->version, __ATOMIC_ACQUIRE);
+    if(version != 0 && version != LIGHT_STATS_VERSION)
+    {
+        LIGHT_WARN("%s was written by another version of light, truncate it to start over", path);
+        munmap(file, sizeof(light_stats_file_t));
+        return NULL;
+    }
+
+    return file;
+}
+
+void light_stats_record(light_context_t *ctx, uint64_t end_ns)
+{
+    // The phases of a run on a virtual clock took no real time
+    if(ctx->sys_params.start_ns == 0 || light_clock_is_virtual())
+    {
+        return;
+    }
+
+    uint64_t slot = 0;
+    while(slot < LIGHT_STATS_NUM_COMMANDS && _light_stats_commands[slot].command != ctx->run_params.command)
+    {
+        slot++;
+    }
+
+    if(slot == LIGHT_STATS_NUM_COMMANDS)
+    {
+        return;
+    }
+
+    light_stats_file_t *file = _light_stats_map(ctx);
+    if(file == NULL)
+    {
+        return;
+    }
+
+    light_histogram_t *phases = file->phases[slot];
+    light_histogram_add(&phases[LIGHT_STATS_ENUMERATE], ctx->sys_params.enumerated_ns - ctx->sys_params.start_ns);
+    light_histogram_add(&phases[LIGHT_STATS_PARSE], ctx->sys_params.parsed_ns - ctx->sys_params.enumerated_ns);
+    light_histogram_add(&phases[LIGHT_STATS_COMMAND], end_ns - ctx->sys_params.parsed_ns);
+    light_histogram_add(&phases[LIGHT_STATS_TOTAL], end_ns - ctx->sys_params.start_ns);
+
+    munmap(file, sizeof(light_stats_file_t));
+}
+
+bool light_stats_print(light_context_t *ctx)
+{
+    light_stats_file_t *file = _light_stats_map(ctx);
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    char since[64] = "now";
+    time_t since_time = (time_t)file->since;
+    struct tm since_tm;
+    if(file->since != 0 && localtime_r(&since_time, &since_tm) != NULL)
+    {
+        strftime(since, sizeof(since), "%Y-%m-%d %H:%M", &since_tm);
+    }
+
+    printf("Invocations since %s (%s/%s):\n", since, ctx->sys_params.conf_dir, LIGHT_STATS_FILE);
+    for(uint64_t c = 0; c < LIGHT_STATS_NUM_COMMANDS; c++)
+    {
+        light_histogram_t const *phases = file->phases[c];
+        if(phases[LIGHT_STATS_TOTAL].count == 0)
+        {
+            continue;
+        }
+
+        printf("%s: %" PRIu64 " runs\n", _light_stats_commands[c].name, phases[LIGHT_STATS_TOTAL].count);
+        for(uint64_t p = 0; p < LIGHT_STATS_PHASES; p++)
+        {
+            light_histogram_t const *histogram = &phases[p];
+            double mean_us = histogram->count > 0 ? (double)histogram->sum_ns / (double)histogram->count / 1000.0 : 0.0;
+
+            printf("  %-10s p50 < %" PRIu64 " us, p99 < %" PRIu64 " us, mean %.1f us, max %.1f us\n", _light_stats_phase_names[p],
+                   light_histogram_percentile(histogram, 0.5) / 1000, light_histogram_percentile(histogram, 0.99) / 1000,
+                   mean_us, (double)histogram->max_ns / 1000.0);
+        }
+    }
+
+    munmap(file, sizeof(light_stats_file_t));
+    fflush(stdout);
+    return true;
+}
+
+bool light_cmd_print_stats(light_context_t *ctx)
+{
+    bool have_stats = light_stats_print(ctx);
+
+    if(ctx->daemon_params.metrics_path != NULL)
+    {
+        if(have_stats)
+        {
+            printf("\n");
+        }
+
+        return light_daemon_print_metrics(ctx->daemon_params.metrics_path);
+    }
+
+    if(!have_stats)
+    {
+        fprintf(stderr, "No stats were recorded. Create an empty file %s/%s to record every invocation, or give the metrics socket of a daemon with --metrics PATH.\n\n",
+                ctx->sys_params.conf_dir, LIGHT_STATS_FILE);
+        return false;
+    }
+
+    return true;
+}
+
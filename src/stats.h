@@ -0,0 +1,45 @@
+
+#pragma once
+
+#include "light.h"
+#include "metrics.h"
+
+// Latency of command-line invocations, kept across runs
+// Once a file named "stats" exists in the configuration directory (an empty one will do), every invocation of light adds how
+// long its phases took to the histograms of its command in that file. The file is mapped shared and updated with atomic
+// increments, so concurrent invocations need no locking, and it costs an open and an mmap per run. light --stats summarizes it.
+// Truncating the file to zero starts over.
+
+#define LIGHT_STATS_FILE "stats"
+#define LIGHT_STATS_MAGIC 0x4154534cu // "LSTA"
+#define LIGHT_STATS_VERSION 1
+
+// Phases of an invocation
+typedef enum
+{
+    LIGHT_STATS_ENUMERATE = 0, // Creating the context, which enumerates all devices
+    LIGHT_STATS_PARSE,         // Parsing the command line and resolving the target
+    LIGHT_STATS_COMMAND,       // Running the command
+    LIGHT_STATS_TOTAL,         // All of the above
+    LIGHT_STATS_PHASES
+} light_stats_phase_t;
+
+// Number of command slots in the file. Commands are numbered by their position in the table of stats.c, which is only appended to.
+#define LIGHT_STATS_COMMANDS 24
+
+typedef struct _light_stats_file_t light_stats_file_t;
+struct _light_stats_file_t
+{
+    uint32_t            magic; // Claimed by whichever invocation found the file empty
+    uint32_t            version; // 0 while the claiming invocation is still filling in the header
+    uint64_t            since; // CLOCK_REALTIME of the initialization, in seconds
+    light_histogram_t   phases[LIGHT_STATS_COMMANDS][LIGHT_STATS_PHASES];
+};
+
+/* Adds the phases of the invocation `ctx` was created for to the stats file, if there is one. Does nothing for contexts that
+ * weren't made by light_initialize. */
+void light_stats_record(light_context_t *ctx, uint64_t end_ns);
+
+/* Prints a summary of the stats file of `ctx`. Returns false if there is none. */
+bool light_stats_print(light_context_t *ctx);
+
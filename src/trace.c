@@ -0,0 +1,193 @@
+
+#include "trace.h"
+#include "helpers.h"
+#include "middleware.h"
+#include "loop.h"
+
+#include <stdio.h> // fopen, fwrite, snprintf
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy, memset, strlen, strerror
+#include <errno.h>
+#include <pthread.h>
+
+// Records the calls that reach the implementation of a target
+typedef struct
+{
+    light_layer_t   layer;
+    uint16_t        id;
+} _light_trace_layer_t;
+
+// One trace per process, shared by all contexts and threads
+static pthread_mutex_t _light_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *_light_trace_file = NULL;
+static uint64_t _light_trace_refs = 0;
+static uint64_t _light_trace_start_ns = 0;
+static uint16_t _light_trace_num_targets = 0;
+
+// Writes a record, and the name that follows it if any. Must be called with the lock held.
+static void _light_trace_write(light_trace_type_t type, uint16_t target, uint64_t start_ns, uint64_t end_ns, uint64_t value, bool success, char const *name)
+{
+    if(_light_trace_file == NULL)
+    {
+        return;
+    }
+
+    uint64_t latency_ns = end_ns - start_ns;
+    size_t name_length = name != NULL ? strlen(name) : 0;
+
+    light_trace_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.time_ns = start_ns - _light_trace_start_ns;
+    record.value = name != NULL ? name_length : value;
+    record.latency_ns = latency_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_ns;
+    record.target = target;
+    record.type = (uint8_t)type;
+    record.success = success;
+
+    if(fwrite(&record, sizeof(record), 1, _light_trace_file) != 1 || (name_length > 0 && fwrite(name, name_length, 1, _light_trace_file) != 1))
+    {
+        LIGHT_ERR("failed to write trace, stopping it: %s", strerror(errno));
+        fclose(_light_trace_file);
+        _light_trace_file = NULL;
+    }
+}
+
+static void _light_trace_operation(light_layer_t *layer, light_trace_type_t type, uint64_t start_ns, uint64_t value, bool success)
+{
+    uint64_t end_ns = light_loop_now_ns();
+
+    pthread_mutex_lock(&_light_trace_lock);
+    _light_trace_write(type, ((_light_trace_layer_t*)layer)->id, start_ns, end_ns, value, success, NULL);
+    pthread_mutex_unlock(&_light_trace_lock);
+}
+
+static bool _light_trace_set(light_layer_t *layer, light_device_target_t *target, uint64_t value)
+{
+    uint64_t start_ns = light_loop_now_ns();
+    bool success = light_layer_set(layer->next, target, value);
+    _light_trace_operation(layer, LIGHT_TRACE_SET, start_ns, value, success);
+    return success;
+}
+
+static bool _light_trace_get(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value)
+{
+    uint64_t start_ns = light_loop_now_ns();
+    bool success = light_layer_get(layer->next, target, out_value);
+    _light_trace_operation(layer, LIGHT_TRACE_GET, start_ns, success ? *out_value : 0, success);
+    return success;
+}
+
+static bool _light_trace_get_max(light_layer_t *layer, light_device_target_t *target, uint64_t *out_value)
+{
+    uint64_t start_ns = light_loop_now_ns();
+    bool success = light_layer_get_max(layer->next, target, out_value);
+    _light_trace_operation(layer, LIGHT_TRACE_GET_MAX, start_ns, success ? *out_value : 0, success);
+    return success;
+}
+
+bool light_trace_start(char const *path)
+{
+    pthread_mutex_lock(&_light_trace_lock);
+    if(_light_trace_refs > 0)
+    {
+        _light_trace_refs++;
+        pthread_mutex_unlock(&_light_trace_lock);
+        return true;
+    }
+
+    FILE *file = fopen(path, "wbe");
+    if(file == NULL)
+    {
+        LIGHT_ERR("couldn't open trace %s: %s", path, strerror(errno));
+        pthread_mutex_unlock(&_light_trace_lock);
+        return false;
+    }
+
+    light_trace_header_t header;
+    memcpy(header.magic, LIGHT_TRACE_MAGIC, sizeof(header.magic));
+    header.version = LIGHT_TRACE_VERSION;
+    if(fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        LIGHT_ERR("couldn't write trace %s: %s", path, strerror(errno));
+        fclose(file);
+        pthread_mutex_unlock(&_light_trace_lock);
+        return false;
+    }
+
+    _light_trace_file = file;
+    _light_trace_refs = 1;
+    _light_trace_start_ns = light_loop_now_ns();
+    _light_trace_num_targets = 0;
+    pthread_mutex_unlock(&_light_trace_lock);
+
+    LIGHT_NOTE("recording device I/O to %s", path);
+    return true;
+}
+
+void light_trace_stop()
+{
+    pthread_mutex_lock(&_light_trace_lock);
+    if(_light_trace_refs > 0 && --_light_trace_refs == 0 && _light_trace_file != NULL)
+    {
+        if(fclose(_light_trace_file) != 0)
+        {
+            LIGHT_ERR("failed to write trace: %s", strerror(errno));
+        }
+        _light_trace_file = NULL;
+    }
+    pthread_mutex_unlock(&_light_trace_lock);
+}
+
+uint64_t light_trace_scan_begin()
+{
+    // Racy on purpose, the worst case is a scan that isn't recorded
+    return _light_trace_file != NULL ? light_loop_now_ns() : 0;
+}
+
+void light_trace_scan(char const *path, uint64_t start_ns, bool success)
+{
+    if(start_ns == 0)
+    {
+        return;
+    }
+
+    uint64_t end_ns = light_loop_now_ns();
+
+    pthread_mutex_lock(&_light_trace_lock);
+    _light_trace_write(LIGHT_TRACE_SCAN, 0, start_ns, end_ns, 0, success, path);
+    pthread_mutex_unlock(&_light_trace_lock);
+}
+
+void light_trace_attach(light_device_target_t *target)
+{
+    if(_light_trace_file == NULL)
+    {
+        return;
+    }
+
+    char name[LIGHT_TRACE_NAME_MAX];
+    snprintf(name, sizeof(name), "%s/%s/%s", target->device->enumerator->name, target->device->name, target->name);
+
+    pthread_mutex_lock(&_light_trace_lock);
+    if(_light_trace_num_targets == UINT16_MAX)
+    {
+        pthread_mutex_unlock(&_light_trace_lock);
+        LIGHT_WARN("too many targets to trace, not recording %s", name);
+        return;
+    }
+
+    uint16_t id = _light_trace_num_targets++;
+    uint64_t now_ns = light_loop_now_ns();
+    _light_trace_write(LIGHT_TRACE_TARGET, id, now_ns, now_ns, 0, true, name);
+    pthread_mutex_unlock(&_light_trace_lock);
+
+    _light_trace_layer_t *trace_layer = malloc(sizeof(_light_trace_layer_t));
+    memset(trace_layer, 0, sizeof(_light_trace_layer_t));
+    trace_layer->layer.name = "trace";
+    trace_layer->layer.set_value = _light_trace_set;
+    trace_layer->layer.get_value = _light_trace_get;
+    trace_layer->layer.get_max_value = _light_trace_get_max;
+    trace_layer->id = id;
+    light_middleware_push(target, &trace_layer->layer);
+}
+
@@ -0,0 +1,65 @@
+
+#pragma once
+
+#include "light.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Recording of device I/O
+// With $LIGHT_TRACE set, every call that reaches an implementation (set_value, get_value, get_max_value) and every directory
+// scan is written to a trace, with when it started and how long it took. The replay enumerator turns a trace back into devices
+// that answer with the same values and take the same time, so that lag seen on someone's hardware can be reproduced offline.
+//
+// A trace is a light_trace_header_t followed by light_trace_record_t records, in native byte order. LIGHT_TRACE_TARGET
+// records declare a target before its first operation; they and LIGHT_TRACE_SCAN records are followed by a name of `value`
+// bytes ("enumerator/device/target", or the scanned path).
+
+#define LIGHT_TRACE_MAGIC "LTRC"
+#define LIGHT_TRACE_VERSION 1
+
+// Longest name in a record
+#define LIGHT_TRACE_NAME_MAX (NAME_MAX * 3 + 2)
+
+typedef enum
+{
+    LIGHT_TRACE_TARGET = 1,
+    LIGHT_TRACE_SET,
+    LIGHT_TRACE_GET,
+    LIGHT_TRACE_GET_MAX,
+    LIGHT_TRACE_SCAN
+} light_trace_type_t;
+
+typedef struct _light_trace_header_t light_trace_header_t;
+struct _light_trace_header_t
+{
+    char        magic[4];
+    uint32_t    version;
+};
+
+typedef struct _light_trace_record_t light_trace_record_t;
+struct _light_trace_record_t
+{
+    uint64_t    time_ns; // When the operation started, since the trace was started
+    uint64_t    value; // The value written or read, or the length of the name that follows
+    uint32_t    latency_ns; // How long the operation took, saturated at about 4 seconds
+    uint16_t    target; // Which target, numbered in the order of their LIGHT_TRACE_TARGET records
+    uint8_t     type; // light_trace_type_t
+    uint8_t     success;
+};
+
+/* Starts writing a trace to `path`, unless one is being written already. Every call is matched by light_trace_stop. */
+bool light_trace_start(char const *path);
+
+/* Stops the trace when the last light_trace_start has been matched, and flushes it */
+void light_trace_stop();
+
+/* Returns the current time if a trace is being written, 0 otherwise. Pass it to light_trace_scan when the scan is done. */
+uint64_t light_trace_scan_begin();
+
+/* Records a scan of the directory `path` that started at `start_ns` */
+void light_trace_scan(char const *path, uint64_t start_ns, bool success);
+
+/* Records the operations of `target` if a trace is being written, through a layer below all others. Called by the middleware. */
+void light_trace_attach(light_device_target_t *target);
+
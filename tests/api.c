@@ -0,0 +1,162 @@
+
+#include "check.h"
+#include "liblight.h"
+
+#include <stdio.h> // printf
+#include <stdlib.h> // mkdtemp, setenv
+#include <time.h> // clock_gettime
+#include <pthread.h>
+
+// Micro-benchmark of calls through the library API, as a status bar or compositor would make them
+// The context and the targets are resolved once, after which every call acts on its target without enumerating anything. The
+// targets are simulated ones that take no time, so what is measured is the cost of the library itself: the middleware, the
+// clamping and the conversions. Two threads then drive a target each through the same context at the same time. The times
+// are only held to their budget with $LIGHT_CHECK_TIMING, see check_timing. The context is created with a scratch configuration
+// directory, see check_use_conf_dir, so that no cap or curve of the user's changes the values read back.
+
+#define API_CALLS 200000
+#define API_MAX_VALUE 1000
+
+// No call should come anywhere near this on average, a call that enumerated would
+#define API_CALL_BUDGET_NS 20000
+
+typedef enum
+{
+    API_GET = 0,
+    API_SET,
+    API_ADD,
+    API_GET_PERCENT,
+    API_SET_PERCENT,
+    API_CALL_TYPES
+} api_call_t;
+
+static char const * const api_call_names[API_CALL_TYPES] = {"get", "set", "add", "get_percent", "set_percent"};
+
+typedef struct
+{
+    light_context_t         *ctx;
+    light_device_target_t   *target;
+    uint64_t                elapsed_ns[API_CALL_TYPES];
+} api_run_t;
+
+static uint64_t api_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Makes API_CALLS calls of every type on the target of `run`, checking what they do
+static void *api_run(void *userdata)
+{
+    api_run_t *run = (api_run_t*)userdata;
+    light_context_t *ctx = run->ctx;
+    light_device_target_t *target = run->target;
+
+    uint64_t value = 0;
+    double percent = 0.0;
+
+    uint64_t start_ns = api_now_ns();
+    for(uint64_t i = 0; i < API_CALLS; i++)
+    {
+        CHECK(light_target_get(ctx, target, &value));
+    }
+    run->elapsed_ns[API_GET] = api_now_ns() - start_ns;
+
+    // Different values every time, so that the write cache doesn't skip them
+    start_ns = api_now_ns();
+    for(uint64_t i = 0; i < API_CALLS; i++)
+    {
+        CHECK(light_target_set(ctx, target, i % API_MAX_VALUE));
+    }
+    run->elapsed_ns[API_SET] = api_now_ns() - start_ns;
+    CHECK(light_target_get(ctx, target, &value) && value == (API_CALLS - 1) % API_MAX_VALUE);
+
+    // Starting over before reaching the max value, where adding wouldn't change anything
+    CHECK(light_target_set(ctx, target, 0));
+    start_ns = api_now_ns();
+    for(uint64_t i = 0; i < API_CALLS; i++)
+    {
+        if(i % API_MAX_VALUE == API_MAX_VALUE - 1)
+        {
+            CHECK(light_target_set(ctx, target, 0));
+        }
+        CHECK(light_target_add(ctx, target, 1));
+    }
+    run->elapsed_ns[API_ADD] = api_now_ns() - start_ns;
+    CHECK(light_target_get(ctx, target, &value) && value == API_CALLS % API_MAX_VALUE + 1);
+
+    start_ns = api_now_ns();
+    for(uint64_t i = 0; i < API_CALLS; i++)
+    {
+        CHECK(light_target_get_percent(ctx, target, &percent));
+    }
+    run->elapsed_ns[API_GET_PERCENT] = api_now_ns() - start_ns;
+
+    start_ns = api_now_ns();
+    for(uint64_t i = 0; i < API_CALLS; i++)
+    {
+        CHECK(light_target_set_percent(ctx, target, (double)(i % 101)));
+    }
+    run->elapsed_ns[API_SET_PERCENT] = api_now_ns() - start_ns;
+    CHECK(light_target_get_percent(ctx, target, &percent) && percent == (double)((API_CALLS - 1) % 101));
+
+    return NULL;
+}
+
+static void api_report(char const *name, api_run_t const *run)
+{
+    for(int c = 0; c < API_CALL_TYPES; c++)
+    {
+        double call_ns = (double)run->elapsed_ns[c] / API_CALLS;
+        printf("%s: %s %.0f ns/call\n", name, api_call_names[c], call_ns);
+        CHECK(!check_timing() || call_ns < API_CALL_BUDGET_NS);
+    }
+}
+
+int main()
+{
+    CHECK(setenv("LIGHT_SIM", "devices=2,max=1000", 1) == 0);
+
+    char conf_dir[] = "/tmp/light-api-XXXXXX";
+    CHECK(mkdtemp(conf_dir) != NULL);
+    check_use_conf_dir(conf_dir);
+
+    uint64_t start_ns = api_now_ns();
+    light_context_t *ctx = light_context_create();
+    CHECK(ctx != NULL);
+    printf("context: %.0f us\n", (double)(api_now_ns() - start_ns) / 1000.0);
+
+    start_ns = api_now_ns();
+    light_device_target_t *first = light_find_device_target(ctx, "sim/device0/target0");
+    light_device_target_t *second = light_find_device_target(ctx, "sim/device1/target0");
+    CHECK(first != NULL && second != NULL);
+    printf("resolve: %.0f ns/target\n", (double)(api_now_ns() - start_ns) / 2.0);
+
+    uint64_t max_value = 0;
+    CHECK(light_target_get_max(ctx, first, &max_value) && max_value == API_MAX_VALUE);
+
+    api_run_t single = { ctx, first, { 0 } };
+    api_run(&single);
+    api_report("1 thread", &single);
+
+    // One context, a target per thread
+    api_run_t runs[2] = { { ctx, first, { 0 } }, { ctx, second, { 0 } } };
+    pthread_t threads[2];
+    for(int t = 0; t < 2; t++)
+    {
+        CHECK(pthread_create(&threads[t], NULL, api_run, &runs[t]) == 0);
+    }
+    for(int t = 0; t < 2; t++)
+    {
+        CHECK(pthread_join(threads[t], NULL) == 0);
+    }
+    api_report("2 threads, first", &runs[0]);
+    api_report("2 threads, second", &runs[1]);
+
+    light_free(ctx);
+    check_release_conf_dir();
+    check_remove_tree(conf_dir);
+    return 0;
+}
+
@@ -0,0 +1,97 @@
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h> // geteuid, rmdir
+#include <ftw.h> // nftw
+#include <sched.h> // unshare
+#include <sys/mount.h>
+#include <sys/stat.h> // mkdir
+
+// Helpers of the checks run by make check
+// Every check is a program linked statically against liblight, so that it can reach the internals as well as the public
+// interface. It exits with 0 if everything held, 1 if something didn't, and CHECK_SKIP if it can't run here (no root,
+// no ptrace), which automake reports as skipped.
+
+#define CHECK_SKIP 77
+
+// Whether the benchmarks hold the times they print to their budgets, which only $LIGHT_CHECK_TIMING asks for: on a loaded
+// machine, or under valgrind or a sanitizer, no budget is met
+static inline bool check_timing()
+{
+    return getenv("LIGHT_CHECK_TIMING") != NULL;
+}
+
+// Fails the check if `condition` doesn't hold
+#define CHECK(condition)\
+    do {\
+        if(!(condition))\
+        {\
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);\
+            exit(1);\
+        }\
+    } while(0)
+
+// Skips the check, saying why
+#define CHECK_SKIP_BECAUSE(reason)\
+    do {\
+        fprintf(stderr, "skipped: %s\n", reason);\
+        exit(CHECK_SKIP);\
+    } while(0)
+
+static int _check_remove_entry(char const *path, struct stat const *entry_stat, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+// Removes a scratch directory and everything in it
+static inline void check_remove_tree(char const *path)
+{
+    CHECK(nftw(path, _check_remove_entry, 16, FTW_DEPTH | FTW_PHYS) == 0);
+}
+
+// Configuration directory of light when run as root, whatever the environment says
+#define CHECK_ROOT_CONF_DIR "/etc/light"
+
+// Whether check_use_conf_dir created CHECK_ROOT_CONF_DIR to mount over it
+static bool _check_created_root_conf_dir = false;
+
+// Makes the light binaries started from now on keep their configuration and state in the scratch directory `dir`. As root, a
+// private mount namespace gets `dir` bind mounted over /etc/light, and the check is skipped if that isn't possible.
+static inline void check_use_conf_dir(char const *dir)
+{
+    if(geteuid() != 0)
+    {
+        CHECK(setenv("XDG_CONFIG_HOME", dir, 1) == 0);
+        return;
+    }
+
+    if(unshare(CLONE_NEWNS) < 0 || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0)
+    {
+        check_remove_tree(dir);
+        CHECK_SKIP_BECAUSE("no private mount namespace to keep /etc/light out of the check");
+    }
+
+    _check_created_root_conf_dir = mkdir(CHECK_ROOT_CONF_DIR, 0755) == 0;
+    CHECK(_check_created_root_conf_dir || errno == EEXIST);
+    CHECK(mount(dir, CHECK_ROOT_CONF_DIR, NULL, MS_BIND, NULL) == 0);
+}
+
+// Undoes check_use_conf_dir, before `dir` is removed
+static inline void check_release_conf_dir()
+{
+    if(geteuid() != 0)
+    {
+        return;
+    }
+
+    CHECK(umount2(CHECK_ROOT_CONF_DIR, MNT_DETACH) == 0);
+    if(_check_created_root_conf_dir)
+    {
+        rmdir(CHECK_ROOT_CONF_DIR);
+    }
+}
+
@@ -0,0 +1,195 @@
+
+#include "check.h"
+#include "trace.h"
+
+#include <stdio.h> // snprintf, fopen, fread, printf
+#include <stdlib.h> // mkdtemp, setenv, malloc
+#include <string.h> // memcmp, strlen
+#include <inttypes.h> // PRIu64
+#include <fcntl.h> // open
+#include <unistd.h> // fork, execl, dup2
+#include <sys/wait.h>
+
+// Timer-driven features on the virtual clock
+// The light binary follows a day of schedule on a virtual clock, with a simulated target and a trace of its writes. The day
+// plays out in an instant, and every write must come with the exact value at the exact virtual time: the value in effect at
+// the start, then a fade in frames of the animation tick, then a plain set. Running the day twice must give the same trace,
+// byte for byte. What the daemon keeps, such as the write latency of the target, goes to a scratch configuration directory,
+// see check_use_conf_dir.
+
+#define CLOCK_TARGET "sim/device0/target0"
+
+// 2025-10-19 00:00:00 UTC
+#define CLOCK_WALL "1760832000"
+#define CLOCK_DAY_S 86400
+
+#define CLOCK_S UINT64_C(1000000000)
+#define CLOCK_MS UINT64_C(1000000)
+
+typedef struct
+{
+    uint64_t    time_ns; // Since the trace started, which is when the day starts
+    uint64_t    value;
+} clock_write_t;
+
+// The rule of 20:00 is in effect at midnight, and is applied without a fade. The one of 08:00 fades over 200 ms, one frame per
+// tick of 20 ms, the last one on the value at the end of the fade.
+static char const * const clock_rules =
+    "08:00 " CLOCK_TARGET " -S 80 fade 200\n"
+    "20:00 " CLOCK_TARGET " -S 20\n";
+
+static clock_write_t const clock_expected[] = {
+    {0, 200},
+    {8 * 3600 * CLOCK_S + 20 * CLOCK_MS, 260},
+    {8 * 3600 * CLOCK_S + 40 * CLOCK_MS, 320},
+    {8 * 3600 * CLOCK_S + 60 * CLOCK_MS, 380},
+    {8 * 3600 * CLOCK_S + 80 * CLOCK_MS, 440},
+    {8 * 3600 * CLOCK_S + 100 * CLOCK_MS, 500},
+    {8 * 3600 * CLOCK_S + 120 * CLOCK_MS, 560},
+    {8 * 3600 * CLOCK_S + 140 * CLOCK_MS, 620},
+    {8 * 3600 * CLOCK_S + 160 * CLOCK_MS, 680},
+    {8 * 3600 * CLOCK_S + 180 * CLOCK_MS, 740},
+    {8 * 3600 * CLOCK_S + 200 * CLOCK_MS, 800},
+    {20 * 3600 * CLOCK_S, 200},
+};
+
+#define CLOCK_EXPECTED (sizeof(clock_expected) / sizeof(clock_expected[0]))
+
+// Runs the day with its trace at `trace_path`
+static void clock_run_day(char const *rules_path, char const *trace_path)
+{
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if(pid == 0)
+    {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+
+        char run[64];
+        snprintf(run, sizeof(run), "wall=%s,run=%d", CLOCK_WALL, CLOCK_DAY_S);
+        setenv("TZ", "UTC", 1);
+        setenv("LIGHT_SIM", "max=1000", 1);
+        setenv("LIGHT_VIRTUAL_CLOCK", run, 1);
+        setenv("LIGHT_TRACE", trace_path, 1);
+        execl(LIGHT_BINARY, "light", "--schedule", rules_path, (char*)NULL);
+        _exit(127);
+    }
+
+    // The daemon stops by itself once the day is over
+    int status = 0;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Reads the whole file at `path`
+static char *clock_read_file(char const *path, size_t *out_length)
+{
+    FILE *file = fopen(path, "rb");
+    CHECK(file != NULL);
+    CHECK(fseek(file, 0, SEEK_END) == 0);
+    long length = ftell(file);
+    CHECK(length >= 0 && fseek(file, 0, SEEK_SET) == 0);
+
+    char *data = malloc((size_t)length + 1);
+    CHECK(data != NULL && fread(data, 1, (size_t)length, file) == (size_t)length);
+    fclose(file);
+
+    *out_length = (size_t)length;
+    return data;
+}
+
+// Returns the successful writes of CLOCK_TARGET in the trace `data`
+static uint64_t clock_writes(char const *data, size_t length, clock_write_t *out_writes, uint64_t max_writes)
+{
+    CHECK(length >= sizeof(light_trace_header_t));
+    light_trace_header_t header;
+    memcpy(&header, data, sizeof(header));
+    CHECK(memcmp(header.magic, LIGHT_TRACE_MAGIC, 4) == 0 && header.version == LIGHT_TRACE_VERSION);
+
+    uint64_t num_targets = 0;
+    int64_t target = -1;
+    uint64_t num_writes = 0;
+    for(size_t offset = sizeof(header); offset < length;)
+    {
+        light_trace_record_t record;
+        CHECK(offset + sizeof(record) <= length);
+        memcpy(&record, data + offset, sizeof(record));
+        offset += sizeof(record);
+
+        if(record.type == LIGHT_TRACE_TARGET || record.type == LIGHT_TRACE_SCAN)
+        {
+            CHECK(offset + record.value <= length);
+            if(record.type == LIGHT_TRACE_TARGET)
+            {
+                if(record.value == strlen(CLOCK_TARGET) && memcmp(data + offset, CLOCK_TARGET, record.value) == 0)
+                {
+                    target = (int64_t)num_targets;
+                }
+                num_targets++;
+            }
+
+            offset += record.value;
+            continue;
+        }
+
+        if(record.type == LIGHT_TRACE_SET && record.success && (int64_t)record.target == target)
+        {
+            CHECK(num_writes < max_writes);
+            out_writes[num_writes].time_ns = record.time_ns;
+            out_writes[num_writes].value = record.value;
+            num_writes++;
+        }
+    }
+
+    CHECK(target >= 0);
+    return num_writes;
+}
+
+int main()
+{
+    char dir[] = "/tmp/light-clock-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    char conf_dir[64], rules_path[64], first_path[64], second_path[64];
+    snprintf(conf_dir, sizeof(conf_dir), "%s/conf", dir);
+    snprintf(rules_path, sizeof(rules_path), "%s/rules", dir);
+    snprintf(first_path, sizeof(first_path), "%s/first.trace", dir);
+    snprintf(second_path, sizeof(second_path), "%s/second.trace", dir);
+    CHECK(mkdir(conf_dir, 0755) == 0);
+    check_use_conf_dir(conf_dir);
+
+    FILE *rules = fopen(rules_path, "w");
+    CHECK(rules != NULL && fputs(clock_rules, rules) >= 0 && fclose(rules) == 0);
+
+    clock_run_day(rules_path, first_path);
+    clock_run_day(rules_path, second_path);
+
+    size_t first_length = 0;
+    size_t second_length = 0;
+    char *first = clock_read_file(first_path, &first_length);
+    char *second = clock_read_file(second_path, &second_length);
+
+    clock_write_t writes[CLOCK_EXPECTED * 2];
+    uint64_t num_writes = clock_writes(first, first_length, writes, CLOCK_EXPECTED * 2);
+    for(uint64_t i = 0; i < num_writes; i++)
+    {
+        printf("%" PRIu64 ".%09" PRIu64 " s: %" PRIu64 "\n", writes[i].time_ns / CLOCK_S, writes[i].time_ns % CLOCK_S, writes[i].value);
+    }
+
+    CHECK(num_writes == CLOCK_EXPECTED);
+    for(uint64_t i = 0; i < CLOCK_EXPECTED; i++)
+    {
+        CHECK(writes[i].time_ns == clock_expected[i].time_ns);
+        CHECK(writes[i].value == clock_expected[i].value);
+    }
+
+    CHECK(first_length == second_length && memcmp(first, second, first_length) == 0);
+
+    free(first);
+    free(second);
+    check_release_conf_dir();
+    check_remove_tree(dir);
+    return 0;
+}
+
@@ -0,0 +1,134 @@
+
+#include "check.h"
+#include "conf.h"
+
+#include <stdio.h> // snprintf, fopen, fputs, rename
+#include <stdlib.h> // mkdtemp
+#include <limits.h> // PATH_MAX
+#include <string.h> // strcmp
+#include <fcntl.h> // AT_FDCWD
+#include <unistd.h> // access, truncate, symlink
+#include <sys/stat.h> // stat, lstat, utimensat
+
+// Invalidation of the cache of the configuration file
+// The cache is trusted as long as the size, modification time and inode of the text match those it was compiled from. Each of
+// them changing on its own must lead to a recompile, and so must a cache that is cut short, has a wrong header, or isn't a
+// regular file. A recompile must write a cache that the next load maps.
+
+#define CONF_TARGET "sim/device0/target0"
+
+static char conf_dir[] = "/tmp/light-conf-XXXXXX";
+static char conf_path[PATH_MAX];
+static char cache_path[PATH_MAX];
+
+static void conf_write(char const *path, char const *text)
+{
+    FILE *file = fopen(path, "w");
+    CHECK(file != NULL && fputs(text, file) >= 0 && fclose(file) == 0);
+}
+
+// Sets the modification time of the text
+static void conf_touch(struct timespec mtime)
+{
+    struct timespec times[2] = { mtime, mtime };
+    CHECK(utimensat(AT_FDCWD, conf_path, times, 0) == 0);
+}
+
+static struct stat conf_stat(char const *path)
+{
+    struct stat path_stat;
+    CHECK(stat(path, &path_stat) == 0);
+    return path_stat;
+}
+
+// Loads the configuration, checks whether it came from the cache and what its alias points to
+static void conf_expect(bool mapped, char const *alias_path)
+{
+    light_conf_t *conf = light_conf_load(conf_dir);
+    CHECK(conf != NULL);
+    CHECK(conf->mapped == mapped);
+    CHECK(strcmp(light_conf_alias(conf, "kbd"), alias_path) == 0);
+    CHECK(strcmp(light_conf_default_target(conf), CONF_TARGET) == 0);
+
+    light_conf_target_t const *target = light_conf_find_target(conf, CONF_TARGET);
+    CHECK(target != NULL);
+    CHECK(target->min.value == 10.0 && target->min.flags == LIGHT_CONF_SET);
+    CHECK(target->max.value == 90.0 && target->max.flags == (LIGHT_CONF_SET | LIGHT_CONF_RAW));
+    CHECK(light_conf_find_target(conf, "sim/device0/target1") == NULL);
+
+    light_conf_free(conf);
+}
+
+int main()
+{
+    CHECK(mkdtemp(conf_dir) != NULL);
+    snprintf(conf_path, sizeof(conf_path), "%s/%s", conf_dir, LIGHT_CONF_FILE);
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", conf_dir, LIGHT_CONF_CACHE_FILE);
+
+    // No text, no configuration and no cache
+    CHECK(light_conf_load(conf_dir) == NULL);
+    CHECK(access(cache_path, F_OK) != 0);
+
+    // Compiled the first time, mapped afterwards without being written again
+    conf_write(conf_path, "default " CONF_TARGET "\nalias kbd sysfs/leds/kbd\ntarget " CONF_TARGET " min=10 max=90r\n");
+    conf_expect(false, "sysfs/leds/kbd");
+    struct stat cached = conf_stat(cache_path);
+    conf_expect(true, "sysfs/leds/kbd");
+    conf_expect(true, "sysfs/leds/kbd");
+    struct stat reused = conf_stat(cache_path);
+    CHECK(reused.st_ino == cached.st_ino && reused.st_mtim.tv_sec == cached.st_mtim.tv_sec && reused.st_mtim.tv_nsec == cached.st_mtim.tv_nsec);
+
+    // Only the modification time changes
+    struct timespec mtime = conf_stat(conf_path).st_mtim;
+    mtime.tv_sec -= 10;
+    conf_touch(mtime);
+    conf_expect(false, "sysfs/leds/kbd");
+    conf_expect(true, "sysfs/leds/kbd");
+
+    // Only the size changes, the text is edited in place with the time put back
+    conf_write(conf_path, "default " CONF_TARGET "\nalias kbd sysfs/leds/kbd2\ntarget " CONF_TARGET " min=10 max=90r\n");
+    conf_touch(mtime);
+    conf_expect(false, "sysfs/leds/kbd2");
+    conf_expect(true, "sysfs/leds/kbd2");
+
+    // Only the inode changes, the text is replaced by one of the same size and time, as editors that rename do
+    char new_path[PATH_MAX];
+    snprintf(new_path, sizeof(new_path), "%s/config.new", conf_dir);
+    conf_write(new_path, "default " CONF_TARGET "\nalias kbd sysfs/leds/kbd3\ntarget " CONF_TARGET " min=10 max=90r\n");
+    ino_t old_ino = conf_stat(conf_path).st_ino;
+    CHECK(rename(new_path, conf_path) == 0);
+    CHECK(conf_stat(conf_path).st_ino != old_ino);
+    conf_touch(mtime);
+    conf_expect(false, "sysfs/leds/kbd3");
+    conf_expect(true, "sysfs/leds/kbd3");
+
+    // A cache cut short, as by a full disk
+    CHECK(truncate(cache_path, conf_stat(cache_path).st_size / 2) == 0);
+    conf_expect(false, "sysfs/leds/kbd3");
+    conf_expect(true, "sysfs/leds/kbd3");
+
+    // A cache of the right size with a wrong header, as left by another version
+    FILE *cache = fopen(cache_path, "r+");
+    CHECK(cache != NULL && fputs("XXXX", cache) >= 0 && fclose(cache) == 0);
+    conf_expect(false, "sysfs/leds/kbd3");
+    conf_expect(true, "sysfs/leds/kbd3");
+
+    // A cache that is a symlink, even to a valid table, isn't followed and is replaced by a file
+    char link_target[PATH_MAX];
+    snprintf(link_target, sizeof(link_target), "%s/elsewhere", conf_dir);
+    CHECK(rename(cache_path, link_target) == 0);
+    CHECK(symlink(link_target, cache_path) == 0);
+    conf_expect(false, "sysfs/leds/kbd3");
+    struct stat replaced;
+    CHECK(lstat(cache_path, &replaced) == 0 && S_ISREG(replaced.st_mode));
+    conf_expect(true, "sysfs/leds/kbd3");
+
+    // An invalid text isn't cached, and a stale cache isn't used in its place
+    conf_write(conf_path, "nonsense\n");
+    CHECK(light_conf_load(conf_dir) == NULL);
+    CHECK(light_conf_load(conf_dir) == NULL);
+
+    check_remove_tree(conf_dir);
+    return 0;
+}
+
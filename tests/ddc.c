@@ -0,0 +1,296 @@
+
+#include "check.h"
+#include "light.h"
+#include "clock.h"
+
+#include <stdio.h> // snprintf
+#include <stdlib.h> // mkdtemp, setenv, posix_openpt
+#include <string.h> // strcmp
+#include <errno.h>
+#include <fcntl.h> // open
+#include <unistd.h> // read, write, close, symlink, unlink, rmdir, usleep
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h> // unshare
+#include <termios.h> // cfmakeraw
+#include <sys/mount.h>
+#include <sys/stat.h> // mknod
+#include <sys/sysmacros.h> // makedev
+
+// Drives the ddc enumerator against an emulated monitor, with no i2c hardware
+// The monitor is a pty, whose master side is answered by a thread that speaks DDC/CI. The enumerator only takes character
+// devices named i2c-*, so the pty is bind mounted over a device node in a private mount namespace, which takes root.
+// The same directory holds a symlink and a regular file named like buses, which must be neither listed nor written, and the
+// scratch configuration directory the context is created with, see check_use_conf_dir.
+// The monitor starts asleep, and doesn't answer until it wakes. The worker runs on a virtual clock, which the check moves past
+// the backoff of a failed bus and the age of the cache instead of waiting for them.
+
+#define EMULATOR_MAX 100
+#define EMULATOR_START 50
+#define EMULATOR_MAX_WRITES 64
+
+// Longer than both the backoff of a failed bus and the age of the cache
+#define EMULATOR_IDLE_NS (60 * 1000000000ull)
+
+typedef struct
+{
+    int         master_fd;
+    bool        stop;
+    bool        asleep; // Reads requests without answering them
+    bool        hold; // Holds back the answers to get requests until cleared
+    uint64_t    value;
+    uint64_t    writes[EMULATOR_MAX_WRITES]; // Values of the set requests, in order
+    uint64_t    num_writes;
+    uint64_t    num_reads; // Get requests, answered or not
+} emulator_t;
+
+static pthread_mutex_t emulator_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reads exactly `length` bytes of a request, or returns false once the emulator is stopped
+static bool emulator_read(emulator_t *emulator, uint8_t *data, size_t length)
+{
+    size_t received = 0;
+    while(received < length)
+    {
+        struct pollfd pfd = { emulator->master_fd, POLLIN, 0 };
+        if(poll(&pfd, 1, 20) <= 0)
+        {
+            pthread_mutex_lock(&emulator_lock);
+            bool stop = emulator->stop;
+            pthread_mutex_unlock(&emulator_lock);
+            if(stop)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        ssize_t nread = read(emulator->master_fd, data + received, length - received);
+        if(nread <= 0)
+        {
+            return false;
+        }
+        received += (size_t)nread;
+    }
+
+    return true;
+}
+
+static uint64_t emulator_num_reads(emulator_t *emulator)
+{
+    pthread_mutex_lock(&emulator_lock);
+    uint64_t num_reads = emulator->num_reads;
+    pthread_mutex_unlock(&emulator_lock);
+    return num_reads;
+}
+
+static void *emulator_run(void *userdata)
+{
+    emulator_t *emulator = (emulator_t*)userdata;
+
+    // Source address, length, then the payload and a checksum
+    uint8_t header[2];
+    while(emulator_read(emulator, header, sizeof(header)))
+    {
+        CHECK(header[0] == 0x51 && (header[1] & 0x80) != 0);
+        uint8_t length = header[1] & 0x7F;
+        CHECK(length <= 4);
+
+        uint8_t payload[5];
+        CHECK(emulator_read(emulator, payload, length + 1u));
+
+        uint8_t checksum = 0x6E ^ header[0] ^ header[1];
+        for(uint8_t i = 0; i < length; i++)
+        {
+            checksum ^= payload[i];
+        }
+        CHECK(checksum == payload[length]);
+        CHECK(payload[1] == 0x10);
+
+        pthread_mutex_lock(&emulator_lock);
+        if(payload[0] == 0x01 && emulator->asleep)
+        {
+            emulator->num_reads++;
+        }
+        else if(payload[0] == 0x01)
+        {
+            // Counted before it is held, so that the check knows when the worker waits for the answer
+            emulator->num_reads++;
+            while(emulator->hold)
+            {
+                pthread_mutex_unlock(&emulator_lock);
+                usleep(1000);
+                pthread_mutex_lock(&emulator_lock);
+            }
+
+            uint8_t reply[11] = { 0x6E, 0x88, 0x02, 0x00, 0x10, 0x00, 0, EMULATOR_MAX, (emulator->value >> 8) & 0xFF, emulator->value & 0xFF, 0 };
+            reply[10] = 0x50;
+            for(int i = 0; i < 10; i++)
+            {
+                reply[10] ^= reply[i];
+            }
+            CHECK(write(emulator->master_fd, reply, sizeof(reply)) == sizeof(reply));
+        }
+        else
+        {
+            CHECK(payload[0] == 0x03 && length == 4);
+            emulator->value = ((uint64_t)payload[2] << 8) | payload[3];
+            CHECK(emulator->num_writes < EMULATOR_MAX_WRITES);
+            emulator->writes[emulator->num_writes++] = emulator->value;
+        }
+        pthread_mutex_unlock(&emulator_lock);
+    }
+
+    return NULL;
+}
+
+// Gets the value straight from the enumerator, from another thread while the check makes sets
+typedef struct
+{
+    light_device_target_t   *target;
+    uint64_t                value;
+    bool                    success;
+} reader_t;
+
+static void *reader_run(void *userdata)
+{
+    reader_t *reader = (reader_t*)userdata;
+    reader->success = reader->target->impl.get_value(reader->target, &reader->value);
+    return NULL;
+}
+
+int main()
+{
+    if(geteuid() != 0)
+    {
+        CHECK_SKIP_BECAUSE("bind mounting the emulated bus takes root");
+    }
+
+    if(unshare(CLONE_NEWNS) < 0 || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0)
+    {
+        CHECK_SKIP_BECAUSE("no private mount namespace");
+    }
+
+    char dir[] = "/tmp/light-ddc-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    char bus_path[64], link_path[64], file_path[64], victim_path[64], conf_dir[64];
+    snprintf(bus_path, sizeof(bus_path), "%s/i2c-0", dir);
+    snprintf(link_path, sizeof(link_path), "%s/i2c-1", dir);
+    snprintf(file_path, sizeof(file_path), "%s/i2c-2", dir);
+    snprintf(victim_path, sizeof(victim_path), "%s/victim", dir);
+    snprintf(conf_dir, sizeof(conf_dir), "%s/conf", dir);
+    CHECK(mkdir(conf_dir, 0755) == 0);
+    check_use_conf_dir(conf_dir);
+
+    // The emulated monitor, raw so that the line discipline leaves the frames alone
+    emulator_t emulator = { .value = EMULATOR_START, .asleep = true };
+    emulator.master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    CHECK(emulator.master_fd >= 0 && grantpt(emulator.master_fd) == 0 && unlockpt(emulator.master_fd) == 0);
+
+    int slave_fd = open(ptsname(emulator.master_fd), O_RDWR | O_NOCTTY);
+    CHECK(slave_fd >= 0);
+    struct termios attributes;
+    CHECK(tcgetattr(slave_fd, &attributes) == 0);
+    cfmakeraw(&attributes);
+    CHECK(tcsetattr(slave_fd, TCSANOW, &attributes) == 0);
+
+    CHECK(mknod(bus_path, S_IFCHR | 0600, makedev(1, 3)) == 0);
+    CHECK(mount(ptsname(emulator.master_fd), bus_path, NULL, MS_BIND, NULL) == 0);
+
+    // Files that only look like buses
+    FILE *victim = fopen(victim_path, "w");
+    CHECK(victim != NULL && fputs("precious", victim) >= 0 && fclose(victim) == 0);
+    CHECK(symlink(victim_path, link_path) == 0);
+    CHECK(link(victim_path, file_path) == 0);
+
+    pthread_t emulator_thread;
+    CHECK(pthread_create(&emulator_thread, NULL, emulator_run, &emulator) == 0);
+
+    CHECK(setenv("LIGHT_DDC_DEVICES", dir, 1) == 0);
+    CHECK(light_clock_set_virtual(""));
+    light_context_t *ctx = light_context_create();
+    CHECK(ctx != NULL);
+
+    CHECK(light_find_device_target(ctx, "ddc/i2c-1/brightness") == NULL);
+    CHECK(light_find_device_target(ctx, "ddc/i2c-2/brightness") == NULL);
+
+    light_device_target_t *target = light_find_device_target(ctx, "ddc/i2c-0/brightness");
+    CHECK(target != NULL);
+
+    // The monitor doesn't answer the first use, and isn't asked again right away
+    uint64_t value = 0;
+    CHECK(!light_target_get(ctx, target, &value));
+    CHECK(!light_target_get(ctx, target, &value));
+    CHECK(!light_target_set(ctx, target, 10));
+    CHECK(emulator_num_reads(&emulator) == 1);
+
+    // Once awake, it is read again after the backoff, and later reads come from the cache
+    pthread_mutex_lock(&emulator_lock);
+    emulator.asleep = false;
+    pthread_mutex_unlock(&emulator_lock);
+    light_clock_advance(EMULATOR_IDLE_NS);
+    CHECK(light_target_get_max(ctx, target, &value) && value == EMULATOR_MAX);
+    CHECK(light_target_get(ctx, target, &value) && value == EMULATOR_START);
+    CHECK(emulator_num_reads(&emulator) == 2);
+
+    // An idle bus isn't read, until a get finds the cache too old
+    light_clock_advance(EMULATOR_IDLE_NS);
+    CHECK(emulator_num_reads(&emulator) == 2);
+    CHECK(light_target_get(ctx, target, &value) && value == EMULATOR_START);
+    CHECK(emulator_num_reads(&emulator) == 3);
+
+    // A burst of sets while the worker waits for an answer collapses into the latest value, which the answer doesn't override
+    pthread_mutex_lock(&emulator_lock);
+    emulator.hold = true;
+    pthread_mutex_unlock(&emulator_lock);
+    light_clock_advance(EMULATOR_IDLE_NS);
+
+    reader_t reader = { .target = target };
+    pthread_t reader_thread;
+    CHECK(pthread_create(&reader_thread, NULL, reader_run, &reader) == 0);
+    while(emulator_num_reads(&emulator) < 4)
+    {
+        usleep(1000);
+    }
+
+    for(uint64_t v = 10; v <= 40; v += 10)
+    {
+        CHECK(light_target_set(ctx, target, v));
+    }
+
+    pthread_mutex_lock(&emulator_lock);
+    emulator.hold = false;
+    pthread_mutex_unlock(&emulator_lock);
+    CHECK(pthread_join(reader_thread, NULL) == 0);
+    CHECK(reader.success && reader.value == 40);
+    CHECK(light_target_get(ctx, target, &value) && value == 40);
+
+    // Freeing the context lets the worker write what is pending
+    light_free(ctx);
+
+    pthread_mutex_lock(&emulator_lock);
+    emulator.stop = true;
+    pthread_mutex_unlock(&emulator_lock);
+    CHECK(pthread_join(emulator_thread, NULL) == 0);
+
+    CHECK(emulator.num_writes == 1);
+    CHECK(emulator.writes[0] == 40);
+    CHECK(emulator.value == 40);
+
+    char contents[16] = "";
+    victim = fopen(victim_path, "r");
+    CHECK(victim != NULL && fgets(contents, sizeof(contents), victim) != NULL && fclose(victim) == 0);
+    CHECK(strcmp(contents, "precious") == 0);
+
+    CHECK(umount2(bus_path, MNT_DETACH) == 0);
+    CHECK(unlink(bus_path) == 0 && unlink(link_path) == 0 && unlink(file_path) == 0 && unlink(victim_path) == 0);
+    check_release_conf_dir();
+    check_remove_tree(conf_dir);
+    CHECK(rmdir(dir) == 0);
+
+    close(slave_fd);
+    close(emulator.master_fd);
+    return 0;
+}
+
@@ -0,0 +1,201 @@
+
+#include "check.h"
+#include "light.h"
+#include "loop.h"
+#include "power.h"
+
+#include <stdio.h> // snprintf, fopen, fputs
+#include <stdlib.h> // mkdtemp, setenv
+#include <string.h> // memset, strlen
+#include <fcntl.h> // open
+#include <unistd.h> // read, write, close, geteuid, getegid
+#include <sched.h> // unshare
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+// Power source profiles
+// The power supplies are read from a fake tree at startup, then followed through power_supply uevents that the check sends
+// straight to the socket of the daemon's listener, as the kernel would. A profile is applied to every target once at startup,
+// then only when the machine switches between ac and battery: any external supply online means ac, a battery never does.
+// Sending uevents takes CAP_NET_ADMIN, which anyone but root gets in a user and network namespace of their own. The
+// profiles go to a scratch configuration directory, see check_use_conf_dir.
+
+#define POWER_TARGET "sim/device0/target0"
+#define POWER_AC 900
+#define POWER_BATTERY 300
+
+// Written to the target by hand, to tell whether a profile was applied since
+#define POWER_UNTOUCHED 555
+
+// Long enough for the loop to take a uevent that is already waiting on its socket
+#define POWER_STEP_MS 20
+
+static void power_write(char const *dir, char const *name, char const *text)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *file = fopen(path, "w");
+    CHECK(file != NULL && fputs(text, file) >= 0 && fclose(file) == 0);
+}
+
+// Adds a supply to the fake tree, `online` is NULL for supplies that have no such file
+static void power_add_supply(char const *supplies_dir, char const *name, char const *type, char const *online)
+{
+    char dir[96];
+    snprintf(dir, sizeof(dir), "%s/%s", supplies_dir, name);
+    CHECK(mkdir(dir, 0755) == 0);
+    power_write(dir, "type", type);
+    if(online != NULL)
+    {
+        power_write(dir, "online", online);
+    }
+}
+
+static void power_write_map(char const *path, char const *text)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    CHECK(fd >= 0 && write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+    close(fd);
+}
+
+// Gets the right to send uevents, keeping the same user and group
+static void power_allow_uevents()
+{
+    if(geteuid() == 0)
+    {
+        return;
+    }
+
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    if(unshare(CLONE_NEWUSER | CLONE_NEWNET) < 0)
+    {
+        CHECK_SKIP_BECAUSE("sending uevents takes root or a user namespace");
+    }
+
+    char map[64];
+    snprintf(map, sizeof(map), "%u %u 1\n", (unsigned)uid, (unsigned)uid);
+    power_write_map("/proc/self/uid_map", map);
+    power_write_map("/proc/self/setgroups", "deny");
+    snprintf(map, sizeof(map), "%u %u 1\n", (unsigned)gid, (unsigned)gid);
+    power_write_map("/proc/self/gid_map", map);
+}
+
+// Sends the uevent of a change of the supply `name` to the listener on `uevent_fd`
+static void power_send_uevent(int uevent_fd, char const *name, char const *type, int online)
+{
+    struct sockaddr_nl listener;
+    socklen_t listener_length = sizeof(listener);
+    CHECK(getsockname(uevent_fd, (struct sockaddr*)&listener, &listener_length) == 0);
+
+    // "action@devpath", followed by KEY=value strings, each ending with a null byte
+    char message[256];
+    int length = snprintf(message, sizeof(message), "change@/devices/fake/power_supply/%s%cSUBSYSTEM=power_supply%cPOWER_SUPPLY_NAME=%s%c"
+                          "POWER_SUPPLY_TYPE=%s%cPOWER_SUPPLY_ONLINE=%d", name, 0, 0, name, 0, type, 0, online);
+    CHECK(length > 0 && length < (int)sizeof(message));
+
+    int sender_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    CHECK(sender_fd >= 0);
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_pid = listener.nl_pid;
+    CHECK(sendto(sender_fd, message, length + 1, 0, (struct sockaddr*)&address, sizeof(address)) == length + 1);
+    close(sender_fd);
+}
+
+static bool power_stop(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    uint64_t expirations = 0;
+    CHECK(read(fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+    light_loop_stop(loop);
+    return true;
+}
+
+// Lets the loop take the uevents sent so far
+static void power_step(light_loop_t *loop, int timer_fd)
+{
+    CHECK(light_loop_timer_arm(timer_fd, light_loop_now_ns() + POWER_STEP_MS * 1000000ull));
+    CHECK(light_loop_run(loop));
+}
+
+static uint64_t power_value(light_context_t *ctx, light_device_target_t *target)
+{
+    uint64_t value = 0;
+    CHECK(light_target_get(ctx, target, &value));
+    return value;
+}
+
+int main()
+{
+    char dir[] = "/tmp/light-power-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    char conf_dir[64], supplies_dir[64];
+    snprintf(conf_dir, sizeof(conf_dir), "%s/conf", dir);
+    snprintf(supplies_dir, sizeof(supplies_dir), "%s/power_supply", dir);
+    CHECK(mkdir(conf_dir, 0755) == 0 && mkdir(supplies_dir, 0755) == 0);
+
+    // Unplugged, with a battery whose online file doesn't count
+    power_add_supply(supplies_dir, "AC", "Mains\n", "0\n");
+    power_add_supply(supplies_dir, "USB", "USB\n", "0\n");
+    power_add_supply(supplies_dir, "BAT0", "Battery\n", "1\n");
+    power_add_supply(supplies_dir, "BAT1", "Battery\n", NULL);
+
+    check_use_conf_dir(conf_dir);
+    power_allow_uevents();
+    CHECK(setenv("LIGHT_POWER_SUPPLIES", supplies_dir, 1) == 0);
+    CHECK(setenv("LIGHT_SIM", "max=1000", 1) == 0);
+
+    light_context_t *ctx = light_context_create();
+    CHECK(ctx != NULL);
+    light_device_target_t *target = light_find_device_target(ctx, POWER_TARGET);
+    CHECK(target != NULL);
+    CHECK(light_write_target_setting(ctx, target, "ac-brightness", POWER_AC));
+    CHECK(light_write_target_setting(ctx, target, "battery-brightness", POWER_BATTERY));
+
+    light_loop_t *loop = light_loop_create();
+    CHECK(loop != NULL);
+    int timer_fd = light_loop_timer_create(false);
+    CHECK(timer_fd >= 0 && light_loop_add(loop, timer_fd, EPOLLIN, power_stop, NULL, "stop"));
+
+    // The profile of the source at startup is applied right away
+    light_power_t *power = light_power_create(ctx, loop);
+    CHECK(power != NULL);
+    CHECK(!power->on_ac && power_value(ctx, target) == POWER_BATTERY);
+
+    // Plugged in
+    power_send_uevent(power->uevent_fd, "AC", "Mains", 1);
+    power_step(loop, timer_fd);
+    CHECK(power->on_ac && power_value(ctx, target) == POWER_AC);
+
+    // Changes that keep the machine on ac don't apply the profile again
+    CHECK(light_target_set(ctx, target, POWER_UNTOUCHED));
+    power_send_uevent(power->uevent_fd, "USB", "USB", 1);
+    power_send_uevent(power->uevent_fd, "AC", "Mains", 0);
+    power_step(loop, timer_fd);
+    CHECK(power->on_ac && power_value(ctx, target) == POWER_UNTOUCHED);
+
+    // The last external supply goes offline
+    power_send_uevent(power->uevent_fd, "USB", "USB", 0);
+    power_step(loop, timer_fd);
+    CHECK(!power->on_ac && power_value(ctx, target) == POWER_BATTERY);
+
+    // A battery never makes the machine on ac
+    CHECK(light_target_set(ctx, target, POWER_UNTOUCHED));
+    power_send_uevent(power->uevent_fd, "BAT0", "Battery", 1);
+    power_step(loop, timer_fd);
+    CHECK(!power->on_ac && power_value(ctx, target) == POWER_UNTOUCHED);
+
+    light_power_free(power);
+    light_loop_remove(loop, timer_fd);
+    light_loop_timer_close(timer_fd);
+    light_loop_free(loop);
+    light_free(ctx);
+
+    check_release_conf_dir();
+    check_remove_tree(dir);
+    return 0;
+}
+
@@ -0,0 +1,256 @@
+
+#include "check.h"
+#include "light.h"
+#include "loop.h"
+#include "publish.h"
+
+#include <stdio.h> // snprintf, printf
+#include <stdlib.h> // mkdtemp, setenv
+#include <string.h> // memset, memcpy, memmove, strlen, strcmp, strchr
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <unistd.h> // close, read
+#include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
+
+// Subscribers of the publisher
+// A publisher runs on a loop over simulated targets, as in the daemon, and clients subscribe to it through its socket. The
+// checks are a script of steps run from a timer of the same loop, so that the publisher gets to accept, read and send in
+// between: every client gets the current values of what it follows, in its format, then every change that matches its
+// filter and nothing else. A burst of changes larger than any socket buffer, to clients that don't read during it, must leave
+// each of them with the latest value once they read again, with far fewer lines than changes. The context is created with a
+// scratch configuration directory, see check_use_conf_dir, so that no alias or cap of the user's changes the values.
+
+#define PUBLISH_MAX 1000
+#define PUBLISH_BURST 40000
+#define PUBLISH_STEP_MS 5
+
+// Steps a drain may take before the latest value must have arrived
+#define PUBLISH_DRAIN_STEPS 400
+
+typedef enum
+{
+    PUBLISH_TEXT_CLIENT = 0, // text, device0 only
+    PUBLISH_JSON_CLIENT, // json, target0 of every device
+    PUBLISH_CLIENTS
+} publish_client_t;
+
+typedef struct
+{
+    int         fd;
+    char        buffer[1 << 16];
+    size_t      length; // Of what is in buffer, which only keeps the unfinished line and the last one
+    char        last_line[LIGHT_PUBLISH_LINE_MAX]; // Latest complete line
+    uint64_t    num_lines;
+} publish_reader_t;
+
+typedef struct
+{
+    light_context_t         *ctx;
+    light_loop_t            *loop;
+    light_publisher_t       *publisher;
+    light_device_target_t   *targets[2];
+    int                     timer_fd;
+    uint64_t                step;
+    uint64_t                drain_steps;
+    uint64_t                changes; // Of the publisher before the first sets
+    publish_reader_t        readers[PUBLISH_CLIENTS];
+    int                     bad_fd; // Subscribes with an unknown format
+    char                    socket_path[64];
+} publish_t;
+
+static int publish_connect(char const *path, char const *subscription)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path, strlen(path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    CHECK(fd >= 0);
+    CHECK(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+    CHECK(send(fd, subscription, strlen(subscription), MSG_NOSIGNAL) == (ssize_t)strlen(subscription));
+    return fd;
+}
+
+// Reads what has arrived, keeping count of the lines and the latest one
+static void publish_read(publish_reader_t *reader)
+{
+    while(true)
+    {
+        ssize_t length = recv(reader->fd, reader->buffer + reader->length, sizeof(reader->buffer) - reader->length - 1, MSG_DONTWAIT);
+        if(length < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return;
+        }
+        CHECK(length > 0);
+        reader->length += (size_t)length;
+        reader->buffer[reader->length] = '\0';
+
+        char *line = reader->buffer;
+        for(char *end = strchr(line, '\n'); end != NULL; end = strchr(line, '\n'))
+        {
+            *end = '\0';
+            CHECK((size_t)(end - line) < sizeof(reader->last_line));
+            memcpy(reader->last_line, line, (size_t)(end - line) + 1);
+            reader->num_lines++;
+            line = end + 1;
+        }
+
+        reader->length = strlen(line);
+        memmove(reader->buffer, line, reader->length + 1);
+    }
+}
+
+// Reads the lines that arrived since the last step, and checks that they are `expected`, in order
+static void publish_expect(publish_reader_t *reader, char const *expected)
+{
+    char received[1024];
+    ssize_t length = recv(reader->fd, received, sizeof(received) - 1, MSG_DONTWAIT);
+    if(length < 0)
+    {
+        CHECK(errno == EAGAIN);
+        length = 0;
+    }
+    received[length] = '\0';
+
+    if(strcmp(received, expected) != 0)
+    {
+        fprintf(stderr, "expected:\n%sreceived:\n%s", expected, received);
+        CHECK(strcmp(received, expected) == 0);
+    }
+}
+
+static bool publish_step(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    publish_t *publish = (publish_t*)userdata;
+    publish_reader_t *text = &publish->readers[PUBLISH_TEXT_CLIENT];
+    publish_reader_t *json = &publish->readers[PUBLISH_JSON_CLIENT];
+
+    uint64_t expirations = 0;
+    CHECK(read(fd, &expirations, sizeof(expirations)) == sizeof(expirations) || errno == EAGAIN);
+
+    switch(publish->step)
+    {
+        case 0:
+            text->fd = publish_connect(publish->socket_path, "text sim/device0/*\n");
+            json->fd = publish_connect(publish->socket_path, "json sim/*/target0\n");
+            publish->bad_fd = publish_connect(publish->socket_path, "yaml\n");
+            break;
+
+        case 1:
+            // The current values, targets start at half their max value
+            publish_expect(text, "sim/device0/target0 50.00 500 1000\n");
+            publish_expect(json, "{\"target\":\"sim/device0/target0\",\"percent\":50.00,\"value\":500,\"max\":1000}\n"
+                                 "{\"target\":\"sim/device1/target0\",\"percent\":50.00,\"value\":500,\"max\":1000}\n");
+            CHECK(publish->publisher->num_clients == 2);
+
+            // A change of each target, and a write that doesn't change anything
+            publish->changes = publish->publisher->changes;
+            CHECK(light_target_set(publish->ctx, publish->targets[0], 250));
+            CHECK(light_target_set(publish->ctx, publish->targets[1], 750));
+            CHECK(light_target_set(publish->ctx, publish->targets[1], 750));
+            break;
+
+        case 2:
+            publish_expect(text, "sim/device0/target0 25.00 250 1000\n");
+            publish_expect(json, "{\"target\":\"sim/device0/target0\",\"percent\":25.00,\"value\":250,\"max\":1000}\n"
+                                 "{\"target\":\"sim/device1/target0\",\"percent\":75.00,\"value\":750,\"max\":1000}\n");
+            CHECK(publish->publisher->changes == publish->changes + 2);
+
+            // Nobody reads while the burst goes on
+            for(uint64_t i = 1; i <= PUBLISH_BURST; i++)
+            {
+                CHECK(light_target_set(publish->ctx, publish->targets[0], i % PUBLISH_MAX));
+            }
+            CHECK(light_target_set(publish->ctx, publish->targets[0], 123));
+            break;
+
+        default:
+            // Reading again, until both have the latest value
+            publish_read(text);
+            publish_read(json);
+            if(strcmp(text->last_line, "sim/device0/target0 12.30 123 1000") == 0 &&
+               strcmp(json->last_line, "{\"target\":\"sim/device0/target0\",\"percent\":12.30,\"value\":123,\"max\":1000}") == 0)
+            {
+                light_loop_stop(loop);
+                return true;
+            }
+
+            CHECK(++publish->drain_steps < PUBLISH_DRAIN_STEPS);
+            break;
+    }
+
+    publish->step++;
+    CHECK(light_loop_timer_arm(fd, light_loop_now_ns() + PUBLISH_STEP_MS * 1000000ull));
+    return true;
+}
+
+int main()
+{
+    CHECK(setenv("LIGHT_SIM", "devices=2,max=1000", 1) == 0);
+
+    char dir[] = "/tmp/light-publish-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    char conf_dir[64];
+    snprintf(conf_dir, sizeof(conf_dir), "%s/conf", dir);
+    CHECK(mkdir(conf_dir, 0755) == 0);
+    check_use_conf_dir(conf_dir);
+
+    publish_t publish;
+    memset(&publish, 0, sizeof(publish));
+    snprintf(publish.socket_path, sizeof(publish.socket_path), "%s/publish", dir);
+
+    publish.ctx = light_context_create();
+    CHECK(publish.ctx != NULL);
+    publish.targets[0] = light_find_device_target(publish.ctx, "sim/device0/target0");
+    publish.targets[1] = light_find_device_target(publish.ctx, "sim/device1/target0");
+    CHECK(publish.targets[0] != NULL && publish.targets[1] != NULL);
+
+    // Listening as the daemon does
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, publish.socket_path, strlen(publish.socket_path));
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    CHECK(listen_fd >= 0);
+    CHECK(bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) == 0 && listen(listen_fd, 8) == 0);
+
+    publish.loop = light_loop_create();
+    CHECK(publish.loop != NULL);
+    publish.publisher = light_publisher_create(publish.ctx, publish.loop, listen_fd);
+    CHECK(publish.publisher != NULL);
+
+    publish.timer_fd = light_loop_timer_create(false);
+    CHECK(publish.timer_fd >= 0);
+    CHECK(light_loop_add(publish.loop, publish.timer_fd, EPOLLIN, publish_step, &publish, "script"));
+    CHECK(light_loop_timer_arm(publish.timer_fd, light_loop_now_ns() + 1));
+    CHECK(light_loop_run(publish.loop));
+
+    // The burst reached everyone as a fraction of its lines
+    for(int c = 0; c < PUBLISH_CLIENTS; c++)
+    {
+        printf("client %d: %" PRIu64 " lines\n", c, publish.readers[c].num_lines);
+        CHECK(publish.readers[c].num_lines < PUBLISH_BURST / 2);
+    }
+    printf("changes %" PRIu64 ", events %" PRIu64 ", coalesced %" PRIu64 "\n", publish.publisher->changes, publish.publisher->events,
+           publish.publisher->coalesced);
+    CHECK(publish.publisher->coalesced > 0);
+
+    light_loop_remove(publish.loop, publish.timer_fd);
+    light_loop_timer_close(publish.timer_fd);
+    light_publisher_free(publish.publisher);
+    light_loop_free(publish.loop);
+    close(listen_fd);
+    for(int c = 0; c < PUBLISH_CLIENTS; c++)
+    {
+        close(publish.readers[c].fd);
+    }
+    close(publish.bad_fd);
+    light_free(publish.ctx);
+    check_release_conf_dir();
+    check_remove_tree(dir);
+    return 0;
+}
+
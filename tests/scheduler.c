@@ -0,0 +1,177 @@
+
+#include "check.h"
+#include "light.h"
+#include "animation.h"
+#include "scheduler.h"
+#include "loop.h"
+#include "clock.h"
+
+#include <stdio.h> // snprintf, printf
+#include <stdlib.h> // mkdtemp, setenv
+#include <inttypes.h> // PRIu64
+#include <errno.h>
+#include <unistd.h> // pipe, read, write, close, usleep
+#include <pthread.h>
+
+// Stress benchmark of the request scheduler: p99 latency of interactive requests while background fades keep every target busy
+// A thread plays the user, sending requests through a pipe as input devices would, while a timer restarts a background fade on
+// every target that finished its own. The targets are simulated ones whose writes take a while, so that the animator has real
+// work to do: the dryrun target writes in no time, which wouldn't put anything in the way of the requests.
+// The loop is set up as in the daemon, with input dispatched before timers. The p99 latency is only held to its budget with
+// $LIGHT_CHECK_TIMING, see check_timing.
+// The context is created with a scratch configuration directory, see check_use_conf_dir: the user's caps or aliases would change
+// what the requests write, and the latencies the animator saves as the fades end don't belong in theirs.
+
+#define BENCH_TARGETS 16
+#define BENCH_REQUESTS 1000
+#define BENCH_REQUEST_INTERVAL_US 1000
+#define BENCH_TICK_MS 10
+#define BENCH_FADE_MS 500
+#define BENCH_BACKGROUND_MS 5
+
+// Interactive requests are run within this much of being sent, 99% of the time
+#define BENCH_INTERACTIVE_P99_BUDGET_NS (50 * 1000000ull)
+
+typedef struct
+{
+    light_context_t         *ctx;
+    light_loop_t            *loop;
+    light_scheduler_t       *scheduler;
+    light_device_target_t   *targets[BENCH_TARGETS];
+    int                     request_fds[2];
+    int                     background_fd;
+    uint64_t                requests;
+    uint64_t                background_value;
+} bench_t;
+
+static void *bench_user(void *userdata)
+{
+    bench_t *bench = (bench_t*)userdata;
+    for(uint64_t i = 0; i < BENCH_REQUESTS; i++)
+    {
+        uint64_t submit_ns = light_clock_now_ns();
+        CHECK(write(bench->request_fds[1], &submit_ns, sizeof(submit_ns)) == sizeof(submit_ns));
+        usleep(BENCH_REQUEST_INTERVAL_US);
+    }
+
+    return NULL;
+}
+
+static bool bench_request(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    bench_t *bench = (bench_t*)userdata;
+
+    uint64_t submit_ns = 0;
+    CHECK(read(fd, &submit_ns, sizeof(submit_ns)) == sizeof(submit_ns));
+
+    light_device_target_t *target = bench->targets[bench->requests % BENCH_TARGETS];
+    CHECK(light_scheduler_run(bench->scheduler, target, LIGHT_PRIORITY_INTERACTIVE, submit_ns, light_cmd_set_brightness, bench->requests % 256));
+
+    if(++bench->requests == BENCH_REQUESTS)
+    {
+        light_loop_stop(loop);
+    }
+
+    return true;
+}
+
+static bool bench_background(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    bench_t *bench = (bench_t*)userdata;
+
+    uint64_t expirations = 0;
+    CHECK(read(fd, &expirations, sizeof(expirations)) == sizeof(expirations) || errno == EAGAIN);
+
+    uint64_t now_ns = light_clock_now_ns();
+    bench->background_value = (bench->background_value + 97) % 256;
+    for(uint64_t t = 0; t < BENCH_TARGETS; t++)
+    {
+        if(light_animator_find(bench->ctx->animator, bench->targets[t]) == NULL)
+        {
+            CHECK(light_scheduler_fade(bench->scheduler, bench->targets[t], LIGHT_PRIORITY_BACKGROUND, now_ns, bench->background_value, BENCH_FADE_MS));
+        }
+    }
+
+    CHECK(light_loop_timer_arm(fd, now_ns + BENCH_BACKGROUND_MS * 1000000ull));
+    return true;
+}
+
+static bool bench_animate(light_loop_t *loop, int fd, uint32_t events, void *userdata)
+{
+    light_animator_dispatch((light_animator_t*)userdata);
+    return true;
+}
+
+int main()
+{
+    char spec[64];
+    snprintf(spec, sizeof(spec), "devices=%d,max=255,set=fixed:200", BENCH_TARGETS);
+    CHECK(setenv("LIGHT_SIM", spec, 1) == 0);
+
+    // The scratch directory is in memory: the latencies saved as the fades end would otherwise put the disk, and whatever a
+    // truncating write costs on it, in the way of the requests
+    char conf_dir[64] = "/dev/shm/light-scheduler-XXXXXX";
+    if(mkdtemp(conf_dir) == NULL)
+    {
+        snprintf(conf_dir, sizeof(conf_dir), "/tmp/light-scheduler-XXXXXX");
+        CHECK(mkdtemp(conf_dir) != NULL);
+    }
+    check_use_conf_dir(conf_dir);
+
+    bench_t bench = { 0 };
+    bench.ctx = light_context_create();
+    CHECK(bench.ctx != NULL);
+
+    for(uint64_t t = 0; t < BENCH_TARGETS; t++)
+    {
+        char path[NAME_MAX];
+        snprintf(path, sizeof(path), "sim/device%" PRIu64 "/target0", t);
+        bench.targets[t] = light_find_device_target(bench.ctx, path);
+        CHECK(bench.targets[t] != NULL);
+    }
+
+    bench.loop = light_loop_create();
+    bench.ctx->animator = light_animator_create(BENCH_TICK_MS);
+    CHECK(bench.loop != NULL && bench.ctx->animator != NULL);
+    bench.scheduler = light_scheduler_create(bench.ctx);
+
+    CHECK(pipe(bench.request_fds) == 0);
+    CHECK(light_loop_add(bench.loop, bench.request_fds[0], EPOLLIN, bench_request, &bench, "input"));
+    CHECK(light_loop_set_priority(bench.loop, bench.request_fds[0], LIGHT_PRIORITY_INTERACTIVE));
+    CHECK(light_loop_add(bench.loop, bench.ctx->animator->timer_fd, EPOLLIN, bench_animate, bench.ctx->animator, "animation"));
+
+    bench.background_fd = light_loop_timer_create(false);
+    CHECK(bench.background_fd >= 0);
+    CHECK(light_loop_add(bench.loop, bench.background_fd, EPOLLIN, bench_background, &bench, "background"));
+    CHECK(light_loop_timer_arm(bench.background_fd, light_clock_now_ns() + 1));
+
+    pthread_t user;
+    CHECK(pthread_create(&user, NULL, bench_user, &bench) == 0);
+    CHECK(light_loop_run(bench.loop));
+    CHECK(pthread_join(user, NULL) == 0);
+
+    light_scheduler_print_stats(bench.scheduler);
+
+    light_scheduler_stats_t const *interactive = &bench.scheduler->stats[LIGHT_PRIORITY_INTERACTIVE];
+    light_scheduler_stats_t const *background = &bench.scheduler->stats[LIGHT_PRIORITY_BACKGROUND];
+    uint64_t p99_ns = light_scheduler_percentile(bench.scheduler, LIGHT_PRIORITY_INTERACTIVE, 0.99);
+    printf("interactive p99 < %.1f ms, budget %.1f ms\n", (double)p99_ns / 1e6, (double)BENCH_INTERACTIVE_P99_BUDGET_NS / 1e6);
+
+    // Every request went through, each one stopping the fade running on its target
+    CHECK(interactive->delay.count == BENCH_REQUESTS);
+    CHECK(interactive->refused == 0);
+    CHECK(background->preempted > 0);
+    CHECK(!check_timing() || p99_ns <= BENCH_INTERACTIVE_P99_BUDGET_NS);
+
+    light_loop_remove(bench.loop, bench.background_fd);
+    light_loop_timer_close(bench.background_fd);
+    light_loop_free(bench.loop);
+    light_scheduler_free(bench.scheduler);
+    close(bench.request_fds[0]);
+    close(bench.request_fds[1]);
+    light_free(bench.ctx);
+    check_release_conf_dir();
+    check_remove_tree(conf_dir);
+    return 0;
+}
+
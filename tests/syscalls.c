@@ -0,0 +1,155 @@
+
+#include "check.h"
+
+#include <stdio.h> // printf, fprintf
+#include <stdlib.h> // mkdtemp, setenv, unsetenv
+#include <stdbool.h>
+#include <inttypes.h> // PRIu64
+#include <signal.h>
+#include <fcntl.h> // open
+#include <unistd.h> // fork, execv, dup2, close
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+// Syscall budget of single commands
+// The light binary runs a command on a simulated target under ptrace, which counts every syscall it makes from its exec to its
+// exit, the dynamic loader and libc included. A command resolves one target and reads or writes it: it must not enumerate
+// other devices, create directories or read files it doesn't need, which would all show up here.
+// The configuration directory is an empty scratch one, see check_use_conf_dir.
+
+#define SYSCALLS_MAX 256
+
+// Syscalls allowed per command, a few above what they make today
+#define SYSCALLS_GET_BUDGET 52
+#define SYSCALLS_ADD_BUDGET 52
+
+typedef struct
+{
+    char const      *name;
+    char * const    *argv;
+    uint64_t        budget;
+} syscalls_command_t;
+
+static char *syscalls_get_argv[] = {"light", "-s", "sim/device0/target0", "-G", NULL};
+static char *syscalls_add_argv[] = {"light", "-s", "sim/device0/target0", "-A", "1", NULL};
+
+static syscalls_command_t const syscalls_commands[] = {
+    {"-G", syscalls_get_argv, SYSCALLS_GET_BUDGET},
+    {"-A", syscalls_add_argv, SYSCALLS_ADD_BUDGET},
+};
+
+// Runs `argv` and returns the number of syscalls it made, with their numbers in `out_numbers`. Skips the check if the process
+// can't be traced here.
+static uint64_t syscalls_count(char * const *argv, uint64_t *out_numbers)
+{
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if(pid == 0)
+    {
+        if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+        {
+            _exit(125);
+        }
+
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+
+        setenv("LIGHT_SIM", "devices=1", 1);
+        unsetenv("LIGHT_TRACE");
+        raise(SIGSTOP);
+        execv(LIGHT_BINARY, argv);
+        _exit(127);
+    }
+
+    int status = 0;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    if(WIFEXITED(status))
+    {
+        CHECK_SKIP_BECAUSE("ptrace is not permitted");
+    }
+    CHECK(WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP);
+    CHECK(ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)) == 0);
+
+    // Counted from the exec on, at the entry of every syscall
+    bool execed = false;
+    uint64_t num_syscalls = 0;
+    int signal = 0;
+    while(true)
+    {
+        CHECK(ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(long)signal) == 0);
+        signal = 0;
+        CHECK(waitpid(pid, &status, 0) == pid);
+        if(WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            break;
+        }
+
+        if(status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXEC << 8)))
+        {
+            execed = true;
+            continue;
+        }
+
+        if(WSTOPSIG(status) != (SIGTRAP | 0x80))
+        {
+            signal = WSTOPSIG(status);
+            continue;
+        }
+
+        struct __ptrace_syscall_info info;
+        if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void*)sizeof(info), &info) <= 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            CHECK_SKIP_BECAUSE("the kernel has no PTRACE_GET_SYSCALL_INFO");
+        }
+
+        if(execed && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+        {
+            if(num_syscalls < SYSCALLS_MAX)
+            {
+                out_numbers[num_syscalls] = info.entry.nr;
+            }
+            num_syscalls++;
+        }
+    }
+
+    CHECK(execed);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return num_syscalls;
+}
+
+int main()
+{
+    char conf_dir[] = "/tmp/light-syscalls-XXXXXX";
+    CHECK(mkdtemp(conf_dir) != NULL);
+
+    check_use_conf_dir(conf_dir);
+
+    bool within_budget = true;
+    for(uint64_t c = 0; c < sizeof(syscalls_commands) / sizeof(syscalls_commands[0]); c++)
+    {
+        syscalls_command_t const *command = &syscalls_commands[c];
+        uint64_t numbers[SYSCALLS_MAX];
+        uint64_t num_syscalls = syscalls_count(command->argv, numbers);
+        printf("%s: %" PRIu64 " syscalls, budget %" PRIu64 "\n", command->name, num_syscalls, command->budget);
+
+        if(num_syscalls > command->budget)
+        {
+            within_budget = false;
+            fprintf(stderr, "%s made:", command->name);
+            for(uint64_t i = 0; i < num_syscalls && i < SYSCALLS_MAX; i++)
+            {
+                fprintf(stderr, " %" PRIu64, numbers[i]);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+
+    check_release_conf_dir();
+    check_remove_tree(conf_dir);
+    CHECK(within_budget);
+    return 0;
+}
+
@@ -0,0 +1,127 @@
+
+#include "check.h"
+
+#include <stdio.h> // snprintf, fopen, fgets, sscanf
+#include <stdlib.h> // mkdtemp, setenv
+#include <inttypes.h> // PRIu64, SCNu64
+#include <signal.h>
+#include <time.h> // time, localtime_r
+#include <fcntl.h> // open
+#include <dirent.h>
+#include <unistd.h> // fork, execl, dup2, usleep, access
+#include <sys/wait.h>
+
+// Wakeup budget of an idle daemon
+// The light binary is started with every feature that can run without hardware: a schedule whose next transition is hours away,
+// power profiles, metrics and publishing. Once it settled, it is left alone for a fixed window, over which the context switches
+// of all its threads are counted. An idle daemon sleeps in epoll_wait until something happens, any switch is a wakeup that some
+// feature caused on its own, such as a timer that polls or a thread that spins. What the daemon keeps goes to a scratch
+// configuration directory, see check_use_conf_dir.
+
+#define WAKEUPS_SETTLE_US 300000
+#define WAKEUPS_WINDOW_US 3000000
+
+// Wakeups allowed over the window, for what the system may send anyway (a uevent of some other device)
+#define WAKEUPS_BUDGET 3
+
+// Returns the context switches of every thread of `pid`
+static uint64_t wakeups_count(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *tasks = opendir(path);
+    CHECK(tasks != NULL);
+
+    uint64_t switches = 0;
+    struct dirent *task = NULL;
+    while((task = readdir(tasks)) != NULL)
+    {
+        if(task->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        char status_path[320];
+        snprintf(status_path, sizeof(status_path), "%s/%s/status", path, task->d_name);
+        FILE *status = fopen(status_path, "r");
+        if(status == NULL)
+        {
+            continue;
+        }
+
+        char line[128];
+        while(fgets(line, sizeof(line), status) != NULL)
+        {
+            uint64_t value = 0;
+            if(sscanf(line, "voluntary_ctxt_switches: %" SCNu64, &value) == 1 || sscanf(line, "nonvoluntary_ctxt_switches: %" SCNu64, &value) == 1)
+            {
+                switches += value;
+            }
+        }
+        fclose(status);
+    }
+
+    closedir(tasks);
+    return switches;
+}
+
+int main()
+{
+    char dir[] = "/tmp/light-wakeups-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    char conf_dir[64], schedule_path[64], metrics_path[64], publish_path[64];
+    snprintf(conf_dir, sizeof(conf_dir), "%s/conf", dir);
+    snprintf(schedule_path, sizeof(schedule_path), "%s/schedule", dir);
+    snprintf(metrics_path, sizeof(metrics_path), "%s/metrics", dir);
+    snprintf(publish_path, sizeof(publish_path), "%s/publish", dir);
+    CHECK(mkdir(conf_dir, 0755) == 0);
+    check_use_conf_dir(conf_dir);
+
+    // Transitions 6 and 18 hours from now, so that none falls in the window
+    time_t now = time(NULL);
+    struct tm local;
+    CHECK(localtime_r(&now, &local) != NULL);
+    FILE *schedule = fopen(schedule_path, "w");
+    CHECK(schedule != NULL);
+    fprintf(schedule, "%02d:%02d sim/device0/target0 -S 30\n", (local.tm_hour + 6) % 24, local.tm_min);
+    fprintf(schedule, "%02d:%02d sim/device0/target0 -S 80\n", (local.tm_hour + 18) % 24, local.tm_min);
+    CHECK(fclose(schedule) == 0);
+
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if(pid == 0)
+    {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        setenv("LIGHT_SIM", "devices=4", 1);
+        execl(LIGHT_BINARY, "light", "--schedule", schedule_path, "--power-profiles", "--metrics", metrics_path, "--publish", publish_path, (char*)NULL);
+        _exit(127);
+    }
+
+    // Up once it serves metrics, which comes after everything else started
+    for(int i = 0; i < 100 && access(metrics_path, F_OK) != 0; i++)
+    {
+        usleep(50000);
+    }
+    CHECK(access(metrics_path, F_OK) == 0);
+    usleep(WAKEUPS_SETTLE_US);
+
+    uint64_t start = wakeups_count(pid);
+    usleep(WAKEUPS_WINDOW_US);
+    uint64_t wakeups = wakeups_count(pid) - start;
+    printf("idle daemon: %" PRIu64 " wakeups in %.1f s, budget %d\n", wakeups, WAKEUPS_WINDOW_US / 1e6, WAKEUPS_BUDGET);
+
+    CHECK(kill(pid, SIGTERM) == 0);
+    int status = 0;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    CHECK(wakeups <= WAKEUPS_BUDGET);
+
+    check_release_conf_dir();
+    check_remove_tree(dir);
+    return 0;
+}
+